@@ -0,0 +1,1813 @@
+#define _GNU_SOURCE
+#include "huffman_file.h"
+#include "huffman_daemon.h"
+#include "huffman_inline.h"
+#include "huffman_iovec.h"
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined(__linux__) && !defined(HUFFMAN_NO_PERF_EVENTS)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define BENCH_PERF_EVENTS 1
+#endif
+
+/// Hardware counters read around each stage by bench_counters
+#define BENCH_CYCLES 0
+#define BENCH_INSTRUCTIONS 1
+#define BENCH_BRANCH_MISSES 2
+#define BENCH_L1D_MISSES 3
+#define BENCH_LLC_MISSES 4
+#define BENCH_NCOUNTERS 5
+/// Each stage of bench_counters is repeated until it has run this long, so that short stages rise above the
+/// resolution of the clock and of the counters
+#define BENCH_COUNTERS_MIN_NS 100000000
+
+/// @brief Hardware counters of the calling thread in one group, so that they count over the same intervals
+///         The counters are opened one by one and the ones refused by the kernel are left out of the group.
+typedef struct BenchCounters
+{
+    // -1 when the counter is not available
+    int fds[BENCH_NCOUNTERS];
+    uint64_t values[BENCH_NCOUNTERS];
+    // First counter opened, the others are read through it
+    int leader;
+    // Counters in the order of the group, navailable of them
+    int order[BENCH_NCOUNTERS];
+    int navailable;
+} BenchCounters;
+
+/// @brief Returns a monotonic time in seconds
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/// @brief Fills a buffer with text following a Zipf-like distribution over an alphabet
+/// @param buffer Buffer to fill
+/// @param length Number of characters
+/// @param alphabet_length Number of distinct characters
+/// @param seed Seed of the generator
+static void generate_corpus(char *buffer, size_t length, unsigned int alphabet_length, unsigned int seed)
+{
+    double cum_distrib[MAX_CHAR] = {0};
+    double proba_sum = 0;
+    for (size_t i = 0; i < alphabet_length; ++i)
+        proba_sum += 1.0 / (double)(i + 1);
+    double cum = 0;
+    for (size_t i = 0; i < alphabet_length; ++i)
+    {
+        cum += 1.0 / (double)(i + 1) / proba_sum;
+        cum_distrib[i] = cum;
+    }
+    srand(seed);
+    for (size_t i = 0; i < length; ++i)
+    {
+        double random = (double)rand() / RAND_MAX;
+        unsigned int c = 0;
+        while (c < (alphabet_length - 1) && random > cum_distrib[c])
+            c++;
+        buffer[i] = (char)(' ' + c);
+    }
+}
+
+/// @brief Writes a generated corpus file
+/// @param path Path of the file
+/// @param size Size of the file in bytes
+/// @return 0 on success
+static int write_corpus_file(const char *path, size_t size)
+{
+    char *data = malloc(size);
+    if (data == NULL)
+        return 1;
+    generate_corpus(data, size, 64, 42);
+    FILE *file = fopen(path, "wb");
+    int status = (file == NULL || fwrite(data, 1, size, file) != size);
+    if (file != NULL)
+        fclose(file);
+    free(data);
+    return status;
+}
+
+/// @brief Returns the size of a file
+static size_t file_size(const char *path)
+{
+    struct stat file_stat;
+    if (stat(path, &file_stat) != 0)
+        return 0;
+    return (size_t)file_stat.st_size;
+}
+
+/// @brief Compares the file compressor with the pread and io_uring backends and with parallel workers
+/// @param input_path File to compress, a corpus is generated when NULL
+/// @param size Size of the generated corpus
+/// @param queue_depth Number of blocks in flight
+/// @param nthreads Number of parallel workers
+/// @return status code
+static int bench_io(const char *input_path, size_t size, unsigned int queue_depth, unsigned int nthreads)
+{
+    char corpus_path[] = "/tmp/bench_huffman_corpus_XXXXXX";
+    char compressed_path[] = "/tmp/bench_huffman_compressed_XXXXXX";
+    char decompressed_path[] = "/tmp/bench_huffman_decompressed_XXXXXX";
+    int fds[3] = {mkstemp(corpus_path), mkstemp(compressed_path), mkstemp(decompressed_path)};
+    for (size_t i = 0; i < 3; ++i)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    if (input_path == NULL)
+    {
+        if (write_corpus_file(corpus_path, size) != 0)
+            return 1;
+        input_path = corpus_path;
+    }
+    size = file_size(input_path);
+    printf("backend,available,threads,size,compressed_size,compress_mb_s,decompress_mb_s\n");
+    const int backends[3] = {HUFFMAN_IO_PREAD, HUFFMAN_IO_URING, HUFFMAN_IO_PREAD};
+    const unsigned int threads[3] = {1, 1, nthreads};
+    const char *names[3] = {"pread", "uring", "pread"};
+    int status = 0;
+    for (size_t i = 0; i < 3 && status == 0; ++i)
+    {
+        HuffmanFileOptions options;
+        huffman_file_default_options(&options);
+        options.io_backend = backends[i];
+        options.queue_depth = queue_depth;
+        options.nthreads = threads[i];
+        double start = now_seconds();
+        status = huffman_compress_file(input_path, compressed_path, &options);
+        double compress_time = now_seconds() - start;
+        if (status == 0)
+        {
+            start = now_seconds();
+            status = huffman_decompress_file(compressed_path, decompressed_path, &options);
+        }
+        double decompress_time = now_seconds() - start;
+        printf("%s,%d,%u,%zu,%zu,%.1f,%.1f\n", names[i], huffman_io_available(backends[i]), threads[i], size,
+               file_size(compressed_path), (double)size / compress_time / 1e6, (double)size / decompress_time / 1e6);
+    }
+    unlink(corpus_path);
+    unlink(compressed_path);
+    unlink(decompressed_path);
+    return status;
+}
+
+/// @brief Arguments and results of a load generator client of bench_daemon
+typedef struct BenchDaemonClient
+{
+    const char *socket_path;
+    const char *corpus;
+    size_t corpus_length;
+    size_t record_length;
+    size_t nrequests;
+    uint32_t table_id;
+    unsigned int seed;
+    // Round trip time of each compress and decompress request in seconds
+    double *latencies;
+    size_t nerrors;
+} BenchDaemonClient;
+
+/// @brief Compresses and decompresses records of the corpus through the daemon
+static void *run_bench_daemon_client(void *arg)
+{
+    BenchDaemonClient *bench_client = arg;
+    HuffmanClient client;
+    if (huffman_client_connect(&client, bench_client->socket_path) > 0)
+    {
+        bench_client->nerrors = bench_client->nrequests;
+        return NULL;
+    }
+    unsigned int seed = bench_client->seed;
+    for (size_t i = 0; i < bench_client->nrequests; ++i)
+    {
+        seed = seed * 1103515245u + 12345u;
+        size_t start = (seed >> 4) % (bench_client->corpus_length - bench_client->record_length + 1);
+        unsigned char *compressed = NULL;
+        unsigned char *decompressed = NULL;
+        size_t compressed_length = 0;
+        size_t decompressed_length = 0;
+        double begin = now_seconds();
+        int status = huffman_client_request(&client, HUFFMAN_DAEMON_COMPRESS, bench_client->table_id,
+                                            bench_client->corpus + start, bench_client->record_length,
+                                            &compressed, &compressed_length);
+        double middle = now_seconds();
+        if (status == 0)
+            status = huffman_client_request(&client, HUFFMAN_DAEMON_DECOMPRESS, bench_client->table_id, compressed,
+                                            compressed_length, &decompressed, &decompressed_length);
+        bench_client->latencies[2 * i] = middle - begin;
+        bench_client->latencies[2 * i + 1] = now_seconds() - middle;
+        if (status > 0 || decompressed_length != bench_client->record_length ||
+            memcmp(decompressed, bench_client->corpus + start, decompressed_length) != 0)
+            bench_client->nerrors += 1;
+        free(compressed);
+        free(decompressed);
+    }
+    free_huffman_client(&client);
+    return NULL;
+}
+
+/// @brief Orders latencies for the percentiles
+static int latency_comparator(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/// @brief Load generator for the daemon: concurrent clients sending small records, with frames and a cached table
+/// @param socket_path Socket of a running daemon, a daemon is started in the benchmark when NULL
+/// @param nclients Number of concurrent clients
+/// @param nrequests Number of records compressed and decompressed by each client
+/// @param record_length Length of the records
+/// @param nthreads Number of workers of the daemon started by the benchmark
+/// @return status code
+static int bench_daemon(const char *socket_path, unsigned int nclients, size_t nrequests, size_t record_length,
+                        unsigned int nthreads)
+{
+    size_t corpus_length = 1 << 20;
+    if (record_length == 0 || record_length > corpus_length || nclients == 0)
+        return 1;
+    char *corpus = malloc(corpus_length);
+    BenchDaemonClient *clients = calloc(nclients, sizeof(BenchDaemonClient));
+    pthread_t *threads = calloc(nclients, sizeof(pthread_t));
+    double *latencies = malloc(2 * nclients * nrequests * sizeof(double) + 1);
+    if (corpus == NULL || clients == NULL || threads == NULL || latencies == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    generate_corpus(corpus, corpus_length, 64, 42);
+    HuffmanHistogram histogram;
+    huffman_histogram_init(&histogram);
+    huffman_histogram_add(&histogram, corpus, corpus_length);
+    HuffmanTable table;
+    int status = huffman_table_from_histogram(&histogram, &table);
+    const HuffmanTable *tables[1] = {&table};
+    char own_socket_path[64];
+    HuffmanDaemon daemon;
+    int own_daemon = (socket_path == NULL);
+    if (own_daemon && status == 0)
+    {
+        snprintf(own_socket_path, sizeof(own_socket_path), "/tmp/bench_huffman_%d.sock", (int)getpid());
+        socket_path = own_socket_path;
+        HuffmanDaemonOptions options;
+        huffman_daemon_default_options(&options, socket_path);
+        options.nthreads = nthreads;
+        options.tables = tables;
+        options.ntables = 1;
+        status = create_huffman_daemon(&daemon, &options);
+    }
+    printf("table_id,clients,threads,record_length,requests,errors,requests_per_s,p50_us,p99_us,p999_us,mean_batch\n");
+    // A daemon started elsewhere is only known to serve frames
+    for (uint32_t table_id = 0; table_id <= (uint32_t)own_daemon && status == 0; ++table_id)
+    {
+        uint64_t nrequests_before = own_daemon ? daemon.nrequests : 0;
+        uint64_t nbatches_before = own_daemon ? daemon.nbatches : 0;
+        double start = now_seconds();
+        for (unsigned int i = 0; i < nclients; ++i)
+        {
+            clients[i] = (BenchDaemonClient){socket_path, corpus, corpus_length, record_length, nrequests, table_id,
+                                             i + 1, latencies + 2 * i * nrequests, 0};
+            if (pthread_create(&threads[i], NULL, run_bench_daemon_client, &clients[i]) != 0)
+                clients[i].nerrors = nrequests;
+        }
+        size_t nerrors = 0;
+        for (unsigned int i = 0; i < nclients; ++i)
+        {
+            if (clients[i].nerrors < nrequests)
+                pthread_join(threads[i], NULL);
+            nerrors += clients[i].nerrors;
+        }
+        double elapsed = now_seconds() - start;
+        size_t nlatencies = 2 * nclients * nrequests;
+        qsort(latencies, nlatencies, sizeof(double), latency_comparator);
+        double mean_batch = 0;
+        if (own_daemon && daemon.nbatches > nbatches_before)
+            mean_batch = (double)(daemon.nrequests - nrequests_before) / (double)(daemon.nbatches - nbatches_before);
+        printf("%u,%u,%u,%zu,%zu,%zu,%.0f,%.1f,%.1f,%.1f,%.1f\n", (unsigned int)table_id, nclients,
+               own_daemon ? nthreads : 0, record_length, nlatencies, nerrors, (double)nlatencies / elapsed,
+               latencies[nlatencies / 2] * 1e6, latencies[nlatencies * 99 / 100] * 1e6,
+               latencies[nlatencies * 999 / 1000] * 1e6, mean_batch);
+        if (nerrors > 0)
+            status = STATUS_CODE_MESSAGE_CORRUPT;
+    }
+    if (own_daemon)
+        free_huffman_daemon(&daemon);
+    free(latencies);
+    free(threads);
+    free(clients);
+    free(corpus);
+    return status;
+}
+
+/// @brief Opens the hardware counters in one group, the ones refused by the kernel or the container are left out
+/// @param counters Pointer to the BenchCounters structure to initialize
+/// @return number of counters available
+static int open_bench_counters(BenchCounters *counters)
+{
+    counters->leader = -1;
+    counters->navailable = 0;
+    for (int i = 0; i < BENCH_NCOUNTERS; ++i)
+    {
+        counters->fds[i] = -1;
+        counters->values[i] = 0;
+    }
+#ifdef BENCH_PERF_EVENTS
+    const uint32_t types[BENCH_NCOUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                             PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE};
+    const uint64_t configs[BENCH_NCOUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    };
+    for (int i = 0; i < BENCH_NCOUNTERS; ++i)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        // The group is enabled and disabled through its leader
+        attr.disabled = (counters->leader < 0);
+        // User space only, allowed with the default perf_event_paranoid
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // The times tell whether the group was multiplexed with other events
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int group_fd = (counters->leader < 0) ? -1 : counters->fds[counters->leader];
+        counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+        if (counters->fds[i] < 0)
+            continue;
+        if (counters->leader < 0)
+            counters->leader = i;
+        counters->order[counters->navailable++] = i;
+    }
+#endif
+    return counters->navailable;
+}
+
+/// @brief Resets the counters of the group, they stay stopped until resume_bench_counters
+static void reset_bench_counters(BenchCounters *counters)
+{
+    for (int i = 0; i < BENCH_NCOUNTERS; ++i)
+        counters->values[i] = 0;
+#ifdef BENCH_PERF_EVENTS
+    if (counters->leader >= 0)
+        ioctl(counters->fds[counters->leader], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+/// @brief Starts counting with all the counters of the group
+static void resume_bench_counters(BenchCounters *counters)
+{
+#ifdef BENCH_PERF_EVENTS
+    if (counters->leader >= 0)
+        ioctl(counters->fds[counters->leader], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+    (void)counters;
+#endif
+}
+
+/// @brief Stops counting with all the counters of the group
+static void pause_bench_counters(BenchCounters *counters)
+{
+#ifdef BENCH_PERF_EVENTS
+    if (counters->leader >= 0)
+        ioctl(counters->fds[counters->leader], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#else
+    (void)counters;
+#endif
+}
+
+/// @brief Reads the counters of the group since reset_bench_counters
+///         When the kernel multiplexed the group with other events, the values are scaled by the time enabled over
+///         the time running. A group that never ran reads as unavailable: its values are left at 0.
+/// @return 1 if the values were read, 0 otherwise
+static int read_bench_counters(BenchCounters *counters)
+{
+#ifdef BENCH_PERF_EVENTS
+    if (counters->leader < 0)
+        return 0;
+    // nr, time_enabled, time_running, then one value per counter of the group
+    uint64_t data[3 + BENCH_NCOUNTERS];
+    ssize_t nread = read(counters->fds[counters->leader], data, sizeof(data));
+    if (nread < (ssize_t)(3 * sizeof(uint64_t)) || data[0] != (uint64_t)counters->navailable ||
+        nread < (ssize_t)((3 + data[0]) * sizeof(uint64_t)) || data[2] == 0)
+        return 0;
+    double scale = (double)data[1] / (double)data[2];
+    for (int i = 0; i < counters->navailable; ++i)
+        counters->values[counters->order[i]] = (uint64_t)((double)data[3 + i] * scale);
+    return 1;
+#else
+    (void)counters;
+    return 0;
+#endif
+}
+
+/// @brief Closes the counters
+static void close_bench_counters(BenchCounters *counters)
+{
+    for (int i = 0; i < BENCH_NCOUNTERS; ++i)
+    {
+        if (counters->fds[i] >= 0)
+            close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+    counters->leader = -1;
+    counters->navailable = 0;
+}
+
+/// @brief Prints a derived metric, or nothing when a counter it needs is not available
+static void print_bench_metric(const BenchCounters *counters, int valid, int counter, int divisor_counter, double scale,
+                               double divisor)
+{
+    if (!valid || counters->fds[counter] < 0 ||
+        (divisor_counter >= 0 && (counters->fds[divisor_counter] < 0 || counters->values[divisor_counter] == 0)))
+    {
+        printf(",");
+        return;
+    }
+    if (divisor_counter >= 0)
+        divisor = (double)counters->values[divisor_counter];
+    printf(",%.3f", (double)counters->values[counter] * scale / divisor);
+}
+
+/// @brief Prints one CSV row of bench_counters, the counters are the totals of the repetitions
+/// @param stage Name of the stage
+/// @param nbytes Bytes processed by one repetition
+/// @param nrepetitions Number of repetitions
+/// @param seconds Time of all the repetitions
+/// @param counters Pointer to the BenchCounters structure read after the repetitions
+/// @param valid 0 to leave the columns of the counters empty
+static void print_bench_stage(const char *stage, size_t nbytes, size_t nrepetitions, double seconds,
+                              const BenchCounters *counters, int valid)
+{
+    double total = (double)nbytes * (double)nrepetitions;
+    printf("%s,%zu,%zu,%.0f,%.1f", stage, nbytes, nrepetitions, seconds * 1e9 / (double)nrepetitions,
+           total / seconds / 1e6);
+    print_bench_metric(counters, valid, BENCH_CYCLES, -1, 1.0, total);
+    print_bench_metric(counters, valid, BENCH_INSTRUCTIONS, BENCH_CYCLES, 1.0, 0);
+    print_bench_metric(counters, valid, BENCH_BRANCH_MISSES, -1, 1024.0, total);
+    print_bench_metric(counters, valid, BENCH_L1D_MISSES, -1, 1024.0, total);
+    print_bench_metric(counters, valid, BENCH_LLC_MISSES, -1, 1024.0, total);
+    printf("\n");
+}
+
+/// Stages of bench_counters
+#define BENCH_STAGE_HISTOGRAM 0
+#define BENCH_STAGE_TABLE_BUILD 1
+#define BENCH_STAGE_ENCODE 2
+#define BENCH_STAGE_DECODE 3
+#define BENCH_NSTAGES 4
+
+/// @brief Inputs and results of the stages of bench_counters, each stage reads the results of the previous ones
+typedef struct BenchCounterStages
+{
+    const char *corpus;
+    size_t size;
+    HuffmanHistogram histogram;
+    HuffmanTable table;
+    BitMessage encoded;
+    char *decoded;
+    size_t decoded_length;
+} BenchCounterStages;
+
+/// @brief Frees the result of the previous repetition of a stage, outside of the measured calls
+static void clear_bench_counter_stage(int stage, BenchCounterStages *stages)
+{
+    if (stage == BENCH_STAGE_ENCODE)
+    {
+        free(stages->encoded.data);
+        stages->encoded = (BitMessage){.data = NULL, .nbits = 0, .nbytes = 0};
+    }
+    else if (stage == BENCH_STAGE_DECODE)
+    {
+        free(stages->decoded);
+        stages->decoded = NULL;
+    }
+}
+
+/// @brief Runs one repetition of a stage
+/// @return status code
+static int run_bench_counter_stage(int stage, BenchCounterStages *stages)
+{
+    switch (stage)
+    {
+    case BENCH_STAGE_HISTOGRAM:
+        huffman_histogram_init(&stages->histogram);
+        huffman_histogram_add(&stages->histogram, stages->corpus, stages->size);
+        return 0;
+    case BENCH_STAGE_TABLE_BUILD:
+        return huffman_table_from_histogram(&stages->histogram, &stages->table);
+    case BENCH_STAGE_ENCODE:
+        return huffman_table_encode(&stages->table, stages->corpus, stages->size, &stages->encoded);
+    default:
+        return huffman_table_decode(&stages->table, &stages->encoded, &stages->decoded, &stages->decoded_length);
+    }
+}
+
+/// @brief Reads the hardware counters around the histogram, the table build, the encoding and the decoding
+///         Reports cycles per byte, instructions per cycle and misses per KiB of input, the columns of the
+///         counters that cannot be opened (containers, virtual machines) are left empty and only the time is kept.
+///         The counters form one group and are scaled when the kernel multiplexed them. Each stage is repeated
+///         for BENCH_COUNTERS_MIN_NS at least, with the counters paused while the previous result is freed.
+/// @param size Size of the generated corpus
+/// @return status code
+static int bench_counters(size_t size)
+{
+    static const char *const names[BENCH_NSTAGES] = {"histogram", "table_build", "encode", "decode"};
+    char *corpus = malloc(size);
+    if (corpus == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    generate_corpus(corpus, size, 64, 42);
+    BenchCounters counters;
+    int navailable = open_bench_counters(&counters);
+    fprintf(stderr, "%d of %d hardware counters available\n", navailable, BENCH_NCOUNTERS);
+    printf("stage,bytes,repetitions,ns,mb_s,cycles_per_byte,ipc,branch_misses_per_kb,l1d_misses_per_kb,"
+           "llc_misses_per_kb\n");
+    BenchCounterStages stages = {.corpus = corpus, .size = size, .encoded = {.data = NULL, .nbits = 0, .nbytes = 0},
+                                 .decoded = NULL, .decoded_length = 0};
+    int status = 0;
+    for (int stage = 0; stage < BENCH_NSTAGES && status == 0; ++stage)
+    {
+        reset_bench_counters(&counters);
+        size_t nrepetitions = 0;
+        double seconds = 0;
+        do
+        {
+            clear_bench_counter_stage(stage, &stages);
+            double start = now_seconds();
+            resume_bench_counters(&counters);
+            status = run_bench_counter_stage(stage, &stages);
+            pause_bench_counters(&counters);
+            seconds += now_seconds() - start;
+            nrepetitions += 1;
+        } while (status == 0 && seconds * 1e9 < BENCH_COUNTERS_MIN_NS);
+        int valid = read_bench_counters(&counters);
+        // The table build does not depend on the size of the input, report it per table
+        if (status == 0)
+            print_bench_stage(names[stage], (stage == BENCH_STAGE_TABLE_BUILD) ? 1 : size, nrepetitions, seconds,
+                              &counters, valid);
+    }
+    if (status == 0 && (stages.decoded_length != size || memcmp(stages.decoded, corpus, size) != 0))
+        status = STATUS_CODE_MESSAGE_CORRUPT;
+    close_bench_counters(&counters);
+    free(stages.decoded);
+    free(stages.encoded.data);
+    free(corpus);
+    return status;
+}
+
+/// @brief Prints the memory of one call of bench_memory
+static void print_bench_memory(const char *coder, const char *operation, size_t nbytes, int status, const HuffmanStats *stats)
+{
+    printf("%s,%s,%zu,%d,%zu,%zu,%zu,%.3f\n", coder, operation, nbytes, status, stats->memory.nallocs,
+           stats->memory.peak, stats->memory.current, (double)stats->memory.peak / (double)nbytes);
+}
+
+/// @brief Reports the heap allocated by the legacy coder and by frames for inputs growing up to size
+///         The peak is counted over the call, the retained bytes are the buffers returned to the caller.
+/// @param size Size of the largest generated corpus
+/// @param limit Memory ceiling of each call, 0 for none
+/// @return status code
+static int bench_memory(size_t size, size_t limit)
+{
+    char *corpus = malloc(size + 1);
+    unsigned char *frame = malloc(HUFFMAN_FRAME_BOUND(size));
+    char *block = malloc(size);
+    if (corpus == NULL || frame == NULL || block == NULL)
+    {
+        free(corpus);
+        free(frame);
+        free(block);
+        return STATUS_CODE_ALLOC_FAIL;
+    }
+    printf("coder,operation,bytes,status,nallocs,peak_bytes,retained_bytes,peak_per_byte\n");
+    for (size_t length = 1024; length <= size; length *= 16)
+    {
+        generate_corpus(corpus, length, 64, 42);
+        corpus[length] = '\0';
+        HuffmanStats stats = {0};
+        stats.memory.limit = limit;
+        EncodedMessage encoded = {.header = {.data = NULL, .nbits = 0, .nbytes = 0}, .message = {.data = NULL, .nbits = 0, .nbytes = 0}};
+        int status = huffman_encode_stats(corpus, &encoded, &stats);
+        print_bench_memory("legacy", "encode", length, status, &stats);
+        if (status == 0)
+        {
+            char *decoded = NULL;
+            status = huffman_decode_stats(&encoded, &decoded, &stats);
+            print_bench_memory("legacy", "decode", length, status, &stats);
+            free(decoded);
+        }
+        free_encoded_message(&encoded);
+        size_t frame_length = 0;
+        status = huffman_encode_frame_stats(corpus, length, frame, &frame_length, &stats);
+        print_bench_memory("frame", "encode", length, status, &stats);
+        HuffmanFrameHeader frame_header;
+        if (status == 0)
+            status = huffman_read_frame_header(frame, &frame_header);
+        if (status == 0)
+        {
+            status = huffman_decode_frame_payload_stats(&frame_header, frame + HUFFMAN_FRAME_HEADER_SIZE, block, &stats);
+            print_bench_memory("frame", "decode", length, status, &stats);
+        }
+    }
+    free(corpus);
+    free(frame);
+    free(block);
+    return 0;
+}
+
+/// Sub-buckets per power of two of the latency histogram, the recorded values are within 1/32 of the real ones
+#define BENCH_HISTOGRAM_SUB_BITS 5
+#define BENCH_HISTOGRAM_NBUCKETS (64 << BENCH_HISTOGRAM_SUB_BITS)
+/// Encoded records prepared for each size of bench_latency, the calls cycle over them
+#define BENCH_LATENCY_NRECORDS 1024
+
+/// @brief Log-linear histogram of latencies in nanoseconds, with constant relative precision as in HdrHistogram
+typedef struct BenchHistogram
+{
+    uint64_t counts[BENCH_HISTOGRAM_NBUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} BenchHistogram;
+
+/// @brief Returns a monotonic time in nanoseconds
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/// @brief Returns the bucket of a value: exact below 2^SUB_BITS, then 2^SUB_BITS buckets per power of two
+static size_t bench_histogram_index(uint64_t value)
+{
+    if (value < (1u << BENCH_HISTOGRAM_SUB_BITS))
+        return (size_t)value;
+    unsigned int msb = 63 - (unsigned int)__builtin_clzll(value);
+    unsigned int shift = msb - BENCH_HISTOGRAM_SUB_BITS;
+    return ((size_t)(shift + 1) << BENCH_HISTOGRAM_SUB_BITS) +
+           (size_t)((value >> shift) & ((1u << BENCH_HISTOGRAM_SUB_BITS) - 1));
+}
+
+/// @brief Returns the highest value counted in a bucket
+static uint64_t bench_histogram_value(size_t index)
+{
+    if (index < (1u << BENCH_HISTOGRAM_SUB_BITS))
+        return index;
+    unsigned int shift = (unsigned int)(index >> BENCH_HISTOGRAM_SUB_BITS) - 1;
+    uint64_t mantissa = (1u << BENCH_HISTOGRAM_SUB_BITS) + (index & ((1u << BENCH_HISTOGRAM_SUB_BITS) - 1));
+    return ((mantissa + 1) << shift) - 1;
+}
+
+/// @brief Adds a latency to the histogram
+static void bench_histogram_record(BenchHistogram *histogram, uint64_t value)
+{
+    histogram->counts[bench_histogram_index(value)] += 1;
+    histogram->total += 1;
+    histogram->sum += value;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+/// @brief Returns the latency below which the given fraction of the calls are, at the precision of the buckets
+static uint64_t bench_histogram_percentile(const BenchHistogram *histogram, double fraction)
+{
+    uint64_t rank = (uint64_t)(fraction * (double)histogram->total);
+    uint64_t count = 0;
+    for (size_t i = 0; i < BENCH_HISTOGRAM_NBUCKETS; ++i)
+    {
+        count += histogram->counts[i];
+        if (count > rank)
+            return (bench_histogram_value(i) < histogram->max) ? bench_histogram_value(i) : histogram->max;
+    }
+    return histogram->max;
+}
+
+/// @brief Records prepared for one size of bench_latency
+typedef struct BenchLatencyRecords
+{
+    size_t length;
+    // Offsets of the records in the corpus
+    size_t offsets[BENCH_LATENCY_NRECORDS];
+    // Frames of the records, HUFFMAN_FRAME_BOUND(length) bytes apart
+    unsigned char *frames;
+    // Codes of the records with the cached table, codes_capacity bytes apart
+    unsigned char *codes;
+    size_t codes_capacity;
+    size_t nbits[BENCH_LATENCY_NRECORDS];
+} BenchLatencyRecords;
+
+/// @brief Times the first call of each operation on a record of a size, before any other call at that size
+///         The calls run in the order of the rows, each decoder reading what the encoder before it wrote.
+/// @param record Record to encode
+/// @param length Number of characters of the record
+/// @param table Cached table of the warm calls
+/// @param frame Buffer of HUFFMAN_FRAME_BOUND(length) bytes receiving the frame of the record
+/// @param codes Buffer of HUFFMAN_FRAME_BOUND(length) bytes receiving the codes of the record with the cached table
+/// @param output Buffer of HUFFMAN_FRAME_BOUND(length) bytes receiving the decoded record
+/// @param first_ns Time of the first call, indexed by [warm][encode]
+/// @return status code
+static int time_first_latency_calls(const char *record, size_t length, const HuffmanTable *table, unsigned char *frame,
+                                    unsigned char *codes, unsigned char *output, uint64_t first_ns[2][2])
+{
+    size_t frame_length = 0;
+    size_t nbits = 0;
+    size_t decoded_length = 0;
+    HuffmanFrameHeader frame_header;
+    uint64_t start = now_ns();
+    int status = huffman_encode_frame(record, length, frame, &frame_length);
+    first_ns[0][1] = now_ns() - start;
+    start = now_ns();
+    if (status == 0)
+        status = huffman_read_frame_header(frame, &frame_header);
+    if (status == 0)
+        status = huffman_decode_frame_payload(&frame_header, frame + HUFFMAN_FRAME_HEADER_SIZE, (char *)output);
+    first_ns[0][0] = now_ns() - start;
+    if (status == 0 && memcmp(output, record, length) != 0)
+        status = STATUS_CODE_MESSAGE_CORRUPT;
+    struct iovec in_iov = {.iov_base = (void *)record, .iov_len = length};
+    struct iovec out_iov = {.iov_base = codes, .iov_len = HUFFMAN_FRAME_BOUND(length)};
+    start = now_ns();
+    if (status == 0)
+        status = huffman_table_encodev(table, &in_iov, 1, &out_iov, 1, &nbits);
+    first_ns[1][1] = now_ns() - start;
+    in_iov = (struct iovec){.iov_base = codes, .iov_len = HUFFMAN_FRAME_BOUND(length)};
+    out_iov = (struct iovec){.iov_base = output, .iov_len = HUFFMAN_FRAME_BOUND(length)};
+    start = now_ns();
+    if (status == 0)
+        status = huffman_table_decodev(table, &in_iov, 1, nbits, &out_iov, 1, &decoded_length);
+    first_ns[1][0] = now_ns() - start;
+    if (status == 0 && (decoded_length != length || memcmp(output, record, length) != 0))
+        status = STATUS_CODE_MESSAGE_CORRUPT;
+    return status;
+}
+
+/// @brief Runs ncalls of one operation and prints the distribution of their latencies
+///         cold: each call builds its table, frames are encoded from the record and decoded from their header
+///         warm: the calls reuse a table built once from the corpus, with no header
+/// @param records Pointer to the BenchLatencyRecords of the size
+/// @param corpus Generated corpus holding the records
+/// @param table Cached table of the warm calls
+/// @param warm 1 to reuse the cached table, 0 to build a table per call
+/// @param encode 1 to time the encoding, 0 the decoding
+/// @param ncalls Number of calls, at least 1
+/// @param first_ns Time of the first call of the operation at this size, from time_first_latency_calls
+/// @param output Buffer of HUFFMAN_FRAME_BOUND(length) bytes receiving the result of each call
+/// @return status code
+static int run_bench_latency(const BenchLatencyRecords *records, const char *corpus, const HuffmanTable *table,
+                             int warm, int encode, size_t ncalls, uint64_t first_ns, unsigned char *output)
+{
+    BenchHistogram *histogram = calloc(1, sizeof(BenchHistogram));
+    if (histogram == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    size_t frame_capacity = HUFFMAN_FRAME_BOUND(records->length);
+    int status = 0;
+    for (size_t i = 0; i < ncalls && status == 0; ++i)
+    {
+        size_t r = i % BENCH_LATENCY_NRECORDS;
+        const char *record = corpus + records->offsets[r];
+        const unsigned char *frame = records->frames + r * frame_capacity;
+        struct iovec in_iov;
+        struct iovec out_iov = {.iov_base = output, .iov_len = frame_capacity};
+        size_t length = 0;
+        uint64_t start = now_ns();
+        if (encode && warm)
+        {
+            in_iov = (struct iovec){.iov_base = (void *)record, .iov_len = records->length};
+            status = huffman_table_encodev(table, &in_iov, 1, &out_iov, 1, &length);
+        }
+        else if (encode)
+            status = huffman_encode_frame(record, records->length, output, &length);
+        else if (warm)
+        {
+            in_iov = (struct iovec){.iov_base = records->codes + r * records->codes_capacity,
+                                    .iov_len = records->codes_capacity};
+            status = huffman_table_decodev(table, &in_iov, 1, records->nbits[r], &out_iov, 1, &length);
+        }
+        else
+        {
+            HuffmanFrameHeader frame_header;
+            status = huffman_read_frame_header(frame, &frame_header);
+            if (status == 0)
+                status = huffman_decode_frame_payload(&frame_header, frame + HUFFMAN_FRAME_HEADER_SIZE, (char *)output);
+        }
+        bench_histogram_record(histogram, now_ns() - start);
+        if (status == 0 && !encode && memcmp(output, record, records->length) != 0)
+            status = STATUS_CODE_MESSAGE_CORRUPT;
+    }
+    if (status == 0)
+        printf("%s,%s,%zu,%llu,%llu,%.1f,%llu,%llu,%llu,%llu,%llu\n", warm ? "warm" : "cold", encode ? "encode" : "decode",
+               records->length, (unsigned long long)histogram->total, (unsigned long long)first_ns,
+               (double)histogram->sum / (double)histogram->total,
+               (unsigned long long)bench_histogram_percentile(histogram, 0.5),
+               (unsigned long long)bench_histogram_percentile(histogram, 0.9),
+               (unsigned long long)bench_histogram_percentile(histogram, 0.99),
+               (unsigned long long)bench_histogram_percentile(histogram, 0.999), (unsigned long long)histogram->max);
+    free(histogram);
+    return status;
+}
+
+/// @brief Latency distribution of single calls on small records, from 16 bytes to 4 KiB
+///         The difference between the cold and the warm rows is the setup cost of a call: counting the characters,
+///         building the table and writing or reading its header. The first call of each operation at a size
+///         is timed before the records of the size are prepared and reported apart.
+/// @param ncalls Number of calls of each operation and record size, at least 1
+/// @return status code
+static int bench_latency(size_t ncalls)
+{
+    const size_t lengths[] = {16, 64, 256, 1024, 4096};
+    const size_t nlengths = sizeof(lengths) / sizeof(lengths[0]);
+    size_t corpus_length = 1 << 20;
+    char *corpus = malloc(corpus_length);
+    size_t output_capacity = HUFFMAN_FRAME_BOUND(lengths[nlengths - 1]);
+    unsigned char *output = malloc(3 * output_capacity);
+    BenchLatencyRecords *records = calloc(1, sizeof(BenchLatencyRecords));
+    if (corpus == NULL || output == NULL || records == NULL)
+    {
+        free(corpus);
+        free(output);
+        free(records);
+        return STATUS_CODE_ALLOC_FAIL;
+    }
+    generate_corpus(corpus, corpus_length, 64, 42);
+    HuffmanHistogram histogram;
+    huffman_histogram_init(&histogram);
+    huffman_histogram_add(&histogram, corpus, corpus_length);
+    HuffmanTable table;
+    int status = huffman_table_from_histogram(&histogram, &table);
+    printf("table,operation,record_length,calls,first_ns,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    for (size_t l = 0; l < nlengths && status == 0; ++l)
+    {
+        size_t length = lengths[l];
+        size_t frame_capacity = HUFFMAN_FRAME_BOUND(length);
+        records->length = length;
+        records->codes_capacity = (length * table.max_nbits + CHAR_BIT - 1) / CHAR_BIT;
+        unsigned int seed = (unsigned int)length;
+        for (size_t r = 0; r < BENCH_LATENCY_NRECORDS; ++r)
+        {
+            seed = seed * 1103515245u + 12345u;
+            records->offsets[r] = (seed >> 4) % (corpus_length - length + 1);
+        }
+        uint64_t first_ns[2][2];
+        status = time_first_latency_calls(corpus + records->offsets[0], length, &table, output + output_capacity,
+                                          output + 2 * output_capacity, output, first_ns);
+        records->frames = malloc(BENCH_LATENCY_NRECORDS * frame_capacity);
+        records->codes = malloc(BENCH_LATENCY_NRECORDS * records->codes_capacity);
+        if (status == 0 && (records->frames == NULL || records->codes == NULL))
+            status = STATUS_CODE_ALLOC_FAIL;
+        // Prepare the inputs of the decoders
+        for (size_t r = 0; r < BENCH_LATENCY_NRECORDS && status == 0; ++r)
+        {
+            size_t frame_length = 0;
+            status = huffman_encode_frame(corpus + records->offsets[r], length, records->frames + r * frame_capacity,
+                                          &frame_length);
+            struct iovec in_iov = {.iov_base = corpus + records->offsets[r], .iov_len = length};
+            struct iovec out_iov = {.iov_base = records->codes + r * records->codes_capacity,
+                                    .iov_len = records->codes_capacity};
+            if (status == 0)
+                status = huffman_table_encodev(&table, &in_iov, 1, &out_iov, 1, &records->nbits[r]);
+        }
+        for (int warm = 0; warm <= 1 && status == 0; ++warm)
+        {
+            for (int encode = 1; encode >= 0 && status == 0; --encode)
+                status = run_bench_latency(records, corpus, &table, warm, encode, ncalls, first_ns[warm][encode], output);
+        }
+        free(records->frames);
+        free(records->codes);
+    }
+    free(records);
+    free(output);
+    free(corpus);
+    return status;
+}
+
+/// @brief Rows of a benchmark printed as CSV or as a JSON array of objects with the same columns
+typedef struct BenchOutput
+{
+    int json;
+    const char *const *columns;
+    // The first column is a label, the others are numbers
+    size_t ncolumns;
+    size_t nrows;
+} BenchOutput;
+
+/// @brief Starts the output with the CSV header or the opening of the JSON array
+static void bench_output_begin(BenchOutput *output, int json, const char *const *columns, size_t ncolumns)
+{
+    *output = (BenchOutput){json, columns, ncolumns, 0};
+    if (json)
+    {
+        printf("[");
+        return;
+    }
+    for (size_t i = 0; i < ncolumns; ++i)
+        printf("%s%s", (i > 0) ? "," : "", columns[i]);
+    printf("\n");
+}
+
+/// @brief Prints one row, values holds the ncolumns - 1 numbers following the label
+static void bench_output_row(BenchOutput *output, const char *label, const double *values)
+{
+    if (output->json)
+    {
+        printf("%s\n  {\"%s\": \"%s\"", (output->nrows > 0) ? "," : "", output->columns[0], label);
+        for (size_t i = 1; i < output->ncolumns; ++i)
+            printf(", \"%s\": %.10g", output->columns[i], values[i - 1]);
+        printf("}");
+    }
+    else
+    {
+        printf("%s", label);
+        for (size_t i = 1; i < output->ncolumns; ++i)
+            printf(",%.10g", values[i - 1]);
+        printf("\n");
+    }
+    output->nrows += 1;
+}
+
+/// @brief Ends the output
+static void bench_output_end(const BenchOutput *output)
+{
+    if (output->json)
+        printf("\n]\n");
+}
+
+/// @brief Compresses and decompresses a generated file with 1 to max_threads parallel workers
+///         The speedup against one worker shows where the workers stop scaling, on memory bandwidth or on the disk.
+///         Each point keeps the best of three runs.
+/// @param size Size of the generated file
+/// @param block_size Size of the blocks, one job of a worker
+/// @param max_threads Largest number of workers
+/// @param json 1 for JSON, 0 for CSV
+/// @return status code
+static int bench_threads(size_t size, size_t block_size, unsigned int max_threads, int json)
+{
+    char corpus_path[] = "/tmp/bench_huffman_corpus_XXXXXX";
+    char compressed_path[] = "/tmp/bench_huffman_compressed_XXXXXX";
+    char decompressed_path[] = "/tmp/bench_huffman_decompressed_XXXXXX";
+    int fds[3] = {mkstemp(corpus_path), mkstemp(compressed_path), mkstemp(decompressed_path)};
+    for (size_t i = 0; i < 3; ++i)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    int status = write_corpus_file(corpus_path, size);
+    static const char *const columns[] = {"engine", "threads", "bytes", "block_size", "compress_mb_s",
+                                          "decompress_mb_s", "compress_speedup", "decompress_speedup"};
+    BenchOutput output;
+    bench_output_begin(&output, json, columns, sizeof(columns) / sizeof(columns[0]));
+    double base_compress = 0;
+    double base_decompress = 0;
+    for (unsigned int nthreads = 1; nthreads <= max_threads && status == 0; ++nthreads)
+    {
+        HuffmanFileOptions options;
+        huffman_file_default_options(&options);
+        options.block_size = block_size;
+        options.nthreads = nthreads;
+        double compress_time = 0;
+        double decompress_time = 0;
+        for (int run = 0; run < 3 && status == 0; ++run)
+        {
+            double start = now_seconds();
+            status = huffman_compress_file(corpus_path, compressed_path, &options);
+            double elapsed = now_seconds() - start;
+            if (run == 0 || elapsed < compress_time)
+                compress_time = elapsed;
+            start = now_seconds();
+            if (status == 0)
+                status = huffman_decompress_file(compressed_path, decompressed_path, &options);
+            elapsed = now_seconds() - start;
+            if (run == 0 || elapsed < decompress_time)
+                decompress_time = elapsed;
+        }
+        if (nthreads == 1)
+        {
+            base_compress = compress_time;
+            base_decompress = decompress_time;
+        }
+        double values[] = {nthreads, (double)size, (double)block_size, (double)size / compress_time / 1e6,
+                           (double)size / decompress_time / 1e6, base_compress / compress_time,
+                           base_decompress / decompress_time};
+        if (status == 0)
+            bench_output_row(&output, "file", values);
+    }
+    bench_output_end(&output);
+    unlink(corpus_path);
+    unlink(compressed_path);
+    unlink(decompressed_path);
+    return status;
+}
+
+/// @brief Runs one kernel of bench_sizes on the first length bytes of the corpus
+/// @param kernel Index of the kernel in the list of bench_sizes
+/// @return status code
+static int run_bench_size_kernel(int kernel, const char *corpus, size_t length, const HuffmanTable *table,
+                                 unsigned char *codes, size_t nbits, unsigned char *buffer)
+{
+    size_t capacity = HUFFMAN_FRAME_BOUND(length);
+    struct iovec in_iov = {.iov_base = (void *)corpus, .iov_len = length};
+    struct iovec code_iov = {.iov_base = codes, .iov_len = capacity};
+    struct iovec out_iov = {.iov_base = buffer, .iov_len = capacity};
+    size_t result = 0;
+    HuffmanHistogram histogram;
+    HuffmanFrameHeader frame_header;
+    switch (kernel)
+    {
+    case 0:
+        huffman_histogram_init(&histogram);
+        huffman_histogram_add(&histogram, corpus, length);
+        return 0;
+    case 1:
+        return huffman_table_encodev(table, &in_iov, 1, &code_iov, 1, &result);
+    case 2:
+        return huffman_table_decodev(table, &code_iov, 1, nbits, &out_iov, 1, &result);
+    case 3:
+        return huffman_encode_frame(corpus, length, buffer, &result);
+    default:
+        // The frame of the block is kept after its codes, see bench_sizes
+        if (huffman_read_frame_header(codes + capacity, &frame_header) > 0)
+            return STATUS_CODE_MESSAGE_CORRUPT;
+        return huffman_decode_frame_payload(&frame_header, codes + capacity + HUFFMAN_FRAME_HEADER_SIZE, (char *)buffer);
+    }
+}
+
+/// @brief Throughput of the single-thread kernels for inputs doubling from 1 KiB to max_size
+///         The throughput drops when the input, its codes and the output leave each cache level,
+///         max_size should be several times the last level cache, whose size is given in a column when it is known.
+/// @param max_size Largest input
+/// @param json 1 for JSON, 0 for CSV
+/// @return status code
+static int bench_sizes(size_t max_size, int json)
+{
+    static const char *const kernels[] = {"histogram", "table_encode", "table_decode", "frame_encode", "frame_decode"};
+    const int nkernels = sizeof(kernels) / sizeof(kernels[0]);
+    long llc_size = 0;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    llc_size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (llc_size <= 0)
+        llc_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    if (llc_size < 0)
+        llc_size = 0;
+    char *corpus = malloc(max_size);
+    // Codes of the input followed by its frame
+    unsigned char *codes = malloc(2 * HUFFMAN_FRAME_BOUND(max_size));
+    unsigned char *buffer = malloc(HUFFMAN_FRAME_BOUND(max_size));
+    if (corpus == NULL || codes == NULL || buffer == NULL || max_size < 1024)
+    {
+        free(corpus);
+        free(codes);
+        free(buffer);
+        return STATUS_CODE_ALLOC_FAIL;
+    }
+    generate_corpus(corpus, max_size, 64, 42);
+    HuffmanHistogram histogram;
+    huffman_histogram_init(&histogram);
+    huffman_histogram_add(&histogram, corpus, max_size);
+    HuffmanTable table;
+    int status = huffman_table_from_histogram(&histogram, &table);
+    static const char *const columns[] = {"kernel", "bytes", "llc_bytes", "iterations", "ns_per_call", "mb_s"};
+    BenchOutput output;
+    bench_output_begin(&output, json, columns, sizeof(columns) / sizeof(columns[0]));
+    for (size_t length = 1024; length <= max_size && status == 0; length *= 2)
+    {
+        size_t capacity = HUFFMAN_FRAME_BOUND(length);
+        struct iovec in_iov = {.iov_base = corpus, .iov_len = length};
+        struct iovec code_iov = {.iov_base = codes, .iov_len = capacity};
+        size_t nbits = 0;
+        size_t frame_length = 0;
+        status = huffman_table_encodev(&table, &in_iov, 1, &code_iov, 1, &nbits);
+        if (status == 0)
+            status = huffman_encode_frame(corpus, length, codes + capacity, &frame_length);
+        for (int kernel = 0; kernel < nkernels && status == 0; ++kernel)
+        {
+            // Repeat the call for 20 ms so that small inputs stay in the caches between iterations
+            size_t iterations = 0;
+            double start = now_seconds();
+            double elapsed = 0;
+            while (status == 0 && (iterations == 0 || elapsed < 0.02))
+            {
+                status = run_bench_size_kernel(kernel, corpus, length, &table, codes, nbits, buffer);
+                iterations += 1;
+                elapsed = now_seconds() - start;
+            }
+            double values[] = {(double)length, (double)llc_size, (double)iterations, elapsed / (double)iterations * 1e9,
+                               (double)length * (double)iterations / elapsed / 1e6};
+            if (status == 0)
+                bench_output_row(&output, kernels[kernel], values);
+        }
+    }
+    bench_output_end(&output);
+    free(corpus);
+    free(codes);
+    free(buffer);
+    return status;
+}
+
+/// Kernels of bench_kernels, each timed alone on the same block
+#define BENCH_KERNEL_BLOCK_SIZE (64 << 10)
+#define BENCH_KERNEL_REPETITIONS 11
+#define BENCH_NKERNELS 9
+/// Short records of the records kernels, from 8 to 64 characters
+#define BENCH_RECORD_MIN_LENGTH 8
+#define BENCH_RECORD_MAX_LENGTH 64
+/// Largest number of kernels read from a baseline file
+#define BENCH_MAX_BASELINE 32
+
+/// Keeps the results of the timed calls alive when the benchmark is linked with link time optimization
+static volatile uint64_t bench_sink;
+
+/// @brief Inputs shared by the kernels of bench_kernels, built once from the corpus
+typedef struct BenchKernelInputs
+{
+    const char *block;
+    size_t frequencies[MAX_CHAR];
+    unsigned char lengths[MAX_CHAR];
+    HuffmanTable table;
+    BitMessage header;
+    unsigned char *codes;
+    size_t codes_capacity;
+    size_t nbits;
+    char *decoded;
+    // The block cut in short records encoded back to back
+    HuffmanRecord *records;
+    size_t nrecords;
+    unsigned char *record_codes;
+    size_t record_codes_nbytes;
+    char *records_decoded;
+    size_t records_capacity;
+    size_t *records_offsets;
+} BenchKernelInputs;
+
+/// @brief Calls one kernel once
+/// @param kernel Index of the kernel in bench_kernel_names
+/// @param inputs Pointer to the BenchKernelInputs structure
+/// @return status code
+static int run_bench_kernel(int kernel, BenchKernelInputs *inputs)
+{
+    HuffmanHistogram histogram;
+    HuffmanTable table;
+    unsigned char lengths[MAX_CHAR];
+    struct iovec in_iov = {.iov_base = (void *)inputs->block, .iov_len = BENCH_KERNEL_BLOCK_SIZE};
+    struct iovec code_iov = {.iov_base = inputs->codes, .iov_len = inputs->codes_capacity};
+    struct iovec out_iov = {.iov_base = inputs->decoded, .iov_len = BENCH_KERNEL_BLOCK_SIZE};
+    size_t result = 0;
+    int status = 0;
+    switch (kernel)
+    {
+    case 0:
+        huffman_histogram_init(&histogram);
+        huffman_histogram_add(&histogram, inputs->block, BENCH_KERNEL_BLOCK_SIZE);
+        result = (size_t)histogram.counts[' '];
+        break;
+    case 1:
+        status = huffman_code_lengths(inputs->frequencies, lengths);
+        result = lengths[' '];
+        break;
+    case 2:
+        status = huffman_table_from_lengths(inputs->lengths, &table);
+        result = table.codes[' '];
+        break;
+    case 3:
+        status = build_huffman_table(inputs->frequencies, &table);
+        result = table.codes[' '];
+        break;
+    case 4:
+        status = huffman_table_encodev(&inputs->table, &in_iov, 1, &code_iov, 1, &result);
+        break;
+    case 5:
+        status = huffman_table_decodev(&inputs->table, &code_iov, 1, inputs->nbits, &out_iov, 1, &result);
+        break;
+    case 6:
+        status = huffman_table_decode_header(&inputs->header, &table);
+        result = table.codes[' '];
+        break;
+    case 7:
+        status = huffman_table_decode_records(&inputs->table, inputs->record_codes, inputs->record_codes_nbytes,
+                                              inputs->records, inputs->nrecords, inputs->records_decoded,
+                                              inputs->records_offsets);
+        result = inputs->records_offsets[inputs->nrecords];
+        break;
+    default:
+        // The same records decoded one after the other
+        for (size_t r = 0; r < inputs->nrecords && status == 0; ++r)
+        {
+            size_t length = 0;
+            status = huffman_inline_decode(&inputs->table, inputs->record_codes, inputs->record_codes_nbytes,
+                                           inputs->records[r].offset, inputs->records[r].nbits,
+                                           inputs->records_decoded + result, inputs->records_capacity - result,
+                                           &length, NULL);
+            result += length;
+        }
+        break;
+    }
+    bench_sink += result;
+    return status;
+}
+
+/// @brief Orders the times of the repetitions
+static int uint64_comparator(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/// @brief Reads the median times per kernel of a file written by bench_kernels in JSON
+/// @param path Path of the baseline file
+/// @param names Receives the names of the kernels, to free
+/// @param medians Receives the median times
+/// @return number of kernels read, 0 if the file cannot be read
+static size_t read_bench_baseline(const char *path, char **names, double *medians)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+    char *data = malloc(1 << 16);
+    size_t nbytes = (data == NULL) ? 0 : fread(data, 1, (1 << 16) - 1, file);
+    fclose(file);
+    if (data == NULL)
+        return 0;
+    data[nbytes] = '\0';
+    size_t count = 0;
+    const char *key = "\"kernel\": \"";
+    for (char *position = strstr(data, key); position != NULL && count < BENCH_MAX_BASELINE;
+         position = strstr(position, key))
+    {
+        position += strlen(key);
+        char *name_end = strchr(position, '"');
+        char *object_end = strchr(position, '}');
+        char *median = strstr(position, "\"median_ns\": ");
+        if (name_end == NULL || object_end == NULL || median == NULL || median > object_end)
+        {
+            fprintf(stderr, "Baseline %s: kernel entry without median_ns skipped\n", path);
+            continue;
+        }
+        names[count] = malloc((size_t)(name_end - position) + 1);
+        if (names[count] == NULL)
+            break;
+        memcpy(names[count], position, (size_t)(name_end - position));
+        names[count][name_end - position] = '\0';
+        medians[count] = strtod(median + strlen("\"median_ns\": "), NULL);
+        count += 1;
+    }
+    free(data);
+    return count;
+}
+
+/// @brief Times each kernel of the codec alone on a 64 KiB block with a fixed methodology
+///         Every kernel runs a fixed number of calls per repetition, one repetition warms the caches up and
+///         the median, min and max time per call are taken over BENCH_KERNEL_REPETITIONS repetitions.
+///         With a baseline written by a previous run, the medians are compared and the kernels slower by more
+///         than threshold percent are reported as regressions.
+/// @param baseline_path JSON output of a previous run, NULL to print the results
+/// @param threshold Largest slowdown in percent that is not a regression
+/// @param json 1 for JSON, 0 for CSV
+/// @return status code, 1 if a kernel regressed
+static int bench_kernels(const char *baseline_path, double threshold, int json)
+{
+    static const char *const names[BENCH_NKERNELS] = {"histogram", "code_lengths", "canonical_codes", "table_build",
+                                                      "encode", "decode", "header_parse", "records",
+                                                      "records_scalar"};
+    // Calls per repetition, fixed so that runs on different builds do the same work
+    static const size_t ncalls[BENCH_NKERNELS] = {64, 64, 1024, 64, 16, 16, 1024, 16, 16};
+    static const size_t nbytes[BENCH_NKERNELS] = {BENCH_KERNEL_BLOCK_SIZE, 0, 0, 0, BENCH_KERNEL_BLOCK_SIZE,
+                                                  BENCH_KERNEL_BLOCK_SIZE, 0, BENCH_KERNEL_BLOCK_SIZE,
+                                                  BENCH_KERNEL_BLOCK_SIZE};
+    char *block = malloc(BENCH_KERNEL_BLOCK_SIZE);
+    BenchKernelInputs *inputs = calloc(1, sizeof(BenchKernelInputs));
+    if (block == NULL || inputs == NULL)
+    {
+        free(block);
+        free(inputs);
+        return STATUS_CODE_ALLOC_FAIL;
+    }
+    generate_corpus(block, BENCH_KERNEL_BLOCK_SIZE, 64, 42);
+    inputs->block = block;
+    for (size_t i = 0; i < BENCH_KERNEL_BLOCK_SIZE; ++i)
+        inputs->frequencies[(unsigned char)block[i]] += 1;
+    int status = huffman_code_lengths(inputs->frequencies, inputs->lengths);
+    if (status == 0)
+        status = huffman_table_from_lengths(inputs->lengths, &inputs->table);
+    if (status == 0)
+        status = huffman_table_encode_header(&inputs->table, &inputs->header);
+    inputs->codes_capacity = (BENCH_KERNEL_BLOCK_SIZE * HUFFMAN_TABLE_MAX_NBITS + CHAR_BIT - 1) / CHAR_BIT;
+    inputs->codes = malloc(inputs->codes_capacity);
+    inputs->decoded = malloc(BENCH_KERNEL_BLOCK_SIZE);
+    if (status == 0 && (inputs->codes == NULL || inputs->decoded == NULL))
+        status = STATUS_CODE_ALLOC_FAIL;
+    if (status == 0)
+    {
+        struct iovec in_iov = {.iov_base = block, .iov_len = BENCH_KERNEL_BLOCK_SIZE};
+        struct iovec code_iov = {.iov_base = inputs->codes, .iov_len = inputs->codes_capacity};
+        status = huffman_table_encodev(&inputs->table, &in_iov, 1, &code_iov, 1, &inputs->nbits);
+    }
+    // Cut the block in records of 8 to 64 characters and encode them back to back
+    inputs->records = malloc((BENCH_KERNEL_BLOCK_SIZE / BENCH_RECORD_MIN_LENGTH + 1) * sizeof(HuffmanRecord));
+    inputs->record_codes = calloc(1, inputs->codes_capacity);
+    if (status == 0 && (inputs->records == NULL || inputs->record_codes == NULL))
+        status = STATUS_CODE_ALLOC_FAIL;
+    size_t record_start = 0;
+    size_t record_nbits = 0;
+    while (status == 0 && record_start < BENCH_KERNEL_BLOCK_SIZE)
+    {
+        size_t length = BENCH_RECORD_MIN_LENGTH +
+                        (inputs->nrecords * 13) % (BENCH_RECORD_MAX_LENGTH - BENCH_RECORD_MIN_LENGTH + 1);
+        if (length > BENCH_KERNEL_BLOCK_SIZE - record_start)
+            length = BENCH_KERNEL_BLOCK_SIZE - record_start;
+        HuffmanRecord *record = &inputs->records[inputs->nrecords];
+        record->offset = record_nbits;
+        status = huffman_inline_encode(&inputs->table, block + record_start, length, inputs->record_codes, &record_nbits,
+                                       NULL);
+        record->nbits = record_nbits - record->offset;
+        record_start += length;
+        inputs->nrecords += 1;
+    }
+    inputs->record_codes_nbytes = (record_nbits + CHAR_BIT - 1) / CHAR_BIT;
+    if (status == 0)
+    {
+        inputs->records_capacity = huffman_records_capacity(&inputs->table, inputs->records, inputs->nrecords);
+        inputs->records_decoded = malloc(inputs->records_capacity);
+        inputs->records_offsets = malloc((inputs->nrecords + 1) * sizeof(size_t));
+        if (inputs->records_decoded == NULL || inputs->records_offsets == NULL)
+            status = STATUS_CODE_ALLOC_FAIL;
+    }
+    double medians[BENCH_NKERNELS] = {0};
+    static const char *const columns[] = {"kernel", "bytes", "calls", "repetitions", "median_ns", "min_ns", "max_ns", "mb_s"};
+    BenchOutput output;
+    if (baseline_path == NULL)
+        bench_output_begin(&output, json, columns, sizeof(columns) / sizeof(columns[0]));
+    for (int kernel = 0; kernel < BENCH_NKERNELS && status == 0; ++kernel)
+    {
+        uint64_t times[BENCH_KERNEL_REPETITIONS];
+        for (int repetition = -1; repetition < BENCH_KERNEL_REPETITIONS && status == 0; ++repetition)
+        {
+            uint64_t start = now_ns();
+            for (size_t i = 0; i < ncalls[kernel] && status == 0; ++i)
+                status = run_bench_kernel(kernel, inputs);
+            if (repetition >= 0)
+                times[repetition] = now_ns() - start;
+        }
+        if (status > 0)
+            break;
+        qsort(times, BENCH_KERNEL_REPETITIONS, sizeof(uint64_t), uint64_comparator);
+        medians[kernel] = (double)times[BENCH_KERNEL_REPETITIONS / 2] / (double)ncalls[kernel];
+        double values[] = {(double)nbytes[kernel], (double)ncalls[kernel], BENCH_KERNEL_REPETITIONS, medians[kernel],
+                           (double)times[0] / (double)ncalls[kernel],
+                           (double)times[BENCH_KERNEL_REPETITIONS - 1] / (double)ncalls[kernel],
+                           (double)nbytes[kernel] / medians[kernel] * 1e3};
+        if (baseline_path == NULL)
+            bench_output_row(&output, names[kernel], values);
+    }
+    if (baseline_path == NULL)
+        bench_output_end(&output);
+    else if (status == 0)
+    {
+        char *baseline_names[BENCH_MAX_BASELINE];
+        double baseline_medians[BENCH_MAX_BASELINE];
+        size_t nbaseline = read_bench_baseline(baseline_path, baseline_names, baseline_medians);
+        if (nbaseline == 0)
+        {
+            fprintf(stderr, "Cannot read the baseline %s\n", baseline_path);
+            status = 1;
+        }
+        static const char *const compare_columns[] = {"kernel", "baseline_ns", "median_ns", "change_percent", "regression"};
+        bench_output_begin(&output, json, compare_columns, sizeof(compare_columns) / sizeof(compare_columns[0]));
+        int compared[BENCH_NKERNELS] = {0};
+        for (size_t b = 0; b < nbaseline; ++b)
+        {
+            int known = 0;
+            for (int kernel = 0; kernel < BENCH_NKERNELS; ++kernel)
+            {
+                if (strcmp(baseline_names[b], names[kernel]) != 0)
+                    continue;
+                known = 1;
+                if (baseline_medians[b] <= 0)
+                {
+                    fprintf(stderr, "Baseline %s: invalid median %g\n", names[kernel], baseline_medians[b]);
+                    continue;
+                }
+                compared[kernel] = 1;
+                double change = (medians[kernel] - baseline_medians[b]) / baseline_medians[b] * 100;
+                int regression = (change > threshold);
+                double values[] = {baseline_medians[b], medians[kernel], change, regression};
+                bench_output_row(&output, names[kernel], values);
+                if (regression)
+                {
+                    fprintf(stderr, "REGRESSION %s: %.1f ns -> %.1f ns (%+.1f%%)\n", names[kernel], baseline_medians[b],
+                            medians[kernel], change);
+                    status = 1;
+                }
+            }
+            if (!known)
+                fprintf(stderr, "Baseline %s: unknown kernel, not compared\n", baseline_names[b]);
+            free(baseline_names[b]);
+        }
+        for (int kernel = 0; kernel < BENCH_NKERNELS && nbaseline > 0; ++kernel)
+        {
+            if (!compared[kernel])
+                fprintf(stderr, "MISSING %s: not in the baseline, not compared\n", names[kernel]);
+        }
+        bench_output_end(&output);
+    }
+    free(inputs->header.data);
+    free(inputs->codes);
+    free(inputs->decoded);
+    free(inputs->records);
+    free(inputs->record_codes);
+    free(inputs->records_decoded);
+    free(inputs->records_offsets);
+    free(inputs);
+    free(block);
+    return status;
+}
+
+/// Worst-case input shapes of bench_worst, the first one is the reference of the others
+#define BENCH_WORST_TEXT 0
+#define BENCH_WORST_FIBONACCI 1
+#define BENCH_WORST_UNIFORM 2
+#define BENCH_WORST_ALTERNATING 3
+#define BENCH_NWORST 4
+/// Symbols with Fibonacci frequencies, the legacy coder gives them codes of up to 24 bits
+#define BENCH_FIBONACCI_NSYMBOLS 25
+
+/// @brief Fills a buffer with a worst-case shape, never with '\0' so that the legacy coder takes it too
+/// @param shape One of the BENCH_WORST_ shapes
+/// @param buffer Buffer to fill
+/// @param length Number of characters
+static void generate_worst_shape(int shape, char *buffer, size_t length)
+{
+    uint64_t cumulative[BENCH_FIBONACCI_NSYMBOLS];
+    uint64_t frequency = 1;
+    uint64_t next_frequency = 1;
+    for (size_t i = 0; i < BENCH_FIBONACCI_NSYMBOLS; ++i)
+    {
+        cumulative[i] = ((i > 0) ? cumulative[i - 1] : 0) + frequency;
+        uint64_t sum = frequency + next_frequency;
+        frequency = next_frequency;
+        next_frequency = sum;
+    }
+    if (shape == BENCH_WORST_TEXT)
+        generate_corpus(buffer, length, 64, 42);
+    uint64_t seed = 42;
+    for (size_t i = 0; i < length && shape != BENCH_WORST_TEXT; ++i)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        uint32_t random = (uint32_t)(seed >> 33);
+        if (shape == BENCH_WORST_FIBONACCI)
+        {
+            // Exact Fibonacci counts in each period, shuffled below
+            uint64_t position = i % cumulative[BENCH_FIBONACCI_NSYMBOLS - 1];
+            size_t c = 0;
+            while (position >= cumulative[c])
+                c++;
+            buffer[i] = (char)('A' + c);
+            size_t j = (size_t)(((uint64_t)random << 31 | (seed >> 2 & 0x7fffffff)) % (i + 1));
+            char swap = buffer[i];
+            buffer[i] = buffer[j];
+            buffer[j] = swap;
+        }
+        else if (shape == BENCH_WORST_UNIFORM)
+            buffer[i] = (char)(1 + i % 255);
+        else
+            // A frequent character with a short code at random places between rare ones with long codes
+            buffer[i] = (random & 1) ? 'a' : (char)(1 + random % 255);
+    }
+}
+
+/// @brief Decodes worst-case shapes with both coders and checks that the decode cost stays bounded
+///         Fibonacci frequencies give the deepest codes, 255 equally frequent characters the largest alphabet
+///         and a frequent character at random places defeats the branch predictor of the decoding loop.
+///         The decode time per coded bit of each shape must stay within max_ratio times the one of text
+///         and the heap of a decode within the size of the coded bits, so that no input can stall a decoder.
+/// @param size Size of each input
+/// @param max_ratio Largest decode time per coded bit against text
+/// @param json 1 for JSON, 0 for CSV
+/// @return status code, 1 if a shape is not bounded
+static int bench_worst(size_t size, double max_ratio, int json)
+{
+    static const char *const shapes[BENCH_NWORST] = {"text", "fibonacci", "uniform255", "alternating"};
+    static const char *const coders[2] = {"legacy", "frame"};
+    char *corpus = malloc(size + 1);
+    unsigned char *frame = malloc(HUFFMAN_FRAME_BOUND(size));
+    char *block = malloc(size);
+    if (corpus == NULL || frame == NULL || block == NULL)
+    {
+        free(corpus);
+        free(frame);
+        free(block);
+        return STATUS_CODE_ALLOC_FAIL;
+    }
+    static const char *const columns[] = {"shape", "bytes", "coded_bits", "max_nbits", "encode_ns_per_byte",
+                                          "decode_ns_per_byte", "decode_ns_per_bit", "decode_peak_bytes", "bounded"};
+    BenchOutput output;
+    bench_output_begin(&output, json, columns, sizeof(columns) / sizeof(columns[0]));
+    double reference[2] = {0, 0};
+    int status = 0;
+    int unbounded = 0;
+    for (int shape = 0; shape < BENCH_NWORST && status == 0; ++shape)
+    {
+        generate_worst_shape(shape, corpus, size);
+        corpus[size] = '\0';
+        for (int coder = 0; coder < 2 && status == 0; ++coder)
+        {
+            HuffmanStats encode_stats = {0};
+            HuffmanStats decode_stats = {0};
+            EncodedMessage encoded = {.header = {.data = NULL, .nbits = 0, .nbytes = 0}, .message = {.data = NULL, .nbits = 0, .nbytes = 0}};
+            HuffmanFrameHeader frame_header;
+            size_t frame_length = 0;
+            size_t coded_bits = 0;
+            double encode_ns = 0;
+            double decode_ns = 0;
+            uint64_t start = now_ns();
+            if (coder == 0)
+                status = huffman_encode_stats(corpus, &encoded, &encode_stats);
+            else
+                status = huffman_encode_frame_stats(corpus, size, frame, &frame_length, &encode_stats);
+            encode_ns = (double)(now_ns() - start);
+            if (status == 0 && coder == 1)
+                status = huffman_read_frame_header(frame, &frame_header);
+            // Best of three decodes
+            for (int repetition = 0; repetition < 3 && status == 0; ++repetition)
+            {
+                char *decoded = NULL;
+                start = now_ns();
+                if (coder == 0)
+                    status = huffman_decode_stats(&encoded, &decoded, &decode_stats);
+                else
+                    status = huffman_decode_frame_payload_stats(&frame_header, frame + HUFFMAN_FRAME_HEADER_SIZE, block,
+                                                                &decode_stats);
+                uint64_t elapsed = now_ns() - start;
+                if (repetition == 0 || (double)elapsed < decode_ns)
+                    decode_ns = (double)elapsed;
+                if (status == 0 && memcmp((coder == 0) ? decoded : block, corpus, size) != 0)
+                    status = STATUS_CODE_MESSAGE_CORRUPT;
+                free(decoded);
+            }
+            coded_bits = (coder == 0) ? encoded.message.nbits : (size_t)(encode_stats.code_nbytes * CHAR_BIT);
+            free_encoded_message(&encoded);
+            if (status > 0)
+            {
+                fprintf(stderr, "%s %s: status %d\n", shapes[shape], coders[coder], status);
+                break;
+            }
+            double ns_per_bit = decode_ns / (double)coded_bits;
+            if (shape == BENCH_WORST_TEXT)
+                reference[coder] = ns_per_bit;
+            // The legacy decoder allocates at most one character per coded bit, frames decode into the caller's block
+            size_t output_capacity = (coder == 0) ? coded_bits + 1 : 0;
+            size_t peak_bound = output_capacity + (64 << 10);
+            int bounded = (ns_per_bit <= max_ratio * reference[coder] && decode_stats.memory.peak <= peak_bound);
+            if (!bounded)
+            {
+                fprintf(stderr, "UNBOUNDED %s %s: %.2f ns per bit against %.2f, peak %zu bytes against %zu\n",
+                        shapes[shape], coders[coder], ns_per_bit, reference[coder], decode_stats.memory.peak, peak_bound);
+                unbounded = 1;
+            }
+            char label[64];
+            snprintf(label, sizeof(label), "%s/%s", shapes[shape], coders[coder]);
+            double values[] = {(double)size, (double)coded_bits, encode_stats.max_nbits, encode_ns / (double)size,
+                               decode_ns / (double)size, ns_per_bit, (double)decode_stats.memory.peak, bounded};
+            bench_output_row(&output, label, values);
+        }
+    }
+    bench_output_end(&output);
+    free(corpus);
+    free(frame);
+    free(block);
+    return (status > 0) ? status : unbounded;
+}
+
+/// @brief Compresses a corpus block by block at each level of HuffmanFrameEncoder and decompresses its frames
+///         The generated corpus changes of distribution every 192 KiB so that splitting blocks pays off.
+///         Each level keeps the best of three runs, on a single thread.
+/// @param input_path File to compress, a corpus is generated when NULL
+/// @param size Size of the generated corpus
+/// @param block_size Size of the blocks
+/// @param json 1 for JSON, 0 for CSV
+/// @return status code
+static int bench_levels(const char *input_path, size_t size, size_t block_size, int json)
+{
+    static const char *const levels[] = {"", "fast", "default", "max"};
+    if (input_path != NULL)
+        size = file_size(input_path);
+    if (block_size == 0)
+        block_size = HUFFMAN_FILE_DEFAULT_BLOCK_SIZE;
+    size_t nblocks = (size + block_size - 1) / block_size;
+    char *corpus = malloc(size + 1);
+    unsigned char *compressed = malloc(size + nblocks * HUFFMAN_FRAME_HEADER_SIZE + 1);
+    char *decompressed = malloc(size + 1);
+    int status = (corpus == NULL || compressed == NULL || decompressed == NULL) ? STATUS_CODE_ALLOC_FAIL : 0;
+    if (status == 0 && input_path != NULL)
+    {
+        FILE *file = fopen(input_path, "rb");
+        if (file == NULL || fread(corpus, 1, size, file) != size)
+            status = STATUS_CODE_FILE_FAIL;
+        if (file != NULL)
+            fclose(file);
+    }
+    else if (status == 0)
+    {
+        for (size_t begin = 0; begin < size; begin += 192 << 10)
+        {
+            size_t length = (size - begin < (192 << 10)) ? size - begin : 192 << 10;
+            unsigned int segment = (unsigned int)(begin / (192 << 10));
+            generate_corpus(corpus + begin, length, (segment % 2 == 0) ? 8 : 90, segment);
+        }
+    }
+    static const char *const columns[] = {"level", "bytes", "compressed_bytes", "ratio", "compress_mb_s",
+                                          "decompress_mb_s"};
+    BenchOutput output;
+    if (status == 0)
+        bench_output_begin(&output, json, columns, sizeof(columns) / sizeof(columns[0]));
+    for (int level = HUFFMAN_LEVEL_FAST; level <= HUFFMAN_LEVEL_MAX && status == 0; ++level)
+    {
+        size_t compressed_length = 0;
+        double compress_time = 0;
+        double decompress_time = 0;
+        for (int run = 0; run < 3 && status == 0; ++run)
+        {
+            HuffmanFrameEncoder encoder;
+            huffman_frame_encoder_init(&encoder, level);
+            compressed_length = 0;
+            double start = now_seconds();
+            for (size_t begin = 0; begin < size && status == 0; begin += block_size)
+            {
+                size_t length = (size - begin < block_size) ? size - begin : block_size;
+                size_t frames_length = 0;
+                status = huffman_frame_encoder_encode(&encoder, corpus + begin, length, compressed + compressed_length,
+                                                      &frames_length);
+                compressed_length += frames_length;
+            }
+            double elapsed = now_seconds() - start;
+            free_huffman_frame_encoder(&encoder);
+            if (run == 0 || elapsed < compress_time)
+                compress_time = elapsed;
+            start = now_seconds();
+            size_t offset = 0;
+            size_t decompressed_length = 0;
+            while (offset < compressed_length && status == 0)
+            {
+                HuffmanFrameHeader frame_header;
+                status = huffman_read_frame_header(compressed + offset, &frame_header);
+                if (status == 0)
+                    status = huffman_decode_frame_payload(&frame_header, compressed + offset + HUFFMAN_FRAME_HEADER_SIZE,
+                                                          decompressed + decompressed_length);
+                offset += HUFFMAN_FRAME_HEADER_SIZE + frame_header.payload_length;
+                decompressed_length += frame_header.raw_length;
+            }
+            elapsed = now_seconds() - start;
+            if (run == 0 || elapsed < decompress_time)
+                decompress_time = elapsed;
+            if (status == 0 && (decompressed_length != size || memcmp(decompressed, corpus, size) != 0))
+                status = STATUS_CODE_MESSAGE_CORRUPT;
+        }
+        double values[] = {(double)size, (double)compressed_length, (double)size / (double)compressed_length,
+                           (double)size / compress_time / 1e6, (double)size / decompress_time / 1e6};
+        if (status == 0)
+            bench_output_row(&output, levels[level], values);
+    }
+    if (status == 0)
+        bench_output_end(&output);
+    free(corpus);
+    free(compressed);
+    free(decompressed);
+    return status;
+}
+
+/// @brief Prints the usage of the benchmark
+/// @param program Name of the program
+static void print_usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s <mode> [options]\n"
+            "  io [-f file] [-s size_mb] [-q queue_depth] [-t threads]\n"
+            "      compare the pread and io_uring file backends and parallel workers\n"
+            "  daemon [-S socket] [-c clients] [-n requests] [-l record_length] [-t threads]\n"
+            "      load generator for huffmand, starts its own daemon when no socket is given\n"
+            "  counters [-s size_mb]\n"
+            "      hardware counters of the histogram, table build, encoding and decoding stages\n"
+            "  threads [-s size_mb] [-b block_kb] [-t max_threads] [-o csv|json]\n"
+            "      file compression and decompression with 1 to max_threads workers, online CPUs by default\n"
+            "  sizes [-s max_size_mb] [-o csv|json]\n"
+            "      single-thread kernels on inputs doubling from 1 KiB, in and out of the caches\n"
+            "  kernels [-B baseline.json] [-r threshold_percent] [-o csv|json]\n"
+            "      time each kernel alone in JSON, or compare with a baseline and fail on regressions (10%% by default)\n"
+            "  latency [-n calls]\n"
+            "      p50 to p99.9 latency of single calls on 16 B to 4 KiB records, building the table or reusing it\n"
+            "  memory [-s size_mb] [-m limit_bytes]\n"
+            "      allocations and peak heap of encoding and decoding, with an optional ceiling per call\n"
+            "  worst [-s size_mb] [-x max_ratio] [-o csv|json]\n"
+            "      decode deep codes, full alphabets and unpredictable code lengths, 1 MiB by default, and fail when\n"
+            "      the time per coded bit exceeds max_ratio times the one of text (4 by default)\n"
+            "  levels [-f file] [-s size_mb] [-b block_kb] [-o csv|json]\n"
+            "      ratio and single-thread speed of the fast, default and max levels, a corpus whose distribution\n"
+            "      changes every 192 KiB by default\n",
+            program);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char *mode = argv[1];
+    const char *input_path = NULL;
+    size_t size = 64 << 20;
+    int size_set = 0;
+    unsigned int queue_depth = HUFFMAN_FILE_DEFAULT_QUEUE_DEPTH;
+    unsigned int nthreads = 4;
+    int nthreads_set = 0;
+    size_t block_size = HUFFMAN_FILE_DEFAULT_BLOCK_SIZE;
+    // CSV by default, JSON by default for the kernels
+    int json = -1;
+    const char *baseline_path = NULL;
+    double threshold = 10;
+    double max_ratio = 4;
+    const char *socket_path = NULL;
+    unsigned int nclients = 16;
+    size_t nrequests = 2000;
+    int nrequests_set = 0;
+    size_t record_length = 256;
+    size_t memory_limit = 0;
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-f") == 0)
+            input_path = argv[i + 1];
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            size = strtoul(argv[i + 1], NULL, 10) << 20;
+            size_set = 1;
+        }
+        else if (strcmp(argv[i], "-q") == 0)
+            queue_depth = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            nthreads = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+            nthreads_set = 1;
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+            block_size = strtoul(argv[i + 1], NULL, 10) << 10;
+        else if (strcmp(argv[i], "-o") == 0)
+            json = (strcmp(argv[i + 1], "json") == 0);
+        else if (strcmp(argv[i], "-B") == 0)
+            baseline_path = argv[i + 1];
+        else if (strcmp(argv[i], "-r") == 0)
+            threshold = strtod(argv[i + 1], NULL);
+        else if (strcmp(argv[i], "-S") == 0)
+            socket_path = argv[i + 1];
+        else if (strcmp(argv[i], "-c") == 0)
+            nclients = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "-n") == 0)
+        {
+            nrequests = strtoul(argv[i + 1], NULL, 10);
+            nrequests_set = 1;
+            if (nrequests == 0)
+            {
+                fprintf(stderr, "-n must be at least 1\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-l") == 0)
+            record_length = strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "-m") == 0)
+            memory_limit = strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "-x") == 0)
+            max_ratio = strtod(argv[i + 1], NULL);
+    }
+    if (strcmp(mode, "io") == 0)
+        return bench_io(input_path, size, queue_depth, nthreads);
+    if (strcmp(mode, "counters") == 0)
+        return bench_counters(size);
+    if (strcmp(mode, "threads") == 0)
+        return bench_threads(size, block_size, nthreads_set ? nthreads : (unsigned int)sysconf(_SC_NPROCESSORS_ONLN),
+                             json == 1);
+    if (strcmp(mode, "sizes") == 0)
+        return bench_sizes(size, json == 1);
+    if (strcmp(mode, "kernels") == 0)
+        return bench_kernels(baseline_path, threshold, json != 0);
+    if (strcmp(mode, "latency") == 0)
+        return bench_latency(nrequests_set ? nrequests : 1000000);
+    if (strcmp(mode, "memory") == 0)
+        return bench_memory(size, memory_limit);
+    if (strcmp(mode, "worst") == 0)
+        return bench_worst(size_set ? size : (1 << 20), max_ratio, json == 1);
+    if (strcmp(mode, "levels") == 0)
+        return bench_levels(input_path, size, block_size, json == 1);
+    if (strcmp(mode, "daemon") == 0)
+        return bench_daemon(socket_path, nclients, nrequests, record_length, nthreads);
+    print_usage(argv[0]);
+    return 1;
+}
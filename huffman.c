@@ -1,9 +1,15 @@
+#define _POSIX_C_SOURCE 200809L
 #include "huffman.h"
+#include "huffman_inline.h"
+#include "huffman_trace.h"
+#include "huffman_endian.h"
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
 #include <assert.h>
 #include <stdint.h>
+#include <math.h>
+#include <time.h>
 
 #if DEBUG_MODE
 #define PRINT_DEBUG(msg)              \
@@ -66,13 +72,28 @@ typedef struct AlphabetCode
     size_t length;
 } AlphabetCode;
 
-/// @brief Structure to organize the alphabet as a binary tree according the bits of the codes
-typedef struct AlphabetCodeTree
+/// Longest code accepted in the header of a message, a message needs more than Fib(64) characters to reach it
+#define ALPHABET_MAX_NBITS 63
+
+/// HUFFMAN_LEVEL_FAST counts one chunk of HUFFMAN_FAST_SAMPLE_LENGTH characters out of HUFFMAN_FAST_SAMPLE_STRIDE
+#define HUFFMAN_FAST_SAMPLE_LENGTH 1024
+#define HUFFMAN_FAST_SAMPLE_STRIDE 4
+/// HUFFMAN_LEVEL_FAST stores the blocks whose codes are not estimated to save 1/HUFFMAN_FAST_MIN_SAVING of them
+#define HUFFMAN_FAST_MIN_SAVING 64
+/// HUFFMAN_LEVEL_FAST keeps the previous table while it is estimated at most 1/HUFFMAN_FAST_REUSE_SLACK larger
+#define HUFFMAN_FAST_REUSE_SLACK 100
+/// Characters encoded by HUFFMAN_LEVEL_FAST between two checks of the size and of the in-place margin of the codes
+#define HUFFMAN_FAST_CHUNK_LENGTH 256
+
+/// @brief Canonical decoding index of an alphabet in code order: the number of codes of each length
+///         Its size is linear in the length of the longest code, where a binary tree of the codes is exponential
+typedef struct AlphabetCodeIndex
 {
-    CharCode **tree;
-    size_t length;
+    const CharCode *chars;
+    size_t counts[ALPHABET_MAX_NBITS + 1];
     size_t min_nbits;
-} AlphabetCodeTree;
+    size_t max_nbits;
+} AlphabetCodeIndex;
 
 /// @brief Node in a Huffman tree containing data and child pointers
 typedef struct HuffmanNode
@@ -91,12 +112,244 @@ typedef struct HuffmanQueue
 
 } HuffmanQueue;
 
+/// Storage class of the memory tracker, one per thread so that concurrent calls count their own allocations.
+/// Define HUFFMAN_THREAD_LOCAL to override it; without thread-local storage the statistics of concurrent calls mix.
+#ifndef HUFFMAN_THREAD_LOCAL
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define HUFFMAN_THREAD_LOCAL _Thread_local
+#elif defined(__GNUC__)
+#define HUFFMAN_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define HUFFMAN_THREAD_LOCAL __declspec(thread)
+#else
+#define HUFFMAN_THREAD_LOCAL
+#endif
+#endif
+
+/// @brief Block allocated while the memory of a call is tracked, with its requested size
+typedef struct HuffmanMemoryBlock
+{
+    void *ptr;
+    size_t size;
+} HuffmanMemoryBlock;
+
+/// @brief Memory of a call being tracked, from memory_track to memory_untrack
+///         The sizes of the blocks allocated by the call are kept in an open addressing table, not in front of the
+///         blocks since the caller frees the returned buffers with free, so that freeing a block removes the size it
+///         added and freeing a block allocated before the call, such as a buffer owned by the caller, removes nothing.
+typedef struct HuffmanMemoryTracker
+{
+    HuffmanMemory *memory;
+    // Linear probing table of capacity entries, a power of two, or NULL
+    HuffmanMemoryBlock *blocks;
+    size_t capacity;
+    size_t count;
+    // Tracker of an enclosing call, whose blocks can be freed by this one
+    struct HuffmanMemoryTracker *previous;
+} HuffmanMemoryTracker;
+
+/// Memory tracked for the calls of the calling thread, set by the functions taking a HuffmanStats
+static HUFFMAN_THREAD_LOCAL HuffmanMemoryTracker *tracked_memory = NULL;
+
+/// @brief Slot of a block in the table of a tracker
+static size_t memory_block_slot(const HuffmanMemoryTracker *tracker, const void *ptr)
+{
+    uint64_t hash = ((uint64_t)(uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull;
+    return (size_t)(hash >> 32) & (tracker->capacity - 1);
+}
+
+/// @brief Records the size of a block allocated while tracking, the table growing with plain malloc
+/// @return 1 on success, 0 if the table cannot grow
+static int memory_block_insert(HuffmanMemoryTracker *tracker, void *ptr, size_t size)
+{
+    if (2 * (tracker->count + 1) > tracker->capacity)
+    {
+        size_t capacity = (tracker->capacity > 0) ? 2 * tracker->capacity : 64;
+        HuffmanMemoryBlock *blocks = calloc(capacity, sizeof(HuffmanMemoryBlock));
+        if (blocks == NULL)
+            return 0;
+        HuffmanMemoryTracker grown = {tracker->memory, blocks, capacity, 0, tracker->previous};
+        for (size_t i = 0; i < tracker->capacity; ++i)
+        {
+            if (tracker->blocks[i].ptr != NULL)
+                memory_block_insert(&grown, tracker->blocks[i].ptr, tracker->blocks[i].size);
+        }
+        free(tracker->blocks);
+        *tracker = grown;
+    }
+    size_t slot = memory_block_slot(tracker, ptr);
+    while (tracker->blocks[slot].ptr != NULL)
+        slot = (slot + 1) & (tracker->capacity - 1);
+    tracker->blocks[slot].ptr = ptr;
+    tracker->blocks[slot].size = size;
+    tracker->count += 1;
+    return 1;
+}
+
+/// @brief Entry of a block in the table of a tracker
+/// @return the entry, NULL if the block was not allocated while tracking
+static HuffmanMemoryBlock *memory_block_find(const HuffmanMemoryTracker *tracker, const void *ptr)
+{
+    if (tracker->capacity == 0)
+        return NULL;
+    size_t slot = memory_block_slot(tracker, ptr);
+    while (tracker->blocks[slot].ptr != ptr)
+    {
+        if (tracker->blocks[slot].ptr == NULL)
+            return NULL;
+        slot = (slot + 1) & (tracker->capacity - 1);
+    }
+    return &tracker->blocks[slot];
+}
+
+/// @brief Forgets an entry of a tracker, shifting back the entries that follow it in its probe sequence
+static void memory_block_remove(HuffmanMemoryTracker *tracker, HuffmanMemoryBlock *block)
+{
+    size_t mask = tracker->capacity - 1;
+    size_t slot = (size_t)(block - tracker->blocks);
+    for (size_t next = (slot + 1) & mask; tracker->blocks[next].ptr != NULL; next = (next + 1) & mask)
+    {
+        // An entry moves into the hole unless its home slot lies cyclically in (slot, next]
+        size_t home = memory_block_slot(tracker, tracker->blocks[next].ptr);
+        if (((next - home) & mask) >= ((next - slot) & mask))
+        {
+            tracker->blocks[slot] = tracker->blocks[next];
+            slot = next;
+        }
+    }
+    tracker->blocks[slot].ptr = NULL;
+    tracker->count -= 1;
+}
+
+/// @brief Counts a new block in the tracked memory
+/// @param ptr Block returned by an allocation, not NULL
+/// @param size Requested size of the block
+/// @return 1 on success, 0 if the block goes above the ceiling or cannot be recorded
+static int memory_add(void *ptr, size_t size)
+{
+    HuffmanMemory *memory = tracked_memory->memory;
+    if (memory->limit > 0 && memory->current + size > memory->limit)
+    {
+        memory->limit_reached = 1;
+        return 0;
+    }
+    if (!memory_block_insert(tracked_memory, ptr, size))
+        return 0;
+    memory->current += size;
+    memory->nallocs += 1;
+    if (memory->current > memory->peak)
+        memory->peak = memory->current;
+    return 1;
+}
+
+/// @brief Removes a block from the memory of the call that allocated it, nothing for a block allocated untracked
+static void memory_remove(const void *ptr)
+{
+    for (HuffmanMemoryTracker *tracker = tracked_memory; tracker != NULL; tracker = tracker->previous)
+    {
+        HuffmanMemoryBlock *block = memory_block_find(tracker, ptr);
+        if (block != NULL)
+        {
+            tracker->memory->current -= block->size;
+            memory_block_remove(tracker, block);
+            return;
+        }
+    }
+}
+
+/// @brief Tells whether a block was allocated while tracking, by this call or an enclosing one
+/// @param size Set to the size of the block
+static int memory_find(const void *ptr, size_t *size)
+{
+    for (HuffmanMemoryTracker *tracker = tracked_memory; tracker != NULL; tracker = tracker->previous)
+    {
+        const HuffmanMemoryBlock *block = memory_block_find(tracker, ptr);
+        if (block != NULL)
+        {
+            *size = block->size;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/// @brief malloc counted in the tracked memory of the calling thread if any
+static void *huffman_malloc(size_t size)
+{
+    if (tracked_memory == NULL)
+        return malloc(size);
+    void *ptr = malloc(size);
+    if (ptr != NULL && !memory_add(ptr, size))
+    {
+        free(ptr);
+        return NULL;
+    }
+    return ptr;
+}
+
+/// @brief calloc counted in the tracked memory of the calling thread if any
+static void *huffman_calloc(size_t count, size_t size)
+{
+    if (tracked_memory == NULL)
+        return calloc(count, size);
+    // calloc has already refused a product that overflows
+    void *ptr = calloc(count, size);
+    if (ptr != NULL && !memory_add(ptr, count * size))
+    {
+        free(ptr);
+        return NULL;
+    }
+    return ptr;
+}
+
+/// @brief free counted in the tracked memory of the calling thread if any
+///         A block allocated before the call, such as a buffer of the caller, is freed without being counted.
+static void huffman_free(void *ptr)
+{
+    if (tracked_memory != NULL && ptr != NULL)
+        memory_remove(ptr);
+    free(ptr);
+}
+
+/// @brief realloc counted in the tracked memory of the calling thread if any, the block is kept on failure
+///         While counting, a tracked block is moved to a new allocation so that the peak includes both copies.
+///         A block allocated before the call, whose size is unknown, is reallocated and counted from then on.
+static void *huffman_realloc(void *ptr, size_t size)
+{
+    if (tracked_memory == NULL)
+        return realloc(ptr, size);
+    size_t old_size = 0;
+    if (ptr != NULL && !memory_find(ptr, &old_size))
+    {
+        HuffmanMemory *memory = tracked_memory->memory;
+        if (memory->limit > 0 && memory->current + size > memory->limit)
+        {
+            memory->limit_reached = 1;
+            return NULL;
+        }
+        void *new_ptr = realloc(ptr, size);
+        // A block that cannot be recorded stays valid, it is only left out of the count
+        if (new_ptr != NULL)
+            memory_add(new_ptr, size);
+        return new_ptr;
+    }
+    void *new_ptr = huffman_malloc(size);
+    if (new_ptr == NULL)
+        return NULL;
+    if (ptr != NULL)
+    {
+        memcpy(new_ptr, ptr, (old_size < size) ? old_size : size);
+        huffman_free(ptr);
+    }
+    return new_ptr;
+}
+
 /// @brief Frees all resources associated with a BitMessage
 /// @param bit_message Pointer to the BitMessage structure to free
-void free_bit_message(BitMessage *bit_message)
+static void free_bit_message(BitMessage *bit_message)
 {
     if (bit_message->data != NULL)
-        free(bit_message->data);
+        huffman_free(bit_message->data);
     bit_message->data = NULL;
     bit_message->nbits = 0;
     bit_message->nbytes = 0;
@@ -104,7 +357,7 @@ void free_bit_message(BitMessage *bit_message)
 
 ///@brief Frees all dynamically allocated memory in a CharCode structure
 ///@param char_code Pointer to CharCode structure to free
-void free_char_code(CharCode *char_code)
+static void free_char_code(CharCode *char_code)
 {
     free_bit_message(&char_code->code);
     char_code->c = '\0';
@@ -113,26 +366,17 @@ void free_char_code(CharCode *char_code)
 
 ///@brief Frees all dynamically allocated memory in a AlphabetCode structure
 ///@param alphabet Pointer to AlphabetCode structure to free
-void free_alphabet_code(AlphabetCode *alphabet)
+static void free_alphabet_code(AlphabetCode *alphabet)
 {
     for (size_t i = 0; i < alphabet->length; i++)
         free_char_code(&alphabet->chars[i]);
     if (alphabet->chars != NULL)
     {
-        free(alphabet->chars);
+        huffman_free(alphabet->chars);
         alphabet->chars = NULL;
     }
 }
 
-///@brief Free the AlphabetCode binary tree structure
-///@param alphabet_code_tree Pointer to AlphabetCode structure to free
-void free_alphabet_code_tree(AlphabetCodeTree *alphabet_code_tree)
-{
-    if (alphabet_code_tree->tree != NULL)
-        free(alphabet_code_tree->tree);
-    alphabet_code_tree->length = 0;
-}
-
 /// @brief Frees resources associated with an encoded message
 /// @param encoded_message Pointer to the EncodedMessage structure to free
 void free_encoded_message(EncodedMessage *encoded_message)
@@ -143,7 +387,7 @@ void free_encoded_message(EncodedMessage *encoded_message)
 
 /// @brief Frees resources associated with a Huffman tree node and its children
 /// @param node Pointer to the HuffmanNode structure to free
-void free_huffman_node(HuffmanNode *node)
+static void free_huffman_node(HuffmanNode *node)
 {
     if (node == NULL)
         return;
@@ -152,23 +396,23 @@ void free_huffman_node(HuffmanNode *node)
     if ((node->left != NULL || node->right != NULL) && node->data != NULL)
     {
         free_char_code(node->data);
-        free(node->data);
+        huffman_free(node->data);
         node->data = NULL;
     }
     HuffmanNode *left = node->left;
     node->left = NULL;
     HuffmanNode *right = node->right;
     node->right = NULL;
-    free(node);
+    huffman_free(node);
     free_huffman_node(left);
     free_huffman_node(right);
 }
 
 /// @brief Frees resources associated with a Huffman priority queue
 /// @param queue Pointer to the HuffmanQueue structure to free
-void free_huffman_queue(HuffmanQueue *queue)
+static void free_huffman_queue(HuffmanQueue *queue)
 {
-    free(queue->queue);
+    huffman_free(queue->queue);
     queue->queue = NULL;
     queue->count = 0;
     queue->capacity = 0;
@@ -176,27 +420,19 @@ void free_huffman_queue(HuffmanQueue *queue)
 
 /// @brief Frees resources associated with a Huffman priority queue
 /// @param queue Pointer to the HuffmanQueue structure to free
-void free_huffman_queue_and_content(HuffmanQueue *queue)
+static void free_huffman_queue_and_content(HuffmanQueue *queue)
 {
-    for (size_t i = 0; i < queue->capacity; ++i)
+    // The slots past count hold nodes already popped and owned by a parent
+    for (size_t i = 0; i < queue->count; ++i)
         free_huffman_node(queue->queue[i]);
     free_huffman_queue(queue);
 }
 
-/// @brief Prints an error message to stderr and exits with the given status
-/// @param message Error message to print
-/// @param status Exit status code
-void exit_error(char *message, int status)
-{
-    fprintf(stderr, "ERROR: %s\n", message);
-    exit(status);
-}
-
 /// @brief Gets the value of a bit at a specific position in a BitMessage
 /// @param bit_message Pointer to the BitMessage structure
 /// @param pos Position of the bit to retrieve (zero-indexed)
 /// @return The bit value (0 or 1) at the specified position
-int get_bit_message_value(const BitMessage *bit_message, size_t pos)
+static int get_bit_message_value(const BitMessage *bit_message, size_t pos)
 {
     return (bit_message->data[pos / CHAR_BIT] >> ((CHAR_BIT - 1) - (pos % CHAR_BIT))) & 1;
 }
@@ -205,7 +441,7 @@ int get_bit_message_value(const BitMessage *bit_message, size_t pos)
 /// @param bit_message Pointer to the BitMessage structure to modify
 /// @param pos Position of the bit to set (zero-indexed)
 /// @param value Value to set (0 or 1)
-void add_one_bit_message_value(BitMessage *bit_message, int value)
+static void add_one_bit_message_value(BitMessage *bit_message, int value)
 {
     size_t pos = bit_message->nbits;
     if (value)
@@ -220,10 +456,10 @@ void add_one_bit_message_value(BitMessage *bit_message, int value)
 /// @brief Creates a deep copy of a BitMessage structure
 /// @param dest Pointer to the destination BitMessage structure
 /// @param src Pointer to the source BitMessage structure to copy
-int copy_bit_message(BitMessage *dest, const BitMessage *src)
+static int copy_bit_message(BitMessage *dest, const BitMessage *src)
 {
     assert(dest->data == NULL);
-    dest->data = malloc(src->nbytes * sizeof(unsigned char));
+    dest->data = huffman_malloc(src->nbytes * sizeof(unsigned char));
     if (dest->data == NULL)
         return STATUS_CODE_ALLOC_FAIL;
     memcpy(dest->data, src->data, src->nbytes);
@@ -234,7 +470,7 @@ int copy_bit_message(BitMessage *dest, const BitMessage *src)
 
 /// @brief Removes the last bit from a BitMessage and updates metadata
 /// @param bit_message Pointer to the BitMessage structure to modify
-void remove_one_bit_message_value(BitMessage *bit_message)
+static void remove_one_bit_message_value(BitMessage *bit_message)
 {
     bit_message->nbits -= 1;
     bit_message->nbytes = bit_message->nbits / CHAR_BIT + 1;
@@ -258,7 +494,7 @@ void display_bit_message(const BitMessage *bit_message, char *data)
 /// @brief Count the frequency of each ASCII character for the given message
 /// @param message Null-terminated string to analyze for character frequencies
 /// @param frequencies Array of frequencies for MAX_CHAR ASCII characters
-void count_frequencies(const char *message, size_t *frequencies)
+static void count_frequencies(const char *message, size_t *frequencies)
 {
     if (message != NULL)
     {
@@ -276,7 +512,7 @@ void count_frequencies(const char *message, size_t *frequencies)
 /// @param a Pointer to the first CharCode to compare
 /// @param b Pointer to the second CharCode to compare
 /// @return Positive if a's frequency is less than b's, negative if greater, zero if equal
-int alphabet_freq_comparator(const void *a, const void *b)
+static int alphabet_freq_comparator(const void *a, const void *b)
 {
     CharCode *char_code_a = (CharCode *)a;
     CharCode *char_code_b = (CharCode *)b;
@@ -291,26 +527,24 @@ int alphabet_freq_comparator(const void *a, const void *b)
     return 0;
 }
 
-/// @brief Builds an alphabet structure containing characters and their frequencies
-/// @param message Null-terminated string to analyze
+/// @brief Builds an alphabet structure from already counted frequencies
+/// @param frequencies Array of frequencies for MAX_CHAR ASCII characters
 /// @param alphabet Pointer to AlphabetCode structure to initialize
 /// @return status code
-int build_alphabet(const char *message, AlphabetCode *alphabet)
+static int build_alphabet_from_frequencies(const size_t *frequencies, AlphabetCode *alphabet)
 {
     if (alphabet->chars != NULL)
         return STATUS_CODE_ALPHABET_NOT_EMPTY;
-    size_t frequencies[MAX_CHAR] = {0};
-    count_frequencies(message, frequencies);
     size_t length = 0;
     for (size_t i = 0; i < MAX_CHAR; i++)
     {
         if (frequencies[i] > 0)
             length += 1;
     }
-    alphabet->length = length;
-    alphabet->chars = malloc(length * sizeof(CharCode));
+    alphabet->chars = huffman_malloc(length * sizeof(CharCode));
     if (alphabet->chars == NULL)
         return STATUS_CODE_ALLOC_FAIL;
+    alphabet->length = length;
     size_t char_idx = 0;
     for (size_t i = 0; i < MAX_CHAR; i++)
     {
@@ -331,12 +565,25 @@ int build_alphabet(const char *message, AlphabetCode *alphabet)
     return 0;
 }
 
+/// @brief Builds an alphabet structure containing characters and their frequencies
+/// @param message Null-terminated string to analyze
+/// @param alphabet Pointer to AlphabetCode structure to initialize
+/// @return status code
+static int build_alphabet(const char *message, AlphabetCode *alphabet)
+{
+    if (alphabet->chars != NULL)
+        return STATUS_CODE_ALPHABET_NOT_EMPTY;
+    size_t frequencies[MAX_CHAR] = {0};
+    count_frequencies(message, frequencies);
+    return build_alphabet_from_frequencies(frequencies, alphabet);
+}
+
 /// @brief Creates a new Huffman tree node for a character
 /// @param char_code Pointer to CharCode structure for the character
 /// @return Pointer to the newly created HuffmanNode
-int create_huffman_node(CharCode *char_code, HuffmanNode **node)
+static int create_huffman_node(CharCode *char_code, HuffmanNode **node)
 {
-    *node = malloc(sizeof(HuffmanNode));
+    *node = huffman_malloc(sizeof(HuffmanNode));
     if (*node == NULL)
         return STATUS_CODE_ALLOC_FAIL;
     (*node)->data = char_code;
@@ -350,14 +597,18 @@ int create_huffman_node(CharCode *char_code, HuffmanNode **node)
 /// @param right Pointer to the right child node
 /// @param parent Pointer to the newly created parent node
 /// @return status code
-int create_parent_huffman_node(HuffmanNode *left, HuffmanNode *right, HuffmanNode **parent)
+static int create_parent_huffman_node(HuffmanNode *left, HuffmanNode *right, HuffmanNode **parent)
 {
-    *parent = malloc(sizeof(HuffmanNode));
+    *parent = huffman_malloc(sizeof(HuffmanNode));
     if (*parent == NULL)
         return STATUS_CODE_ALLOC_FAIL;
-    (*parent)->data = malloc(sizeof(CharCode));
+    (*parent)->data = huffman_malloc(sizeof(CharCode));
     if ((*parent)->data == NULL)
+    {
+        huffman_free(*parent);
+        *parent = NULL;
         return STATUS_CODE_ALLOC_FAIL;
+    }
     (*parent)->data->c = '\0',
     (*parent)->data->freq = (left->data->freq + right->data->freq),
     (*parent)->data->code.data = NULL;
@@ -372,17 +623,17 @@ int create_parent_huffman_node(HuffmanNode *left, HuffmanNode *right, HuffmanNod
 /// @param queue Pointer to the HuffmanQueue to add to
 /// @param node Pointer to the HuffmanNode to add
 /// @return status code
-int append_huffman_queue(HuffmanQueue *queue, HuffmanNode *node)
+static int append_huffman_queue(HuffmanQueue *queue, HuffmanNode *node)
 {
     queue->count += 1;
     if ((queue->count) >= queue->capacity)
     {
         size_t capacity = 2 * queue->capacity;
-        HuffmanNode **new_queue = realloc(queue->queue, capacity * sizeof(HuffmanNode *));
+        HuffmanNode **new_queue = huffman_realloc(queue->queue, capacity * sizeof(HuffmanNode *));
         if (new_queue == NULL)
         {
-            free_huffman_queue_and_content(queue);
-            queue->queue = NULL;
+            // The queue is left as it was, the node is still owned by the caller
+            queue->count -= 1;
             return STATUS_CODE_ALLOC_FAIL;
         }
         queue->queue = new_queue;
@@ -416,7 +667,7 @@ int append_huffman_queue(HuffmanQueue *queue, HuffmanNode *node)
 /// @brief Removes and returns the node with the lowest frequency (and the lowest character) from the queue
 /// @param queue Pointer to the HuffmanQueue to pop from
 /// @return Pointer to the HuffmanNode with minimum frequency
-HuffmanNode *pop_min_freq_huffman_queue(HuffmanQueue *queue)
+static HuffmanNode *pop_min_freq_huffman_queue(HuffmanQueue *queue)
 {
     HuffmanNode *min_node = queue->queue[0];
     // Replace the root with the last element
@@ -435,25 +686,20 @@ HuffmanNode *pop_min_freq_huffman_queue(HuffmanQueue *queue)
         HuffmanNode *right_node = NULL;
         if (right_index < queue->count)
             right_node = queue->queue[right_index];
-        if (left_node != NULL &&
-            (right_node == NULL ||
-             (right_node != NULL && alphabet_freq_comparator(left_node->data, right_node->data) == 1)) &&
-            alphabet_freq_comparator(left_node->data, current_node->data) == 1)
+        // Select the smallest child, the left one when both are equal
+        size_t child_index = left_index;
+        HuffmanNode *child_node = left_node;
+        if (right_node != NULL && alphabet_freq_comparator(right_node->data, left_node->data) == 1)
         {
-            // swap the nodes
-            queue->queue[left_index] = current_node;
-            queue->queue[current_index] = left_node;
-            current_index = left_index;
+            child_index = right_index;
+            child_node = right_node;
         }
-        else if (right_node != NULL &&
-                 (left_node == NULL ||
-                  (left_node != NULL && alphabet_freq_comparator(right_node->data, left_node->data) == 1)) &&
-                 alphabet_freq_comparator(right_node->data, current_node->data) == 1)
+        if (child_node != NULL && alphabet_freq_comparator(child_node->data, current_node->data) == 1)
         {
             // swap the nodes
-            queue->queue[right_index] = current_node;
-            queue->queue[current_index] = right_node;
-            current_index = right_index;
+            queue->queue[child_index] = current_node;
+            queue->queue[current_index] = child_node;
+            current_index = child_index;
         }
         else
         {
@@ -467,10 +713,10 @@ HuffmanNode *pop_min_freq_huffman_queue(HuffmanQueue *queue)
 /// @param alphabet Pointer to the AlphabetCode structure containing character information
 /// @param root node of the generated Huffman tree
 /// @return status code
-int generate_huffman_tree(const AlphabetCode *alphabet, HuffmanNode **root)
+static int generate_huffman_tree(const AlphabetCode *alphabet, HuffmanNode **root)
 {
     HuffmanQueue queue = {
-        .queue = calloc(2 * alphabet->length, sizeof(HuffmanNode *)),
+        .queue = huffman_calloc(2 * alphabet->length, sizeof(HuffmanNode *)),
         .count = 0,
         .capacity = 2 * alphabet->length,
     };
@@ -489,6 +735,7 @@ int generate_huffman_tree(const AlphabetCode *alphabet, HuffmanNode **root)
         status = append_huffman_queue(&queue, node);
         if (status > 0)
         {
+            free_huffman_node(node);
             free_huffman_queue_and_content(&queue);
             return status;
         }
@@ -502,12 +749,15 @@ int generate_huffman_tree(const AlphabetCode *alphabet, HuffmanNode **root)
         int status = create_parent_huffman_node(left_node, right_node, &parent_node);
         if (status > 0)
         {
+            free_huffman_node(left_node);
+            free_huffman_node(right_node);
             free_huffman_queue_and_content(&queue);
             return status;
         }
         status = append_huffman_queue(&queue, parent_node);
         if (status > 0)
         {
+            free_huffman_node(parent_node);
             free_huffman_queue_and_content(&queue);
             return status;
         }
@@ -562,7 +812,7 @@ static int _generate_huffman_code(HuffmanNode *node, BitMessage *code_buffer)
 /// @param a Pointer to the first CharCode to compare
 /// @param b Pointer to the second CharCode to compare
 /// @return Positive if a's nbits is greater than b's, negative if less, zero if equal
-int alphabet_nbits_comparator(const void *a, const void *b)
+static int alphabet_nbits_comparator(const void *a, const void *b)
 {
     CharCode *char_code_a = (CharCode *)a;
     CharCode *char_code_b = (CharCode *)b;
@@ -580,7 +830,7 @@ int alphabet_nbits_comparator(const void *a, const void *b)
 /// @brief Transforms standard Huffman codes to canonical form
 ///         (see https://en.wikipedia.org/wiki/Canonical_Huffman_code)
 /// @param alphabet Pointer to the AlphabetCode structure
-void transform_to_canonical_code(const AlphabetCode *alphabet)
+static void transform_to_canonical_code(const AlphabetCode *alphabet)
 {
     if (alphabet->length == 0)
         return;
@@ -610,7 +860,7 @@ void transform_to_canonical_code(const AlphabetCode *alphabet)
 /// @brief Generates Huffman codes for all characters in the alphabet
 /// @param alphabet Pointer to the AlphabetCode structure
 /// @return status code
-int generate_huffman_code(const AlphabetCode *alphabet)
+static int generate_huffman_code(const AlphabetCode *alphabet)
 {
     PRINT_DEBUG("Start generating huffman code");
     // Create the huffman tree
@@ -623,12 +873,15 @@ int generate_huffman_code(const AlphabetCode *alphabet)
         return STATUS_CODE_TREE_FAIL;
     // Create a code buffer that will traverse the tree and define the code for each node
     BitMessage code_buffer = {
-        .data = malloc((alphabet->length + 1) * sizeof(unsigned char)),
+        .data = huffman_malloc((alphabet->length + 1) * sizeof(unsigned char)),
         .nbits = 0,
         .nbytes = 0,
     };
     if (code_buffer.data == NULL)
+    {
+        free_huffman_node(root);
         return STATUS_CODE_ALLOC_FAIL;
+    }
     // Create the huffman code by traversing the tree recursively
     status = _generate_huffman_code(root, &code_buffer);
     // Free the tree and the buffer
@@ -648,7 +901,7 @@ int generate_huffman_code(const AlphabetCode *alphabet)
 /// @param alphabet Pointer to the AlphabetCode structure
 /// @param header Pointer to BitMessage structure to store the encoded header
 /// @return status code
-int huffman_encode_alphabet(const AlphabetCode *alphabet, BitMessage *header)
+static int huffman_encode_alphabet(const AlphabetCode *alphabet, BitMessage *header)
 {
     // The maximum number of bits is the last one because the alphabet is sorted
     unsigned int max_nbits = alphabet->chars[alphabet->length - 1].code.nbits;
@@ -657,7 +910,7 @@ int huffman_encode_alphabet(const AlphabetCode *alphabet, BitMessage *header)
     size_t header_size = (max_nbits + 1 + alphabet->length);
     header->nbytes = header_size;
     header->nbits = header_size * sizeof(unsigned char) * CHAR_BIT;
-    header->data = calloc(header_size, sizeof(unsigned char));
+    header->data = huffman_calloc(header_size, sizeof(unsigned char));
     if (header->data == NULL)
         return STATUS_CODE_ALLOC_FAIL;
     // Store the maximum number of bits to indicate how many bytes to read after the first one
@@ -682,28 +935,26 @@ int huffman_encode_alphabet(const AlphabetCode *alphabet, BitMessage *header)
 /// @param message Null-terminated string to encode
 /// @param alphabet Pointer to the AlphabetCode structure with character codes
 /// @param encoded_message Pointer to BitMessage structure to store the encoded message
-int huffman_encode_message(const char *message, AlphabetCode *alphabet, BitMessage *encoded_message)
+static int huffman_encode_message(const char *message, AlphabetCode *alphabet, BitMessage *encoded_message)
 {
     if (encoded_message->data != NULL)
         return STATUS_CODE_ENCODED_MESSAGE_NOT_EMPTY;
     if (alphabet->length == 0)
         return 0;
-    size_t capacity = 0;
+    // Create a lookup table
+    CharCode *lookup_alphabet[MAX_CHAR] = {0};
+    for (size_t i = 0; i < alphabet->length; ++i)
+        lookup_alphabet[(unsigned char)alphabet->chars[i].c] = &alphabet->chars[i];
     // Count the size of the encoded message
+    size_t capacity = 0;
     for (size_t i = 0; message[i] != '\0'; ++i)
     {
-        for (size_t j = 0; j < alphabet->length; ++j)
-        {
-            if (alphabet->chars[j].c == message[i])
-                capacity += alphabet->chars[j].code.nbits;
-        }
+        if (lookup_alphabet[(unsigned char)message[i]] == NULL)
+            return STATUS_CODE_SYMBOL_NOT_IN_TABLE;
+        capacity += lookup_alphabet[(unsigned char)message[i]]->code.nbits;
     }
-    // Create a lookup table
-    CharCode *lookup_alphabet[MAX_CHAR] = {0};
-    for (size_t i = 0; i < alphabet->length; ++i)
-        lookup_alphabet[(unsigned int)alphabet->chars[i].c] = &alphabet->chars[i];
     // Encode the message
-    encoded_message->data = malloc((capacity / CHAR_BIT + 1) * sizeof(unsigned char));
+    encoded_message->data = huffman_malloc((capacity / CHAR_BIT + 1) * sizeof(unsigned char));
     if (encoded_message->data == NULL)
         return STATUS_CODE_ALLOC_FAIL;
     encoded_message->nbits = 0;
@@ -711,7 +962,7 @@ int huffman_encode_message(const char *message, AlphabetCode *alphabet, BitMessa
     for (size_t i = 0; message[i] != '\0'; ++i)
     {
         char c = message[i];
-        CharCode *char_code = lookup_alphabet[(unsigned int)c];
+        CharCode *char_code = lookup_alphabet[(unsigned char)c];
         assert(char_code != NULL);
         assert(char_code->c == c);
         for (size_t k = 0; k < char_code->code.nbits; ++k)
@@ -727,7 +978,7 @@ int huffman_encode_message(const char *message, AlphabetCode *alphabet, BitMessa
 /// @param encoded_message Pointer to EncodedMessage containing the header
 /// @param alphabet Pointer to AlphabetCode structure to store the decoded alphabet
 /// @return status code
-int huffman_decode_alphabet(const EncodedMessage *encoded_message, AlphabetCode *alphabet)
+static int huffman_decode_alphabet(const EncodedMessage *encoded_message, AlphabetCode *alphabet)
 {
     if (alphabet->chars != NULL)
         return STATUS_CODE_ALPHABET_NOT_EMPTY;
@@ -742,13 +993,15 @@ int huffman_decode_alphabet(const EncodedMessage *encoded_message, AlphabetCode
     }
     // Retrieve the maximum number of bits
     size_t max_nbits = (size_t)header->data[0];
-    if (header->nbytes <= (max_nbits + 1))
+    if (max_nbits > ALPHABET_MAX_NBITS || header->nbytes <= (max_nbits + 1))
         return STATUS_CODE_HEADER_CORRUPT;
     // Find the total number of unique characters
     for (unsigned int i = 0; i < max_nbits; ++i)
         length += (unsigned int)header->data[i + 1];
+    if (length == 0 || header->nbytes < max_nbits + 1 + length)
+        return STATUS_CODE_HEADER_CORRUPT;
     // fill the message info
-    alphabet->chars = malloc(length * sizeof(CharCode));
+    alphabet->chars = huffman_malloc(length * sizeof(CharCode));
     if (alphabet->chars == NULL)
         return STATUS_CODE_ALLOC_FAIL;
     alphabet->length = (size_t)length;
@@ -764,7 +1017,14 @@ int huffman_decode_alphabet(const EncodedMessage *encoded_message, AlphabetCode
         {
             CharCode *char_code = &alphabet->chars[current_idx];
             char_code->c = header->data[current_header_idx];
-            char_code->code.data = calloc(nbytes, sizeof(unsigned char));
+            char_code->code.data = huffman_calloc(nbytes, sizeof(unsigned char));
+            if (char_code->code.data == NULL)
+            {
+                // Only the characters before this one hold a code
+                alphabet->length = current_idx;
+                free_alphabet_code(alphabet);
+                return STATUS_CODE_ALLOC_FAIL;
+            }
             char_code->code.nbits = nbits;
             char_code->code.nbytes = nbytes;
             char_code->freq = 0;
@@ -784,113 +1044,210 @@ int huffman_decode_alphabet(const EncodedMessage *encoded_message, AlphabetCode
     return 0;
 }
 
-/// @brief Create a binary tree using the code bits of the alphabet
-/// @param alphabet Pointer to AlphabetCode structure to store the decoded alphabet
-/// @param alphabet_code_tree Pointer to AlphabetCodeTree structure
-/// @return status code
-int create_alphabet_code_tree(const AlphabetCode *alphabet, AlphabetCodeTree *alphabet_code_tree)
-{
-    if (alphabet_code_tree->tree != NULL)
-        return STATUS_CODE_ALPHABET_CODE_TREE_NOT_EMPTY;
-    // Compute the number of nodes of the binary tree
-    size_t min_nbits = 0;
-    size_t max_nbits = 0;
-    if (alphabet->length > 0)
-    {
-        min_nbits = alphabet->chars[0].code.nbits;
-        max_nbits = alphabet->chars[alphabet->length - 1].code.nbits;
-    }
-    alphabet_code_tree->min_nbits = min_nbits;
-    alphabet_code_tree->length = 1;
-    for (size_t i = 0; i < (max_nbits + 1); ++i)
-        alphabet_code_tree->length *= 2;
-    alphabet_code_tree->length -= 1;
-    // Fill the binary tree
-    alphabet_code_tree->tree = calloc(alphabet_code_tree->length, sizeof(CharCode *));
-    if (alphabet_code_tree->tree == NULL)
-        return STATUS_CODE_ALLOC_FAIL;
+/// @brief Creates the canonical decoding index of an alphabet
+/// @param alphabet Pointer to AlphabetCode structure in code order, as decoded by huffman_decode_alphabet
+/// @param index Pointer to AlphabetCodeIndex structure to fill, it refers to the characters of the alphabet
+/// @return status code, STATUS_CODE_HEADER_CORRUPT if the lengths do not describe a prefix code
+static int create_alphabet_code_index(const AlphabetCode *alphabet, AlphabetCodeIndex *index)
+{
+    memset(index, 0, sizeof(AlphabetCodeIndex));
+    index->chars = alphabet->chars;
     for (size_t i = 0; i < alphabet->length; ++i)
     {
-        CharCode *char_code = &alphabet->chars[i];
-        size_t pos = 0;
-        for (size_t j = 0; j < char_code->code.nbits; ++j)
-            pos = 2 * pos + 1 + (size_t)get_bit_message_value(&char_code->code, j);
-        assert(pos < alphabet_code_tree->length);
-        alphabet_code_tree->tree[pos] = char_code;
+        size_t nbits = alphabet->chars[i].code.nbits;
+        if (nbits == 0 || nbits > ALPHABET_MAX_NBITS || nbits < index->max_nbits)
+            return STATUS_CODE_HEADER_CORRUPT;
+        index->counts[nbits] += 1;
+        if (index->min_nbits == 0)
+            index->min_nbits = nbits;
+        index->max_nbits = nbits;
+    }
+    // Codes left at each length, none can be taken twice (Kraft inequality)
+    uint64_t left = 1;
+    for (size_t nbits = 1; nbits <= index->max_nbits; ++nbits)
+    {
+        left <<= 1;
+        if (index->counts[nbits] > left)
+            return STATUS_CODE_HEADER_CORRUPT;
+        left -= index->counts[nbits];
     }
     return 0;
 }
 
 /// @brief Decodes a Huffman-encoded message using the provided alphabet
+///         Each character reads at most max_nbits bits one by one and takes at least min_nbits of them,
+///         the time and the memory are linear in the number of bits whatever the header.
 /// @param encoded_message Pointer to BitMessage containing the encoded data
-/// @param alphabet Pointer to AlphabetCode structure with character codes
+/// @param index Pointer to AlphabetCodeIndex structure of the alphabet
 /// @param decoded_message Point to the decoded message
 /// @return status code
-int huffman_decode_message(const BitMessage *encoded_message, const AlphabetCodeTree *alphabet_code_tree, char **decoded_message)
+static int huffman_decode_message(const BitMessage *encoded_message, const AlphabetCodeIndex *index, char **decoded_message)
 {
     if (*decoded_message != NULL)
         return STATUS_CODE_DECODED_MESSAGE_NOT_EMPTY;
-    // Compute the capacity
+    // The capacity is an upper bound of the number of characters, the message is never reallocated
     size_t capacity = 0;
-    if (alphabet_code_tree->min_nbits > 0)
-        capacity = encoded_message->nbits / alphabet_code_tree->min_nbits;
-    *decoded_message = malloc(capacity * sizeof(char));
+    if (index->min_nbits > 0)
+        capacity = encoded_message->nbits / index->min_nbits;
+    else if (encoded_message->nbits > 0)
+        return STATUS_CODE_MESSAGE_CORRUPT;
+    if (encoded_message->nbits > encoded_message->nbytes * CHAR_BIT)
+        return STATUS_CODE_MESSAGE_CORRUPT;
+    *decoded_message = huffman_malloc((capacity + 1) * sizeof(char));
     if (*decoded_message == NULL)
         return STATUS_CODE_ALLOC_FAIL;
     size_t start = 0;
     size_t current_idx = 0;
     while (start < encoded_message->nbits)
     {
-        // Search for the character
-        size_t k = 0;
-        size_t pos = 0;
-        while (alphabet_code_tree->tree[pos] == NULL && pos < alphabet_code_tree->length)
-        {
-            pos = 2 * pos + 1 + get_bit_message_value(encoded_message, start + k);
-            k += 1;
-        }
-        CharCode *char_code = alphabet_code_tree->tree[pos];
-        if (char_code != NULL)
+        // Canonical codes of a length are consecutive from the first one of this length
+        uint64_t code = 0;
+        uint64_t first = 0;
+        size_t offset = 0;
+        size_t nbits = 1;
+        for (; nbits <= index->max_nbits; ++nbits)
         {
-            (*decoded_message)[current_idx] = char_code->c;
-            start += char_code->code.nbits;
-            current_idx += 1;
+            if (start + nbits > encoded_message->nbits)
+                return STATUS_CODE_MESSAGE_CORRUPT;
+            code |= (uint64_t)get_bit_message_value(encoded_message, start + nbits - 1);
+            if (code < first + index->counts[nbits])
+                break;
+            offset += index->counts[nbits];
+            first = (first + index->counts[nbits]) << 1;
+            code <<= 1;
         }
-        else
-        {
+        // The bits are not the prefix of any code of an incomplete code
+        if (nbits > index->max_nbits || current_idx >= capacity)
             return STATUS_CODE_HEADER_CORRUPT;
-        }
-        // If the current index is greater than the current capacity
-        // Then we reallocate the decoded message
-        if (current_idx >= capacity)
-        {
-            capacity = 2 * capacity;
-            char *new_decoded_message = realloc(*decoded_message, capacity);
-            if (new_decoded_message == NULL)
-            {
-                free(*decoded_message);
-                *decoded_message = NULL;
-                return STATUS_CODE_ALLOC_FAIL;
-            }
-            *decoded_message = new_decoded_message;
-        }
+        (*decoded_message)[current_idx++] = index->chars[offset + (code - first)].c;
+        start += nbits;
     }
     (*decoded_message)[current_idx] = '\0';
     return 0;
 }
 
+/// @brief Returns a monotonic time in nanoseconds, only read when statistics are requested
+static uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/// @brief Starts the statistics of a call
+/// @param stats Pointer to the HuffmanStats structure to reset or NULL
+/// @return start time of the first stage, 0 without statistics
+static uint64_t stats_start(HuffmanStats *stats)
+{
+    if (stats == NULL)
+        return 0;
+    size_t limit = stats->memory.limit;
+    memset(stats, 0, sizeof(HuffmanStats));
+    stats->memory.limit = limit;
+    return stats_now_ns();
+}
+
+/// @brief Counts the allocations of the calling thread in the memory of the statistics until memory_untrack
+/// @param tracker Tracker of the call, on the stack of the caller
+/// @param stats Pointer to the HuffmanStats structure or NULL
+static void memory_track(HuffmanMemoryTracker *tracker, HuffmanStats *stats)
+{
+    memset(tracker, 0, sizeof(HuffmanMemoryTracker));
+    tracker->previous = tracked_memory;
+    if (stats == NULL)
+        return;
+    tracker->memory = &stats->memory;
+    tracked_memory = tracker;
+}
+
+/// @brief Stops counting the allocations of a call, the blocks it returns stay counted in memory.current
+/// @param tracker Tracker of the call passed to memory_track
+/// @param stats Pointer to the HuffmanStats structure or NULL
+/// @param status Status code of the call
+/// @return status code of the call, STATUS_CODE_MEMORY_LIMIT if it failed on the ceiling
+static int memory_untrack(HuffmanMemoryTracker *tracker, HuffmanStats *stats, int status)
+{
+    if (stats == NULL)
+        return status;
+    tracked_memory = tracker->previous;
+    free(tracker->blocks);
+    if (status > 0 && stats->memory.limit_reached)
+        return STATUS_CODE_MEMORY_LIMIT;
+    return status;
+}
+
+/// @brief Adds the time elapsed since the start of the stage to it and starts the next one
+/// @param stats Pointer to the HuffmanStats structure or NULL
+/// @param stage Stage that ends, one of the HUFFMAN_STAGE constants
+/// @param start Start time of the stage, updated to the current time
+static void stats_end_stage(HuffmanStats *stats, int stage, uint64_t *start)
+{
+    if (stats == NULL)
+        return;
+    uint64_t now = stats_now_ns();
+    stats->stage_ns[stage] += now - *start;
+    *start = now;
+}
+
+/// @brief Fills the length, the number of symbols, the entropy and the bits per symbol from the frequencies
+/// @param stats Pointer to the HuffmanStats structure
+/// @param frequencies Array of MAX_CHAR frequencies
+/// @param code_nbits Number of bits of the codes
+static void stats_set_symbols(HuffmanStats *stats, const size_t *frequencies, size_t code_nbits)
+{
+    size_t length = 0;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+        length += frequencies[i];
+    stats->input_length = length;
+    if (length == 0)
+        return;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+    {
+        if (frequencies[i] == 0)
+            continue;
+        double p = (double)frequencies[i] / (double)length;
+        stats->nsymbols += 1;
+        stats->entropy -= p * log2(p);
+    }
+    stats->bits_per_symbol = (double)code_nbits / (double)length;
+}
+
+/// @brief Fills the statistics of the legacy coder from its alphabet
+static void stats_set_alphabet(HuffmanStats *stats, const AlphabetCode *alphabet, const EncodedMessage *encoded_message)
+{
+    size_t frequencies[MAX_CHAR] = {0};
+    for (size_t i = 0; i < alphabet->length; ++i)
+    {
+        frequencies[(unsigned char)alphabet->chars[i].c] = alphabet->chars[i].freq;
+        if (alphabet->chars[i].code.nbits > stats->max_nbits)
+            stats->max_nbits = (unsigned int)alphabet->chars[i].code.nbits;
+    }
+    stats_set_symbols(stats, frequencies, encoded_message->message.nbits);
+    stats->header_nbytes = encoded_message->header.nbytes;
+    stats->code_nbytes = encoded_message->message.nbytes;
+    stats->mode = HUFFMAN_BLOCK_HUFFMAN;
+}
+
 /// @brief Encodes a message using Huffman coding
 /// @param message Null-terminated string to encode
 /// @param encoded_message Pointer to EncodedMessage structure to store the result
 /// @return Error code of the encoding, 0 if success, > 0 otherwise
 int huffman_encode(const char *message, EncodedMessage *encoded_message)
+{
+    return huffman_encode_stats(message, encoded_message, NULL);
+}
+
+/// @brief Body of huffman_encode_stats, its allocations are counted by the caller
+static int _huffman_encode_stats(const char *message, EncodedMessage *encoded_message, HuffmanStats *stats)
 {
     PRINT_DEBUG("START Encoding");
+    uint64_t start = stats_start(stats);
     if (strlen(message) == 0)
         return 0;
     // Build the alphabet of the message
     AlphabetCode alphabet = {.chars = NULL, .length = 0};
     int status = build_alphabet(message, &alphabet);
+    stats_end_stage(stats, HUFFMAN_STAGE_COUNT, &start);
     if (status > 0)
     {
         free_alphabet_code(&alphabet);
@@ -899,6 +1256,7 @@ int huffman_encode(const char *message, EncodedMessage *encoded_message)
     PRINT_DEBUG("build the alphabet");
     // Generate the huffman code for each character of the alphabet
     status = generate_huffman_code(&alphabet);
+    stats_end_stage(stats, HUFFMAN_STAGE_BUILD, &start);
     if (status > 0)
     {
         free_alphabet_code(&alphabet);
@@ -907,6 +1265,7 @@ int huffman_encode(const char *message, EncodedMessage *encoded_message)
     PRINT_DEBUG("generate the huffman code for the alphabet");
     // Encode the alphabet
     status = huffman_encode_alphabet(&alphabet, &encoded_message->header);
+    stats_end_stage(stats, HUFFMAN_STAGE_HEADER, &start);
     if (status > 0)
     {
         free_alphabet_code(&alphabet);
@@ -921,6 +1280,9 @@ int huffman_encode(const char *message, EncodedMessage *encoded_message)
     }
     // Encode the message
     status = huffman_encode_message(message, &alphabet, &encoded_message->message);
+    stats_end_stage(stats, HUFFMAN_STAGE_CODES, &start);
+    if (status == 0 && stats != NULL)
+        stats_set_alphabet(stats, &alphabet, encoded_message);
     free_alphabet_code(&alphabet);
     if (status > 0)
         return status;
@@ -928,34 +1290,1744 @@ int huffman_encode(const char *message, EncodedMessage *encoded_message)
     return 0;
 }
 
+/// @brief Encodes a message using Huffman coding and reports what the encoding achieved
+/// @param message Null-terminated string to encode
+/// @param encoded_message Pointer to EncodedMessage structure to store the result
+/// @param stats Pointer to the HuffmanStats structure to fill, NULL to skip the statistics and their timing,
+///        its memory.limit caps the heap allocated by the call
+/// @return Error code of the encoding, 0 if success, > 0 otherwise
+int huffman_encode_stats(const char *message, EncodedMessage *encoded_message, HuffmanStats *stats)
+{
+    HuffmanMemoryTracker tracker;
+    memory_track(&tracker, stats);
+    int status = _huffman_encode_stats(message, encoded_message, stats);
+    return memory_untrack(&tracker, stats, status);
+}
+
 /// @brief Decodes a Huffman-encoded message
 /// @param encoded_message Pointer to EncodedMessage structure containing encoded data
 /// @param decoded_message Dynamically allocated string containing the decoded message
 /// @return status code
 int huffman_decode(const EncodedMessage *encoded_message, char **decoded_message)
 {
+    return huffman_decode_stats(encoded_message, decoded_message, NULL);
+}
+
+/// @brief Body of huffman_decode_stats, its allocations are counted by the caller
+static int _huffman_decode_stats(const EncodedMessage *encoded_message, char **decoded_message, HuffmanStats *stats)
+{
+    uint64_t start = stats_start(stats);
     // Decode the alphabet from the header of the encoded message
     AlphabetCode alphabet = {.chars = NULL, .length = 0};
     int status = huffman_decode_alphabet(encoded_message, &alphabet);
     if (status > 0)
+    {
+        stats_end_stage(stats, HUFFMAN_STAGE_HEADER, &start);
         return status;
-    // Create a tree from the alphabet
-    AlphabetCodeTree alphabet_code_tree = {.tree = NULL, .length = 0};
-    status = create_alphabet_code_tree(&alphabet, &alphabet_code_tree);
+    }
+    // Index the codes of the alphabet by length
+    AlphabetCodeIndex code_index;
+    status = create_alphabet_code_index(&alphabet, &code_index);
+    stats_end_stage(stats, HUFFMAN_STAGE_HEADER, &start);
     if (status > 0)
     {
         free_alphabet_code(&alphabet);
-        free_alphabet_code_tree(&alphabet_code_tree);
         return status;
     }
-    // Decode the message using the HuffmanTree
-    status = huffman_decode_message(&encoded_message->message, &alphabet_code_tree, decoded_message);
+    // Decode the message using the index
+    status = huffman_decode_message(&encoded_message->message, &code_index, decoded_message);
+    stats_end_stage(stats, HUFFMAN_STAGE_CODES, &start);
     if (status > 0 && *decoded_message != NULL)
     {
-        free(*decoded_message);
+        huffman_free(*decoded_message);
         *decoded_message = NULL;
     }
+    if (status == 0 && stats != NULL)
+    {
+        // The header holds the code lengths only, count the decoded characters
+        for (size_t i = 0; i < alphabet.length; ++i)
+            alphabet.chars[i].freq = 0;
+        size_t index[MAX_CHAR] = {0};
+        for (size_t i = 0; i < alphabet.length; ++i)
+            index[(unsigned char)alphabet.chars[i].c] = i;
+        for (const char *c = *decoded_message; *c != '\0'; ++c)
+            alphabet.chars[index[(unsigned char)*c]].freq += 1;
+        stats_set_alphabet(stats, &alphabet, encoded_message);
+    }
     free_alphabet_code(&alphabet);
-    free_alphabet_code_tree(&alphabet_code_tree);
     return status;
 }
+
+/// @brief Decodes a Huffman-encoded message and reports the statistics of the decoded message
+/// @param encoded_message Pointer to EncodedMessage structure containing encoded data
+/// @param decoded_message Dynamically allocated string containing the decoded message
+/// @param stats Pointer to the HuffmanStats structure to fill, NULL to skip the statistics and their timing,
+///        its memory.limit caps the heap allocated by the call
+/// @return status code
+int huffman_decode_stats(const EncodedMessage *encoded_message, char **decoded_message, HuffmanStats *stats)
+{
+    HuffmanMemoryTracker tracker;
+    memory_track(&tracker, stats);
+    int status = _huffman_decode_stats(encoded_message, decoded_message, stats);
+    return memory_untrack(&tracker, stats, status);
+}
+
+/// @brief Assigns the canonical codes and fills the decoding lookup from the code lengths of the table
+/// @param table Pointer to HuffmanTable structure with the nbits already set
+/// @return status code
+static int assign_huffman_table_codes(HuffmanTable *table)
+{
+    uint32_t counts[HUFFMAN_TABLE_MAX_NBITS + 1] = {0};
+    table->length = 0;
+    table->min_nbits = 0;
+    table->max_nbits = 0;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+    {
+        unsigned int nbits = table->nbits[i];
+        if (nbits == 0)
+            continue;
+        if (nbits > HUFFMAN_TABLE_MAX_NBITS)
+            return STATUS_CODE_HEADER_CORRUPT;
+        counts[nbits] += 1;
+        table->length += 1;
+        if (table->min_nbits == 0 || nbits < table->min_nbits)
+            table->min_nbits = nbits;
+        if (nbits > table->max_nbits)
+            table->max_nbits = nbits;
+    }
+    // Check that the code lengths describe a prefix code (Kraft inequality)
+    uint32_t kraft = 0;
+    for (size_t nbits = 1; nbits <= HUFFMAN_TABLE_MAX_NBITS; ++nbits)
+        kraft += counts[nbits] << (HUFFMAN_TABLE_MAX_NBITS - nbits);
+    if (kraft > (1u << HUFFMAN_TABLE_MAX_NBITS))
+        return STATUS_CODE_HEADER_CORRUPT;
+    // First code of each length (see https://en.wikipedia.org/wiki/Canonical_Huffman_code)
+    uint32_t next_code[HUFFMAN_TABLE_MAX_NBITS + 1] = {0};
+    uint32_t code = 0;
+    for (size_t nbits = 1; nbits <= HUFFMAN_TABLE_MAX_NBITS; ++nbits)
+    {
+        code = (code + counts[nbits - 1]) << 1;
+        next_code[nbits] = code;
+    }
+    memset(table->lookup, 0, sizeof(table->lookup));
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+    {
+        unsigned int nbits = table->nbits[i];
+        table->codes[i] = 0;
+        if (nbits == 0)
+            continue;
+        table->codes[i] = next_code[nbits]++;
+        // Every lookup entry starting with the code decodes to this character
+        size_t shift = HUFFMAN_TABLE_MAX_NBITS - nbits;
+        size_t first = (size_t)table->codes[i] << shift;
+        uint16_t entry = (uint16_t)((i << HUFFMAN_LOOKUP_NBITS_WIDTH) | nbits);
+        for (size_t j = 0; j < ((size_t)1 << shift); ++j)
+            table->lookup[first + j] = entry;
+    }
+    return 0;
+}
+
+/// @brief Computes the lengths of a Huffman code limited to HUFFMAN_TABLE_MAX_NBITS bits from character frequencies
+/// @param frequencies Array of frequencies for MAX_CHAR ASCII characters
+/// @param nbits Array of MAX_CHAR code lengths to fill, 0 for the characters that do not appear
+/// @return status code
+int huffman_code_lengths(const size_t *frequencies, unsigned char *nbits)
+{
+    size_t scaled_frequencies[MAX_CHAR];
+    memcpy(scaled_frequencies, frequencies, sizeof(scaled_frequencies));
+    memset(nbits, 0, MAX_CHAR * sizeof(unsigned char));
+    size_t nchars = 0;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+        nchars += (frequencies[i] > 0);
+    while (nchars > 0)
+    {
+        AlphabetCode alphabet = {.chars = NULL, .length = 0};
+        int status = build_alphabet_from_frequencies(scaled_frequencies, &alphabet);
+        if (status == 0)
+            status = generate_huffman_code(&alphabet);
+        if (status > 0)
+        {
+            free_alphabet_code(&alphabet);
+            return status;
+        }
+        // The alphabet is sorted by number of bits so the longest code is the last one
+        if (alphabet.chars[alphabet.length - 1].code.nbits <= HUFFMAN_TABLE_MAX_NBITS)
+        {
+            for (size_t i = 0; i < alphabet.length; ++i)
+                nbits[(unsigned char)alphabet.chars[i].c] = (unsigned char)alphabet.chars[i].code.nbits;
+            free_alphabet_code(&alphabet);
+            break;
+        }
+        free_alphabet_code(&alphabet);
+        // Flatten the distribution until the codes fit in the limit
+        PRINT_DEBUG("Rescale the frequencies to limit the code length");
+        for (size_t i = 0; i < MAX_CHAR; ++i)
+            scaled_frequencies[i] = (scaled_frequencies[i] + 1) / 2;
+    }
+    return 0;
+}
+
+/// @brief Builds a canonical code table from code lengths
+/// @param nbits Array of MAX_CHAR code lengths, 0 for the characters without a code
+/// @param table Pointer to HuffmanTable structure to fill
+/// @return status code, STATUS_CODE_HEADER_CORRUPT if the lengths do not describe a prefix code
+int huffman_table_from_lengths(const unsigned char *nbits, HuffmanTable *table)
+{
+    memcpy(table->nbits, nbits, sizeof(table->nbits));
+    return assign_huffman_table_codes(table);
+}
+
+/// @brief Builds a canonical code table limited to HUFFMAN_TABLE_MAX_NBITS bits from character frequencies
+/// @param frequencies Array of frequencies for MAX_CHAR ASCII characters
+/// @param table Pointer to HuffmanTable structure to fill
+/// @return status code
+int build_huffman_table(const size_t *frequencies, HuffmanTable *table)
+{
+    size_t nchars = 0;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+        nchars += (frequencies[i] > 0);
+    HUFFMAN_TRACE1(table_build_start, nchars);
+    int status = huffman_code_lengths(frequencies, table->nbits);
+    if (status == 0)
+        status = assign_huffman_table_codes(table);
+    HUFFMAN_TRACE2(table_build_done, table->max_nbits, nchars);
+    return status;
+}
+
+/// @brief Resets all the counts of a histogram
+/// @param histogram Pointer to the HuffmanHistogram structure to initialize
+void huffman_histogram_init(HuffmanHistogram *histogram)
+{
+    memset(histogram, 0, sizeof(HuffmanHistogram));
+}
+
+/// @brief Counts the characters of a message into a histogram
+/// @param histogram Pointer to the HuffmanHistogram structure to update
+/// @param message Message to count
+/// @param length Number of characters of the message
+void huffman_histogram_add(HuffmanHistogram *histogram, const char *message, size_t length)
+{
+    for (size_t i = 0; i < length; ++i)
+        histogram->counts[(unsigned char)message[i]] += 1;
+}
+
+/// @brief Adds the counts of a histogram into another one, saturating instead of overflowing
+/// @param dest Pointer to the HuffmanHistogram structure receiving the counts
+/// @param src Pointer to the HuffmanHistogram structure to add
+void huffman_histogram_merge(HuffmanHistogram *dest, const HuffmanHistogram *src)
+{
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+    {
+        if (dest->counts[i] > UINT64_MAX - src->counts[i])
+            dest->counts[i] = UINT64_MAX;
+        else
+            dest->counts[i] += src->counts[i];
+    }
+}
+
+/// @brief Serializes a histogram in a portable format
+///         [version][count_0...count_255] with each count stored as a little-endian base 128 varint
+/// @param histogram Pointer to the HuffmanHistogram structure
+/// @param serialized Pointer to BitMessage structure to store the serialized histogram
+/// @return status code
+int huffman_histogram_serialize(const HuffmanHistogram *histogram, BitMessage *serialized)
+{
+    if (serialized->data != NULL)
+        return STATUS_CODE_ENCODED_MESSAGE_NOT_EMPTY;
+    // A 64-bit varint needs at most 10 bytes
+    serialized->data = huffman_malloc(1 + MAX_CHAR * 10);
+    if (serialized->data == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    size_t nbytes = 0;
+    serialized->data[nbytes++] = HUFFMAN_HISTOGRAM_VERSION;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+    {
+        uint64_t count = histogram->counts[i];
+        while (count >= 0x80)
+        {
+            serialized->data[nbytes++] = (unsigned char)(count | 0x80);
+            count >>= 7;
+        }
+        serialized->data[nbytes++] = (unsigned char)count;
+    }
+    serialized->nbytes = nbytes;
+    serialized->nbits = nbytes * CHAR_BIT;
+    return 0;
+}
+
+/// @brief Recreates a histogram serialized with huffman_histogram_serialize
+/// @param serialized Pointer to BitMessage containing the serialized histogram
+/// @param histogram Pointer to the HuffmanHistogram structure to fill
+/// @return status code
+int huffman_histogram_deserialize(const BitMessage *serialized, HuffmanHistogram *histogram)
+{
+    huffman_histogram_init(histogram);
+    if (serialized->nbytes == 0 || serialized->data[0] != HUFFMAN_HISTOGRAM_VERSION)
+        return STATUS_CODE_HEADER_CORRUPT;
+    size_t pos = 1;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+    {
+        uint64_t count = 0;
+        for (unsigned int shift = 0;; shift += 7)
+        {
+            if (pos >= serialized->nbytes || shift >= 64)
+                return STATUS_CODE_HEADER_CORRUPT;
+            unsigned char byte = serialized->data[pos++];
+            // Only the lowest bit of the tenth byte fits in 64 bits and it cannot be followed by another one
+            if (shift == 63 && (byte & 0xFE) != 0)
+                return STATUS_CODE_HEADER_CORRUPT;
+            count |= (uint64_t)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+                break;
+        }
+        histogram->counts[i] = count;
+    }
+    if (pos != serialized->nbytes)
+        return STATUS_CODE_HEADER_CORRUPT;
+    return 0;
+}
+
+/// @brief Builds a code table from a histogram, typically merged from the histograms of several shards
+/// @param histogram Pointer to the HuffmanHistogram structure
+/// @param table Pointer to HuffmanTable structure to fill
+/// @return status code
+int huffman_table_from_histogram(const HuffmanHistogram *histogram, HuffmanTable *table)
+{
+    // Scale the counts down so that the sums done while building the tree cannot overflow
+    uint64_t max_count = 0;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+    {
+        if (histogram->counts[i] > max_count)
+            max_count = histogram->counts[i];
+    }
+    unsigned int shift = 0;
+    while ((max_count >> shift) > (SIZE_MAX / (2 * MAX_CHAR)))
+        shift += 1;
+    size_t frequencies[MAX_CHAR] = {0};
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+    {
+        frequencies[i] = (size_t)(histogram->counts[i] >> shift);
+        if (frequencies[i] == 0 && histogram->counts[i] > 0)
+            frequencies[i] = 1;
+    }
+    return build_huffman_table(frequencies, table);
+}
+
+/// @brief Encodes the code lengths of a table as a header using the same layout as huffman_encode_alphabet
+/// @param table Pointer to the HuffmanTable structure
+/// @param header Pointer to BitMessage structure to store the encoded header
+/// @return status code
+int huffman_table_encode_header(const HuffmanTable *table, BitMessage *header)
+{
+    if (header->data != NULL)
+        return STATUS_CODE_ENCODED_MESSAGE_NOT_EMPTY;
+    if (table->length == 0)
+        return 0;
+    // [[max_nbits][N_0...N_max_nbits][a_0...a_nb_chars]]
+    size_t header_size = table->max_nbits + 1 + table->length;
+    header->data = huffman_calloc(header_size, sizeof(unsigned char));
+    if (header->data == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    header->nbytes = header_size;
+    header->nbits = header_size * CHAR_BIT;
+    header->data[0] = (unsigned char)table->max_nbits;
+    size_t current_idx = table->max_nbits + 1;
+    for (size_t nbits = 1; nbits <= table->max_nbits; ++nbits)
+    {
+        for (size_t i = 0; i < MAX_CHAR; ++i)
+        {
+            if (table->nbits[i] != nbits)
+                continue;
+            // A single length can hold all the MAX_CHAR characters: the count wraps to 0 and is
+            // recovered from the header size when decoding
+            header->data[nbits] = (unsigned char)(header->data[nbits] + 1);
+            header->data[current_idx++] = (unsigned char)i;
+        }
+    }
+    return 0;
+}
+
+/// @brief Recreates a code table from a header written by huffman_table_encode_header
+/// @param header Pointer to BitMessage containing the header
+/// @param table Pointer to HuffmanTable structure to fill
+/// @return status code
+int huffman_table_decode_header(const BitMessage *header, HuffmanTable *table)
+{
+    memset(table->nbits, 0, sizeof(table->nbits));
+    if (header->nbytes == 0)
+        return assign_huffman_table_codes(table);
+    size_t max_nbits = header->data[0];
+    if (max_nbits == 0 || max_nbits > HUFFMAN_TABLE_MAX_NBITS || header->nbytes <= max_nbits + 1)
+        return STATUS_CODE_HEADER_CORRUPT;
+    size_t length = 0;
+    for (size_t nbits = 1; nbits <= max_nbits; ++nbits)
+        length += header->data[nbits];
+    size_t nchars = header->nbytes - (max_nbits + 1);
+    // All the characters share the same length: the count has wrapped
+    if (length == 0 && nchars == MAX_CHAR)
+        length = MAX_CHAR;
+    if (length != nchars)
+        return STATUS_CODE_HEADER_CORRUPT;
+    size_t current_idx = max_nbits + 1;
+    for (size_t nbits = 1; nbits <= max_nbits; ++nbits)
+    {
+        size_t count = header->data[nbits];
+        if (length == MAX_CHAR && nbits == max_nbits && count == 0)
+            count = MAX_CHAR;
+        for (size_t j = 0; j < count; ++j)
+        {
+            unsigned char c = header->data[current_idx++];
+            if (table->nbits[c] != 0)
+                return STATUS_CODE_HEADER_CORRUPT;
+            table->nbits[c] = (unsigned char)nbits;
+        }
+    }
+    return assign_huffman_table_codes(table);
+}
+
+/// @brief Appends the codes of a message after the last bit of a BitMessage
+///         The data of the BitMessage must have room for length * max_nbits more bits.
+/// @param table Pointer to the HuffmanTable structure
+/// @param message Message to encode
+/// @param length Number of characters of the message
+/// @param bit_message Pointer to the BitMessage structure to append to
+/// @param frequencies Array of MAX_CHAR frequencies incremented for each character or NULL
+/// @return status code, STATUS_CODE_SYMBOL_NOT_IN_TABLE if a character has no code in the table
+static int huffman_table_append(const HuffmanTable *table, const char *message, size_t length,
+                                BitMessage *bit_message, size_t *frequencies)
+{
+    HUFFMAN_TRACE1(encode_start, length);
+    int status = huffman_inline_encode(table, message, length, bit_message->data, &bit_message->nbits, frequencies);
+    if (status == 0)
+        bit_message->nbytes = (bit_message->nbits + CHAR_BIT - 1) / CHAR_BIT;
+    HUFFMAN_TRACE3(encode_done, length, bit_message->nbits, status);
+    return status;
+}
+
+/// @brief Encodes a message with a code table, optionally counting the character frequencies on the way
+/// @param table Pointer to the HuffmanTable structure
+/// @param message Message to encode
+/// @param length Number of characters of the message
+/// @param encoded_message Pointer to BitMessage structure to store the encoded message
+/// @param frequencies Array of MAX_CHAR frequencies incremented for each character or NULL
+/// @return status code, STATUS_CODE_SYMBOL_NOT_IN_TABLE if a character has no code in the table
+static int _huffman_table_encode(const HuffmanTable *table, const char *message, size_t length,
+                                 BitMessage *encoded_message, size_t *frequencies)
+{
+    if (encoded_message->data != NULL)
+        return STATUS_CODE_ENCODED_MESSAGE_NOT_EMPTY;
+    if (length == 0)
+        return 0;
+    encoded_message->data = huffman_malloc((length * table->max_nbits) / CHAR_BIT + 1);
+    if (encoded_message->data == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    encoded_message->nbits = 0;
+    encoded_message->nbytes = 0;
+    int status = huffman_table_append(table, message, length, encoded_message, frequencies);
+    if (status > 0)
+        free_bit_message(encoded_message);
+    return status;
+}
+
+/// @brief Decodes a range of bits into a buffer, optionally counting the character frequencies on the way
+/// @param table Pointer to the HuffmanTable structure
+/// @param data Encoded data, bits past nbytes are read as zeros
+/// @param nbytes Number of bytes of the encoded data
+/// @param start Position of the first bit to decode
+/// @param nbits Number of bits to decode
+/// @param decoded_message Buffer receiving the decoded characters
+/// @param capacity Number of characters the buffer can hold
+/// @param length Number of decoded characters
+/// @param frequencies Array of MAX_CHAR frequencies incremented for each character or NULL
+/// @return status code
+static int huffman_table_decode_bits(const HuffmanTable *table, const unsigned char *data, size_t nbytes,
+                                     size_t start, size_t nbits, char *decoded_message, size_t capacity,
+                                     size_t *length, size_t *frequencies)
+{
+    HUFFMAN_TRACE1(decode_start, nbits);
+    int status = huffman_inline_decode(table, data, nbytes, start, nbits, decoded_message, capacity, length, frequencies);
+    HUFFMAN_TRACE3(decode_done, nbits, *length, status);
+    return status;
+}
+
+/// @brief Decodes a message with a code table, optionally counting the character frequencies on the way
+/// @param table Pointer to the HuffmanTable structure
+/// @param encoded_message Pointer to BitMessage containing the encoded data
+/// @param decoded_message Dynamically allocated null-terminated decoded message
+/// @param length Number of decoded characters
+/// @param frequencies Array of MAX_CHAR frequencies incremented for each character or NULL
+/// @return status code
+static int _huffman_table_decode(const HuffmanTable *table, const BitMessage *encoded_message,
+                                 char **decoded_message, size_t *length, size_t *frequencies)
+{
+    if (*decoded_message != NULL)
+        return STATUS_CODE_DECODED_MESSAGE_NOT_EMPTY;
+    size_t capacity = 0;
+    if (table->min_nbits > 0)
+        capacity = encoded_message->nbits / table->min_nbits;
+    else if (encoded_message->nbits > 0)
+        return STATUS_CODE_MESSAGE_CORRUPT;
+    *decoded_message = huffman_malloc((capacity + 1) * sizeof(char));
+    if (*decoded_message == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    *length = 0;
+    int status = huffman_table_decode_bits(table, encoded_message->data, encoded_message->nbytes, 0,
+                                           encoded_message->nbits, *decoded_message, capacity, length, frequencies);
+    if (status > 0)
+    {
+        huffman_free(*decoded_message);
+        *decoded_message = NULL;
+        // The capacity is an upper bound of the number of characters of a valid message
+        return STATUS_CODE_MESSAGE_CORRUPT;
+    }
+    (*decoded_message)[*length] = '\0';
+    return 0;
+}
+
+/// @brief Encodes a message with a code table
+/// @param table Pointer to the HuffmanTable structure
+/// @param message Message to encode
+/// @param length Number of characters of the message
+/// @param encoded_message Pointer to BitMessage structure to store the encoded message
+/// @return status code
+int huffman_table_encode(const HuffmanTable *table, const char *message, size_t length, BitMessage *encoded_message)
+{
+    return _huffman_table_encode(table, message, length, encoded_message, NULL);
+}
+
+/// @brief Decodes a message with a code table
+/// @param table Pointer to the HuffmanTable structure
+/// @param encoded_message Pointer to BitMessage containing the encoded data
+/// @param decoded_message Dynamically allocated null-terminated decoded message
+/// @param length Number of decoded characters
+/// @return status code
+int huffman_table_decode(const HuffmanTable *table, const BitMessage *encoded_message, char **decoded_message, size_t *length)
+{
+    return _huffman_table_decode(table, encoded_message, decoded_message, length, NULL);
+}
+
+/// @brief Allocates a sliding window keeping the frequencies of the last characters
+/// @param window Pointer to the HuffmanWindow structure to initialize
+/// @param capacity Number of characters covered by the window
+/// @return status code
+int create_huffman_window(HuffmanWindow *window, size_t capacity)
+{
+    memset(window, 0, sizeof(HuffmanWindow));
+    if (capacity == 0)
+        return 0;
+    window->data = huffman_malloc(capacity * sizeof(unsigned char));
+    if (window->data == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    window->capacity = capacity;
+    return 0;
+}
+
+/// @brief Frees resources associated with a sliding window
+/// @param window Pointer to the HuffmanWindow structure to free
+void free_huffman_window(HuffmanWindow *window)
+{
+    if (window->data != NULL)
+        huffman_free(window->data);
+    memset(window, 0, sizeof(HuffmanWindow));
+}
+
+/// @brief Slides the window over new characters, the oldest ones leaving the frequencies
+/// @param window Pointer to the HuffmanWindow structure
+/// @param data Characters entering the window
+/// @param length Number of characters entering the window
+void huffman_window_update(HuffmanWindow *window, const char *data, size_t length)
+{
+    if (window->capacity == 0)
+        return;
+    // Only the last characters can remain in the window
+    if (length > window->capacity)
+    {
+        data += length - window->capacity;
+        length = window->capacity;
+    }
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (window->count == window->capacity)
+        {
+            window->frequencies[window->data[window->start]] -= 1;
+            window->start = (window->start + 1) % window->capacity;
+            window->count -= 1;
+        }
+        unsigned char c = (unsigned char)data[i];
+        window->data[(window->start + window->count) % window->capacity] = c;
+        window->count += 1;
+        window->frequencies[c] += 1;
+    }
+}
+
+/// @brief Estimates how many bits a table wastes on a distribution compared to its entropy
+///         Characters missing from the table are counted at HUFFMAN_TABLE_MAX_NBITS bits
+/// @param table Pointer to the HuffmanTable structure
+/// @param frequencies Array of frequencies for MAX_CHAR ASCII characters
+/// @return Estimated cost of the table minus the entropy, in bits per character
+static double huffman_table_redundancy(const HuffmanTable *table, const size_t *frequencies)
+{
+    double total = 0;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+        total += (double)frequencies[i];
+    if (total == 0)
+        return 0;
+    double redundancy = 0;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+    {
+        if (frequencies[i] == 0)
+            continue;
+        double freq = (double)frequencies[i];
+        unsigned int nbits = table->nbits[i] > 0 ? table->nbits[i] : HUFFMAN_TABLE_MAX_NBITS;
+        redundancy += freq * ((double)nbits - log2(total / freq));
+    }
+    return redundancy / total;
+}
+
+/// @brief Initializes a stream used either to encode or to decode a sequence of blocks
+/// @param stream Pointer to the HuffmanStream structure to initialize
+/// @param mode HUFFMAN_STREAM_FRESH_TABLE, HUFFMAN_STREAM_PREVIOUS_TABLE or HUFFMAN_STREAM_DRIFT_TABLE
+void huffman_stream_init(HuffmanStream *stream, int mode)
+{
+    memset(stream, 0, sizeof(HuffmanStream));
+    stream->mode = mode;
+}
+
+/// @brief Sets the sliding window used by the encoder in HUFFMAN_STREAM_DRIFT_TABLE mode
+/// @param stream Pointer to the HuffmanStream structure
+/// @param window_length Number of characters the tables are built from
+/// @param rebuild_cost_bits Cost of rebuilding a table expressed in bits, added to the header size
+/// @return status code
+int huffman_stream_set_window(HuffmanStream *stream, size_t window_length, size_t rebuild_cost_bits)
+{
+    free_huffman_window(&stream->window);
+    stream->rebuild_cost_bits = rebuild_cost_bits;
+    return create_huffman_window(&stream->window, window_length);
+}
+
+/// @brief Frees resources associated with a stream
+/// @param stream Pointer to the HuffmanStream structure to free
+void free_huffman_stream(HuffmanStream *stream)
+{
+    free_huffman_window(&stream->window);
+    stream->has_table = 0;
+}
+
+/// @brief Encodes a block with a new table built from the given frequencies and stores the table in the header
+/// @param stream Pointer to the HuffmanStream structure
+/// @param frequencies Array of frequencies covering at least the characters of the block
+/// @param block Block to encode
+/// @param length Number of characters of the block
+/// @param encoded_block Pointer to EncodedMessage structure to store the result
+/// @return status code
+static int huffman_stream_encode_new_table(HuffmanStream *stream, const size_t *frequencies, const char *block,
+                                           size_t length, EncodedMessage *encoded_block)
+{
+    stream->has_table = 0;
+    int status = build_huffman_table(frequencies, &stream->table);
+    if (status > 0)
+        return status;
+    status = huffman_table_encode_header(&stream->table, &encoded_block->header);
+    if (status > 0)
+        return status;
+    status = _huffman_table_encode(&stream->table, block, length, &encoded_block->message, NULL);
+    if (status > 0)
+    {
+        free_encoded_message(encoded_block);
+        return status;
+    }
+    stream->has_table = 1;
+    stream->nrebuilds += 1;
+    return 0;
+}
+
+/// @brief Encodes a block with a table built from its own frequencies and stores the table in the header
+/// @param stream Pointer to the HuffmanStream structure
+/// @param block Block to encode
+/// @param length Number of characters of the block
+/// @param encoded_block Pointer to EncodedMessage structure to store the result
+/// @return status code
+static int huffman_stream_encode_fresh(HuffmanStream *stream, const char *block, size_t length, EncodedMessage *encoded_block)
+{
+    size_t frequencies[MAX_CHAR] = {0};
+    for (size_t i = 0; i < length; ++i)
+        frequencies[(unsigned char)block[i]] += 1;
+    return huffman_stream_encode_new_table(stream, frequencies, block, length, encoded_block);
+}
+
+/// @brief Encodes a block in HUFFMAN_STREAM_DRIFT_TABLE mode
+///         The table is rebuilt from the sliding window only when the bits expected to be saved on the
+///         block, compared to the redundancy the current table had when it was built, exceed the size
+///         of the new header plus the configured rebuild cost. A character missing from the current
+///         table always forces a rebuild.
+/// @param stream Pointer to the HuffmanStream structure
+/// @param block Block to encode
+/// @param length Number of characters of the block
+/// @param encoded_block Pointer to EncodedMessage structure to store the result
+/// @return status code
+static int huffman_stream_encode_drift(HuffmanStream *stream, const char *block, size_t length, EncodedMessage *encoded_block)
+{
+    int rebuild = !stream->has_table;
+    size_t block_frequencies[MAX_CHAR] = {0};
+    for (size_t i = 0; i < length; ++i)
+        block_frequencies[(unsigned char)block[i]] += 1;
+    huffman_window_update(&stream->window, block, length);
+    size_t frequencies[MAX_CHAR] = {0};
+    size_t nchars = 0;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+    {
+        frequencies[i] = (stream->window.capacity > 0) ? stream->window.frequencies[i] : block_frequencies[i];
+        // The block can be longer than the window: keep every character of the block encodable
+        if (frequencies[i] == 0 && block_frequencies[i] > 0)
+            frequencies[i] = 1;
+        if (block_frequencies[i] > 0 && stream->table.nbits[i] == 0)
+            rebuild = 1;
+        nchars += (frequencies[i] > 0);
+    }
+    if (!rebuild)
+    {
+        double gain = (huffman_table_redundancy(&stream->table, frequencies) - stream->redundancy) * (double)length;
+        double cost = (double)((HUFFMAN_TABLE_MAX_NBITS + 1 + nchars) * CHAR_BIT + stream->rebuild_cost_bits);
+        rebuild = gain > cost;
+    }
+    if (!rebuild)
+        return _huffman_table_encode(&stream->table, block, length, &encoded_block->message, NULL);
+    PRINT_DEBUG("Rebuild the table from the sliding window");
+    int status = huffman_stream_encode_new_table(stream, frequencies, block, length, encoded_block);
+    if (status > 0)
+        return status;
+    stream->redundancy = huffman_table_redundancy(&stream->table, frequencies);
+    return 0;
+}
+
+/// @brief Encodes the next block of a stream
+///         In HUFFMAN_STREAM_PREVIOUS_TABLE mode, the block is encoded in a single pass with the table
+///         built from the previous block and the header is left empty. The frequencies are counted
+///         while encoding to build the table of the next block. If the block contains a character
+///         unknown to the previous table, it falls back to a fresh table sent in the header.
+/// @param stream Pointer to the HuffmanStream structure
+/// @param block Block to encode
+/// @param length Number of characters of the block
+/// @param encoded_block Pointer to EncodedMessage structure to store the result
+/// @return status code
+int huffman_stream_encode(HuffmanStream *stream, const char *block, size_t length, EncodedMessage *encoded_block)
+{
+    if (encoded_block->header.data != NULL || encoded_block->message.data != NULL)
+        return STATUS_CODE_ENCODED_MESSAGE_NOT_EMPTY;
+    if (length == 0)
+        return 0;
+    if (stream->mode == HUFFMAN_STREAM_DRIFT_TABLE)
+        return huffman_stream_encode_drift(stream, block, length, encoded_block);
+    if (stream->mode != HUFFMAN_STREAM_PREVIOUS_TABLE || !stream->has_table)
+        return huffman_stream_encode_fresh(stream, block, length, encoded_block);
+    size_t frequencies[MAX_CHAR] = {0};
+    int status = _huffman_table_encode(&stream->table, block, length, &encoded_block->message, frequencies);
+    if (status == STATUS_CODE_SYMBOL_NOT_IN_TABLE)
+    {
+        // Escape: the block is encoded with its own table which is also the best guess for the next block
+        PRINT_DEBUG("Unknown character in the previous table, fall back to a fresh table");
+        return huffman_stream_encode_fresh(stream, block, length, encoded_block);
+    }
+    if (status > 0)
+        return status;
+    status = build_huffman_table(frequencies, &stream->table);
+    stream->has_table = (status == 0);
+    return status;
+}
+
+/// @brief Decodes the next block of a stream encoded with huffman_stream_encode
+/// @param stream Pointer to the HuffmanStream structure initialized with the mode used to encode
+/// @param encoded_block Pointer to EncodedMessage structure containing the encoded block
+/// @param block Dynamically allocated null-terminated decoded block
+/// @param length Number of decoded characters
+/// @return status code
+int huffman_stream_decode(HuffmanStream *stream, const EncodedMessage *encoded_block, char **block, size_t *length)
+{
+    if (*block != NULL)
+        return STATUS_CODE_DECODED_MESSAGE_NOT_EMPTY;
+    *length = 0;
+    if (encoded_block->message.nbits == 0)
+    {
+        if (encoded_block->header.nbytes > 0)
+            return STATUS_CODE_HEADER_CORRUPT;
+        *block = huffman_calloc(1, sizeof(char));
+        return (*block == NULL) ? STATUS_CODE_ALLOC_FAIL : 0;
+    }
+    int status = 0;
+    if (encoded_block->header.nbytes > 0)
+    {
+        status = huffman_table_decode_header(&encoded_block->header, &stream->table);
+        stream->has_table = (status == 0);
+        if (status > 0)
+            return status;
+        stream->nrebuilds += 1;
+        return _huffman_table_decode(&stream->table, &encoded_block->message, block, length, NULL);
+    }
+    if (stream->mode == HUFFMAN_STREAM_FRESH_TABLE || !stream->has_table)
+        return STATUS_CODE_HEADER_CORRUPT;
+    // The table is kept until the encoder sends a new one
+    if (stream->mode == HUFFMAN_STREAM_DRIFT_TABLE)
+        return _huffman_table_decode(&stream->table, &encoded_block->message, block, length, NULL);
+    size_t frequencies[MAX_CHAR] = {0};
+    status = _huffman_table_decode(&stream->table, &encoded_block->message, block, length, frequencies);
+    if (status > 0)
+        return status;
+    // Mirror the encoder: the table of the next block is built from this block
+    status = build_huffman_table(frequencies, &stream->table);
+    stream->has_table = (status == 0);
+    if (status > 0)
+    {
+        huffman_free(*block);
+        *block = NULL;
+    }
+    return status;
+}
+
+/// @brief Trains one table over a set of records and packs their codes contiguously
+///         The bits of record i are in [offsets[i], offsets[i + 1]) so it can be decoded alone.
+/// @param records Array of records to encode
+/// @param lengths Number of characters of each record
+/// @param count Number of records
+/// @param batch Pointer to the HuffmanBatch structure to fill
+/// @return status code
+int huffman_batch_encode(const char *const *records, const size_t *lengths, size_t count, HuffmanBatch *batch)
+{
+    if (batch->data != NULL || batch->offsets != NULL)
+        return STATUS_CODE_ENCODED_MESSAGE_NOT_EMPTY;
+    HuffmanHistogram histogram;
+    huffman_histogram_init(&histogram);
+    size_t total_length = 0;
+    batch->max_length = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        huffman_histogram_add(&histogram, records[i], lengths[i]);
+        total_length += lengths[i];
+        if (lengths[i] > batch->max_length)
+            batch->max_length = lengths[i];
+    }
+    int status = huffman_table_from_histogram(&histogram, &batch->table);
+    if (status > 0)
+        return status;
+    batch->offsets = huffman_malloc((count + 1) * sizeof(size_t));
+    batch->data = huffman_malloc((total_length * batch->table.max_nbits) / CHAR_BIT + 1);
+    if (batch->offsets == NULL || batch->data == NULL)
+    {
+        free_huffman_batch(batch);
+        return STATUS_CODE_ALLOC_FAIL;
+    }
+    BitMessage bit_message = {.data = batch->data, .nbits = 0, .nbytes = 0};
+    for (size_t i = 0; i < count; ++i)
+    {
+        batch->offsets[i] = bit_message.nbits;
+        status = huffman_table_append(&batch->table, records[i], lengths[i], &bit_message, NULL);
+        if (status > 0)
+        {
+            free_huffman_batch(batch);
+            return status;
+        }
+    }
+    batch->offsets[count] = bit_message.nbits;
+    batch->nbytes = bit_message.nbytes;
+    batch->count = count;
+    return 0;
+}
+
+/// @brief Decodes a single record of a batch, in a time proportional to its length
+/// @param batch Pointer to the HuffmanBatch structure
+/// @param index Index of the record to decode
+/// @param record Buffer receiving the record, max_length characters are always enough
+/// @param capacity Number of characters the buffer can hold
+/// @param length Number of characters of the record
+/// @return status code
+int huffman_batch_get(const HuffmanBatch *batch, size_t index, char *record, size_t capacity, size_t *length)
+{
+    if (index >= batch->count)
+        return STATUS_CODE_INDEX_OUT_OF_RANGE;
+    *length = 0;
+    size_t start = batch->offsets[index];
+    return huffman_table_decode_bits(&batch->table, batch->data, batch->nbytes, start,
+                                     batch->offsets[index + 1] - start, record, capacity, length, NULL);
+}
+
+/// @brief Frees resources associated with a batch
+/// @param batch Pointer to the HuffmanBatch structure to free
+void free_huffman_batch(HuffmanBatch *batch)
+{
+    if (batch->data != NULL)
+        huffman_free(batch->data);
+    if (batch->offsets != NULL)
+        huffman_free(batch->offsets);
+    batch->data = NULL;
+    batch->offsets = NULL;
+    batch->nbytes = 0;
+    batch->count = 0;
+    batch->max_length = 0;
+}
+
+/// @brief Bit reader and output of one record decoded by huffman_table_decode_records
+typedef struct HuffmanLane
+{
+    uint64_t buffer;
+    unsigned int count;
+    size_t byte_idx;
+    size_t pos;
+    size_t end;
+    char *decoded;
+    size_t length;
+    size_t capacity;
+} HuffmanLane;
+
+/// @brief Refills the bit buffer of a lane, padding with zeros after the end of the data
+/// @param data Encoded data
+/// @param nbytes Number of bytes of the encoded data
+/// @param lane Pointer to the HuffmanLane structure
+static inline void huffman_lane_refill(const unsigned char *data, size_t nbytes, HuffmanLane *lane)
+{
+    while (lane->count <= 64 - CHAR_BIT)
+    {
+        uint64_t byte = 0;
+        if (lane->byte_idx < nbytes)
+            byte = data[lane->byte_idx];
+        lane->byte_idx += 1;
+        lane->buffer |= byte << (64 - CHAR_BIT - lane->count);
+        lane->count += CHAR_BIT;
+    }
+}
+
+/// @brief Positions a lane on the first bit of a record
+/// @param data Encoded data
+/// @param nbytes Number of bytes of the encoded data
+/// @param record Pointer to the HuffmanRecord structure to decode
+/// @param decoded Buffer receiving the characters of the record
+/// @param capacity Number of characters the buffer can hold
+/// @param lane Pointer to the HuffmanLane structure to initialize
+static void huffman_lane_init(const unsigned char *data, size_t nbytes, const HuffmanRecord *record,
+                              char *decoded, size_t capacity, HuffmanLane *lane)
+{
+    lane->buffer = 0;
+    lane->count = 0;
+    lane->byte_idx = record->offset / CHAR_BIT;
+    lane->pos = record->offset;
+    lane->end = record->offset + record->nbits;
+    lane->decoded = decoded;
+    lane->length = 0;
+    lane->capacity = capacity;
+    huffman_lane_refill(data, nbytes, lane);
+    unsigned int skip = record->offset % CHAR_BIT;
+    lane->buffer <<= skip;
+    lane->count -= skip;
+}
+
+/// @brief Decodes one character of a lane
+/// @param table Pointer to the HuffmanTable structure
+/// @param data Encoded data
+/// @param nbytes Number of bytes of the encoded data
+/// @param lane Pointer to the HuffmanLane structure
+/// @return status code
+static inline int huffman_lane_step(const HuffmanTable *table, const unsigned char *data, size_t nbytes, HuffmanLane *lane)
+{
+    huffman_lane_refill(data, nbytes, lane);
+    uint16_t entry = table->lookup[lane->buffer >> (64 - HUFFMAN_TABLE_MAX_NBITS)];
+    unsigned int nbits = entry & ((1u << HUFFMAN_LOOKUP_NBITS_WIDTH) - 1);
+    if (nbits == 0 || lane->length >= lane->capacity)
+        return STATUS_CODE_MESSAGE_CORRUPT;
+    lane->decoded[lane->length++] = (char)(entry >> HUFFMAN_LOOKUP_NBITS_WIDTH);
+    lane->buffer <<= nbits;
+    lane->count -= nbits;
+    lane->pos += nbits;
+    return 0;
+}
+
+/// @brief Computes the size of the buffer needed by huffman_table_decode_records
+/// @param table Pointer to the HuffmanTable structure
+/// @param records Array of records to decode
+/// @param count Number of records
+/// @return Number of characters the decoding buffer must hold
+size_t huffman_records_capacity(const HuffmanTable *table, const HuffmanRecord *records, size_t count)
+{
+    if (table->min_nbits == 0)
+        return 0;
+    size_t capacity = 0;
+    for (size_t i = 0; i < count; ++i)
+        capacity += records[i].nbits / table->min_nbits;
+    return capacity;
+}
+
+/// @brief Decodes many short records encoded with the same table
+///         HUFFMAN_DECODE_LANES records are decoded together, their bit readers interleaved, so that
+///         the dependency chain of one record does not stall the decoding of the others.
+/// @param table Pointer to the HuffmanTable structure
+/// @param data Encoded data containing all the records
+/// @param nbytes Number of bytes of the encoded data
+/// @param records Array of records to decode
+/// @param count Number of records
+/// @param decoded Buffer of huffman_records_capacity characters receiving the records back to back
+/// @param decoded_offsets Array of count + 1 entries, record i is in [decoded_offsets[i], decoded_offsets[i + 1])
+/// @return status code
+int huffman_table_decode_records(const HuffmanTable *table, const unsigned char *data, size_t nbytes,
+                                 const HuffmanRecord *records, size_t count, char *decoded, size_t *decoded_offsets)
+{
+    HUFFMAN_TRACE2(records_decode_start, count, nbytes);
+    int status = 0;
+    if (table->min_nbits == 0)
+    {
+        for (size_t i = 0; i < count && status == 0; ++i)
+        {
+            if (records[i].nbits > 0)
+                status = STATUS_CODE_MESSAGE_CORRUPT;
+        }
+        if (status == 0)
+            memset(decoded_offsets, 0, (count + 1) * sizeof(size_t));
+        HUFFMAN_TRACE2(records_decode_done, count, status);
+        return status;
+    }
+    // Each record is decoded at the position given by the upper bound of the previous ones,
+    // decoded_offsets keeps the start of each slot until the records are packed
+    size_t slot = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        decoded_offsets[i] = slot;
+        slot += records[i].nbits / table->min_nbits;
+    }
+    decoded_offsets[count] = slot;
+    size_t *lengths = huffman_malloc((count + 1) * sizeof(size_t));
+    if (lengths == NULL)
+    {
+        HUFFMAN_TRACE2(records_decode_done, count, STATUS_CODE_ALLOC_FAIL);
+        return STATUS_CODE_ALLOC_FAIL;
+    }
+    size_t first = 0;
+    for (; first + HUFFMAN_DECODE_LANES <= count && status == 0; first += HUFFMAN_DECODE_LANES)
+    {
+        HuffmanLane lanes[HUFFMAN_DECODE_LANES];
+        for (size_t l = 0; l < HUFFMAN_DECODE_LANES; ++l)
+        {
+            size_t i = first + l;
+            huffman_lane_init(data, nbytes, &records[i], decoded + decoded_offsets[i],
+                              decoded_offsets[i + 1] - decoded_offsets[i], &lanes[l]);
+        }
+        // Interleave the lanes while they all have bits left
+        int active = 1;
+        for (size_t l = 0; l < HUFFMAN_DECODE_LANES; ++l)
+            active &= (lanes[l].pos < lanes[l].end);
+        while (active && status == 0)
+        {
+            for (size_t l = 0; l < HUFFMAN_DECODE_LANES; ++l)
+                status |= huffman_lane_step(table, data, nbytes, &lanes[l]);
+            for (size_t l = 0; l < HUFFMAN_DECODE_LANES; ++l)
+                active &= (lanes[l].pos < lanes[l].end);
+        }
+        // Finish the longest records one by one
+        for (size_t l = 0; l < HUFFMAN_DECODE_LANES && status == 0; ++l)
+        {
+            while (lanes[l].pos < lanes[l].end && status == 0)
+                status = huffman_lane_step(table, data, nbytes, &lanes[l]);
+            if (lanes[l].pos != lanes[l].end)
+                status = STATUS_CODE_MESSAGE_CORRUPT;
+            lengths[first + l] = lanes[l].length;
+        }
+    }
+    for (size_t i = first; i < count && status == 0; ++i)
+    {
+        status = huffman_table_decode_bits(table, data, nbytes, records[i].offset, records[i].nbits,
+                                           decoded + decoded_offsets[i], decoded_offsets[i + 1] - decoded_offsets[i],
+                                           &lengths[i], NULL);
+    }
+    if (status == 0)
+    {
+        // Pack the records back to back
+        size_t current_offset = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            memmove(decoded + current_offset, decoded + decoded_offsets[i], lengths[i]);
+            decoded_offsets[i] = current_offset;
+            current_offset += lengths[i];
+        }
+        decoded_offsets[count] = current_offset;
+    }
+    huffman_free(lengths);
+    status = (status > 0) ? STATUS_CODE_MESSAGE_CORRUPT : 0;
+    HUFFMAN_TRACE2(records_decode_done, count, status);
+    return status;
+}
+
+/// @brief Writes the header of a frame
+/// @param frame_header Pointer to the HuffmanFrameHeader structure to write
+/// @param frame Buffer of at least HUFFMAN_FRAME_HEADER_SIZE bytes
+static void write_frame_header(const HuffmanFrameHeader *frame_header, unsigned char *frame)
+{
+    // [mode][padding][table_nbytes (2)][raw_length (4)][payload_length (4)]
+    frame[0] = frame_header->mode;
+    frame[1] = frame_header->padding;
+    store_le16(frame + 2, frame_header->table_nbytes);
+    store_le32(frame + 4, frame_header->raw_length);
+    store_le32(frame + 8, frame_header->payload_length);
+}
+
+/// @brief Reads and checks the header of a frame
+/// @param frame Buffer of at least HUFFMAN_FRAME_HEADER_SIZE bytes
+/// @param frame_header Pointer to the HuffmanFrameHeader structure to fill
+/// @return status code
+int huffman_read_frame_header(const unsigned char *frame, HuffmanFrameHeader *frame_header)
+{
+    frame_header->mode = frame[0];
+    frame_header->padding = frame[1];
+    frame_header->table_nbytes = load_le16(frame + 2);
+    frame_header->raw_length = load_le32(frame + 4);
+    frame_header->payload_length = load_le32(frame + 8);
+    if (frame_header->mode == HUFFMAN_BLOCK_STORED)
+    {
+        if (frame_header->payload_length != frame_header->raw_length ||
+            frame_header->padding != 0 || frame_header->table_nbytes != 0)
+            return STATUS_CODE_HEADER_CORRUPT;
+    }
+    else if (frame_header->mode == HUFFMAN_BLOCK_HUFFMAN)
+    {
+        if (frame_header->padding >= CHAR_BIT || frame_header->table_nbytes == 0 ||
+            frame_header->table_nbytes >= frame_header->payload_length)
+            return STATUS_CODE_HEADER_CORRUPT;
+    }
+    else
+        return STATUS_CODE_HEADER_CORRUPT;
+    return 0;
+}
+
+/// @brief Computes the space needed after a decoded block to decode its codes in place
+///         The codes are placed at the end of the buffer and the characters are written from its start: the
+///         margin is the smallest one for which every character is written before the byte holding its code.
+/// @param table Pointer to the HuffmanTable structure
+/// @param block Block to encode
+/// @param length Number of characters of the block
+/// @param code_nbytes Number of bytes of the codes, smaller than length
+/// @return margin in bytes
+static size_t in_place_margin(const HuffmanTable *table, const char *block, size_t length, size_t code_nbytes)
+{
+    size_t margin = 0;
+    size_t nbits = 0;
+    for (size_t i = 0; i < length; ++i)
+    {
+        // Next byte to read when the buffer holds exactly the decoded block
+        size_t read_idx = length - code_nbytes + nbits / CHAR_BIT;
+        if (i + 1 > read_idx + margin)
+            margin = i + 1 - read_idx;
+        nbits += table->nbits[(unsigned char)block[i]];
+    }
+    return margin;
+}
+
+/// @brief Fills the statistics of a frame
+/// @param stats Pointer to the HuffmanStats structure
+/// @param frame_header Pointer to the HuffmanFrameHeader structure of the frame
+/// @param frequencies Array of MAX_CHAR frequencies of the block
+/// @param code_nbits Number of bits of the codes, or of the raw block when it is stored
+/// @param max_nbits Maximum code length of the table of a coded frame
+static void stats_set_frame(HuffmanStats *stats, const HuffmanFrameHeader *frame_header, const size_t *frequencies,
+                            size_t code_nbits, unsigned int max_nbits)
+{
+    stats_set_symbols(stats, frequencies, code_nbits);
+    stats->mode = frame_header->mode;
+    stats->header_nbytes = HUFFMAN_FRAME_HEADER_SIZE + frame_header->table_nbytes;
+    stats->code_nbytes = frame_header->payload_length - frame_header->table_nbytes;
+    stats->max_nbits = (frame_header->mode == HUFFMAN_BLOCK_HUFFMAN) ? max_nbits : CHAR_BIT;
+}
+
+/// @brief Encodes a block as a self-contained frame, stored raw when coding would not make it smaller
+///         A coded frame can always be decoded in place in HUFFMAN_IN_PLACE_BUFFER_SIZE(length) bytes,
+///         blocks whose codes would need a larger margin are stored raw.
+/// @param block Block to encode
+/// @param length Number of characters of the block, at most UINT32_MAX
+/// @param frame Buffer of at least HUFFMAN_FRAME_BOUND(length) bytes
+/// @param frame_length Number of bytes written in the frame
+/// @return status code
+int huffman_encode_frame(const char *block, size_t length, unsigned char *frame, size_t *frame_length)
+{
+    return huffman_encode_frame_stats(block, length, frame, frame_length, NULL);
+}
+
+/// @brief Body of huffman_encode_frame_stats, its allocations are counted by the caller
+static int _huffman_encode_frame_stats(const char *block, size_t length, unsigned char *frame, size_t *frame_length,
+                                       HuffmanStats *stats)
+{
+    uint64_t start = stats_start(stats);
+    if (length > UINT32_MAX)
+        return STATUS_CODE_BUFFER_TOO_SMALL;
+    HuffmanFrameHeader frame_header = {
+        .mode = HUFFMAN_BLOCK_STORED,
+        .padding = 0,
+        .table_nbytes = 0,
+        .raw_length = (uint32_t)length,
+        .payload_length = (uint32_t)length,
+    };
+    size_t frequencies[MAX_CHAR] = {0};
+    for (size_t i = 0; i < length; ++i)
+        frequencies[(unsigned char)block[i]] += 1;
+    stats_end_stage(stats, HUFFMAN_STAGE_COUNT, &start);
+    HuffmanTable table;
+    int status = build_huffman_table(frequencies, &table);
+    stats_end_stage(stats, HUFFMAN_STAGE_BUILD, &start);
+    if (status > 0)
+        return status;
+    // The exact size of the codes is known from the frequencies before encoding
+    size_t nbits = 0;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+        nbits += frequencies[i] * table.nbits[i];
+    size_t table_nbytes = table.max_nbits + 1 + table.length;
+    size_t payload_length = table_nbytes + (nbits + CHAR_BIT - 1) / CHAR_BIT;
+    if (length > 0 && payload_length < length &&
+        in_place_margin(&table, block, length, (nbits + CHAR_BIT - 1) / CHAR_BIT) <= HUFFMAN_IN_PLACE_MARGIN(length))
+    {
+        BitMessage header = {.data = NULL, .nbits = 0, .nbytes = 0};
+        status = huffman_table_encode_header(&table, &header);
+        if (status == 0)
+            memcpy(frame + HUFFMAN_FRAME_HEADER_SIZE, header.data, header.nbytes);
+        free_bit_message(&header);
+        stats_end_stage(stats, HUFFMAN_STAGE_HEADER, &start);
+        if (status > 0)
+            return status;
+        BitMessage message = {.data = frame + HUFFMAN_FRAME_HEADER_SIZE + table_nbytes, .nbits = 0, .nbytes = 0};
+        status = huffman_table_append(&table, block, length, &message, NULL);
+        if (status > 0)
+        {
+            stats_end_stage(stats, HUFFMAN_STAGE_CODES, &start);
+            return status;
+        }
+        frame_header.mode = HUFFMAN_BLOCK_HUFFMAN;
+        frame_header.padding = (unsigned char)((CHAR_BIT - nbits % CHAR_BIT) % CHAR_BIT);
+        frame_header.table_nbytes = (uint16_t)table_nbytes;
+        frame_header.payload_length = (uint32_t)payload_length;
+    }
+    else
+    {
+        PRINT_DEBUG("Store the block raw");
+        // The header stage of a stored frame is the choice of the mode
+        stats_end_stage(stats, HUFFMAN_STAGE_HEADER, &start);
+        memcpy(frame + HUFFMAN_FRAME_HEADER_SIZE, block, length);
+    }
+    write_frame_header(&frame_header, frame);
+    *frame_length = HUFFMAN_FRAME_HEADER_SIZE + frame_header.payload_length;
+    stats_end_stage(stats, HUFFMAN_STAGE_CODES, &start);
+    if (stats != NULL)
+        stats_set_frame(stats, &frame_header, frequencies, (frame_header.mode == HUFFMAN_BLOCK_HUFFMAN) ? nbits : length * CHAR_BIT,
+                        table.max_nbits);
+    return 0;
+}
+
+/// @brief Encodes a block as a self-contained frame and reports what the encoding achieved
+/// @param block Block to encode
+/// @param length Number of characters of the block, at most UINT32_MAX
+/// @param frame Buffer of at least HUFFMAN_FRAME_BOUND(length) bytes
+/// @param frame_length Number of bytes written in the frame
+/// @param stats Pointer to the HuffmanStats structure to fill, NULL to skip the statistics and their timing,
+///        its memory.limit caps the heap allocated by the call
+/// @return status code
+int huffman_encode_frame_stats(const char *block, size_t length, unsigned char *frame, size_t *frame_length,
+                               HuffmanStats *stats)
+{
+    HUFFMAN_TRACE1(frame_encode_start, length);
+    HuffmanMemoryTracker tracker;
+    memory_track(&tracker, stats);
+    int status = _huffman_encode_frame_stats(block, length, frame, frame_length, stats);
+    status = memory_untrack(&tracker, stats, status);
+    // The mode is the first byte of the frame
+    HUFFMAN_TRACE4(frame_encode_done, length, (status == 0) ? frame[0] : 0, (status == 0) ? *frame_length : 0, status);
+    return status;
+}
+
+/// @brief Initializes an encoder producing the frames of successive blocks at a level
+/// @param encoder Pointer to the HuffmanFrameEncoder structure to initialize
+/// @param level HUFFMAN_LEVEL_FAST, HUFFMAN_LEVEL_DEFAULT or HUFFMAN_LEVEL_MAX, it can be changed between blocks
+void huffman_frame_encoder_init(HuffmanFrameEncoder *encoder, int level)
+{
+    memset(encoder, 0, sizeof(HuffmanFrameEncoder));
+    encoder->level = level;
+}
+
+/// @brief Frees resources associated with an encoder
+/// @param encoder Pointer to the HuffmanFrameEncoder structure to free
+void free_huffman_frame_encoder(HuffmanFrameEncoder *encoder)
+{
+    huffman_free(encoder->scratch);
+    encoder->scratch = NULL;
+    encoder->scratch_capacity = 0;
+    encoder->has_table = 0;
+}
+
+/// @brief Computes the size of the table header and of the codes of characters given their code lengths
+/// @param nbits Array of MAX_CHAR code lengths, 0 for the characters without a code
+/// @param frequencies Array of MAX_CHAR frequencies
+/// @param code_nbits Number of bits of the codes, SIZE_MAX if a character with a frequency has no code
+/// @return number of bytes of the table header
+static size_t table_cost(const unsigned char *nbits, const size_t *frequencies, size_t *code_nbits)
+{
+    size_t nchars = 0;
+    unsigned int max_nbits = 0;
+    *code_nbits = 0;
+    for (size_t i = 0; i < MAX_CHAR; ++i)
+    {
+        if (frequencies[i] > 0 && nbits[i] == 0)
+            *code_nbits = SIZE_MAX;
+        if (*code_nbits != SIZE_MAX)
+            *code_nbits += frequencies[i] * nbits[i];
+        nchars += (nbits[i] > 0);
+        if (nbits[i] > max_nbits)
+            max_nbits = nbits[i];
+    }
+    return max_nbits + 1 + nchars;
+}
+
+/// @brief Encodes the codes of a block while bounding their size and their in-place margin
+///         The checks are made once per chunk of at most HUFFMAN_FAST_CHUNK_LENGTH characters instead of once per
+///         character, with chunks small enough for the overestimated margin to only store a few more blocks.
+///         The table must have at least one code.
+/// @param table Pointer to the HuffmanTable structure
+/// @param block Block to encode
+/// @param length Number of characters of the block
+/// @param data Buffer receiving the codes
+/// @param capacity Number of bytes of the buffer
+/// @param nbits Number of bits of the codes
+/// @param margin Upper bound of the in-place margin of the codes
+/// @return status code, STATUS_CODE_BUFFER_TOO_SMALL if the codes may not fit,
+///         STATUS_CODE_SYMBOL_NOT_IN_TABLE if a character has no code in the table
+static int encode_codes_checked(const HuffmanTable *table, const char *block, size_t length, unsigned char *data,
+                                size_t capacity, size_t *nbits, size_t *margin)
+{
+    // The margin is overestimated by less than the characters and the codes of a chunk
+    size_t max_chunk_length = HUFFMAN_IN_PLACE_MARGIN(length) / 4;
+    if (max_chunk_length > HUFFMAN_FAST_CHUNK_LENGTH)
+        max_chunk_length = HUFFMAN_FAST_CHUNK_LENGTH;
+    size_t ahead = 0;
+    *nbits = 0;
+    for (size_t begin = 0; begin < length;)
+    {
+        // Characters whose codes fit in the rest of the buffer whatever their length, the chunks shrink near its end
+        size_t used = *nbits / CHAR_BIT + 1;
+        size_t chunk_length = (used < capacity) ? (capacity - used) * CHAR_BIT / table->max_nbits : 0;
+        if (chunk_length == 0)
+            return STATUS_CODE_BUFFER_TOO_SMALL;
+        if (chunk_length > max_chunk_length)
+            chunk_length = max_chunk_length;
+        size_t end = (length - begin < chunk_length) ? length : begin + chunk_length;
+        // Every character of the chunk is read at or after the byte holding the start of the chunk, see in_place_margin
+        if (length + end - *nbits / CHAR_BIT > ahead)
+            ahead = length + end - *nbits / CHAR_BIT;
+        int status = huffman_inline_encode(table, block + begin, end - begin, data, nbits, NULL);
+        if (status > 0)
+            return status;
+        begin = end;
+    }
+    size_t code_nbytes = (*nbits + CHAR_BIT - 1) / CHAR_BIT;
+    *margin = (ahead + code_nbytes > 2 * length) ? ahead + code_nbytes - 2 * length : 0;
+    return 0;
+}
+
+/// @brief Encodes a block as a frame at HUFFMAN_LEVEL_FAST
+///         The table is built from a sample of the block and the previous table is kept while it is estimated
+///         as good on the sample, saving the code construction. Blocks estimated to barely shrink are stored
+///         without being encoded, the others are encoded in a single pass that checks their size and margin.
+///         A character missing from the sample falls back to the exact histogram.
+/// @param encoder Pointer to the HuffmanFrameEncoder structure
+/// @param block Block to encode
+/// @param length Number of characters of the block, at most UINT32_MAX
+/// @param frame Buffer of at least HUFFMAN_FRAME_BOUND(length) bytes
+/// @param frame_length Number of bytes written in the frame
+/// @return status code
+static int _encode_frame_fast(HuffmanFrameEncoder *encoder, const char *block, size_t length, unsigned char *frame,
+                              size_t *frame_length)
+{
+    if (length > UINT32_MAX)
+        return STATUS_CODE_BUFFER_TOO_SMALL;
+    HuffmanFrameHeader frame_header = {
+        .mode = HUFFMAN_BLOCK_STORED,
+        .padding = 0,
+        .table_nbytes = 0,
+        .raw_length = (uint32_t)length,
+        .payload_length = (uint32_t)length,
+    };
+    size_t sample[MAX_CHAR] = {0};
+    size_t nsampled = 0;
+    for (size_t begin = 0; begin < length; begin += HUFFMAN_FAST_SAMPLE_STRIDE * HUFFMAN_FAST_SAMPLE_LENGTH)
+    {
+        size_t end = (length - begin < HUFFMAN_FAST_SAMPLE_LENGTH) ? length : begin + HUFFMAN_FAST_SAMPLE_LENGTH;
+        for (size_t i = begin; i < end; ++i)
+            sample[(unsigned char)block[i]] += 1;
+        nsampled += end - begin;
+    }
+    unsigned char sample_nbits[MAX_CHAR];
+    int status = huffman_code_lengths(sample, sample_nbits);
+    if (status > 0)
+        return status;
+    // Sizes in bits of the table and of the codes of the whole block, extrapolated from the sample
+    double scale = (nsampled > 0) ? (double)length / (double)nsampled : 0;
+    size_t code_nbits = 0;
+    double estimate = (double)table_cost(sample_nbits, sample, &code_nbits) * CHAR_BIT + (double)code_nbits * scale;
+    if (length > 0 && estimate < (double)(length - length / HUFFMAN_FAST_MIN_SAVING) * CHAR_BIT)
+    {
+        int reuse = 0;
+        if (encoder->has_table)
+        {
+            size_t table_nbytes = table_cost(encoder->table.nbits, sample, &code_nbits);
+            reuse = code_nbits != SIZE_MAX && (double)table_nbytes * CHAR_BIT + (double)code_nbits * scale <=
+                                                  estimate + estimate / HUFFMAN_FAST_REUSE_SLACK;
+        }
+        if (!reuse)
+        {
+            encoder->has_table = 0;
+            status = huffman_table_from_lengths(sample_nbits, &encoder->table);
+            if (status > 0)
+                return status;
+            encoder->has_table = 1;
+        }
+        size_t table_nbytes = encoder->table.max_nbits + 1 + encoder->table.length;
+        // The payload must stay smaller than the block
+        size_t capacity = (table_nbytes < length) ? length - 1 - table_nbytes : 0;
+        unsigned char *codes = frame + HUFFMAN_FRAME_HEADER_SIZE + table_nbytes;
+        size_t nbits = 0;
+        size_t margin = 0;
+        status = encode_codes_checked(&encoder->table, block, length, codes, capacity, &nbits, &margin);
+        if (status == STATUS_CODE_SYMBOL_NOT_IN_TABLE)
+        {
+            PRINT_DEBUG("Rebuild the table from the exact histogram");
+            size_t frequencies[MAX_CHAR] = {0};
+            for (size_t i = 0; i < length; ++i)
+                frequencies[(unsigned char)block[i]] += 1;
+            encoder->has_table = 0;
+            status = build_huffman_table(frequencies, &encoder->table);
+            if (status > 0)
+                return status;
+            encoder->has_table = 1;
+            table_nbytes = encoder->table.max_nbits + 1 + encoder->table.length;
+            capacity = (table_nbytes < length) ? length - 1 - table_nbytes : 0;
+            codes = frame + HUFFMAN_FRAME_HEADER_SIZE + table_nbytes;
+            status = encode_codes_checked(&encoder->table, block, length, codes, capacity, &nbits, &margin);
+        }
+        if (status == 0 && margin <= HUFFMAN_IN_PLACE_MARGIN(length))
+        {
+            BitMessage header = {.data = NULL, .nbits = 0, .nbytes = 0};
+            status = huffman_table_encode_header(&encoder->table, &header);
+            if (status > 0)
+                return status;
+            memcpy(frame + HUFFMAN_FRAME_HEADER_SIZE, header.data, header.nbytes);
+            free_bit_message(&header);
+            frame_header.mode = HUFFMAN_BLOCK_HUFFMAN;
+            frame_header.padding = (unsigned char)((CHAR_BIT - nbits % CHAR_BIT) % CHAR_BIT);
+            frame_header.table_nbytes = (uint16_t)table_nbytes;
+            frame_header.payload_length = (uint32_t)(table_nbytes + (nbits + CHAR_BIT - 1) / CHAR_BIT);
+        }
+        else if (status > 0 && status != STATUS_CODE_BUFFER_TOO_SMALL)
+            return status;
+    }
+    if (frame_header.mode == HUFFMAN_BLOCK_STORED)
+    {
+        PRINT_DEBUG("Store the block raw");
+        memcpy(frame + HUFFMAN_FRAME_HEADER_SIZE, block, length);
+    }
+    write_frame_header(&frame_header, frame);
+    *frame_length = HUFFMAN_FRAME_HEADER_SIZE + frame_header.payload_length;
+    return 0;
+}
+
+/// @brief Encodes a block as a frame at HUFFMAN_LEVEL_FAST, see _encode_frame_fast
+/// @param encoder Pointer to the HuffmanFrameEncoder structure
+/// @param block Block to encode
+/// @param length Number of characters of the block, at most UINT32_MAX
+/// @param frame Buffer of at least HUFFMAN_FRAME_BOUND(length) bytes
+/// @param frame_length Number of bytes written in the frame
+/// @return status code
+static int encode_frame_fast(HuffmanFrameEncoder *encoder, const char *block, size_t length, unsigned char *frame,
+                             size_t *frame_length)
+{
+    HUFFMAN_TRACE1(frame_encode_start, length);
+    int status = _encode_frame_fast(encoder, block, length, frame, frame_length);
+    HUFFMAN_TRACE4(frame_encode_done, length, (status == 0) ? frame[0] : 0, (status == 0) ? *frame_length : 0, status);
+    return status;
+}
+
+/// @brief Estimates the size of the frame of a block from its frequencies
+/// @param frequencies Array of MAX_CHAR frequencies of the block
+/// @param length Number of characters of the block
+/// @param frame_length Estimated number of bytes of the frame, ignoring the in-place margin
+/// @return status code
+static int estimate_frame_length(const size_t *frequencies, size_t length, size_t *frame_length)
+{
+    unsigned char nbits[MAX_CHAR];
+    int status = huffman_code_lengths(frequencies, nbits);
+    if (status > 0)
+        return status;
+    size_t code_nbits = 0;
+    size_t payload_length = table_cost(nbits, frequencies, &code_nbits) + (code_nbits + CHAR_BIT - 1) / CHAR_BIT;
+    *frame_length = HUFFMAN_FRAME_HEADER_SIZE + ((payload_length < length) ? payload_length : length);
+    return 0;
+}
+
+/// @brief Chooses where to cut a range of leaves: the range is cut in two halves, recursively, when the frames
+///         of the halves are estimated smaller than the frame of the range
+/// @param leaves Array of nleaves histograms of MAX_CHAR counts
+/// @param nleaves Number of leaves
+/// @param leaf_length Number of characters of a leaf, the last leaf also holds the rest of the block
+/// @param length Number of characters of the block
+/// @param first First leaf of the range
+/// @param last Leaf after the range
+/// @param cuts Array receiving the leaves starting a part, in increasing order
+/// @param ncuts Number of cuts in the array
+/// @param frame_length Estimated number of bytes of the frames of the range
+/// @return status code
+static int choose_cuts(const size_t *leaves, size_t nleaves, size_t leaf_length, size_t length, size_t first,
+                       size_t last, size_t *cuts, size_t *ncuts, size_t *frame_length)
+{
+    size_t frequencies[MAX_CHAR] = {0};
+    for (size_t leaf = first; leaf < last; ++leaf)
+        for (size_t i = 0; i < MAX_CHAR; ++i)
+            frequencies[i] += leaves[leaf * MAX_CHAR + i];
+    size_t range_length = ((last == nleaves) ? length : last * leaf_length) - first * leaf_length;
+    int status = estimate_frame_length(frequencies, range_length, frame_length);
+    if (status > 0 || last - first < 2)
+        return status;
+    size_t middle = first + (last - first) / 2;
+    size_t kept_ncuts = *ncuts;
+    size_t first_length = 0;
+    size_t second_length = 0;
+    status = choose_cuts(leaves, nleaves, leaf_length, length, first, middle, cuts, ncuts, &first_length);
+    if (status > 0)
+        return status;
+    cuts[(*ncuts)++] = middle;
+    status = choose_cuts(leaves, nleaves, leaf_length, length, middle, last, cuts, ncuts, &second_length);
+    if (status > 0)
+        return status;
+    if (first_length + second_length < *frame_length)
+        *frame_length = first_length + second_length;
+    else
+        *ncuts = kept_ncuts;
+    return 0;
+}
+
+/// @brief Encodes a block as one or more frames at HUFFMAN_LEVEL_MAX
+///         The block is cut in leaves of at least HUFFMAN_SPLIT_MIN_LENGTH characters whose histograms choose the
+///         parts. The parts are encoded aside and kept only when their frames are smaller than the single frame.
+/// @param encoder Pointer to the HuffmanFrameEncoder structure
+/// @param block Block to encode
+/// @param length Number of characters of the block, at most UINT32_MAX
+/// @param output Buffer of at least HUFFMAN_FRAME_BOUND(length) bytes
+/// @param output_length Number of bytes written in the output
+/// @return status code
+static int encode_frames_split(HuffmanFrameEncoder *encoder, const char *block, size_t length, unsigned char *output,
+                               size_t *output_length)
+{
+    if (length < 2 * HUFFMAN_SPLIT_MIN_LENGTH || length > UINT32_MAX)
+        return huffman_encode_frame(block, length, output, output_length);
+    size_t leaf_length = length / HUFFMAN_SPLIT_MAX_PARTS;
+    if (leaf_length < HUFFMAN_SPLIT_MIN_LENGTH)
+        leaf_length = HUFFMAN_SPLIT_MIN_LENGTH;
+    size_t nleaves = length / leaf_length;
+    size_t *leaves = huffman_calloc(nleaves * MAX_CHAR, sizeof(size_t));
+    if (leaves == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    for (size_t i = 0; i < length; ++i)
+    {
+        size_t leaf = (i / leaf_length < nleaves) ? i / leaf_length : nleaves - 1;
+        leaves[leaf * MAX_CHAR + (unsigned char)block[i]] += 1;
+    }
+    size_t frequencies[MAX_CHAR] = {0};
+    for (size_t leaf = 0; leaf < nleaves; ++leaf)
+        for (size_t i = 0; i < MAX_CHAR; ++i)
+            frequencies[i] += leaves[leaf * MAX_CHAR + i];
+    size_t estimate = 0;
+    int status = estimate_frame_length(frequencies, length, &estimate);
+    size_t cuts[HUFFMAN_SPLIT_MAX_PARTS];
+    size_t ncuts = 0;
+    size_t split_estimate = 0;
+    if (status == 0)
+        status = choose_cuts(leaves, nleaves, leaf_length, length, 0, nleaves, cuts, &ncuts, &split_estimate);
+    huffman_free(leaves);
+    if (status > 0)
+        return status;
+    if (ncuts == 0)
+        return huffman_encode_frame(block, length, output, output_length);
+    size_t capacity = HUFFMAN_FRAME_BOUND(length) + ncuts * HUFFMAN_FRAME_HEADER_SIZE;
+    if (encoder->scratch_capacity < capacity)
+    {
+        huffman_free(encoder->scratch);
+        encoder->scratch_capacity = 0;
+        encoder->scratch = huffman_malloc(capacity);
+        if (encoder->scratch == NULL)
+            return STATUS_CODE_ALLOC_FAIL;
+        encoder->scratch_capacity = capacity;
+    }
+    size_t scratch_length = 0;
+    for (size_t part = 0; part <= ncuts; ++part)
+    {
+        size_t begin = (part == 0) ? 0 : cuts[part - 1] * leaf_length;
+        size_t end = (part == ncuts) ? length : cuts[part] * leaf_length;
+        size_t frame_length = 0;
+        status = huffman_encode_frame(block + begin, end - begin, encoder->scratch + scratch_length, &frame_length);
+        if (status > 0)
+            return status;
+        scratch_length += frame_length;
+    }
+    // The single frame is never smaller than its estimate, unless the estimate missed its in-place margin
+    if (scratch_length >= estimate)
+        return huffman_encode_frame(block, length, output, output_length);
+    memcpy(output, encoder->scratch, scratch_length);
+    *output_length = scratch_length;
+    return 0;
+}
+
+/// @brief Encodes a block as one or more frames at the level of the encoder
+///         Every frame is self-contained and decoded by huffman_read_frame_header and huffman_decode_frame_payload,
+///         the frames of a block follow each other and their raw lengths add up to its length.
+/// @param encoder Pointer to the HuffmanFrameEncoder structure
+/// @param block Block to encode
+/// @param length Number of characters of the block, at most UINT32_MAX
+/// @param output Buffer of at least HUFFMAN_FRAME_BOUND(length) bytes
+/// @param output_length Number of bytes written in the output
+/// @return status code
+int huffman_frame_encoder_encode(HuffmanFrameEncoder *encoder, const char *block, size_t length, unsigned char *output,
+                                 size_t *output_length)
+{
+    if (encoder->level == HUFFMAN_LEVEL_FAST)
+        return encode_frame_fast(encoder, block, length, output, output_length);
+    if (encoder->level == HUFFMAN_LEVEL_MAX)
+        return encode_frames_split(encoder, block, length, output, output_length);
+    return huffman_encode_frame(block, length, output, output_length);
+}
+
+/// @brief Decodes the payload of a frame whose header has been read by huffman_read_frame_header
+/// @param frame_header Pointer to the HuffmanFrameHeader structure of the frame
+/// @param payload Payload of the frame, payload_length bytes
+/// @param block Buffer receiving the block, raw_length characters
+/// @return status code
+int huffman_decode_frame_payload(const HuffmanFrameHeader *frame_header, const unsigned char *payload, char *block)
+{
+    return huffman_decode_frame_payload_stats(frame_header, payload, block, NULL);
+}
+
+/// @brief Body of huffman_decode_frame_payload_stats, its allocations are counted by the caller
+static int _huffman_decode_frame_payload_stats(const HuffmanFrameHeader *frame_header, const unsigned char *payload,
+                                               char *block, HuffmanStats *stats)
+{
+    HUFFMAN_TRACE2(frame_decode_start, frame_header->raw_length, frame_header->mode);
+    uint64_t start = stats_start(stats);
+    size_t frequencies[MAX_CHAR] = {0};
+    if (frame_header->mode == HUFFMAN_BLOCK_STORED)
+    {
+        stats_end_stage(stats, HUFFMAN_STAGE_HEADER, &start);
+        memcpy(block, payload, frame_header->raw_length);
+        stats_end_stage(stats, HUFFMAN_STAGE_CODES, &start);
+        if (stats != NULL)
+        {
+            for (size_t i = 0; i < frame_header->raw_length; ++i)
+                frequencies[(unsigned char)block[i]] += 1;
+            stats_set_frame(stats, frame_header, frequencies, (size_t)frame_header->raw_length * CHAR_BIT, 0);
+        }
+        HUFFMAN_TRACE3(frame_decode_done, frame_header->raw_length, frame_header->mode, 0);
+        return 0;
+    }
+    HuffmanTable table;
+    BitMessage header = {.data = (unsigned char *)payload, .nbits = frame_header->table_nbytes * CHAR_BIT, .nbytes = frame_header->table_nbytes};
+    int status = huffman_table_decode_header(&header, &table);
+    stats_end_stage(stats, HUFFMAN_STAGE_HEADER, &start);
+    if (status > 0)
+    {
+        HUFFMAN_TRACE3(frame_decode_done, frame_header->raw_length, frame_header->mode, status);
+        return status;
+    }
+    size_t nbytes = frame_header->payload_length - frame_header->table_nbytes;
+    size_t length = 0;
+    // The frequencies are counted while decoding only when the statistics are requested
+    status = huffman_table_decode_bits(&table, payload + frame_header->table_nbytes, nbytes, 0,
+                                       nbytes * CHAR_BIT - frame_header->padding, block,
+                                       frame_header->raw_length, &length, (stats != NULL) ? frequencies : NULL);
+    stats_end_stage(stats, HUFFMAN_STAGE_CODES, &start);
+    status = (status > 0 || length != frame_header->raw_length) ? STATUS_CODE_MESSAGE_CORRUPT : 0;
+    // The statistics describe a decoded block only
+    if (status == 0 && stats != NULL)
+        stats_set_frame(stats, frame_header, frequencies, nbytes * CHAR_BIT - frame_header->padding, table.max_nbits);
+    HUFFMAN_TRACE3(frame_decode_done, frame_header->raw_length, frame_header->mode, status);
+    return status;
+}
+
+/// @brief Decodes the payload of a frame and reports the statistics of the decoded block
+/// @param frame_header Pointer to the HuffmanFrameHeader structure of the frame
+/// @param payload Payload of the frame, payload_length bytes
+/// @param block Buffer receiving the block, raw_length characters
+/// @param stats Pointer to the HuffmanStats structure to fill, NULL to skip the statistics and their timing,
+///        its memory.limit caps the heap allocated by the call
+/// @return status code
+int huffman_decode_frame_payload_stats(const HuffmanFrameHeader *frame_header, const unsigned char *payload, char *block,
+                                       HuffmanStats *stats)
+{
+    HuffmanMemoryTracker tracker;
+    memory_track(&tracker, stats);
+    int status = _huffman_decode_frame_payload_stats(frame_header, payload, block, stats);
+    return memory_untrack(&tracker, stats, status);
+}
+
+/// @brief Decodes a frame in place, the frame is at the end of the buffer and the block is written from its start
+///         Peak memory is a single buffer of HUFFMAN_IN_PLACE_BUFFER_SIZE(raw_length) bytes, the size of the block
+///         being known from huffman_read_frame_header before the rest of the frame is read.
+///         The write position is checked against the read position for each character.
+/// @param buffer Buffer holding the frame in its last frame_length bytes, receives the block at its start
+/// @param capacity Size of the buffer
+/// @param frame_length Number of bytes of the frame
+/// @param length Number of characters of the decoded block
+/// @return status code, STATUS_CODE_BUFFER_TOO_SMALL if the buffer leaves too little margin
+int huffman_decode_frame_in_place(unsigned char *buffer, size_t capacity, size_t frame_length, size_t *length)
+{
+    if (frame_length < HUFFMAN_FRAME_HEADER_SIZE || frame_length > capacity)
+        return STATUS_CODE_MESSAGE_CORRUPT;
+    size_t frame_offset = capacity - frame_length;
+    HuffmanFrameHeader frame_header;
+    int status = huffman_read_frame_header(buffer + frame_offset, &frame_header);
+    if (status > 0)
+        return status;
+    if (HUFFMAN_FRAME_HEADER_SIZE + (size_t)frame_header.payload_length != frame_length)
+        return STATUS_CODE_MESSAGE_CORRUPT;
+    if (frame_header.raw_length > capacity)
+        return STATUS_CODE_BUFFER_TOO_SMALL;
+    const unsigned char *payload = buffer + frame_offset + HUFFMAN_FRAME_HEADER_SIZE;
+    if (frame_header.mode == HUFFMAN_BLOCK_STORED)
+    {
+        memmove(buffer, payload, frame_header.raw_length);
+        *length = frame_header.raw_length;
+        return 0;
+    }
+    // The table is copied out of the buffer before the first character overwrites the headers
+    HuffmanTable table;
+    BitMessage header = {.data = (unsigned char *)payload, .nbits = frame_header.table_nbytes * CHAR_BIT, .nbytes = frame_header.table_nbytes};
+    status = huffman_table_decode_header(&header, &table);
+    if (status > 0)
+        return status;
+    size_t code_idx = frame_offset + HUFFMAN_FRAME_HEADER_SIZE + frame_header.table_nbytes;
+    size_t nbits = (capacity - code_idx) * CHAR_BIT - frame_header.padding;
+    uint64_t bit_buffer = 0;
+    unsigned int count = 0;
+    size_t byte_idx = code_idx;
+    size_t pos = 0;
+    size_t current_idx = 0;
+    while (pos < nbits)
+    {
+        while (count <= 64 - CHAR_BIT)
+        {
+            uint64_t byte = 0;
+            if (byte_idx < capacity)
+                byte = buffer[byte_idx];
+            byte_idx += 1;
+            bit_buffer |= byte << (64 - CHAR_BIT - count);
+            count += CHAR_BIT;
+        }
+        uint16_t entry = table.lookup[bit_buffer >> (64 - HUFFMAN_TABLE_MAX_NBITS)];
+        unsigned int code_nbits = entry & ((1u << HUFFMAN_LOOKUP_NBITS_WIDTH) - 1);
+        if (code_nbits == 0 || current_idx >= frame_header.raw_length)
+            return STATUS_CODE_MESSAGE_CORRUPT;
+        // The byte holding the current code and the following ones must not be overwritten
+        if (current_idx >= code_idx + pos / CHAR_BIT)
+            return STATUS_CODE_BUFFER_TOO_SMALL;
+        buffer[current_idx++] = (unsigned char)(entry >> HUFFMAN_LOOKUP_NBITS_WIDTH);
+        bit_buffer <<= code_nbits;
+        count -= code_nbits;
+        pos += code_nbits;
+    }
+    if (pos != nbits || current_idx != frame_header.raw_length)
+        return STATUS_CODE_MESSAGE_CORRUPT;
+    *length = current_idx;
+    return 0;
+}
@@ -3,6 +3,16 @@
 #define _HUFFMAN_H 1
 
 #include <stdlib.h>
+#include <stdint.h>
+
+/// Functions of the public API, the other symbols are hidden when the library is built with -fvisibility=hidden
+#ifndef HUFFMAN_API
+#if defined(__GNUC__)
+#define HUFFMAN_API __attribute__((visibility("default")))
+#else
+#define HUFFMAN_API
+#endif
+#endif
 
 #define STATUS_CODE_ALLOC_FAIL 1
 #define STATUS_CODE_TREE_FAIL 2
@@ -12,9 +22,68 @@
 #define STATUS_CODE_DECODED_MESSAGE_NOT_EMPTY 6
 #define STATUS_CODE_HEADER_FAIL 7
 #define STATUS_CODE_HEADER_CORRUPT 8
+#define STATUS_CODE_SYMBOL_NOT_IN_TABLE 9
+#define STATUS_CODE_MESSAGE_CORRUPT 10
+#define STATUS_CODE_BUFFER_TOO_SMALL 11
+#define STATUS_CODE_INDEX_OUT_OF_RANGE 12
+#define STATUS_CODE_MEMORY_LIMIT 13
 
 #define MAX_CHAR 256
 
+/// Maximum number of bits of a code in a HuffmanTable
+#define HUFFMAN_TABLE_MAX_NBITS 12
+/// Number of low bits of a lookup entry holding the code length, the character is stored above
+#define HUFFMAN_LOOKUP_NBITS_WIDTH 4
+
+/// Number of records decoded together by huffman_table_decode_records
+#define HUFFMAN_DECODE_LANES 4
+
+/// Size of the header of a frame, see huffman_encode_frame
+#define HUFFMAN_FRAME_HEADER_SIZE 12
+/// Maximum size of the frame of a block of the given length
+#define HUFFMAN_FRAME_BOUND(length) (HUFFMAN_FRAME_HEADER_SIZE + (length))
+/// Space after the decoded block that every frame needs to be decoded in place, see huffman_decode_frame_in_place
+#define HUFFMAN_IN_PLACE_MARGIN(length) (32 + (length) / 64)
+/// Size of a buffer in which a frame of a block of the given length can be decoded in place
+#define HUFFMAN_IN_PLACE_BUFFER_SIZE(length) ((length) + HUFFMAN_IN_PLACE_MARGIN(length))
+/// The payload of the frame is the raw block
+#define HUFFMAN_BLOCK_STORED 0
+/// The payload of the frame is a table header followed by the codes
+#define HUFFMAN_BLOCK_HUFFMAN 1
+
+/// Stages timed in HuffmanStats: counting the characters, building the code, writing or reading the header,
+/// encoding or decoding the characters
+#define HUFFMAN_STAGE_COUNT 0
+#define HUFFMAN_STAGE_BUILD 1
+#define HUFFMAN_STAGE_HEADER 2
+#define HUFFMAN_STAGE_CODES 3
+#define HUFFMAN_NSTAGES 4
+
+/// Version of the serialized histogram format
+#define HUFFMAN_HISTOGRAM_VERSION 1
+
+/// Each block is encoded with its own table stored in the header
+#define HUFFMAN_STREAM_FRESH_TABLE 0
+/// Each block is encoded with the table built from the previous block, the header is empty
+/// unless the block contains a character missing from that table
+#define HUFFMAN_STREAM_PREVIOUS_TABLE 1
+/// The table is rebuilt from a sliding window only when the drift of the data makes it worth its header,
+/// the header is empty while the current table is kept
+#define HUFFMAN_STREAM_DRIFT_TABLE 2
+
+/// Levels of a HuffmanFrameEncoder, each one producing frames that huffman_decode_frame_payload reads
+/// The histogram is sampled, the previous table is reused while it stays as good and
+/// blocks that would barely shrink are stored raw without being encoded
+#define HUFFMAN_LEVEL_FAST 1
+/// Each block is encoded with the table of its exact histogram, as huffman_encode_frame
+#define HUFFMAN_LEVEL_DEFAULT 2
+/// Blocks are split where their distribution changes and each part gets its own frame and table
+#define HUFFMAN_LEVEL_MAX 3
+/// Smallest part of a block split by HUFFMAN_LEVEL_MAX
+#define HUFFMAN_SPLIT_MIN_LENGTH 16384
+/// Largest number of parts a block is cut into by HUFFMAN_LEVEL_MAX
+#define HUFFMAN_SPLIT_MAX_PARTS 64
+
 /// @brief Structure representing a bit-level message
 typedef struct BitMessage
 {
@@ -30,12 +99,208 @@ typedef struct EncodedMessage
     BitMessage message;
 } EncodedMessage;
 
-void display_bit_message(const BitMessage *, char *);
+/// @brief Heap memory of one encoding or decoding call, counted only when statistics are requested
+typedef struct HuffmanMemory
+{
+    // Ceiling set by the caller, kept across calls, 0 for no ceiling
+    // An allocation that would go above it fails and the call returns STATUS_CODE_MEMORY_LIMIT
+    size_t limit;
+    // Bytes allocated by the call and not freed when it returns, the returned buffers included
+    size_t current;
+    // Largest number of bytes allocated at once during the call
+    size_t peak;
+    // Number of allocations and reallocations
+    size_t nallocs;
+    // Set when an allocation has been refused because of the ceiling
+    int limit_reached;
+} HuffmanMemory;
+
+/// @brief Statistics of one encoding or decoding call, filled only when requested
+///         memory.limit is the only field read by the calls, zero-initialize the structure before the first one
+typedef struct HuffmanStats
+{
+    // Number of characters encoded or decoded
+    size_t input_length;
+    // Number of distinct characters
+    size_t nsymbols;
+    // Shannon entropy of the characters in bits per character
+    double entropy;
+    // Bits of code per character, header excluded
+    double bits_per_symbol;
+    size_t header_nbytes;
+    size_t code_nbytes;
+    unsigned int max_nbits;
+    // HUFFMAN_BLOCK_STORED or HUFFMAN_BLOCK_HUFFMAN
+    int mode;
+    uint64_t stage_ns[HUFFMAN_NSTAGES];
+    HuffmanMemory memory;
+} HuffmanStats;
+
+/// @brief Character counts that can be merged and serialized to train a table over several shards
+typedef struct HuffmanHistogram
+{
+    uint64_t counts[MAX_CHAR];
+} HuffmanHistogram;
+
+/// @brief Canonical code table limited to HUFFMAN_TABLE_MAX_NBITS bits
+typedef struct HuffmanTable
+{
+    uint32_t codes[MAX_CHAR];
+    unsigned char nbits[MAX_CHAR];
+    // Indexed by the next HUFFMAN_TABLE_MAX_NBITS bits: (character << HUFFMAN_LOOKUP_NBITS_WIDTH) | nbits
+    uint16_t lookup[1 << HUFFMAN_TABLE_MAX_NBITS];
+    uint32_t length;
+    uint32_t min_nbits;
+    uint32_t max_nbits;
+} HuffmanTable;
+
+/// @brief Frequencies of the last characters of a stream, kept in a ring buffer
+typedef struct HuffmanWindow
+{
+    unsigned char *data;
+    size_t capacity;
+    size_t start;
+    size_t count;
+    size_t frequencies[MAX_CHAR];
+} HuffmanWindow;
+
+/// @brief State shared by the successive blocks of a stream, on the encoder or the decoder side
+typedef struct HuffmanStream
+{
+    int mode;
+    int has_table;
+    HuffmanTable table;
+    // Number of tables sent in a header
+    size_t nrebuilds;
+    // Only used by the encoder in HUFFMAN_STREAM_DRIFT_TABLE mode
+    HuffmanWindow window;
+    size_t rebuild_cost_bits;
+    double redundancy;
+} HuffmanStream;
+
+/// @brief Records sharing one table with their codes packed contiguously
+typedef struct HuffmanBatch
+{
+    HuffmanTable table;
+    unsigned char *data;
+    size_t nbytes;
+    // Bit offset of each record, the last entry is the total number of bits
+    size_t *offsets;
+    size_t count;
+    // Length of the longest record
+    size_t max_length;
+} HuffmanBatch;
+
+/// @brief Position of a record encoded in a larger buffer
+typedef struct HuffmanRecord
+{
+    size_t offset;
+    size_t nbits;
+} HuffmanRecord;
+
+/// @brief Header of a self-contained frame encoding one block
+typedef struct HuffmanFrameHeader
+{
+    unsigned char mode;
+    // Number of unused bits in the last byte of the codes
+    unsigned char padding;
+    uint16_t table_nbytes;
+    uint32_t raw_length;
+    uint32_t payload_length;
+} HuffmanFrameHeader;
+
+/// @brief State kept by an encoder between the frames of successive blocks
+typedef struct HuffmanFrameEncoder
+{
+    int level;
+    // Only used at HUFFMAN_LEVEL_FAST: table of the previous block
+    int has_table;
+    HuffmanTable table;
+    // Only used at HUFFMAN_LEVEL_MAX: frames of the parts of a block before they are compared to a single frame
+    unsigned char *scratch;
+    size_t scratch_capacity;
+} HuffmanFrameEncoder;
+
+HUFFMAN_API void display_bit_message(const BitMessage *, char *);
+
+HUFFMAN_API void free_encoded_message(EncodedMessage *);
+
+HUFFMAN_API int huffman_encode(const char *, EncodedMessage *);
+
+HUFFMAN_API int huffman_decode(const EncodedMessage *, char **);
+
+HUFFMAN_API int huffman_encode_stats(const char *, EncodedMessage *, HuffmanStats *);
+
+HUFFMAN_API int huffman_decode_stats(const EncodedMessage *, char **, HuffmanStats *);
+
+HUFFMAN_API void huffman_histogram_init(HuffmanHistogram *);
+
+HUFFMAN_API void huffman_histogram_add(HuffmanHistogram *, const char *, size_t);
+
+HUFFMAN_API void huffman_histogram_merge(HuffmanHistogram *, const HuffmanHistogram *);
+
+HUFFMAN_API int huffman_histogram_serialize(const HuffmanHistogram *, BitMessage *);
+
+HUFFMAN_API int huffman_histogram_deserialize(const BitMessage *, HuffmanHistogram *);
+
+HUFFMAN_API int huffman_code_lengths(const size_t *, unsigned char *);
+
+HUFFMAN_API int huffman_table_from_lengths(const unsigned char *, HuffmanTable *);
+
+HUFFMAN_API int build_huffman_table(const size_t *, HuffmanTable *);
+
+HUFFMAN_API int huffman_table_from_histogram(const HuffmanHistogram *, HuffmanTable *);
+
+HUFFMAN_API int huffman_table_encode_header(const HuffmanTable *, BitMessage *);
+
+HUFFMAN_API int huffman_table_decode_header(const BitMessage *, HuffmanTable *);
+
+HUFFMAN_API int huffman_table_encode(const HuffmanTable *, const char *, size_t, BitMessage *);
+
+HUFFMAN_API int huffman_table_decode(const HuffmanTable *, const BitMessage *, char **, size_t *);
+
+HUFFMAN_API int create_huffman_window(HuffmanWindow *, size_t);
+
+HUFFMAN_API void free_huffman_window(HuffmanWindow *);
+
+HUFFMAN_API void huffman_window_update(HuffmanWindow *, const char *, size_t);
+
+HUFFMAN_API void huffman_stream_init(HuffmanStream *, int);
+
+HUFFMAN_API int huffman_stream_set_window(HuffmanStream *, size_t, size_t);
+
+HUFFMAN_API void free_huffman_stream(HuffmanStream *);
+
+HUFFMAN_API int huffman_stream_encode(HuffmanStream *, const char *, size_t, EncodedMessage *);
+
+HUFFMAN_API int huffman_stream_decode(HuffmanStream *, const EncodedMessage *, char **, size_t *);
+
+HUFFMAN_API int huffman_batch_encode(const char *const *, const size_t *, size_t, HuffmanBatch *);
+
+HUFFMAN_API int huffman_batch_get(const HuffmanBatch *, size_t, char *, size_t, size_t *);
+
+HUFFMAN_API void free_huffman_batch(HuffmanBatch *);
+
+HUFFMAN_API size_t huffman_records_capacity(const HuffmanTable *, const HuffmanRecord *, size_t);
+
+HUFFMAN_API int huffman_table_decode_records(const HuffmanTable *, const unsigned char *, size_t, const HuffmanRecord *, size_t, char *, size_t *);
+
+HUFFMAN_API int huffman_encode_frame(const char *, size_t, unsigned char *, size_t *);
+
+HUFFMAN_API int huffman_encode_frame_stats(const char *, size_t, unsigned char *, size_t *, HuffmanStats *);
+
+HUFFMAN_API int huffman_read_frame_header(const unsigned char *, HuffmanFrameHeader *);
+
+HUFFMAN_API int huffman_decode_frame_payload(const HuffmanFrameHeader *, const unsigned char *, char *);
+
+HUFFMAN_API int huffman_decode_frame_payload_stats(const HuffmanFrameHeader *, const unsigned char *, char *, HuffmanStats *);
+
+HUFFMAN_API void huffman_frame_encoder_init(HuffmanFrameEncoder *, int);
 
-void free_encoded_message(EncodedMessage *);
+HUFFMAN_API void free_huffman_frame_encoder(HuffmanFrameEncoder *);
 
-int huffman_encode(const char *, EncodedMessage *);
+HUFFMAN_API int huffman_frame_encoder_encode(HuffmanFrameEncoder *, const char *, size_t, unsigned char *, size_t *);
 
-int huffman_decode(const EncodedMessage *, char **);
+HUFFMAN_API int huffman_decode_frame_in_place(unsigned char *, size_t, size_t, size_t *);
 
 #endif // HUFFMAN included
\ No newline at end of file
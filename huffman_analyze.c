@@ -0,0 +1,406 @@
+#define _XOPEN_SOURCE 700
+#include "huffman_file.h"
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+/// Block sizes compared for the recommendation
+#define ANALYZE_NBLOCK_SIZES 5
+static const size_t analyze_block_sizes[ANALYZE_NBLOCK_SIZES] = {16 << 10, 64 << 10, 256 << 10, 1 << 20, 4 << 20};
+/// Table strategies of the streams, indexed by their HUFFMAN_STREAM_ mode
+#define ANALYZE_NSTRATEGIES 3
+static const char *const analyze_strategies[ANALYZE_NSTRATEGIES] = {"fresh", "previous", "drift"};
+/// A larger block or a simpler strategy is preferred when it is within this fraction of the smallest output
+#define ANALYZE_TOLERANCE 0.01
+
+/// @brief Totals of a corpus for one block size
+typedef struct AnalyzeBlockSize
+{
+    size_t nblocks;
+    size_t nstored;
+    // Bytes of the frames written by the file compressor
+    size_t frame_nbytes;
+    // Bits of the blocks encoded as one stream per file with each table strategy
+    size_t stream_nbits[ANALYZE_NSTRATEGIES];
+    double encode_seconds;
+    double decode_seconds;
+} AnalyzeBlockSize;
+
+/// @brief State of the analysis of a corpus
+typedef struct Analyze
+{
+    // Block size of the per-block report
+    size_t block_size;
+    int per_block;
+    size_t nfiles;
+    size_t nbytes;
+    // Order-0 entropy of each block at the report block size, summed in bits
+    double ideal_nbits;
+    // Jensen-Shannon divergence between consecutive blocks of a file, in bits
+    double divergence_sum;
+    double divergence_max;
+    size_t ndivergences;
+    AnalyzeBlockSize sizes[ANALYZE_NBLOCK_SIZES];
+    int status;
+} Analyze;
+
+/// The nftw callback has no argument for its state
+static Analyze *analyze_state = NULL;
+
+/// @brief Returns a monotonic time in seconds
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/// @brief Shannon entropy of a histogram in bits per character
+static double histogram_entropy(const size_t *frequencies, size_t length)
+{
+    double entropy = 0;
+    for (size_t c = 0; c < MAX_CHAR; ++c)
+    {
+        if (frequencies[c] == 0)
+            continue;
+        double p = (double)frequencies[c] / (double)length;
+        entropy -= p * log2(p);
+    }
+    return entropy;
+}
+
+/// @brief Jensen-Shannon divergence between the distributions of two blocks, 0 when they match and 1 at most
+static double histogram_divergence(const size_t *a, size_t a_length, const size_t *b, size_t b_length)
+{
+    double divergence = 0;
+    for (size_t c = 0; c < MAX_CHAR; ++c)
+    {
+        double p = (double)a[c] / (double)a_length;
+        double q = (double)b[c] / (double)b_length;
+        double m = (p + q) / 2;
+        if (p > 0)
+            divergence += p * log2(p / m) / 2;
+        if (q > 0)
+            divergence += q * log2(q / m) / 2;
+    }
+    return divergence;
+}
+
+/// @brief Reads a whole file
+/// @param path Path of the file
+/// @param data Dynamically allocated content of the file
+/// @param length Number of bytes read
+/// @return status code
+static int read_file(const char *path, char **data, size_t *length)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return STATUS_CODE_IO_FAIL;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return STATUS_CODE_IO_FAIL;
+    }
+    *length = (size_t)st.st_size;
+    *data = malloc(*length + 1);
+    if (*data == NULL)
+    {
+        close(fd);
+        return STATUS_CODE_ALLOC_FAIL;
+    }
+    size_t done = 0;
+    while (done < *length)
+    {
+        ssize_t n = read(fd, *data + done, *length - done);
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    close(fd);
+    if (done != *length)
+    {
+        free(*data);
+        *data = NULL;
+        return STATUS_CODE_IO_FAIL;
+    }
+    return 0;
+}
+
+/// @brief Encodes and decodes the blocks of a file as frames, as the file compressor does
+/// @param data Content of the file
+/// @param length Number of bytes of the file
+/// @param block_size Size of the blocks
+/// @param totals Pointer to the AnalyzeBlockSize structure receiving the totals
+/// @return status code
+static int analyze_frames(const char *data, size_t length, size_t block_size, AnalyzeBlockSize *totals)
+{
+    unsigned char *frame = malloc(HUFFMAN_FRAME_BOUND(block_size));
+    char *block = malloc(block_size);
+    if (frame == NULL || block == NULL)
+    {
+        free(frame);
+        free(block);
+        return STATUS_CODE_ALLOC_FAIL;
+    }
+    int status = 0;
+    for (size_t start = 0; start < length && status == 0; start += block_size)
+    {
+        size_t block_length = (length - start < block_size) ? length - start : block_size;
+        size_t frame_length = 0;
+        double begin = now_seconds();
+        status = huffman_encode_frame(data + start, block_length, frame, &frame_length);
+        double middle = now_seconds();
+        HuffmanFrameHeader frame_header;
+        if (status == 0)
+            status = huffman_read_frame_header(frame, &frame_header);
+        if (status == 0)
+            status = huffman_decode_frame_payload(&frame_header, frame + HUFFMAN_FRAME_HEADER_SIZE, block);
+        totals->encode_seconds += middle - begin;
+        totals->decode_seconds += now_seconds() - middle;
+        if (status == 0 && memcmp(block, data + start, block_length) != 0)
+            status = STATUS_CODE_MESSAGE_CORRUPT;
+        totals->nblocks += 1;
+        totals->nstored += (frame[0] == HUFFMAN_BLOCK_STORED);
+        totals->frame_nbytes += frame_length;
+    }
+    free(frame);
+    free(block);
+    return status;
+}
+
+/// @brief Encodes the blocks of a file as one stream with a table strategy
+/// @param data Content of the file
+/// @param length Number of bytes of the file
+/// @param block_size Size of the blocks
+/// @param mode HUFFMAN_STREAM_ mode of the stream
+/// @param nbits Incremented by the number of bits of the headers and the codes
+/// @return status code
+static int analyze_stream(const char *data, size_t length, size_t block_size, int mode, size_t *nbits)
+{
+    HuffmanStream stream;
+    huffman_stream_init(&stream, mode);
+    int status = 0;
+    if (mode == HUFFMAN_STREAM_DRIFT_TABLE)
+        status = huffman_stream_set_window(&stream, 4 * block_size, 0);
+    for (size_t start = 0; start < length && status == 0; start += block_size)
+    {
+        size_t block_length = (length - start < block_size) ? length - start : block_size;
+        EncodedMessage encoded_block = {.header = {.data = NULL, .nbits = 0, .nbytes = 0}, .message = {.data = NULL, .nbits = 0, .nbytes = 0}};
+        status = huffman_stream_encode(&stream, data + start, block_length, &encoded_block);
+        *nbits += encoded_block.header.nbytes * CHAR_BIT + encoded_block.message.nbits;
+        free_encoded_message(&encoded_block);
+    }
+    free_huffman_stream(&stream);
+    return status;
+}
+
+/// @brief Reports the blocks of a file at the report block size and adds the file to the totals
+/// @param path Path of the file
+/// @param analyze Pointer to the Analyze structure
+/// @return status code
+static int analyze_file(const char *path, Analyze *analyze)
+{
+    char *data = NULL;
+    size_t length = 0;
+    int status = read_file(path, &data, &length);
+    if (status > 0)
+        return status;
+    analyze->nfiles += 1;
+    analyze->nbytes += length;
+    size_t previous[MAX_CHAR] = {0};
+    size_t previous_length = 0;
+    unsigned char *frame = malloc(HUFFMAN_FRAME_BOUND(analyze->block_size));
+    if (frame == NULL)
+        status = STATUS_CODE_ALLOC_FAIL;
+    for (size_t start = 0; start < length && status == 0; start += analyze->block_size)
+    {
+        size_t block_length = (length - start < analyze->block_size) ? length - start : analyze->block_size;
+        size_t frequencies[MAX_CHAR] = {0};
+        size_t nsymbols = 0;
+        for (size_t i = 0; i < block_length; ++i)
+            frequencies[(unsigned char)data[start + i]] += 1;
+        for (size_t c = 0; c < MAX_CHAR; ++c)
+            nsymbols += (frequencies[c] > 0);
+        double entropy = histogram_entropy(frequencies, block_length);
+        analyze->ideal_nbits += entropy * (double)block_length;
+        double divergence = 0;
+        if (previous_length > 0)
+        {
+            divergence = histogram_divergence(previous, previous_length, frequencies, block_length);
+            analyze->divergence_sum += divergence;
+            analyze->ndivergences += 1;
+            if (divergence > analyze->divergence_max)
+                analyze->divergence_max = divergence;
+        }
+        memcpy(previous, frequencies, sizeof(previous));
+        previous_length = block_length;
+        size_t frame_length = 0;
+        status = huffman_encode_frame(data + start, block_length, frame, &frame_length);
+        if (status == 0 && analyze->per_block)
+        {
+            double achieved = (double)frame_length * CHAR_BIT / (double)block_length;
+            printf("%s,%zu,%zu,%zu,%.4f,%.4f,%.4f,%s,%.4f,%.4f\n", path, start, block_length, nsymbols, entropy, achieved,
+                   achieved - entropy, (frame[0] == HUFFMAN_BLOCK_STORED) ? "stored" : "huffman",
+                   1 - (double)frame_length / (double)block_length, divergence);
+        }
+    }
+    free(frame);
+    for (size_t s = 0; s < ANALYZE_NBLOCK_SIZES && status == 0; ++s)
+    {
+        status = analyze_frames(data, length, analyze_block_sizes[s], &analyze->sizes[s]);
+        for (int mode = 0; mode < ANALYZE_NSTRATEGIES && status == 0; ++mode)
+            status = analyze_stream(data, length, analyze_block_sizes[s], mode, &analyze->sizes[s].stream_nbits[mode]);
+    }
+    free(data);
+    return status;
+}
+
+/// @brief Analyzes each regular file found under a directory
+static int analyze_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)ftw;
+    if (type != FTW_F || !S_ISREG(st->st_mode))
+        return 0;
+    int status = analyze_file(path, analyze_state);
+    if (status > 0)
+    {
+        fprintf(stderr, "ERROR: %s failed with status code %d\n", path, status);
+        analyze_state->status = status;
+    }
+    return 0;
+}
+
+/// @brief Prints the totals of each block size and strategy, and the recommended configuration
+/// @param analyze Pointer to the Analyze structure of the corpus
+/// @param nthreads Number of online processors
+static void print_recommendation(const Analyze *analyze, unsigned int nthreads)
+{
+    double nbytes = (double)analyze->nbytes;
+    printf("\n%zu bytes in %zu files, entropy %.4f bits per byte, ideal ratio %.4f\n", analyze->nbytes, analyze->nfiles,
+           analyze->ideal_nbits / nbytes, nbytes * CHAR_BIT / analyze->ideal_nbits);
+    printf("divergence between consecutive blocks: mean %.4f, max %.4f bits\n\n",
+           (analyze->ndivergences > 0) ? analyze->divergence_sum / (double)analyze->ndivergences : 0,
+           analyze->divergence_max);
+    printf("block_size,blocks,stored_blocks,frame_ratio,fresh_ratio,previous_ratio,drift_ratio,encode_mb_s,decode_mb_s\n");
+    // Smallest output of the frames and of the streams over every block size
+    size_t best_frames = 0;
+    size_t best_stream_nbits = 0;
+    for (size_t s = 0; s < ANALYZE_NBLOCK_SIZES; ++s)
+    {
+        const AnalyzeBlockSize *size = &analyze->sizes[s];
+        printf("%zu,%zu,%zu,%.4f", analyze_block_sizes[s], size->nblocks, size->nstored, nbytes / (double)size->frame_nbytes);
+        for (int mode = 0; mode < ANALYZE_NSTRATEGIES; ++mode)
+        {
+            printf(",%.4f", nbytes * CHAR_BIT / (double)size->stream_nbits[mode]);
+            if (best_stream_nbits == 0 || size->stream_nbits[mode] < best_stream_nbits)
+                best_stream_nbits = size->stream_nbits[mode];
+        }
+        printf(",%.1f,%.1f\n", nbytes / size->encode_seconds * 1e-6, nbytes / size->decode_seconds * 1e-6);
+        if (best_frames == 0 || size->frame_nbytes < best_frames)
+            best_frames = size->frame_nbytes;
+    }
+    // The largest block within the tolerance that still gives a block to each worker: fewer headers to parse and
+    // less time per block outside the kernels, unless the files are too small to fill it
+    size_t chosen = ANALYZE_NBLOCK_SIZES;
+    for (size_t s = 0; s < ANALYZE_NBLOCK_SIZES; ++s)
+    {
+        const AnalyzeBlockSize *size = &analyze->sizes[s];
+        if ((double)size->frame_nbytes > (double)best_frames * (1 + ANALYZE_TOLERANCE))
+            continue;
+        if (chosen == ANALYZE_NBLOCK_SIZES || (size->nblocks >= nthreads && size->nblocks < analyze->sizes[chosen].nblocks))
+            chosen = s;
+    }
+    const AnalyzeBlockSize *size = &analyze->sizes[chosen];
+    unsigned int nworkers = (size->nblocks < nthreads) ? (unsigned int)size->nblocks : nthreads;
+    if (nworkers == 0)
+        nworkers = 1;
+    printf("\nrecommended: huffman -b %zu -t %u, predicted ratio %.4f, encode %.1f MB/s and decode %.1f MB/s "
+           "if the %u workers scale linearly\n",
+           analyze_block_sizes[chosen], nworkers, nbytes / (double)size->frame_nbytes,
+           nbytes / size->encode_seconds * 1e-6 * nworkers, nbytes / size->decode_seconds * 1e-6 * nworkers, nworkers);
+    if (size->nstored * 2 > size->nblocks)
+        printf("note: most blocks are stored, the data is close to random for an order-0 coder\n");
+    // Streams share tables between the blocks of a file, worth it only when they beat the frames clearly
+    if ((double)best_stream_nbits < (double)best_frames * CHAR_BIT * (1 - ANALYZE_TOLERANCE))
+    {
+        for (size_t s = 0; s < ANALYZE_NBLOCK_SIZES; ++s)
+        {
+            for (int mode = 0; mode < ANALYZE_NSTRATEGIES; ++mode)
+            {
+                if (analyze->sizes[s].stream_nbits[mode] != best_stream_nbits)
+                    continue;
+                printf("note: a stream with the %s table strategy and blocks of %zu bytes reaches ratio %.4f\n",
+                       analyze_strategies[mode], analyze_block_sizes[s], nbytes * CHAR_BIT / (double)best_stream_nbits);
+                s = ANALYZE_NBLOCK_SIZES - 1;
+                break;
+            }
+        }
+    }
+}
+
+/// @brief Prints the usage of the analysis tool
+/// @param program Name of the program
+static void print_usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-b block_size] [-q] input...\n"
+            "  Profiles files and directories and recommends the settings of the compressor\n"
+            "  -b  size of the blocks of the per-block report in bytes (default %d)\n"
+            "  -q  print the totals and the recommendation only\n",
+            program, HUFFMAN_FILE_DEFAULT_BLOCK_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+    Analyze analyze;
+    memset(&analyze, 0, sizeof(analyze));
+    analyze.block_size = HUFFMAN_FILE_DEFAULT_BLOCK_SIZE;
+    analyze.per_block = 1;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "b:qh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            analyze.block_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            analyze.per_block = 0;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc || analyze.block_size == 0)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    analyze_state = &analyze;
+    if (analyze.per_block)
+        printf("file,offset,bytes,symbols,entropy,achieved_bits,excess_bits,mode,huffman_gain,divergence\n");
+    for (int i = optind; i < argc; ++i)
+    {
+        if (nftw(argv[i], analyze_entry, 16, FTW_PHYS) != 0)
+        {
+            fprintf(stderr, "ERROR: cannot read %s\n", argv[i]);
+            analyze.status = STATUS_CODE_IO_FAIL;
+        }
+    }
+    if (analyze.nbytes == 0)
+    {
+        fprintf(stderr, "ERROR: no data to analyze\n");
+        return (analyze.status > 0) ? analyze.status : 1;
+    }
+    long nprocessors = sysconf(_SC_NPROCESSORS_ONLN);
+    print_recommendation(&analyze, (nprocessors > 0) ? (unsigned int)nprocessors : 1);
+    return analyze.status;
+}
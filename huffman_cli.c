@@ -0,0 +1,103 @@
+#define _POSIX_C_SOURCE 200809L
+#include "huffman_file.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/// @brief Prints the usage of the command line tool
+/// @param program Name of the program
+static void print_usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-c | -d] [-b block_size] [-q queue_depth] [-i pread|uring] [-t threads] [-M]\n"
+            "       [-l fast|default|max] [-T mb_s] input output\n"
+            "  -c  compress the input (default)\n"
+            "  -d  decompress the input\n"
+            "  -b  size of the blocks in bytes (default %d)\n"
+            "  -q  number of blocks in flight (default %d)\n"
+            "  -i  I/O backend, uring falls back to pread when unavailable (default uring)\n"
+            "  -t  number of workers reading and writing their own blocks (default 1)\n"
+            "  -M  decompress with writes instead of mapping the output file\n"
+            "  -l  compression level: sampled tables, one table per block or blocks split by distribution (default default)\n"
+            "  -T  compression throughput of each worker in MB per CPU second to stay above by lowering the level\n"
+            "      down from -l, 0 to keep the level (default 0)\n",
+            program, HUFFMAN_FILE_DEFAULT_BLOCK_SIZE, HUFFMAN_FILE_DEFAULT_QUEUE_DEPTH);
+}
+
+int main(int argc, char **argv)
+{
+    HuffmanFileOptions options;
+    huffman_file_default_options(&options);
+    int decompress = 0;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "cdb:q:i:t:Ml:T:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            decompress = 0;
+            break;
+        case 'd':
+            decompress = 1;
+            break;
+        case 'b':
+            options.block_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            options.queue_depth = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            if (strcmp(optarg, "pread") == 0)
+                options.io_backend = HUFFMAN_IO_PREAD;
+            else if (strcmp(optarg, "uring") == 0)
+                options.io_backend = HUFFMAN_IO_URING;
+            else
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            options.nthreads = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            options.output_mmap = 0;
+            break;
+        case 'l':
+            if (strcmp(optarg, "fast") == 0)
+                options.level = HUFFMAN_LEVEL_FAST;
+            else if (strcmp(optarg, "default") == 0)
+                options.level = HUFFMAN_LEVEL_DEFAULT;
+            else if (strcmp(optarg, "max") == 0)
+                options.level = HUFFMAN_LEVEL_MAX;
+            else
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'T':
+            options.min_mb_s = strtod(optarg, NULL);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    int status = 0;
+    if (decompress)
+        status = huffman_decompress_file(argv[optind], argv[optind + 1], &options);
+    else
+        status = huffman_compress_file(argv[optind], argv[optind + 1], &options);
+    if (status > 0)
+    {
+        fprintf(stderr, "ERROR: %s failed with status code %d\n", decompress ? "decompression" : "compression", status);
+        return status;
+    }
+    return 0;
+}
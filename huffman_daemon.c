@@ -0,0 +1,1109 @@
+#define _POSIX_C_SOURCE 200809L
+#include "huffman_daemon.h"
+#include "huffman_inline.h"
+#include "huffman_endian.h"
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+
+/// Bytes read from a connection at once, holds many small requests
+#define HUFFMAN_DAEMON_READ_BUFFER_SIZE 4096
+/// Delay after a first transient error of the I/O thread, doubled after each following one
+#define HUFFMAN_DAEMON_MIN_BACKOFF_MS 1
+#define HUFFMAN_DAEMON_MAX_BACKOFF_MS 1000
+
+/// @brief End of a response the socket did not accept yet
+typedef struct HuffmanDaemonOutput
+{
+    struct HuffmanDaemonOutput *next;
+    size_t length;
+    size_t sent;
+    unsigned char data[];
+} HuffmanDaemonOutput;
+
+/// @brief Connection of a client, read by the I/O thread and answered by the workers
+///         The socket is non-blocking: a worker sends what the socket accepts of its response and queues the rest,
+///         which the I/O thread sends when the socket becomes writable.
+typedef struct HuffmanDaemonConnection
+{
+    int fd;
+    // Serializes the responses of the workers and guards the fields below up to closed
+    pthread_mutex_t write_mutex;
+    // Responses not sent yet, in order
+    HuffmanDaemonOutput *output_head;
+    HuffmanDaemonOutput *output_tail;
+    size_t output_bytes;
+    // Set when the I/O thread closes the connection, the responses are dropped from then on
+    int closed;
+    // The I/O thread while the connection is open and each request not answered yet, under the daemon mutex
+    size_t refcount;
+    unsigned char buffer[HUFFMAN_DAEMON_READ_BUFFER_SIZE];
+    size_t buffered;
+    // Request whose payload is larger than what was buffered with its header
+    struct HuffmanDaemonRequest *current;
+    size_t payload_received;
+} HuffmanDaemonConnection;
+
+/// @brief Request waiting in the queue of the daemon
+typedef struct HuffmanDaemonRequest
+{
+    HuffmanDaemonConnection *connection;
+    unsigned char op;
+    uint32_t id;
+    uint32_t table_id;
+    size_t length;
+    unsigned char *payload;
+    int answered;
+    struct HuffmanDaemonRequest *next;
+} HuffmanDaemonRequest;
+
+/// @brief Sends a header followed by a payload, the payload may be empty
+/// @param fd Socket to send to
+/// @param header Header of HUFFMAN_DAEMON_HEADER_SIZE bytes
+/// @param payload Payload to send after the header
+/// @param length Number of bytes of the payload
+/// @return status code
+static int send_message(int fd, const unsigned char *header, const void *payload, size_t length)
+{
+    struct iovec iov[2] = {
+        {.iov_base = (void *)header, .iov_len = HUFFMAN_DAEMON_HEADER_SIZE},
+        {.iov_base = (void *)payload, .iov_len = length},
+    };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = (length > 0) ? 2 : 1;
+    while (message.msg_iovlen > 0)
+    {
+        ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return STATUS_CODE_DAEMON_FAIL;
+        // Skip what has been sent
+        while (message.msg_iovlen > 0 && (size_t)sent >= message.msg_iov[0].iov_len)
+        {
+            sent -= (ssize_t)message.msg_iov[0].iov_len;
+            message.msg_iov += 1;
+            message.msg_iovlen -= 1;
+        }
+        if (message.msg_iovlen > 0)
+        {
+            message.msg_iov[0].iov_base = (unsigned char *)message.msg_iov[0].iov_base + sent;
+            message.msg_iov[0].iov_len -= (size_t)sent;
+        }
+    }
+    return 0;
+}
+
+/// @brief Sends what a socket accepts of a header followed by a payload, without blocking
+/// @param fd Socket to send to
+/// @param header Header of HUFFMAN_DAEMON_HEADER_SIZE bytes
+/// @param payload Payload to send after the header
+/// @param length Number of bytes of the payload
+/// @return number of bytes sent, all of them if the client went away since nothing more can be sent to it
+static size_t send_available(int fd, const unsigned char *header, const void *payload, size_t length)
+{
+    struct iovec iov[2] = {
+        {.iov_base = (void *)header, .iov_len = HUFFMAN_DAEMON_HEADER_SIZE},
+        {.iov_base = (void *)payload, .iov_len = length},
+    };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = (length > 0) ? 2 : 1;
+    for (;;)
+    {
+        ssize_t sent = sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        // A client that went away is noticed by the I/O thread
+        return (sent < 0) ? HUFFMAN_DAEMON_HEADER_SIZE + length : (size_t)sent;
+    }
+}
+
+/// @brief Sends what a socket accepts of the responses queued on a connection, without blocking
+/// @param connection Pointer to the connection
+/// @return status code, STATUS_CODE_DAEMON_FAIL if the client went away
+static int flush_connection(HuffmanDaemonConnection *connection)
+{
+    int status = 0;
+    pthread_mutex_lock(&connection->write_mutex);
+    while (connection->output_head != NULL)
+    {
+        HuffmanDaemonOutput *output = connection->output_head;
+        ssize_t sent = send(connection->fd, output->data + output->sent, output->length - output->sent,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent <= 0)
+        {
+            status = STATUS_CODE_DAEMON_FAIL;
+            break;
+        }
+        output->sent += (size_t)sent;
+        connection->output_bytes -= (size_t)sent;
+        if (output->sent < output->length)
+            continue;
+        connection->output_head = output->next;
+        if (connection->output_head == NULL)
+            connection->output_tail = NULL;
+        free(output);
+    }
+    pthread_mutex_unlock(&connection->write_mutex);
+    return status;
+}
+
+/// @brief Frees the responses not sent on a connection, the caller holds its write_mutex or the last reference
+/// @param connection Pointer to the connection
+static void drop_connection_output(HuffmanDaemonConnection *connection)
+{
+    while (connection->output_head != NULL)
+    {
+        HuffmanDaemonOutput *next = connection->output_head->next;
+        free(connection->output_head);
+        connection->output_head = next;
+    }
+    connection->output_tail = NULL;
+    connection->output_bytes = 0;
+}
+
+/// @brief Reads exactly the given number of bytes from a socket
+/// @return status code, STATUS_CODE_DAEMON_FAIL if the connection is closed before
+static int receive_all(int fd, void *data, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t received = read(fd, (unsigned char *)data + done, size - done);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return STATUS_CODE_DAEMON_FAIL;
+        done += (size_t)received;
+    }
+    return 0;
+}
+
+/// @brief Wakes the I/O thread up, a wake up already pending in the pipe is enough
+/// @param daemon Pointer to the HuffmanDaemon structure
+static void wake_daemon_io(HuffmanDaemon *daemon)
+{
+    ssize_t written = write(daemon->wake_fds[1], "", 1);
+    (void)written;
+}
+
+/// @brief Empties the wake up pipe of the I/O thread
+/// @param daemon Pointer to the HuffmanDaemon structure
+/// @return 1 if the daemon is stopping
+static int drain_daemon_wake(HuffmanDaemon *daemon)
+{
+    char buffer[64];
+    while (read(daemon->wake_fds[0], buffer, sizeof(buffer)) > 0)
+        ;
+    pthread_mutex_lock(&daemon->mutex);
+    int stopping = daemon->stopping;
+    pthread_mutex_unlock(&daemon->mutex);
+    return stopping;
+}
+
+/// @brief Subtracts the payload of a freed request from the bytes in flight
+///         The I/O thread is woken up when this lets it read requests again.
+/// @param daemon Pointer to the HuffmanDaemon structure
+/// @param length Number of bytes of the payload
+static void release_inflight(HuffmanDaemon *daemon, size_t length)
+{
+    pthread_mutex_lock(&daemon->mutex);
+    int blocked = (daemon->inflight_bytes >= daemon->options.max_inflight_bytes);
+    daemon->inflight_bytes -= length;
+    int resume = blocked && daemon->inflight_bytes < daemon->options.max_inflight_bytes;
+    pthread_mutex_unlock(&daemon->mutex);
+    if (resume)
+        wake_daemon_io(daemon);
+}
+
+/// @brief Drops a reference to a connection, closes and frees it with the last one
+/// @param daemon Pointer to the HuffmanDaemon structure
+/// @param connection Pointer to the connection
+static void release_connection(HuffmanDaemon *daemon, HuffmanDaemonConnection *connection)
+{
+    pthread_mutex_lock(&daemon->mutex);
+    size_t refcount = --connection->refcount;
+    pthread_mutex_unlock(&daemon->mutex);
+    if (refcount > 0)
+        return;
+    // A request still being received does not hold a reference to its connection
+    if (connection->current != NULL)
+    {
+        release_inflight(daemon, connection->current->length);
+        free(connection->current->payload);
+        free(connection->current);
+    }
+    drop_connection_output(connection);
+    close(connection->fd);
+    pthread_mutex_destroy(&connection->write_mutex);
+    free(connection);
+}
+
+/// @brief Frees a queued request and releases its connection
+/// @param daemon Pointer to the HuffmanDaemon structure
+/// @param request Pointer to the request
+static void free_huffman_daemon_request(HuffmanDaemon *daemon, HuffmanDaemonRequest *request)
+{
+    release_inflight(daemon, request->length);
+    release_connection(daemon, request->connection);
+    free(request->payload);
+    free(request);
+}
+
+/// @brief Sends the response to a request, the part the socket does not accept is queued for the I/O thread
+///         A worker never blocks on a slow client: behind a queued response, the next ones are queued whole.
+/// @param daemon Pointer to the HuffmanDaemon structure
+/// @param request Pointer to the request
+/// @param status Status code of the request, 0 on success
+/// @param result Result sent when the status is 0
+/// @param length Number of bytes of the result
+static void answer_request(HuffmanDaemon *daemon, HuffmanDaemonRequest *request, int status, const void *result,
+                           size_t length)
+{
+    unsigned char header[HUFFMAN_DAEMON_HEADER_SIZE] = {0};
+    if (status > 0)
+        length = 0;
+    header[0] = (unsigned char)status;
+    store_le32(header + 4, request->id);
+    store_le32(header + 12, (uint32_t)length);
+    HuffmanDaemonConnection *connection = request->connection;
+    size_t total = HUFFMAN_DAEMON_HEADER_SIZE + length;
+    int queued = 0;
+    pthread_mutex_lock(&connection->write_mutex);
+    size_t sent = total;
+    if (!connection->closed)
+        sent = (connection->output_head == NULL) ? send_available(connection->fd, header, result, length) : 0;
+    if (sent < total)
+    {
+        HuffmanDaemonOutput *output = malloc(sizeof(HuffmanDaemonOutput) + total - sent);
+        if (output == NULL)
+        {
+            // The response is lost: disconnect the client rather than leave it waiting
+            shutdown(connection->fd, SHUT_RDWR);
+        }
+        else
+        {
+            size_t offset = 0;
+            if (sent < HUFFMAN_DAEMON_HEADER_SIZE)
+            {
+                memcpy(output->data, header + sent, HUFFMAN_DAEMON_HEADER_SIZE - sent);
+                offset = HUFFMAN_DAEMON_HEADER_SIZE - sent;
+            }
+            size_t result_sent = (sent > HUFFMAN_DAEMON_HEADER_SIZE) ? sent - HUFFMAN_DAEMON_HEADER_SIZE : 0;
+            if (length > result_sent)
+                memcpy(output->data + offset, (const unsigned char *)result + result_sent, length - result_sent);
+            output->next = NULL;
+            output->length = total - sent;
+            output->sent = 0;
+            if (connection->output_tail != NULL)
+                connection->output_tail->next = output;
+            else
+                connection->output_head = output;
+            connection->output_tail = output;
+            connection->output_bytes += output->length;
+            queued = 1;
+        }
+    }
+    pthread_mutex_unlock(&connection->write_mutex);
+    if (queued)
+        wake_daemon_io(daemon);
+    request->answered = 1;
+}
+
+/// @brief Parses the requests available in the buffer of a connection
+/// @param connection Pointer to the connection
+/// @param head First request of the list receiving the complete requests
+/// @param tail Last request of the list
+/// @param nbytes Incremented by the size of the payloads allocated
+/// @return status code, STATUS_CODE_PROTOCOL_FAIL if a header is invalid
+static int parse_requests(HuffmanDaemonConnection *connection, HuffmanDaemonRequest **head, HuffmanDaemonRequest **tail,
+                          size_t *nbytes)
+{
+    while (connection->current == NULL && connection->buffered >= HUFFMAN_DAEMON_HEADER_SIZE)
+    {
+        const unsigned char *header = connection->buffer;
+        size_t length = load_le32(header + 12);
+        if ((header[0] != HUFFMAN_DAEMON_COMPRESS && header[0] != HUFFMAN_DAEMON_DECOMPRESS) ||
+            length > HUFFMAN_DAEMON_MAX_PAYLOAD)
+            return STATUS_CODE_PROTOCOL_FAIL;
+        HuffmanDaemonRequest *request = malloc(sizeof(HuffmanDaemonRequest));
+        unsigned char *payload = malloc(length > 0 ? length : 1);
+        if (request == NULL || payload == NULL)
+        {
+            free(request);
+            free(payload);
+            return STATUS_CODE_ALLOC_FAIL;
+        }
+        *nbytes += length;
+        request->connection = connection;
+        request->op = header[0];
+        request->id = load_le32(header + 4);
+        request->table_id = load_le32(header + 8);
+        request->length = length;
+        request->payload = payload;
+        request->answered = 0;
+        request->next = NULL;
+        size_t available = connection->buffered - HUFFMAN_DAEMON_HEADER_SIZE;
+        size_t taken = (available < length) ? available : length;
+        memcpy(payload, connection->buffer + HUFFMAN_DAEMON_HEADER_SIZE, taken);
+        size_t consumed = HUFFMAN_DAEMON_HEADER_SIZE + taken;
+        memmove(connection->buffer, connection->buffer + consumed, connection->buffered - consumed);
+        connection->buffered -= consumed;
+        if (taken < length)
+        {
+            // The rest of the payload is read straight into the request
+            connection->current = request;
+            connection->payload_received = taken;
+            break;
+        }
+        if (*tail != NULL)
+            (*tail)->next = request;
+        else
+            *head = request;
+        *tail = request;
+    }
+    return 0;
+}
+
+/// @brief Reads what a readable connection has to offer, without blocking
+/// @param connection Pointer to the connection
+/// @param head First request of the list receiving the complete requests
+/// @param tail Last request of the list
+/// @param nbytes Incremented by the size of the payloads allocated
+/// @return status code, non zero when the connection must be closed
+static int read_connection(HuffmanDaemonConnection *connection, HuffmanDaemonRequest **head, HuffmanDaemonRequest **tail,
+                           size_t *nbytes)
+{
+    HuffmanDaemonRequest *current = connection->current;
+    unsigned char *data = connection->buffer + connection->buffered;
+    size_t size = HUFFMAN_DAEMON_READ_BUFFER_SIZE - connection->buffered;
+    if (current != NULL)
+    {
+        data = current->payload + connection->payload_received;
+        size = current->length - connection->payload_received;
+    }
+    ssize_t received = read(connection->fd, data, size);
+    if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (received <= 0)
+        return STATUS_CODE_DAEMON_FAIL;
+    if (current == NULL)
+    {
+        connection->buffered += (size_t)received;
+        return parse_requests(connection, head, tail, nbytes);
+    }
+    connection->payload_received += (size_t)received;
+    if (connection->payload_received == current->length)
+    {
+        connection->current = NULL;
+        if (*tail != NULL)
+            (*tail)->next = current;
+        else
+            *head = current;
+        *tail = current;
+    }
+    return 0;
+}
+
+/// @brief Accepts a new connection
+/// @param daemon Pointer to the HuffmanDaemon structure
+/// @return status code, errno tells why a connection could not be accepted
+static int accept_connection(HuffmanDaemon *daemon)
+{
+    int fd = accept(daemon->listen_fd, NULL, NULL);
+    if (fd < 0)
+        return (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) ? 0 : STATUS_CODE_DAEMON_FAIL;
+    HuffmanDaemonConnection *connection = malloc(sizeof(HuffmanDaemonConnection));
+    HuffmanDaemonConnection **connections = realloc(daemon->connections,
+                                                    (daemon->nconnections + 1) * sizeof(HuffmanDaemonConnection *));
+    if (connections != NULL)
+        daemon->connections = connections;
+    if (connection == NULL || connections == NULL)
+    {
+        free(connection);
+        close(fd);
+        errno = ENOMEM;
+        return STATUS_CODE_ALLOC_FAIL;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+    {
+        free(connection);
+        close(fd);
+        return STATUS_CODE_DAEMON_FAIL;
+    }
+    connection->fd = fd;
+    pthread_mutex_init(&connection->write_mutex, NULL);
+    connection->output_head = NULL;
+    connection->output_tail = NULL;
+    connection->output_bytes = 0;
+    connection->closed = 0;
+    connection->refcount = 1;
+    connection->buffered = 0;
+    connection->current = NULL;
+    connection->payload_received = 0;
+    daemon->connections[daemon->nconnections++] = connection;
+    return 0;
+}
+
+/// @brief Monotonic clock in milliseconds
+static int64_t daemon_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/// @brief Logs a transient error of the I/O thread and returns the delay before retrying
+///         The delay doubles with each error in a row, from HUFFMAN_DAEMON_MIN_BACKOFF_MS up to HUFFMAN_DAEMON_MAX_BACKOFF_MS.
+/// @param backoff_ms Delay after the previous error in a row, 0 after a success
+/// @param what Name of the call that failed
+/// @param error errno of the call
+/// @return delay in milliseconds
+static int daemon_backoff(int backoff_ms, const char *what, int error)
+{
+    if (backoff_ms < HUFFMAN_DAEMON_MIN_BACKOFF_MS)
+        backoff_ms = HUFFMAN_DAEMON_MIN_BACKOFF_MS;
+    else if (backoff_ms < HUFFMAN_DAEMON_MAX_BACKOFF_MS / 2)
+        backoff_ms *= 2;
+    else
+        backoff_ms = HUFFMAN_DAEMON_MAX_BACKOFF_MS;
+    fprintf(stderr, "huffmand: %s: %s, retrying in %d ms\n", what, strerror(error), backoff_ms);
+    return backoff_ms;
+}
+
+/// @brief Sleeps after a transient error, waking up early when the daemon stops
+/// @param daemon Pointer to the HuffmanDaemon structure
+/// @param backoff_ms Delay in milliseconds
+/// @return 1 if the daemon is stopping
+static int wait_daemon_backoff(HuffmanDaemon *daemon, int backoff_ms)
+{
+    struct pollfd wake = {.fd = daemon->wake_fds[0], .events = POLLIN, .revents = 0};
+    return poll(&wake, 1, backoff_ms) > 0 && drain_daemon_wake(daemon);
+}
+
+/// @brief Closes a connection on the I/O thread side, its responses not sent yet are dropped
+/// @param connection Pointer to the connection
+static void close_connection_output(HuffmanDaemonConnection *connection)
+{
+    pthread_mutex_lock(&connection->write_mutex);
+    connection->closed = 1;
+    drop_connection_output(connection);
+    pthread_mutex_unlock(&connection->write_mutex);
+}
+
+/// @brief Accepts the clients, reads their requests, queues them for the workers and sends the queued responses
+///         The requests read from every ready connection in one round are queued together, so that a worker
+///         takes requests of several clients in the same batch. A connection is no longer read while more than
+///         max_output_bytes of responses wait on it, and no new request is read while the payloads of the requests
+///         not answered yet exceed max_inflight_bytes, which one read can overshoot by the requests it parses.
+///         The loop only ends through wake_fds: a failure
+///         to accept (out of file descriptors or memory), to grow the arrays or to poll is logged and retried
+///         after a delay, the listening socket being left out of the poll while accepting backs off.
+static void *run_daemon_io(void *arg)
+{
+    HuffmanDaemon *daemon = arg;
+    struct pollfd *fds = NULL;
+    HuffmanDaemonConnection **closed = NULL;
+    size_t fds_capacity = 0;
+    int backoff_ms = 0;
+    int accept_backoff_ms = 0;
+    int64_t accept_resume_ms = 0;
+    for (;;)
+    {
+        size_t nfds = daemon->nconnections + 2;
+        if (nfds > fds_capacity)
+        {
+            struct pollfd *new_fds = realloc(fds, nfds * sizeof(struct pollfd));
+            if (new_fds != NULL)
+                fds = new_fds;
+            HuffmanDaemonConnection **new_closed = realloc(closed, nfds * sizeof(HuffmanDaemonConnection *));
+            if (new_closed != NULL)
+                closed = new_closed;
+            if (new_fds == NULL || new_closed == NULL)
+            {
+                backoff_ms = daemon_backoff(backoff_ms, "realloc", ENOMEM);
+                if (wait_daemon_backoff(daemon, backoff_ms))
+                    break;
+                continue;
+            }
+            fds_capacity = nfds;
+        }
+        int timeout_ms = -1;
+        fds[0].fd = daemon->wake_fds[0];
+        fds[1].fd = daemon->listen_fd;
+        if (accept_resume_ms != 0)
+        {
+            int64_t remaining_ms = accept_resume_ms - daemon_now_ms();
+            if (remaining_ms > 0)
+            {
+                // A negative descriptor is skipped by poll
+                fds[1].fd = -1;
+                timeout_ms = (int)remaining_ms;
+            }
+            else
+            {
+                accept_resume_ms = 0;
+            }
+        }
+        pthread_mutex_lock(&daemon->mutex);
+        int reading = (daemon->inflight_bytes < daemon->options.max_inflight_bytes);
+        pthread_mutex_unlock(&daemon->mutex);
+        for (size_t i = 0; i < nfds; ++i)
+        {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        for (size_t i = 0; i < daemon->nconnections; ++i)
+        {
+            HuffmanDaemonConnection *connection = daemon->connections[i];
+            pthread_mutex_lock(&connection->write_mutex);
+            size_t output_bytes = connection->output_bytes;
+            pthread_mutex_unlock(&connection->write_mutex);
+            fds[i + 2].fd = connection->fd;
+            // The rest of a payload being received goes to a buffer already counted in flight
+            int receiving = (reading || connection->current != NULL);
+            fds[i + 2].events = (receiving && output_bytes < daemon->options.max_output_bytes) ? POLLIN : 0;
+            if (output_bytes > 0)
+                fds[i + 2].events |= POLLOUT;
+        }
+        if (poll(fds, nfds, timeout_ms) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            backoff_ms = daemon_backoff(backoff_ms, "poll", errno);
+            if (wait_daemon_backoff(daemon, backoff_ms))
+                break;
+            continue;
+        }
+        backoff_ms = 0;
+        if (fds[0].revents != 0 && drain_daemon_wake(daemon))
+            break;
+        HuffmanDaemonRequest *head = NULL;
+        HuffmanDaemonRequest *tail = NULL;
+        size_t nbytes = 0;
+        size_t nclosed = 0;
+        // Connections are removed by moving the last one in their place, walk backwards
+        for (size_t i = nfds - 2; i-- > 0;)
+        {
+            short revents = fds[i + 2].revents;
+            if (revents == 0)
+                continue;
+            HuffmanDaemonConnection *connection = daemon->connections[i];
+            int status = 0;
+            if (revents & POLLOUT)
+                status = flush_connection(connection);
+            if (status == 0 && (fds[i + 2].events & POLLIN) && (revents & (POLLIN | POLLHUP | POLLERR)))
+                status = read_connection(connection, &head, &tail, &nbytes);
+            else if (status == 0 && (revents & (POLLHUP | POLLERR)))
+                // Gone while it is not read, nothing can be sent to it any more
+                status = STATUS_CODE_DAEMON_FAIL;
+            if (status != 0)
+            {
+                close_connection_output(connection);
+                daemon->connections[i] = daemon->connections[--daemon->nconnections];
+                closed[nclosed++] = connection;
+            }
+        }
+        if (head != NULL || nbytes > 0)
+        {
+            pthread_mutex_lock(&daemon->mutex);
+            daemon->inflight_bytes += nbytes;
+            for (HuffmanDaemonRequest *request = head; request != NULL; request = request->next)
+                request->connection->refcount += 1;
+            if (daemon->queue_tail != NULL)
+                daemon->queue_tail->next = head;
+            else
+                daemon->queue_head = head;
+            daemon->queue_tail = tail;
+            if (head != NULL)
+                pthread_cond_broadcast(&daemon->available);
+            pthread_mutex_unlock(&daemon->mutex);
+        }
+        // Released once the requests read before the end of the connection hold their reference
+        for (size_t i = 0; i < nclosed; ++i)
+            release_connection(daemon, closed[i]);
+        if (fds[1].revents != 0)
+        {
+            if (accept_connection(daemon) > 0)
+            {
+                accept_backoff_ms = daemon_backoff(accept_backoff_ms, "accept", errno);
+                accept_resume_ms = daemon_now_ms() + accept_backoff_ms;
+            }
+            else
+            {
+                accept_backoff_ms = 0;
+            }
+        }
+    }
+    free(closed);
+    free(fds);
+    // The connections stay alive until the requests still queued on them are freed
+    for (size_t i = 0; i < daemon->nconnections; ++i)
+    {
+        close_connection_output(daemon->connections[i]);
+        release_connection(daemon, daemon->connections[i]);
+    }
+    daemon->nconnections = 0;
+    return NULL;
+}
+
+/// @brief Returns the cached table selected by a table id, or NULL
+static const HuffmanTable *daemon_table(const HuffmanDaemon *daemon, uint32_t table_id)
+{
+    if (table_id == 0 || table_id > daemon->options.ntables)
+        return NULL;
+    return daemon->options.tables[table_id - 1];
+}
+
+/// @brief Checks the payload of a request decoded with a cached table: [nbits (4)][codes]
+static int check_table_codes(const HuffmanDaemonRequest *request, size_t *nbits)
+{
+    if (request->length < 4)
+        return STATUS_CODE_PROTOCOL_FAIL;
+    *nbits = load_le32(request->payload);
+    if (*nbits > (request->length - 4) * CHAR_BIT)
+        return STATUS_CODE_PROTOCOL_FAIL;
+    return 0;
+}
+
+/// @brief Decodes the requests of a batch encoded with the same cached table in one call
+///         The codes of the requests are laid end to end and decoded by huffman_table_decode_records,
+///         which interleaves the records. A batch with a corrupt request is left to process_request.
+/// @param daemon Pointer to the HuffmanDaemon structure
+/// @param batch First request of the batch
+/// @param table_id Table id of the requests to decode
+static void decode_table_group(HuffmanDaemon *daemon, HuffmanDaemonRequest *batch, uint32_t table_id)
+{
+    const HuffmanTable *table = daemon_table(daemon, table_id);
+    size_t count = 0;
+    size_t nbytes = 0;
+    for (HuffmanDaemonRequest *request = batch; request != NULL; request = request->next)
+    {
+        size_t nbits = 0;
+        if (request->op != HUFFMAN_DAEMON_DECOMPRESS || request->table_id != table_id || request->answered)
+            continue;
+        if (check_table_codes(request, &nbits) > 0)
+            return;
+        count += 1;
+        nbytes += request->length - 4;
+    }
+    unsigned char *data = malloc(nbytes > 0 ? nbytes : 1);
+    HuffmanRecord *records = malloc(count * sizeof(HuffmanRecord));
+    size_t *decoded_offsets = malloc((count + 1) * sizeof(size_t));
+    char *decoded = NULL;
+    int status = (data == NULL || records == NULL || decoded_offsets == NULL) ? STATUS_CODE_ALLOC_FAIL : 0;
+    size_t offset = 0;
+    size_t i = 0;
+    for (HuffmanDaemonRequest *request = batch; request != NULL && status == 0; request = request->next)
+    {
+        if (request->op != HUFFMAN_DAEMON_DECOMPRESS || request->table_id != table_id || request->answered)
+            continue;
+        check_table_codes(request, &records[i].nbits);
+        records[i].offset = offset * CHAR_BIT;
+        memcpy(data + offset, request->payload + 4, request->length - 4);
+        offset += request->length - 4;
+        i += 1;
+    }
+    if (status == 0)
+    {
+        size_t capacity = huffman_records_capacity(table, records, count);
+        decoded = malloc(capacity > 0 ? capacity : 1);
+        status = (decoded == NULL) ? STATUS_CODE_ALLOC_FAIL : 0;
+    }
+    if (status == 0)
+        status = huffman_table_decode_records(table, data, nbytes, records, count, decoded, decoded_offsets);
+    i = 0;
+    for (HuffmanDaemonRequest *request = batch; request != NULL && status == 0; request = request->next)
+    {
+        if (request->op != HUFFMAN_DAEMON_DECOMPRESS || request->table_id != table_id || request->answered)
+            continue;
+        answer_request(daemon, request, 0, decoded + decoded_offsets[i], decoded_offsets[i + 1] - decoded_offsets[i]);
+        i += 1;
+    }
+    free(decoded);
+    free(decoded_offsets);
+    free(records);
+    free(data);
+}
+
+/// @brief Encodes the requests of a batch with the same cached table into one buffer
+///         Each request gets its own byte-aligned range sized for the longest code, filled by the inlined encoding
+///         kernel, so that the group costs one allocation instead of two per request. A request with a character
+///         missing from the table is answered with its error. If the buffer cannot be allocated, the requests are
+///         left to process_request.
+/// @param daemon Pointer to the HuffmanDaemon structure
+/// @param batch First request of the batch
+/// @param table_id Table id of the requests to encode
+static void encode_table_group(HuffmanDaemon *daemon, HuffmanDaemonRequest *batch, uint32_t table_id)
+{
+    const HuffmanTable *table = daemon_table(daemon, table_id);
+    size_t capacity = 0;
+    for (HuffmanDaemonRequest *request = batch; request != NULL; request = request->next)
+    {
+        if (request->op != HUFFMAN_DAEMON_COMPRESS || request->table_id != table_id || request->answered)
+            continue;
+        capacity += 4 + (request->length * table->max_nbits + CHAR_BIT - 1) / CHAR_BIT;
+    }
+    unsigned char *data = malloc(capacity > 0 ? capacity : 1);
+    if (data == NULL)
+        return;
+    size_t offset = 0;
+    for (HuffmanDaemonRequest *request = batch; request != NULL; request = request->next)
+    {
+        if (request->op != HUFFMAN_DAEMON_COMPRESS || request->table_id != table_id || request->answered)
+            continue;
+        // [nbits (4)][codes], no header since the client knows the table
+        unsigned char *result = data + offset;
+        size_t nbits = 0;
+        int status = huffman_inline_encode(table, (const char *)request->payload, request->length, result + 4, &nbits, NULL);
+        store_le32(result, (uint32_t)nbits);
+        answer_request(daemon, request, status, result, 4 + (nbits + CHAR_BIT - 1) / CHAR_BIT);
+        offset += 4 + (request->length * table->max_nbits + CHAR_BIT - 1) / CHAR_BIT;
+    }
+    free(data);
+}
+
+/// @brief Encodes or decodes one request and sends its response
+/// @param daemon Pointer to the HuffmanDaemon structure
+/// @param request Pointer to the request
+static void process_request(HuffmanDaemon *daemon, HuffmanDaemonRequest *request)
+{
+    const HuffmanTable *table = daemon_table(daemon, request->table_id);
+    unsigned char *result = NULL;
+    size_t length = 0;
+    int status = 0;
+    if (request->table_id != 0 && table == NULL)
+    {
+        status = STATUS_CODE_INDEX_OUT_OF_RANGE;
+    }
+    else if (request->op == HUFFMAN_DAEMON_COMPRESS && table == NULL)
+    {
+        result = malloc(HUFFMAN_FRAME_BOUND(request->length));
+        status = (result == NULL) ? STATUS_CODE_ALLOC_FAIL
+                                  : huffman_encode_frame((const char *)request->payload, request->length, result, &length);
+    }
+    else if (request->op == HUFFMAN_DAEMON_DECOMPRESS && table == NULL)
+    {
+        HuffmanFrameHeader frame_header;
+        if (request->length < HUFFMAN_FRAME_HEADER_SIZE)
+            status = STATUS_CODE_PROTOCOL_FAIL;
+        if (status == 0)
+            status = huffman_read_frame_header(request->payload, &frame_header);
+        if (status == 0 && (HUFFMAN_FRAME_HEADER_SIZE + (size_t)frame_header.payload_length != request->length ||
+                            frame_header.raw_length > HUFFMAN_DAEMON_MAX_PAYLOAD))
+            status = STATUS_CODE_PROTOCOL_FAIL;
+        if (status == 0)
+        {
+            length = frame_header.raw_length;
+            result = malloc(length > 0 ? length : 1);
+            status = (result == NULL) ? STATUS_CODE_ALLOC_FAIL
+                                      : huffman_decode_frame_payload(&frame_header, request->payload + HUFFMAN_FRAME_HEADER_SIZE,
+                                                                     (char *)result);
+        }
+    }
+    else if (request->op == HUFFMAN_DAEMON_COMPRESS)
+    {
+        // [nbits (4)][codes], no header since the client knows the table
+        BitMessage encoded = {.data = NULL, .nbits = 0, .nbytes = 0};
+        status = huffman_table_encode(table, (const char *)request->payload, request->length, &encoded);
+        if (status == 0)
+        {
+            length = 4 + encoded.nbytes;
+            result = malloc(length);
+            status = (result == NULL) ? STATUS_CODE_ALLOC_FAIL : 0;
+        }
+        if (status == 0)
+        {
+            store_le32(result, (uint32_t)encoded.nbits);
+            if (encoded.nbytes > 0)
+                memcpy(result + 4, encoded.data, encoded.nbytes);
+        }
+        free(encoded.data);
+    }
+    else
+    {
+        HuffmanRecord record = {.offset = 0, .nbits = 0};
+        size_t decoded_offsets[2] = {0, 0};
+        status = check_table_codes(request, &record.nbits);
+        if (status == 0)
+        {
+            size_t capacity = huffman_records_capacity(table, &record, 1);
+            result = malloc(capacity > 0 ? capacity : 1);
+            status = (result == NULL) ? STATUS_CODE_ALLOC_FAIL : 0;
+        }
+        if (status == 0)
+            status = huffman_table_decode_records(table, request->payload + 4, request->length - 4, &record, 1,
+                                                  (char *)result, decoded_offsets);
+        length = decoded_offsets[1];
+    }
+    answer_request(daemon, request, status, result, length);
+    free(result);
+}
+
+/// @brief Takes batches of requests from the queue and answers them
+///         The requests of a batch using the same cached table are encoded or decoded together, frames one by one.
+static void *run_daemon_worker(void *arg)
+{
+    HuffmanDaemon *daemon = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&daemon->mutex);
+        while (daemon->queue_head == NULL && !daemon->stopping)
+            pthread_cond_wait(&daemon->available, &daemon->mutex);
+        if (daemon->stopping)
+        {
+            pthread_mutex_unlock(&daemon->mutex);
+            break;
+        }
+        HuffmanDaemonRequest *batch = daemon->queue_head;
+        HuffmanDaemonRequest *last = batch;
+        size_t count = 1;
+        while (last->next != NULL && count < daemon->options.max_batch)
+        {
+            last = last->next;
+            count += 1;
+        }
+        daemon->queue_head = last->next;
+        if (daemon->queue_head == NULL)
+            daemon->queue_tail = NULL;
+        last->next = NULL;
+        daemon->nrequests += count;
+        daemon->nbatches += 1;
+        pthread_mutex_unlock(&daemon->mutex);
+        for (HuffmanDaemonRequest *request = batch; request != NULL; request = request->next)
+        {
+            if (!request->answered && request->op == HUFFMAN_DAEMON_COMPRESS && daemon_table(daemon, request->table_id) != NULL)
+                encode_table_group(daemon, batch, request->table_id);
+            if (!request->answered && request->op == HUFFMAN_DAEMON_DECOMPRESS && daemon_table(daemon, request->table_id) != NULL)
+                decode_table_group(daemon, batch, request->table_id);
+            if (!request->answered)
+                process_request(daemon, request);
+        }
+        while (batch != NULL)
+        {
+            HuffmanDaemonRequest *next = batch->next;
+            free_huffman_daemon_request(daemon, batch);
+            batch = next;
+        }
+    }
+    return NULL;
+}
+
+/// @brief Sets the default options: HUFFMAN_DAEMON_DEFAULT_MAX_BATCH requests per batch, 4 workers, no cached table,
+///         HUFFMAN_DAEMON_DEFAULT_MAX_OUTPUT_BYTES queued per connection and HUFFMAN_DAEMON_DEFAULT_MAX_INFLIGHT_BYTES in flight
+/// @param options Pointer to the HuffmanDaemonOptions structure to fill
+/// @param socket_path Path of the Unix domain socket
+void huffman_daemon_default_options(HuffmanDaemonOptions *options, const char *socket_path)
+{
+    options->socket_path = socket_path;
+    options->nthreads = 4;
+    options->max_batch = HUFFMAN_DAEMON_DEFAULT_MAX_BATCH;
+    options->max_output_bytes = HUFFMAN_DAEMON_DEFAULT_MAX_OUTPUT_BYTES;
+    options->max_inflight_bytes = HUFFMAN_DAEMON_DEFAULT_MAX_INFLIGHT_BYTES;
+    options->tables = NULL;
+    options->ntables = 0;
+}
+
+/// @brief Creates the socket and starts the I/O thread and the workers
+///         A stale socket left at the path is removed, any other file makes the creation fail.
+/// @param daemon Pointer to the HuffmanDaemon structure to initialize
+/// @param options Pointer to the HuffmanDaemonOptions structure, the cached tables must outlive the daemon
+/// @return status code
+int create_huffman_daemon(HuffmanDaemon *daemon, const HuffmanDaemonOptions *options)
+{
+    memset(daemon, 0, sizeof(HuffmanDaemon));
+    daemon->options = *options;
+    if (daemon->options.nthreads == 0)
+        daemon->options.nthreads = 1;
+    if (daemon->options.max_batch == 0)
+        daemon->options.max_batch = 1;
+    if (daemon->options.max_output_bytes == 0)
+        daemon->options.max_output_bytes = 1;
+    if (daemon->options.max_inflight_bytes == 0)
+        daemon->options.max_inflight_bytes = 1;
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(options->socket_path) >= sizeof(address.sun_path))
+        return STATUS_CODE_DAEMON_FAIL;
+    strcpy(address.sun_path, options->socket_path);
+    struct stat socket_stat;
+    if (stat(options->socket_path, &socket_stat) == 0 && S_ISSOCK(socket_stat.st_mode))
+        unlink(options->socket_path);
+    daemon->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (daemon->listen_fd < 0)
+        return STATUS_CODE_DAEMON_FAIL;
+    if (bind(daemon->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(daemon->listen_fd, SOMAXCONN) != 0 || pipe(daemon->wake_fds) != 0)
+    {
+        close(daemon->listen_fd);
+        return STATUS_CODE_DAEMON_FAIL;
+    }
+    // The workers never block on a full pipe, the wake up already pending in it is enough
+    for (int i = 0; i < 2; ++i)
+        fcntl(daemon->wake_fds[i], F_SETFL, fcntl(daemon->wake_fds[i], F_GETFL) | O_NONBLOCK);
+    daemon->workers = malloc(daemon->options.nthreads * sizeof(pthread_t));
+    if (daemon->workers == NULL)
+    {
+        close(daemon->listen_fd);
+        close(daemon->wake_fds[0]);
+        close(daemon->wake_fds[1]);
+        unlink(options->socket_path);
+        return STATUS_CODE_ALLOC_FAIL;
+    }
+    pthread_mutex_init(&daemon->mutex, NULL);
+    pthread_cond_init(&daemon->available, NULL);
+    for (; daemon->nworkers < daemon->options.nthreads; ++daemon->nworkers)
+    {
+        if (pthread_create(&daemon->workers[daemon->nworkers], NULL, run_daemon_worker, daemon) != 0)
+            break;
+    }
+    if (daemon->nworkers == 0 || pthread_create(&daemon->io_thread, NULL, run_daemon_io, daemon) != 0)
+    {
+        pthread_mutex_lock(&daemon->mutex);
+        daemon->stopping = 1;
+        pthread_cond_broadcast(&daemon->available);
+        pthread_mutex_unlock(&daemon->mutex);
+        for (unsigned int i = 0; i < daemon->nworkers; ++i)
+            pthread_join(daemon->workers[i], NULL);
+        pthread_cond_destroy(&daemon->available);
+        pthread_mutex_destroy(&daemon->mutex);
+        free(daemon->workers);
+        close(daemon->listen_fd);
+        close(daemon->wake_fds[0]);
+        close(daemon->wake_fds[1]);
+        unlink(options->socket_path);
+        return STATUS_CODE_DAEMON_FAIL;
+    }
+    return 0;
+}
+
+/// @brief Stops the daemon, the requests not answered yet are dropped, and removes the socket
+/// @param daemon Pointer to the HuffmanDaemon structure
+void free_huffman_daemon(HuffmanDaemon *daemon)
+{
+    pthread_mutex_lock(&daemon->mutex);
+    daemon->stopping = 1;
+    pthread_cond_broadcast(&daemon->available);
+    pthread_mutex_unlock(&daemon->mutex);
+    ssize_t written = write(daemon->wake_fds[1], "", 1);
+    (void)written;
+    pthread_join(daemon->io_thread, NULL);
+    for (unsigned int i = 0; i < daemon->nworkers; ++i)
+        pthread_join(daemon->workers[i], NULL);
+    while (daemon->queue_head != NULL)
+    {
+        HuffmanDaemonRequest *next = daemon->queue_head->next;
+        free_huffman_daemon_request(daemon, daemon->queue_head);
+        daemon->queue_head = next;
+    }
+    daemon->queue_tail = NULL;
+    free(daemon->connections);
+    daemon->connections = NULL;
+    free(daemon->workers);
+    daemon->workers = NULL;
+    pthread_cond_destroy(&daemon->available);
+    pthread_mutex_destroy(&daemon->mutex);
+    close(daemon->listen_fd);
+    close(daemon->wake_fds[0]);
+    close(daemon->wake_fds[1]);
+    unlink(daemon->options.socket_path);
+}
+
+/// @brief Connects to a daemon
+/// @param client Pointer to the HuffmanClient structure to initialize
+/// @param socket_path Path of the Unix domain socket of the daemon
+/// @return status code
+int huffman_client_connect(HuffmanClient *client, const char *socket_path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path))
+        return STATUS_CODE_DAEMON_FAIL;
+    strcpy(address.sun_path, socket_path);
+    client->next_id = 0;
+    client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client->fd < 0)
+        return STATUS_CODE_DAEMON_FAIL;
+    if (connect(client->fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(client->fd);
+        client->fd = -1;
+        return STATUS_CODE_DAEMON_FAIL;
+    }
+    return 0;
+}
+
+/// @brief Sends a request to the daemon and waits for its response
+///         With a table id, compression returns [nbits (4, little-endian)][codes] without table header and
+///         decompression expects the same; without, the daemon encodes and decodes self-contained frames.
+/// @param client Pointer to the HuffmanClient structure
+/// @param op HUFFMAN_DAEMON_COMPRESS or HUFFMAN_DAEMON_DECOMPRESS
+/// @param table_id Cached table to use, 0 for frames
+/// @param data Payload of the request
+/// @param length Number of bytes of the payload
+/// @param result Dynamically allocated result
+/// @param result_length Number of bytes of the result
+/// @return status code, the status code of the daemon when the request failed there
+int huffman_client_request(HuffmanClient *client, int op, uint32_t table_id, const void *data, size_t length,
+                           unsigned char **result, size_t *result_length)
+{
+    if (length > HUFFMAN_DAEMON_MAX_PAYLOAD)
+        return STATUS_CODE_PROTOCOL_FAIL;
+    unsigned char header[HUFFMAN_DAEMON_HEADER_SIZE] = {0};
+    uint32_t id = client->next_id++;
+    header[0] = (unsigned char)op;
+    store_le32(header + 4, id);
+    store_le32(header + 8, table_id);
+    store_le32(header + 12, (uint32_t)length);
+    int status = send_message(client->fd, header, data, length);
+    if (status == 0)
+        status = receive_all(client->fd, header, sizeof(header));
+    if (status > 0)
+        return status;
+    if (load_le32(header + 4) != id)
+        return STATUS_CODE_PROTOCOL_FAIL;
+    *result_length = load_le32(header + 12);
+    *result = malloc(*result_length > 0 ? *result_length : 1);
+    if (*result == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    status = receive_all(client->fd, *result, *result_length);
+    if (status == 0 && header[0] != 0)
+        status = header[0];
+    if (status > 0)
+    {
+        free(*result);
+        *result = NULL;
+    }
+    return status;
+}
+
+/// @brief Closes the connection of a client
+/// @param client Pointer to the HuffmanClient structure
+void free_huffman_client(HuffmanClient *client)
+{
+    if (client->fd >= 0)
+        close(client->fd);
+    client->fd = -1;
+}
@@ -0,0 +1,89 @@
+#ifndef _HUFFMAN_DAEMON_H
+#define _HUFFMAN_DAEMON_H 1
+
+#include "huffman.h"
+#include <pthread.h>
+
+#define STATUS_CODE_DAEMON_FAIL 40
+#define STATUS_CODE_PROTOCOL_FAIL 41
+
+/// Encode the payload as a frame, or with a cached table when the table id is not 0
+#define HUFFMAN_DAEMON_COMPRESS 1
+/// Decode a frame, or codes produced with a cached table when the table id is not 0
+#define HUFFMAN_DAEMON_DECOMPRESS 2
+
+/// Request: [op][reserved (3)][id (4)][table_id (4)][length (4)] followed by the payload
+/// Response: [status][reserved (3)][id (4)][reserved (4)][length (4)] followed by the result
+#define HUFFMAN_DAEMON_HEADER_SIZE 16
+/// Largest payload of a request
+#define HUFFMAN_DAEMON_MAX_PAYLOAD (1 << 24)
+#define HUFFMAN_DAEMON_DEFAULT_MAX_BATCH 64
+#define HUFFMAN_DAEMON_DEFAULT_MAX_OUTPUT_BYTES (1 << 22)
+#define HUFFMAN_DAEMON_DEFAULT_MAX_INFLIGHT_BYTES (1 << 26)
+
+/// @brief Options of the daemon
+typedef struct HuffmanDaemonOptions
+{
+    const char *socket_path;
+    // Number of workers encoding and decoding the requests
+    unsigned int nthreads;
+    // Largest number of requests taken together by a worker
+    size_t max_batch;
+    // Responses waiting to be sent on a connection above which its requests are no longer read
+    size_t max_output_bytes;
+    // Payloads of the requests read and not answered yet above which no request is read
+    size_t max_inflight_bytes;
+    // Cached tables, table id i + 1 selects tables[i]
+    const HuffmanTable *const *tables;
+    size_t ntables;
+} HuffmanDaemonOptions;
+
+struct HuffmanDaemonConnection;
+struct HuffmanDaemonRequest;
+
+/// @brief Daemon serving compress and decompress requests on a Unix domain socket
+typedef struct HuffmanDaemon
+{
+    HuffmanDaemonOptions options;
+    int listen_fd;
+    // Written to wake the I/O thread up when the daemon stops, when a response is queued or when reading can resume
+    int wake_fds[2];
+    pthread_t io_thread;
+    pthread_t *workers;
+    unsigned int nworkers;
+    pthread_mutex_t mutex;
+    pthread_cond_t available;
+    // Requests read from every connection and not taken by a worker yet, in arrival order
+    struct HuffmanDaemonRequest *queue_head;
+    struct HuffmanDaemonRequest *queue_tail;
+    // Open connections, owned by the I/O thread
+    struct HuffmanDaemonConnection **connections;
+    size_t nconnections;
+    // Bytes of the payloads of the requests read and not freed yet, under the mutex
+    size_t inflight_bytes;
+    int stopping;
+    // Number of requests served and of batches taken by the workers
+    uint64_t nrequests;
+    uint64_t nbatches;
+} HuffmanDaemon;
+
+/// @brief Connection of a client to the daemon
+typedef struct HuffmanClient
+{
+    int fd;
+    uint32_t next_id;
+} HuffmanClient;
+
+HUFFMAN_API void huffman_daemon_default_options(HuffmanDaemonOptions *, const char *);
+
+HUFFMAN_API int create_huffman_daemon(HuffmanDaemon *, const HuffmanDaemonOptions *);
+
+HUFFMAN_API void free_huffman_daemon(HuffmanDaemon *);
+
+HUFFMAN_API int huffman_client_connect(HuffmanClient *, const char *);
+
+HUFFMAN_API int huffman_client_request(HuffmanClient *, int, uint32_t, const void *, size_t, unsigned char **, size_t *);
+
+HUFFMAN_API void free_huffman_client(HuffmanClient *);
+
+#endif // HUFFMAN_DAEMON included
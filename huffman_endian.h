@@ -0,0 +1,39 @@
+#ifndef _HUFFMAN_ENDIAN_H
+#define _HUFFMAN_ENDIAN_H 1
+
+/// Little-endian loads and stores of the fields of the frame, file and daemon formats.
+/// Internal to the library and its tests, not installed with the public headers.
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// @brief Stores a 16-bit value in little-endian order
+static inline void store_le16(unsigned char *data, uint16_t value)
+{
+    data[0] = (unsigned char)value;
+    data[1] = (unsigned char)(value >> 8);
+}
+
+/// @brief Stores a 32-bit value in little-endian order
+static inline void store_le32(unsigned char *data, uint32_t value)
+{
+    for (size_t i = 0; i < 4; ++i)
+        data[i] = (unsigned char)(value >> (8 * i));
+}
+
+/// @brief Loads a 16-bit value stored in little-endian order
+static inline uint16_t load_le16(const unsigned char *data)
+{
+    return (uint16_t)(data[0] | (data[1] << 8));
+}
+
+/// @brief Loads a 32-bit value stored in little-endian order
+static inline uint32_t load_le32(const unsigned char *data)
+{
+    uint32_t value = 0;
+    for (size_t i = 0; i < 4; ++i)
+        value |= (uint32_t)data[i] << (8 * i);
+    return value;
+}
+
+#endif // HUFFMAN_ENDIAN included
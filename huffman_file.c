@@ -0,0 +1,1089 @@
+#define _GNU_SOURCE
+#include "huffman_file.h"
+#include "huffman_trace.h"
+#include "huffman_endian.h"
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+/// Blocks encoded at a level before a worker first tries the next slower one, and most blocks it waits after failed climbs
+#define HUFFMAN_FILE_LEVEL_UP_BLOCKS 16
+#define HUFFMAN_FILE_LEVEL_MAX_UP_BLOCKS 4096
+/// Blocks at the slower level after a climb before the climb is kept
+#define HUFFMAN_FILE_LEVEL_PROBE_BLOCKS 4
+/// Weight of the last block in the CPU time per byte of a level, 1/HUFFMAN_FILE_LEVEL_SMOOTHING
+#define HUFFMAN_FILE_LEVEL_SMOOTHING 8
+
+/// @brief Range of the input file processed as one block
+typedef struct HuffmanFileJob
+{
+    off_t input_offset;
+    size_t input_length;
+    // Known when decompressing, -1 when the offset is reserved after the block is transformed
+    off_t output_offset;
+    // Known when decompressing, 0 otherwise
+    size_t output_length;
+    // Stored frame whose payload is copied to the output as is
+    int stored;
+} HuffmanFileJob;
+
+/// @brief State of a thread transforming blocks, kept from one block to the next
+typedef struct HuffmanFileWorker
+{
+    HuffmanFrameEncoder encoder;
+    // Level of the encoder when options->min_mb_s is set
+    HuffmanLevelController controller;
+} HuffmanFileWorker;
+
+/// @brief Transforms an input block into an output block of at most the given capacity
+typedef int (*HuffmanBlockFunction)(HuffmanFileWorker *, const unsigned char *, size_t, unsigned char *, size_t, size_t *);
+
+/// @brief Buffers and state of one block in flight in the pipeline
+typedef struct HuffmanFileSlot
+{
+    unsigned char *input;
+    unsigned char *output;
+    size_t job;
+    int read_done;
+    size_t read_length;
+    int write_pending;
+    size_t write_length;
+} HuffmanFileSlot;
+
+/// @brief State shared by the workers of run_parallel_file_jobs
+typedef struct HuffmanParallelContext
+{
+    int input_fd;
+    int output_fd;
+    const HuffmanFileJob *jobs;
+    size_t njobs;
+    size_t input_capacity;
+    size_t output_capacity;
+    HuffmanBlockFunction function;
+    const HuffmanFileOptions *options;
+    // Shared mapping of the output file written in place instead of using pwrite, or NULL
+    unsigned char *output_mapping;
+    // The output cannot seek (pipe, socket): the blocks are written with write in the order of the input
+    int output_stream;
+    pthread_mutex_t mutex;
+    pthread_cond_t reserved;
+    // Next job to take
+    size_t next_job;
+    // Next job allowed to reserve its output range, in the order of the input
+    size_t next_reservation;
+    off_t output_offset;
+    int status;
+} HuffmanParallelContext;
+
+/// @brief Writes a whole buffer to a file descriptor
+/// @param fd File descriptor to write to
+/// @param data Buffer to write
+/// @param size Number of bytes to write
+/// @return status code
+static int write_all(int fd, const void *data, size_t size)
+{
+    const unsigned char *current = data;
+    while (size > 0)
+    {
+        ssize_t nwritten = write(fd, current, size);
+        if (nwritten <= 0)
+            return STATUS_CODE_FILE_FAIL;
+        current += nwritten;
+        size -= (size_t)nwritten;
+    }
+    return 0;
+}
+
+/// @brief Hash of the bytes of a table stored in its file, 64-bit FNV-1a
+/// @param table Pointer to the HuffmanTable structure
+/// @return hash of the table
+static uint64_t table_checksum(const HuffmanTable *table)
+{
+    const unsigned char *bytes = (const unsigned char *)table;
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < sizeof(HuffmanTable); ++i)
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    return hash;
+}
+
+/// @brief Saves a table in a file that can be mapped and used in place by huffman_table_map
+///         The table contains no pointer so the file is position independent, but it keeps the
+///         byte order of the machine that wrote it. The file is written under a temporary name and renamed
+///         over path, so the processes that mapped the previous table keep it unchanged.
+/// @param table Pointer to the HuffmanTable structure to save
+/// @param path Path of the file to create or replace
+/// @return status code
+int huffman_table_save(const HuffmanTable *table, const char *path)
+{
+    unsigned char header[HUFFMAN_TABLE_FILE_OFFSET] = {0};
+    HuffmanTableFileHeader file_header = {
+        .magic = HUFFMAN_TABLE_FILE_MAGIC,
+        .version = HUFFMAN_TABLE_FILE_VERSION,
+        .byte_order = HUFFMAN_TABLE_FILE_BYTE_ORDER,
+        .table_size = (uint32_t)sizeof(HuffmanTable),
+        .checksum = table_checksum(table),
+    };
+    memcpy(header, &file_header, sizeof(file_header));
+    // The temporary file is in the same directory so that the rename does not cross file systems
+    size_t path_length = strlen(path);
+    char *temp_path = malloc(path_length + sizeof(".XXXXXX"));
+    if (temp_path == NULL)
+        return STATUS_CODE_FILE_FAIL;
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, ".XXXXXX", sizeof(".XXXXXX"));
+    int fd = mkstemp(temp_path);
+    if (fd < 0)
+    {
+        free(temp_path);
+        return STATUS_CODE_FILE_FAIL;
+    }
+    int status = (fchmod(fd, 0644) == 0) ? 0 : STATUS_CODE_FILE_FAIL;
+    if (status == 0)
+        status = write_all(fd, header, sizeof(header));
+    if (status == 0)
+        status = write_all(fd, table, sizeof(HuffmanTable));
+    if (status == 0 && fsync(fd) != 0)
+        status = STATUS_CODE_FILE_FAIL;
+    if (close(fd) != 0 && status == 0)
+        status = STATUS_CODE_FILE_FAIL;
+    if (status == 0 && rename(temp_path, path) != 0)
+        status = STATUS_CODE_FILE_FAIL;
+    if (status > 0)
+        unlink(temp_path);
+    free(temp_path);
+    return status;
+}
+
+/// @brief Maps a table file read-only, the table is used in place without any build step
+///         Every process mapping the same file shares the same physical pages. The table is only checked
+///         against the hash stored by huffman_table_save, a file whose table was corrupted before saving is trusted.
+/// @param path Path of a file written by huffman_table_save
+/// @param mapped_table Pointer to the HuffmanMappedTable structure to fill
+/// @return status code
+int huffman_table_map(const char *path, HuffmanMappedTable *mapped_table)
+{
+    memset(mapped_table, 0, sizeof(HuffmanMappedTable));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return STATUS_CODE_FILE_FAIL;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+    {
+        close(fd);
+        return STATUS_CODE_FILE_FAIL;
+    }
+    size_t size = (size_t)file_stat.st_size;
+    if (size != HUFFMAN_TABLE_FILE_OFFSET + sizeof(HuffmanTable))
+    {
+        close(fd);
+        return STATUS_CODE_FILE_CORRUPT;
+    }
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return STATUS_CODE_FILE_FAIL;
+    HuffmanTableFileHeader file_header;
+    memcpy(&file_header, mapping, sizeof(file_header));
+    const HuffmanTable *table = (const HuffmanTable *)((const unsigned char *)mapping + HUFFMAN_TABLE_FILE_OFFSET);
+    if (file_header.magic != HUFFMAN_TABLE_FILE_MAGIC ||
+        file_header.version != HUFFMAN_TABLE_FILE_VERSION ||
+        file_header.byte_order != HUFFMAN_TABLE_FILE_BYTE_ORDER ||
+        file_header.table_size != sizeof(HuffmanTable) ||
+        file_header.checksum != table_checksum(table))
+    {
+        munmap(mapping, size);
+        return STATUS_CODE_FILE_CORRUPT;
+    }
+    mapped_table->table = table;
+    mapped_table->mapping = mapping;
+    mapped_table->mapping_size = size;
+    return 0;
+}
+
+/// @brief Unmaps a table mapped by huffman_table_map
+/// @param mapped_table Pointer to the HuffmanMappedTable structure to release
+void huffman_table_unmap(HuffmanMappedTable *mapped_table)
+{
+    if (mapped_table->mapping != NULL)
+        munmap(mapped_table->mapping, mapped_table->mapping_size);
+    memset(mapped_table, 0, sizeof(HuffmanMappedTable));
+}
+
+/// @brief Reads a whole range of a file, retrying short reads
+/// @param fd File descriptor
+/// @param data Buffer to read into
+/// @param size Number of bytes to read
+/// @param offset Offset in the file
+/// @return status code
+static int pread_all(int fd, void *data, size_t size, off_t offset)
+{
+    unsigned char *current = data;
+    while (size > 0)
+    {
+        ssize_t nread = pread(fd, current, size, offset);
+        if (nread <= 0)
+            return STATUS_CODE_FILE_FAIL;
+        current += nread;
+        offset += nread;
+        size -= (size_t)nread;
+    }
+    return 0;
+}
+
+/// @brief Writes a whole buffer at an offset of a file, retrying short writes
+/// @param fd File descriptor
+/// @param data Buffer to write
+/// @param size Number of bytes to write
+/// @param offset Offset in the file
+/// @return status code
+static int pwrite_all(int fd, const void *data, size_t size, off_t offset)
+{
+    const unsigned char *current = data;
+    while (size > 0)
+    {
+        ssize_t nwritten = pwrite(fd, current, size, offset);
+        if (nwritten <= 0)
+            return STATUS_CODE_FILE_FAIL;
+        current += nwritten;
+        offset += nwritten;
+        size -= (size_t)nwritten;
+    }
+    return 0;
+}
+
+/// @brief Sets the default options: 1 MiB blocks, io_uring when available, 8 blocks in flight, one thread,
+///         decompression into a mapping of the output, HUFFMAN_LEVEL_DEFAULT without throughput target
+/// @param options Pointer to the HuffmanFileOptions structure to initialize
+void huffman_file_default_options(HuffmanFileOptions *options)
+{
+    options->block_size = HUFFMAN_FILE_DEFAULT_BLOCK_SIZE;
+    options->io_backend = HUFFMAN_IO_URING;
+    options->queue_depth = HUFFMAN_FILE_DEFAULT_QUEUE_DEPTH;
+    options->nthreads = 1;
+    options->output_mmap = 1;
+    options->level = HUFFMAN_LEVEL_DEFAULT;
+    options->min_mb_s = 0;
+    options->stats = NULL;
+}
+
+/// @brief Initializes the state of a thread transforming blocks
+/// @param worker Pointer to the HuffmanFileWorker structure to initialize
+/// @param options Pointer to the HuffmanFileOptions structure
+static void huffman_file_worker_init(HuffmanFileWorker *worker, const HuffmanFileOptions *options)
+{
+    huffman_frame_encoder_init(&worker->encoder, options->level);
+    huffman_level_controller_init(&worker->controller, options->level, options->min_mb_s);
+}
+
+/// @brief Resets the statistics of a call before its workers start
+/// @param options Pointer to the HuffmanFileOptions structure
+static void huffman_file_stats_init(const HuffmanFileOptions *options)
+{
+    if (options->stats == NULL)
+        return;
+    options->stats->nlevel_changes = 0;
+    options->stats->final_level = options->level;
+}
+
+/// @brief Adds the level changes and the final level of a worker to the statistics of the call
+/// @param options Pointer to the HuffmanFileOptions structure
+/// @param worker Pointer to the HuffmanFileWorker structure, of a worker that is done
+static void huffman_file_stats_add(const HuffmanFileOptions *options, const HuffmanFileWorker *worker)
+{
+    if (options->stats == NULL)
+        return;
+    options->stats->nlevel_changes += worker->controller.nchanges;
+    if (worker->controller.level < options->stats->final_level)
+        options->stats->final_level = worker->controller.level;
+}
+
+/// @brief Frees resources associated with the state of a thread transforming blocks
+/// @param worker Pointer to the HuffmanFileWorker structure to free
+static void free_huffman_file_worker(HuffmanFileWorker *worker)
+{
+    free_huffman_frame_encoder(&worker->encoder);
+}
+
+/// @brief CPU time consumed by the calling thread
+/// @return time in nanoseconds
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/// @brief Starts a level controller at its highest level, with an empty budget
+/// @param controller Pointer to the HuffmanLevelController structure to initialize
+/// @param level Highest level, the level of the first block
+/// @param min_mb_s Throughput to stay above on average, in MB per second of CPU time, 0 to keep the level
+void huffman_level_controller_init(HuffmanLevelController *controller, int level, double min_mb_s)
+{
+    memset(controller, 0, sizeof(HuffmanLevelController));
+    if (level < HUFFMAN_LEVEL_FAST)
+        level = HUFFMAN_LEVEL_FAST;
+    if (level > HUFFMAN_LEVEL_MAX)
+        level = HUFFMAN_LEVEL_MAX;
+    controller->level = level;
+    controller->max_level = level;
+    controller->min_mb_s = min_mb_s;
+    controller->climb_wait = HUFFMAN_FILE_LEVEL_UP_BLOCKS;
+}
+
+/// @brief Accounts for a block and moves the level to keep the CPU time used within the budget
+///         Each byte adds 1000 / min_mb_s nanoseconds to the budget and the CPU time of its block to the time used,
+///         measured on the thread so that waiting for I/O or for other threads is not counted. The level drops as
+///         soon as the time used exceeds the budget. After climb_wait blocks at a level below the highest one, it
+///         climbs to the next slower level only if the slack saved covers HUFFMAN_FILE_LEVEL_PROBE_BLOCKS blocks
+///         at the CPU time per byte last measured there, twice the current one if never measured. A drop during
+///         these probe blocks doubles climb_wait, up to HUFFMAN_FILE_LEVEL_MAX_UP_BLOCKS; completing them resets it.
+/// @param controller Pointer to the HuffmanLevelController structure
+/// @param length Number of characters of the block
+/// @param cpu_ns CPU time spent encoding the block
+/// @return level of the next block
+int huffman_level_controller_update(HuffmanLevelController *controller, size_t length, uint64_t cpu_ns)
+{
+    if (controller->min_mb_s <= 0 || length == 0)
+        return controller->level;
+    double budget_ns_per_byte = 1e3 / controller->min_mb_s;
+    double ns_per_byte = (double)cpu_ns / (double)length;
+    double *measured = &controller->ns_per_byte[controller->level];
+    *measured = (*measured == 0) ? ns_per_byte : *measured + (ns_per_byte - *measured) / HUFFMAN_FILE_LEVEL_SMOOTHING;
+    controller->budget_ns += (double)length * budget_ns_per_byte;
+    controller->used_ns += (double)cpu_ns;
+    controller->nblocks += 1;
+    double slack_ns = controller->budget_ns - controller->used_ns;
+    int level = controller->level;
+    if (slack_ns < 0 && level > HUFFMAN_LEVEL_FAST)
+    {
+        if (controller->probing)
+            controller->climb_wait = (2 * controller->climb_wait < HUFFMAN_FILE_LEVEL_MAX_UP_BLOCKS)
+                                         ? 2 * controller->climb_wait
+                                         : HUFFMAN_FILE_LEVEL_MAX_UP_BLOCKS;
+        controller->probing = 0;
+        level -= 1;
+    }
+    else if (controller->probing)
+    {
+        if (controller->nblocks >= HUFFMAN_FILE_LEVEL_PROBE_BLOCKS)
+        {
+            controller->probing = 0;
+            controller->climb_wait = HUFFMAN_FILE_LEVEL_UP_BLOCKS;
+        }
+    }
+    else if (level < controller->max_level && controller->nblocks >= controller->climb_wait)
+    {
+        double probe_ns_per_byte = controller->ns_per_byte[level + 1];
+        if (probe_ns_per_byte == 0)
+            probe_ns_per_byte = 2 * controller->ns_per_byte[level];
+        double probe_excess_ns = HUFFMAN_FILE_LEVEL_PROBE_BLOCKS * (double)length * (probe_ns_per_byte - budget_ns_per_byte);
+        if (slack_ns >= probe_excess_ns)
+        {
+            controller->probing = 1;
+            level += 1;
+        }
+    }
+    if (level == controller->level)
+        return level;
+    HUFFMAN_TRACE2(block_level, level, (int64_t)(slack_ns / 1e3));
+    controller->level = level;
+    controller->nblocks = 0;
+    controller->nchanges += 1;
+    return level;
+}
+
+/// @brief Completes a read or a write of the pipeline, finishing short transfers synchronously
+/// @param slots Array of slots of the pipeline
+/// @param jobs Array of jobs
+/// @param input_fd Input file descriptor
+/// @param output_fd Output file descriptor
+/// @param completion Pointer to the HuffmanIoCompletion structure
+/// @param output_offsets Output offset of the block in each slot
+/// @return status code
+static int complete_pipeline_request(HuffmanFileSlot *slots, const HuffmanFileJob *jobs, int input_fd, int output_fd,
+                                     const HuffmanIoCompletion *completion, const off_t *output_offsets)
+{
+    // user_data = (slot << 1) | is_write
+    HuffmanFileSlot *slot = &slots[completion->user_data >> 1];
+    int is_write = (int)(completion->user_data & 1);
+    if (completion->result < 0)
+        return STATUS_CODE_FILE_FAIL;
+    size_t done = (size_t)completion->result;
+    if (is_write)
+    {
+        size_t idx = (size_t)(completion->user_data >> 1);
+        if (done < slot->write_length &&
+            pwrite_all(output_fd, slot->output + done, slot->write_length - done, output_offsets[idx] + (off_t)done) > 0)
+            return STATUS_CODE_FILE_FAIL;
+        slot->write_pending = 0;
+        return 0;
+    }
+    const HuffmanFileJob *job = &jobs[slot->job];
+    if (done < job->input_length &&
+        pread_all(input_fd, slot->input + done, job->input_length - done, job->input_offset + (off_t)done) > 0)
+        return STATUS_CODE_FILE_FAIL;
+    slot->read_length = job->input_length;
+    slot->read_done = 1;
+    return 0;
+}
+
+/// @brief Reads the jobs, transforms them and writes the results one after the other
+///         queue_depth blocks are in flight: the reads of the next blocks and the writes of the
+///         previous ones are queued while a block is transformed.
+/// @param input_fd Input file descriptor
+/// @param output_fd Output file descriptor
+/// @param jobs Array of input ranges
+/// @param njobs Number of jobs
+/// @param input_capacity Maximum input length of a job
+/// @param output_capacity Maximum output length of a job
+/// @param function Function transforming an input block into an output block
+/// @param options Pointer to the HuffmanFileOptions structure
+/// @param output_offset Offset of the first output block, updated to the end of the output
+/// @return status code
+static int run_file_pipeline(int input_fd, int output_fd, const HuffmanFileJob *jobs, size_t njobs,
+                             size_t input_capacity, size_t output_capacity, HuffmanBlockFunction function,
+                             const HuffmanFileOptions *options, off_t *output_offset)
+{
+    unsigned int nslots = options->queue_depth > 0 ? options->queue_depth : 1;
+    if (nslots > njobs)
+        nslots = (njobs > 0) ? (unsigned int)njobs : 1;
+    HuffmanFileSlot *slots = calloc(nslots, sizeof(HuffmanFileSlot));
+    off_t *output_offsets = calloc(nslots, sizeof(off_t));
+    void **buffers = calloc(2 * nslots, sizeof(void *));
+    size_t *sizes = calloc(2 * nslots, sizeof(size_t));
+    int status = (slots == NULL || output_offsets == NULL || buffers == NULL || sizes == NULL) ? STATUS_CODE_ALLOC_FAIL : 0;
+    for (unsigned int i = 0; i < nslots && status == 0; ++i)
+    {
+        slots[i].input = malloc(input_capacity);
+        slots[i].output = malloc(output_capacity);
+        if (slots[i].input == NULL || slots[i].output == NULL)
+            status = STATUS_CODE_ALLOC_FAIL;
+        buffers[2 * i] = slots[i].input;
+        sizes[2 * i] = input_capacity;
+        buffers[2 * i + 1] = slots[i].output;
+        sizes[2 * i + 1] = output_capacity;
+    }
+    HuffmanFileWorker worker;
+    huffman_file_worker_init(&worker, options);
+    HuffmanIo io;
+    int io_created = 0;
+    if (status == 0)
+    {
+        // One read and one write per slot can be in flight
+        status = create_huffman_io(&io, options->io_backend, 2 * nslots);
+        io_created = (status == 0);
+    }
+    if (status == 0)
+        status = huffman_io_register_buffers(&io, buffers, sizes, 2 * nslots);
+    for (size_t job = 0; job < nslots && job < njobs && status == 0; ++job)
+    {
+        slots[job].job = job;
+        status = huffman_io_read(&io, input_fd, slots[job].input, jobs[job].input_length,
+                                 jobs[job].input_offset, (int)(2 * job), (uint64_t)job << 1);
+    }
+    for (size_t job = 0; job < njobs && status == 0; ++job)
+    {
+        size_t idx = job % nslots;
+        HuffmanFileSlot *slot = &slots[idx];
+        while (status == 0 && (!slot->read_done || slot->write_pending))
+        {
+            HuffmanIoCompletion completion;
+            status = huffman_io_wait(&io, &completion);
+            if (status == 0)
+                status = complete_pipeline_request(slots, jobs, input_fd, output_fd, &completion, output_offsets);
+        }
+        if (status > 0)
+            break;
+        status = function(&worker, slot->input, slot->read_length, slot->output, output_capacity, &slot->write_length);
+        if (status > 0)
+            break;
+        slot->read_done = 0;
+        slot->write_pending = 1;
+        if (jobs[job].output_offset >= 0)
+        {
+            output_offsets[idx] = jobs[job].output_offset;
+        }
+        else
+        {
+            output_offsets[idx] = *output_offset;
+            *output_offset += (off_t)slot->write_length;
+        }
+        status = huffman_io_write(&io, output_fd, slot->output, slot->write_length, output_offsets[idx],
+                                  (int)(2 * idx + 1), ((uint64_t)idx << 1) | 1);
+        // The input buffer is free again: read the block that will use this slot next
+        size_t next_job = job + nslots;
+        if (status == 0 && next_job < njobs)
+        {
+            slot->job = next_job;
+            status = huffman_io_read(&io, input_fd, slot->input, jobs[next_job].input_length,
+                                     jobs[next_job].input_offset, (int)(2 * idx), (uint64_t)idx << 1);
+        }
+    }
+    // Wait for the last writes
+    for (unsigned int i = 0; i < nslots && status == 0 && slots != NULL; ++i)
+    {
+        while (status == 0 && slots[i].write_pending)
+        {
+            HuffmanIoCompletion completion;
+            status = huffman_io_wait(&io, &completion);
+            if (status == 0)
+                status = complete_pipeline_request(slots, jobs, input_fd, output_fd, &completion, output_offsets);
+        }
+    }
+    if (io_created)
+    {
+        // Requests still in flight after an error must complete before their buffers are freed
+        HuffmanIoCompletion completion;
+        while (io.backend == HUFFMAN_IO_URING && (io.ninflight > 0 || io.nqueued > 0) && huffman_io_wait(&io, &completion) == 0)
+            ;
+        free_huffman_io(&io);
+    }
+    huffman_file_stats_add(options, &worker);
+    free_huffman_file_worker(&worker);
+    for (unsigned int i = 0; i < nslots && slots != NULL; ++i)
+    {
+        free(slots[i].input);
+        free(slots[i].output);
+    }
+    free(slots);
+    free(output_offsets);
+    free(buffers);
+    free(sizes);
+    return status;
+}
+
+/// @brief Records the first error of the workers and wakes up the ones waiting for a reservation
+/// @param context Pointer to the HuffmanParallelContext structure
+/// @param status status code of the worker
+static void fail_parallel_context(HuffmanParallelContext *context, int status)
+{
+    pthread_mutex_lock(&context->mutex);
+    if (context->status == 0)
+        context->status = status;
+    pthread_cond_broadcast(&context->reserved);
+    pthread_mutex_unlock(&context->mutex);
+}
+
+/// @brief Worker taking the next job, reading its range with pread, transforming it and writing
+///         the result with pwrite at its output offset, or with write in turn to a stream output
+/// @param arg Pointer to the HuffmanParallelContext structure
+/// @return NULL
+static void *run_parallel_worker(void *arg)
+{
+    HuffmanParallelContext *context = arg;
+    unsigned char *input = malloc(context->input_capacity);
+    // Nothing to allocate for the output when writing into the mapping
+    unsigned char *output = malloc(context->output_capacity > 0 ? context->output_capacity : 1);
+    HuffmanFileWorker worker;
+    huffman_file_worker_init(&worker, context->options);
+    if (input == NULL || output == NULL)
+        fail_parallel_context(context, STATUS_CODE_ALLOC_FAIL);
+    while (input != NULL && output != NULL)
+    {
+        pthread_mutex_lock(&context->mutex);
+        size_t job_idx = context->next_job++;
+        int stop = (context->status > 0 || job_idx >= context->njobs);
+        pthread_mutex_unlock(&context->mutex);
+        if (stop)
+            break;
+        const HuffmanFileJob *job = &context->jobs[job_idx];
+        size_t output_length = 0;
+        int status = pread_all(context->input_fd, input, job->input_length, job->input_offset);
+        if (status == 0 && context->output_mapping != NULL)
+        {
+            // Decode straight into the final location, the block must fill its range exactly
+            status = context->function(&worker, input, job->input_length, context->output_mapping + job->output_offset,
+                                       job->output_length, &output_length);
+            if (status == 0 && output_length != job->output_length)
+                status = STATUS_CODE_FILE_CORRUPT;
+            if (status > 0)
+            {
+                fail_parallel_context(context, status);
+                break;
+            }
+            continue;
+        }
+        if (status == 0)
+            status = context->function(&worker, input, job->input_length, output, context->output_capacity, &output_length);
+        if (status > 0)
+        {
+            fail_parallel_context(context, status);
+            break;
+        }
+        off_t output_offset = job->output_offset;
+        if (context->output_stream)
+        {
+            // Wait for the turn of this block, the writes of the previous blocks are done when it comes
+            pthread_mutex_lock(&context->mutex);
+            while (context->next_reservation != job_idx && context->status == 0)
+                pthread_cond_wait(&context->reserved, &context->mutex);
+            status = context->status;
+            pthread_mutex_unlock(&context->mutex);
+            if (status == 0)
+                status = write_all(context->output_fd, output, output_length);
+            if (status > 0)
+            {
+                fail_parallel_context(context, status);
+                break;
+            }
+            pthread_mutex_lock(&context->mutex);
+            context->output_offset += (off_t)output_length;
+            context->next_reservation += 1;
+            pthread_cond_broadcast(&context->reserved);
+            pthread_mutex_unlock(&context->mutex);
+            continue;
+        }
+        if (output_offset < 0)
+        {
+            // Reserve the output range once the previous blocks have reserved theirs
+            pthread_mutex_lock(&context->mutex);
+            while (context->next_reservation != job_idx && context->status == 0)
+                pthread_cond_wait(&context->reserved, &context->mutex);
+            output_offset = context->output_offset;
+            context->output_offset += (off_t)output_length;
+            context->next_reservation += 1;
+            status = context->status;
+            pthread_cond_broadcast(&context->reserved);
+            pthread_mutex_unlock(&context->mutex);
+            if (status > 0)
+                break;
+        }
+        status = pwrite_all(context->output_fd, output, output_length, output_offset);
+        if (status > 0)
+        {
+            fail_parallel_context(context, status);
+            break;
+        }
+    }
+    pthread_mutex_lock(&context->mutex);
+    huffman_file_stats_add(context->options, &worker);
+    pthread_mutex_unlock(&context->mutex);
+    free_huffman_file_worker(&worker);
+    free(input);
+    free(output);
+    return NULL;
+}
+
+/// @brief Processes the jobs with several workers reading and writing their own ranges
+///         There is no single reader and no central copy: each worker reads its input range with
+///         pread and writes its result with pwrite, in place when the output offset is known or in
+///         a range reserved in the order of the input otherwise. A stream output is written with write
+///         by each worker in turn, in the order of the input.
+/// @param input_fd Input file descriptor
+/// @param output_fd Output file descriptor
+/// @param jobs Array of input ranges
+/// @param njobs Number of jobs
+/// @param input_capacity Maximum input length of a job
+/// @param output_capacity Maximum output length of a job
+/// @param function Function transforming an input block into an output block
+/// @param options Pointer to the HuffmanFileOptions structure
+/// @param nthreads Number of workers
+/// @param output_offset Offset of the first reserved output range, updated to the end of the output
+/// @param output_mapping Shared mapping of the output file written in place, or NULL
+/// @param output_stream 1 if the output cannot seek and is written in order with write
+/// @return status code
+static int run_parallel_file_jobs(int input_fd, int output_fd, const HuffmanFileJob *jobs, size_t njobs,
+                                  size_t input_capacity, size_t output_capacity, HuffmanBlockFunction function,
+                                  const HuffmanFileOptions *options, unsigned int nthreads, off_t *output_offset,
+                                  unsigned char *output_mapping, int output_stream)
+{
+    HuffmanParallelContext context = {
+        .input_fd = input_fd,
+        .output_fd = output_fd,
+        .jobs = jobs,
+        .njobs = njobs,
+        .input_capacity = input_capacity,
+        .output_capacity = (output_mapping != NULL) ? 0 : output_capacity,
+        .function = function,
+        .options = options,
+        .output_mapping = output_mapping,
+        .output_stream = output_stream,
+        .next_job = 0,
+        .next_reservation = 0,
+        .output_offset = *output_offset,
+        .status = 0,
+    };
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    if (threads == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    pthread_mutex_init(&context.mutex, NULL);
+    pthread_cond_init(&context.reserved, NULL);
+    unsigned int nstarted = 0;
+    for (; nstarted < nthreads; ++nstarted)
+    {
+        if (pthread_create(&threads[nstarted], NULL, run_parallel_worker, &context) != 0)
+            break;
+    }
+    if (nstarted == 0)
+        run_parallel_worker(&context);
+    for (unsigned int i = 0; i < nstarted; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_cond_destroy(&context.reserved);
+    pthread_mutex_destroy(&context.mutex);
+    free(threads);
+    *output_offset = context.output_offset;
+    return context.status;
+}
+
+/// @brief Processes the jobs with the I/O pipeline or with parallel workers
+///         The pipeline writes at offsets, a stream output always goes through the workers writing in order.
+static int run_file_jobs(int input_fd, int output_fd, const HuffmanFileJob *jobs, size_t njobs,
+                         size_t input_capacity, size_t output_capacity, HuffmanBlockFunction function,
+                         const HuffmanFileOptions *options, off_t *output_offset, int output_stream)
+{
+    if (output_stream || (options->nthreads > 1 && njobs > 1))
+        return run_parallel_file_jobs(input_fd, output_fd, jobs, njobs, input_capacity, output_capacity, function,
+                                      options, (options->nthreads > 0) ? options->nthreads : 1, output_offset, NULL,
+                                      output_stream);
+    return run_file_pipeline(input_fd, output_fd, jobs, njobs, input_capacity, output_capacity,
+                             function, options, output_offset);
+}
+
+/// @brief Encodes one block of the input file as one or more frames at the level of the worker
+static int compress_block(HuffmanFileWorker *worker, const unsigned char *input, size_t input_length,
+                          unsigned char *output, size_t output_capacity, size_t *output_length)
+{
+    if (HUFFMAN_FRAME_BOUND(input_length) > output_capacity)
+        return STATUS_CODE_BUFFER_TOO_SMALL;
+    HUFFMAN_TRACE1(block_compress_start, input_length);
+    uint64_t start = (worker->controller.min_mb_s > 0) ? thread_cpu_ns() : 0;
+    int status = huffman_frame_encoder_encode(&worker->encoder, (const char *)input, input_length, output, output_length);
+    if (status == 0 && worker->controller.min_mb_s > 0)
+        worker->encoder.level = huffman_level_controller_update(&worker->controller, input_length, thread_cpu_ns() - start);
+    HUFFMAN_TRACE3(block_compress_done, input_length, (status == 0) ? *output_length : 0, status);
+    return status;
+}
+
+/// @brief Decodes one frame of the compressed file
+static int decompress_block(HuffmanFileWorker *worker, const unsigned char *input, size_t input_length,
+                            unsigned char *output, size_t output_capacity, size_t *output_length)
+{
+    (void)worker;
+    HuffmanFrameHeader frame_header;
+    if (input_length < HUFFMAN_FRAME_HEADER_SIZE)
+        return STATUS_CODE_FILE_CORRUPT;
+    int status = huffman_read_frame_header(input, &frame_header);
+    if (status > 0)
+        return status;
+    if (HUFFMAN_FRAME_HEADER_SIZE + (size_t)frame_header.payload_length != input_length ||
+        frame_header.raw_length > output_capacity)
+        return STATUS_CODE_FILE_CORRUPT;
+    *output_length = frame_header.raw_length;
+    HUFFMAN_TRACE1(block_decompress_start, input_length);
+    status = huffman_decode_frame_payload(&frame_header, input + HUFFMAN_FRAME_HEADER_SIZE, (char *)output);
+    HUFFMAN_TRACE3(block_decompress_done, input_length, *output_length, status);
+    return status;
+}
+
+/// @brief Opens the output file, a FIFO or a socket being written in order instead of at offsets
+/// @param path Path of the output file
+/// @param flags Flags of open for a regular file, a FIFO is opened with O_WRONLY only
+/// @param output_stream Set to 1 if the output cannot seek
+/// @return file descriptor, -1 on error
+static int open_output_file(const char *path, int flags, int *output_stream)
+{
+    struct stat path_stat;
+    int fifo = (stat(path, &path_stat) == 0 && S_ISFIFO(path_stat.st_mode));
+    int fd = open(path, fifo ? O_WRONLY : flags, 0644);
+    if (fd < 0)
+        return -1;
+    struct stat output_stat;
+    int special = (fstat(fd, &output_stat) == 0 && (S_ISFIFO(output_stat.st_mode) || S_ISSOCK(output_stat.st_mode)));
+    *output_stream = fifo || special || (lseek(fd, 0, SEEK_CUR) < 0 && errno == ESPIPE);
+    return fd;
+}
+
+/// @brief Compresses a file as a sequence of independent frames of options->block_size bytes
+/// @param input_path Path of the file to compress
+/// @param output_path Path of the compressed file to create
+/// @param options Pointer to the HuffmanFileOptions structure
+/// @return status code
+int huffman_compress_file(const char *input_path, const char *output_path, const HuffmanFileOptions *options)
+{
+    huffman_file_stats_init(options);
+    if (options->block_size == 0 || options->block_size > HUFFMAN_FILE_MAX_BLOCK_SIZE)
+        return STATUS_CODE_FILE_FAIL;
+    int input_fd = open(input_path, O_RDONLY);
+    if (input_fd < 0)
+        return STATUS_CODE_FILE_FAIL;
+    struct stat input_stat;
+    if (fstat(input_fd, &input_stat) != 0)
+    {
+        close(input_fd);
+        return STATUS_CODE_FILE_FAIL;
+    }
+    int output_stream = 0;
+    int output_fd = open_output_file(output_path, O_WRONLY | O_CREAT | O_TRUNC, &output_stream);
+    if (output_fd < 0)
+    {
+        close(input_fd);
+        return STATUS_CODE_FILE_FAIL;
+    }
+    size_t input_size = (size_t)input_stat.st_size;
+    size_t njobs = (input_size + options->block_size - 1) / options->block_size;
+    HuffmanFileJob *jobs = malloc((njobs + 1) * sizeof(HuffmanFileJob));
+    int status = (jobs == NULL) ? STATUS_CODE_ALLOC_FAIL : 0;
+    for (size_t i = 0; i < njobs && status == 0; ++i)
+    {
+        jobs[i].input_offset = (off_t)(i * options->block_size);
+        jobs[i].input_length = (input_size - i * options->block_size < options->block_size)
+                                   ? input_size - i * options->block_size
+                                   : options->block_size;
+        jobs[i].output_offset = -1;
+        jobs[i].output_length = 0;
+        jobs[i].stored = 0;
+    }
+    unsigned char header[HUFFMAN_FILE_HEADER_SIZE] = {0};
+    store_le32(header, HUFFMAN_FILE_MAGIC);
+    store_le32(header + 4, HUFFMAN_FILE_VERSION);
+    store_le32(header + 8, (uint32_t)options->block_size);
+    if (status == 0)
+        status = output_stream ? write_all(output_fd, header, sizeof(header)) : pwrite_all(output_fd, header, sizeof(header), 0);
+    off_t output_offset = HUFFMAN_FILE_HEADER_SIZE;
+    if (status == 0)
+        status = run_file_jobs(input_fd, output_fd, jobs, njobs, options->block_size, HUFFMAN_FRAME_BOUND(options->block_size),
+                               compress_block, options, &output_offset, output_stream);
+    free(jobs);
+    close(input_fd);
+    if (close(output_fd) != 0 && status == 0)
+        status = STATUS_CODE_FILE_FAIL;
+    return status;
+}
+
+/// @brief Reads the file header and the frame headers of a compressed file
+/// @param input_fd File descriptor of the compressed file
+/// @param block_size Block size of the file
+/// @param jobs Dynamically allocated array with the range of each frame
+/// @param njobs Number of frames
+/// @param output_size Exact size of the decompressed file
+/// @return status code
+static int scan_compressed_file(int input_fd, size_t *block_size, HuffmanFileJob **jobs, size_t *njobs, off_t *output_size)
+{
+    struct stat input_stat;
+    if (fstat(input_fd, &input_stat) != 0)
+        return STATUS_CODE_FILE_FAIL;
+    off_t input_size = input_stat.st_size;
+    unsigned char header[HUFFMAN_FILE_HEADER_SIZE];
+    if (input_size < HUFFMAN_FILE_HEADER_SIZE || pread_all(input_fd, header, sizeof(header), 0) > 0)
+        return STATUS_CODE_FILE_CORRUPT;
+    *block_size = load_le32(header + 8);
+    if (load_le32(header) != HUFFMAN_FILE_MAGIC || load_le32(header + 4) != HUFFMAN_FILE_VERSION ||
+        *block_size == 0 || *block_size > HUFFMAN_FILE_MAX_BLOCK_SIZE)
+        return STATUS_CODE_FILE_CORRUPT;
+    size_t capacity = 16;
+    *njobs = 0;
+    *jobs = malloc(capacity * sizeof(HuffmanFileJob));
+    if (*jobs == NULL)
+        return STATUS_CODE_ALLOC_FAIL;
+    off_t offset = HUFFMAN_FILE_HEADER_SIZE;
+    off_t output_offset = 0;
+    while (offset < input_size)
+    {
+        unsigned char frame[HUFFMAN_FRAME_HEADER_SIZE];
+        HuffmanFrameHeader frame_header;
+        if (input_size - offset < HUFFMAN_FRAME_HEADER_SIZE ||
+            pread_all(input_fd, frame, sizeof(frame), offset) > 0 ||
+            huffman_read_frame_header(frame, &frame_header) > 0 ||
+            frame_header.raw_length > *block_size ||
+            (off_t)frame_header.payload_length > input_size - offset - HUFFMAN_FRAME_HEADER_SIZE)
+            return STATUS_CODE_FILE_CORRUPT;
+        if (*njobs == capacity)
+        {
+            capacity *= 2;
+            HuffmanFileJob *new_jobs = realloc(*jobs, capacity * sizeof(HuffmanFileJob));
+            if (new_jobs == NULL)
+                return STATUS_CODE_ALLOC_FAIL;
+            *jobs = new_jobs;
+        }
+        (*jobs)[*njobs].input_offset = offset;
+        (*jobs)[*njobs].input_length = HUFFMAN_FRAME_HEADER_SIZE + frame_header.payload_length;
+        (*jobs)[*njobs].output_offset = output_offset;
+        (*jobs)[*njobs].output_length = frame_header.raw_length;
+        (*jobs)[*njobs].stored = (frame_header.mode == HUFFMAN_BLOCK_STORED);
+        *njobs += 1;
+        output_offset += frame_header.raw_length;
+        offset += HUFFMAN_FRAME_HEADER_SIZE + (off_t)frame_header.payload_length;
+    }
+    *output_size = output_offset;
+    return 0;
+}
+
+/// @brief Copies a range between two files, in the kernel with copy_file_range when possible
+/// @param input_fd File descriptor to copy from
+/// @param input_offset Offset of the range in the input
+/// @param output_fd File descriptor to copy to
+/// @param output_offset Offset of the range in the output
+/// @param length Length of the range
+/// @param buffer Buffer of buffer_size bytes used when the kernel cannot copy the range
+/// @param buffer_size Size of the buffer
+/// @param in_kernel Set to 0 after the first copy the kernel does not support, so that later copies use the buffer
+/// @return status code
+static int copy_file_data(int input_fd, off_t input_offset, int output_fd, off_t output_offset, size_t length,
+                          unsigned char *buffer, size_t buffer_size, int *in_kernel)
+{
+#if defined(__linux__) && !defined(HUFFMAN_NO_COPY_FILE_RANGE)
+    while (*in_kernel && length > 0)
+    {
+        ssize_t copied = copy_file_range(input_fd, &input_offset, output_fd, &output_offset, length, 0);
+        if (copied < 0 && errno == EINTR)
+            continue;
+        if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP ||
+                           errno == EBADF || errno == ESPIPE))
+        {
+            // Not supported between these files, copy this range and the next ones through the buffer
+            *in_kernel = 0;
+            break;
+        }
+        if (copied <= 0)
+            return STATUS_CODE_FILE_FAIL;
+        length -= (size_t)copied;
+    }
+#else
+    *in_kernel = 0;
+#endif
+    while (length > 0)
+    {
+        size_t chunk = (length < buffer_size) ? length : buffer_size;
+        int status = pread_all(input_fd, buffer, chunk, input_offset);
+        if (status == 0)
+            status = pwrite_all(output_fd, buffer, chunk, output_offset);
+        if (status > 0)
+            return status;
+        input_offset += (off_t)chunk;
+        output_offset += (off_t)chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+/// @brief Copies the payload of the stored frames to the output and removes them from the jobs
+///         Incompressible data never goes through user space when the kernel can copy it.
+/// @param input_fd File descriptor of the compressed file
+/// @param output_fd File descriptor of the output file
+/// @param jobs Array with the range of each frame and its output offset, compacted to the coded frames
+/// @param njobs Number of frames, updated to the number of coded frames
+/// @param block_size Block size of the file
+/// @return status code
+static int copy_stored_frames(int input_fd, int output_fd, HuffmanFileJob *jobs, size_t *njobs, size_t block_size)
+{
+    unsigned char *buffer = NULL;
+    int in_kernel = 1;
+    int status = 0;
+    size_t ncoded = 0;
+    for (size_t i = 0; i < *njobs && status == 0; ++i)
+    {
+        if (!jobs[i].stored)
+        {
+            jobs[ncoded++] = jobs[i];
+            continue;
+        }
+        if (jobs[i].input_length != HUFFMAN_FRAME_HEADER_SIZE + jobs[i].output_length)
+        {
+            status = STATUS_CODE_FILE_CORRUPT;
+            break;
+        }
+        if (buffer == NULL && (buffer = malloc(block_size)) == NULL)
+        {
+            status = STATUS_CODE_ALLOC_FAIL;
+            break;
+        }
+        status = copy_file_data(input_fd, jobs[i].input_offset + HUFFMAN_FRAME_HEADER_SIZE, output_fd,
+                                jobs[i].output_offset, jobs[i].output_length, buffer, block_size, &in_kernel);
+    }
+    free(buffer);
+    *njobs = ncoded;
+    return status;
+}
+
+/// @brief Decodes every frame straight into a shared mapping of the output file
+///         The output file is resized to its exact size known from the frame headers, so that neither
+///         the whole output nor a copy of each block is held in private memory.
+/// @param input_fd File descriptor of the compressed file
+/// @param output_fd File descriptor of the output file, opened for reading and writing
+/// @param jobs Array with the range of each frame and its output offset
+/// @param njobs Number of frames
+/// @param block_size Block size of the file
+/// @param output_size Exact size of the decompressed file
+/// @param options Pointer to the HuffmanFileOptions structure
+/// @param mapped Set to 1 when the output could be mapped, 0 when the caller must fall back to writes
+/// @return status code
+static int decompress_file_mapped(int input_fd, int output_fd, const HuffmanFileJob *jobs, size_t njobs,
+                                  size_t block_size, off_t output_size, const HuffmanFileOptions *options, int *mapped)
+{
+    *mapped = 0;
+    if (ftruncate(output_fd, output_size) != 0)
+        return 0;
+    if (output_size == 0)
+    {
+        *mapped = 1;
+        return 0;
+    }
+    void *mapping = mmap(NULL, (size_t)output_size, PROT_READ | PROT_WRITE, MAP_SHARED, output_fd, 0);
+    if (mapping == MAP_FAILED)
+        return 0;
+    *mapped = 1;
+    off_t output_offset = 0;
+    int status = run_parallel_file_jobs(input_fd, output_fd, jobs, njobs, HUFFMAN_FRAME_BOUND(block_size), block_size,
+                                        decompress_block, options, (options->nthreads > 0) ? options->nthreads : 1,
+                                        &output_offset, mapping, 0);
+    if (munmap(mapping, (size_t)output_size) != 0 && status == 0)
+        status = STATUS_CODE_FILE_FAIL;
+    return status;
+}
+
+/// @brief Decompresses a file written by huffman_compress_file
+/// @param input_path Path of the compressed file
+/// @param output_path Path of the decompressed file to create
+/// @param options Pointer to the HuffmanFileOptions structure, the block size is read from the file
+/// @return status code
+int huffman_decompress_file(const char *input_path, const char *output_path, const HuffmanFileOptions *options)
+{
+    huffman_file_stats_init(options);
+    int input_fd = open(input_path, O_RDONLY);
+    if (input_fd < 0)
+        return STATUS_CODE_FILE_FAIL;
+    size_t block_size = 0;
+    HuffmanFileJob *jobs = NULL;
+    size_t njobs = 0;
+    off_t output_size = 0;
+    int status = scan_compressed_file(input_fd, &block_size, &jobs, &njobs, &output_size);
+    if (status > 0)
+    {
+        free(jobs);
+        close(input_fd);
+        return status;
+    }
+    int output_stream = 0;
+    int output_fd = open_output_file(output_path, O_RDWR | O_CREAT | O_TRUNC, &output_stream);
+    if (output_fd < 0)
+    {
+        free(jobs);
+        close(input_fd);
+        return STATUS_CODE_FILE_FAIL;
+    }
+    // A stream output gets every frame in order, the stored ones included, through write
+    if (!output_stream)
+        status = copy_stored_frames(input_fd, output_fd, jobs, &njobs, block_size);
+    int mapped = 0;
+    if (status == 0 && options->output_mmap && !output_stream)
+        status = decompress_file_mapped(input_fd, output_fd, jobs, njobs, block_size, output_size, options, &mapped);
+    if (status == 0 && !mapped)
+    {
+        // The output cannot be mapped (pipe, character device...) or mapping is disabled
+        off_t output_offset = 0;
+        status = run_file_jobs(input_fd, output_fd, jobs, njobs, HUFFMAN_FRAME_BOUND(block_size), block_size,
+                               decompress_block, options, &output_offset, output_stream);
+    }
+    free(jobs);
+    close(input_fd);
+    if (close(output_fd) != 0 && status == 0)
+        status = STATUS_CODE_FILE_FAIL;
+    return status;
+}
@@ -0,0 +1,114 @@
+#ifndef _HUFFMAN_FILE_H
+#define _HUFFMAN_FILE_H 1
+
+#include "huffman.h"
+#include "huffman_io.h"
+
+#define STATUS_CODE_FILE_FAIL 20
+#define STATUS_CODE_FILE_CORRUPT 21
+
+/// Magic number at the beginning of a table file ("HUFT")
+#define HUFFMAN_TABLE_FILE_MAGIC 0x54465548u
+#define HUFFMAN_TABLE_FILE_VERSION 2
+/// Stored to reject a table file written on a machine with another byte order
+#define HUFFMAN_TABLE_FILE_BYTE_ORDER 0x01020304u
+/// Offset of the table in the file, keeps the table aligned in the mapping
+#define HUFFMAN_TABLE_FILE_OFFSET 64
+
+/// Magic number at the beginning of a compressed file ("HUF1")
+#define HUFFMAN_FILE_MAGIC 0x31465548u
+#define HUFFMAN_FILE_VERSION 1
+/// [magic (4)][version (4)][block_size (4)][reserved (4)] followed by the frames of the blocks
+#define HUFFMAN_FILE_HEADER_SIZE 16
+#define HUFFMAN_FILE_DEFAULT_BLOCK_SIZE (1 << 20)
+#define HUFFMAN_FILE_MAX_BLOCK_SIZE (1 << 30)
+#define HUFFMAN_FILE_DEFAULT_QUEUE_DEPTH 8
+
+/// @brief Outcome of the level control of the workers of one call
+typedef struct HuffmanFileStats
+{
+    // Changes of level of all the workers
+    size_t nlevel_changes;
+    // Lowest level of a worker at the end
+    int final_level;
+} HuffmanFileStats;
+
+/// @brief Options of the file compressor and decompressor
+typedef struct HuffmanFileOptions
+{
+    size_t block_size;
+    // HUFFMAN_IO_PREAD or HUFFMAN_IO_URING
+    int io_backend;
+    // Number of blocks in flight
+    unsigned int queue_depth;
+    // Above 1, workers read, transform and write their own blocks with pread/pwrite instead of the I/O pipeline
+    unsigned int nthreads;
+    // Decompress straight into a shared mapping of the output file when it can be mapped
+    int output_mmap;
+    // HUFFMAN_LEVEL_FAST, HUFFMAN_LEVEL_DEFAULT or HUFFMAN_LEVEL_MAX, the highest level used when min_mb_s is set
+    int level;
+    // Compression throughput of each worker to stay above on average, in MB of input per second of CPU time, 0 to
+    // keep the level: the CPU budget is 1000 / min_mb_s seconds per GB
+    double min_mb_s;
+    // Filled by the call when not NULL
+    HuffmanFileStats *stats;
+} HuffmanFileOptions;
+
+/// @brief Level of a compressing worker kept within a CPU budget of 1000 / min_mb_s nanoseconds per byte
+///         The budget and the CPU time used are cumulative, so that the level can spend the time saved earlier.
+typedef struct HuffmanLevelController
+{
+    int level;
+    int max_level;
+    double min_mb_s;
+    // CPU time allowed for the bytes encoded so far and CPU time used, in nanoseconds
+    double budget_ns;
+    double used_ns;
+    // CPU time per byte measured at each level, 0 for a level not run yet
+    double ns_per_byte[HUFFMAN_LEVEL_MAX + 1];
+    // Blocks encoded at the current level
+    size_t nblocks;
+    // Blocks to encode at a level before trying the next slower one, doubled after each failed climb
+    size_t climb_wait;
+    // 1 while the blocks at the current level are the probe of a climb
+    int probing;
+    // Number of changes of level
+    size_t nchanges;
+} HuffmanLevelController;
+
+/// @brief Header of a table file, followed by the HuffmanTable at HUFFMAN_TABLE_FILE_OFFSET
+typedef struct HuffmanTableFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t table_size;
+    // FNV-1a hash of the bytes of the table, checked at map time instead of rebuilding the table
+    uint64_t checksum;
+} HuffmanTableFileHeader;
+
+/// @brief Table used in place from a read-only mapping of a table file
+typedef struct HuffmanMappedTable
+{
+    const HuffmanTable *table;
+    void *mapping;
+    size_t mapping_size;
+} HuffmanMappedTable;
+
+HUFFMAN_API int huffman_table_save(const HuffmanTable *, const char *);
+
+HUFFMAN_API int huffman_table_map(const char *, HuffmanMappedTable *);
+
+HUFFMAN_API void huffman_table_unmap(HuffmanMappedTable *);
+
+HUFFMAN_API void huffman_level_controller_init(HuffmanLevelController *, int, double);
+
+HUFFMAN_API int huffman_level_controller_update(HuffmanLevelController *, size_t, uint64_t);
+
+HUFFMAN_API void huffman_file_default_options(HuffmanFileOptions *);
+
+HUFFMAN_API int huffman_compress_file(const char *, const char *, const HuffmanFileOptions *);
+
+HUFFMAN_API int huffman_decompress_file(const char *, const char *, const HuffmanFileOptions *);
+
+#endif // HUFFMAN_FILE included
@@ -0,0 +1,145 @@
+#ifndef _HUFFMAN_INLINE_H
+#define _HUFFMAN_INLINE_H 1
+
+/// Encoding and decoding kernels of a HuffmanTable as static inline functions.
+/// Callers including this header get the kernels inlined into their own loops, with the frequency counting
+/// compiled out when they pass NULL. huffman_table_encode, huffman_table_decode and the frames use the same kernels,
+/// the iovec paths use the same bit writer and bit reader steps with their own cursors.
+
+#include "huffman.h"
+#include <limits.h>
+
+/// @brief Appends the code of a character to a bit buffer, the caller stores the bytes completed in the buffer
+/// @param table Pointer to the HuffmanTable structure
+/// @param c Character to encode
+/// @param buffer Bit buffer, its last count bits are not stored yet
+/// @param count Number of bits not stored yet, less than CHAR_BIT before the call
+/// @return number of bits of the code, 0 if the character has no code in the table
+static inline unsigned int huffman_inline_put_code(const HuffmanTable *table, unsigned char c, uint64_t *buffer,
+                                                   unsigned int *count)
+{
+    unsigned int code_nbits = table->nbits[c];
+    *buffer = (*buffer << code_nbits) | table->codes[c];
+    *count += code_nbits;
+    return code_nbits;
+}
+
+/// @brief Appends a byte of encoded data to a bit buffer aligned on its most significant bit
+/// @param buffer Bit buffer
+/// @param count Number of bits in the buffer, at most 64 - CHAR_BIT before the call
+/// @param byte Next byte of the encoded data, 0 past the end
+static inline void huffman_inline_refill(uint64_t *buffer, unsigned int *count, uint64_t byte)
+{
+    *buffer |= byte << (64 - CHAR_BIT - *count);
+    *count += CHAR_BIT;
+}
+
+/// @brief Decodes the character whose code starts the bit buffer and removes the code from the buffer
+/// @param table Pointer to the HuffmanTable structure
+/// @param buffer Bit buffer aligned on its most significant bit, with at least HUFFMAN_TABLE_MAX_NBITS bits
+/// @param count Number of bits in the buffer
+/// @param c Decoded character
+/// @return number of bits of the code, 0 if no code starts the buffer
+static inline unsigned int huffman_inline_get_code(const HuffmanTable *table, uint64_t *buffer, unsigned int *count,
+                                                   unsigned char *c)
+{
+    uint16_t entry = table->lookup[*buffer >> (64 - HUFFMAN_TABLE_MAX_NBITS)];
+    unsigned int code_nbits = entry & ((1u << HUFFMAN_LOOKUP_NBITS_WIDTH) - 1);
+    *c = (unsigned char)(entry >> HUFFMAN_LOOKUP_NBITS_WIDTH);
+    *buffer <<= code_nbits;
+    *count -= code_nbits;
+    return code_nbits;
+}
+
+/// @brief Appends the codes of a message after the first nbits bits of a buffer
+/// @param table Pointer to the HuffmanTable structure
+/// @param message Message to encode
+/// @param length Number of characters of the message
+/// @param data Buffer with room for length * max_nbits more bits, the bits after nbits in its last byte are ignored
+/// @param nbits Number of bits already in the buffer, updated only on success
+/// @param frequencies Array of MAX_CHAR frequencies incremented for each character or NULL
+/// @return status code, STATUS_CODE_SYMBOL_NOT_IN_TABLE if a character has no code in the table
+static inline int huffman_inline_encode(const HuffmanTable *table, const char *message, size_t length,
+                                        unsigned char *data, size_t *nbits, size_t *frequencies)
+{
+    size_t nbytes = *nbits / CHAR_BIT;
+    unsigned int count = *nbits % CHAR_BIT;
+    // Start from the bits already in the last partial byte
+    uint64_t buffer = 0;
+    if (count > 0)
+        buffer = data[nbytes] >> (CHAR_BIT - count);
+    for (size_t i = 0; i < length; ++i)
+    {
+        unsigned char c = (unsigned char)message[i];
+        if (huffman_inline_put_code(table, c, &buffer, &count) == 0)
+            return STATUS_CODE_SYMBOL_NOT_IN_TABLE;
+        while (count >= CHAR_BIT)
+        {
+            count -= CHAR_BIT;
+            data[nbytes++] = (unsigned char)(buffer >> count);
+        }
+        if (frequencies != NULL)
+            frequencies[c] += 1;
+    }
+    if (count > 0)
+        data[nbytes] = (unsigned char)(buffer << (CHAR_BIT - count));
+    *nbits = nbytes * CHAR_BIT + count;
+    return 0;
+}
+
+/// @brief Decodes a range of bits into a buffer
+/// @param table Pointer to the HuffmanTable structure
+/// @param data Encoded data, bits past nbytes are read as zeros
+/// @param nbytes Number of bytes of the encoded data
+/// @param start Position of the first bit to decode
+/// @param nbits Number of bits to decode
+/// @param decoded_message Buffer receiving the decoded characters
+/// @param capacity Number of characters the buffer can hold
+/// @param length Number of decoded characters
+/// @param frequencies Array of MAX_CHAR frequencies incremented for each character or NULL
+/// @return status code
+static inline int huffman_inline_decode(const HuffmanTable *table, const unsigned char *data, size_t nbytes,
+                                        size_t start, size_t nbits, char *decoded_message, size_t capacity,
+                                        size_t *length, size_t *frequencies)
+{
+    uint64_t buffer = 0;
+    unsigned int count = 0;
+    size_t byte_idx = start / CHAR_BIT;
+    unsigned int skip = start % CHAR_BIT;
+    size_t pos = 0;
+    size_t current_idx = 0;
+    while (pos < nbits)
+    {
+        // Keep at least HUFFMAN_TABLE_MAX_NBITS bits in the buffer, padding with zeros after the end
+        while (count <= 64 - CHAR_BIT)
+        {
+            uint64_t byte = 0;
+            if (byte_idx < nbytes)
+                byte = data[byte_idx];
+            byte_idx += 1;
+            huffman_inline_refill(&buffer, &count, byte);
+        }
+        if (skip > 0)
+        {
+            buffer <<= skip;
+            count -= skip;
+            skip = 0;
+        }
+        unsigned char c = 0;
+        unsigned int code_nbits = huffman_inline_get_code(table, &buffer, &count, &c);
+        if (code_nbits == 0)
+            return STATUS_CODE_MESSAGE_CORRUPT;
+        if (current_idx >= capacity)
+            return STATUS_CODE_BUFFER_TOO_SMALL;
+        decoded_message[current_idx++] = (char)c;
+        if (frequencies != NULL)
+            frequencies[c] += 1;
+        pos += code_nbits;
+    }
+    if (pos != nbits)
+        return STATUS_CODE_MESSAGE_CORRUPT;
+    *length = current_idx;
+    return 0;
+}
+
+#endif // HUFFMAN_INLINE included
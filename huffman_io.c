@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include "huffman_io.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#if defined(__linux__) && !defined(HUFFMAN_NO_IO_URING)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define HUFFMAN_HAS_IO_URING 1
+#else
+#define HUFFMAN_HAS_IO_URING 0
+#endif
+
+/// @brief Queues the completion of a request executed synchronously
+/// @param io Pointer to the HuffmanIo structure
+/// @param user_data Value identifying the request
+/// @param result Number of bytes transferred or negative errno
+/// @return status code
+static int push_completion(HuffmanIo *io, uint64_t user_data, int64_t result)
+{
+    if (io->completion_count == io->completion_capacity)
+        return STATUS_CODE_IO_QUEUE_FULL;
+    size_t idx = (io->completion_start + io->completion_count) % io->completion_capacity;
+    io->completions[idx].user_data = user_data;
+    io->completions[idx].result = result;
+    io->completion_count += 1;
+    return 0;
+}
+
+#if HUFFMAN_HAS_IO_URING
+/// Number of opcodes asked to the kernel, above IORING_OP_LAST of any kernel so far
+#define HUFFMAN_IO_URING_PROBE_OPS 256
+
+/// @brief Checks whether the kernel supports the opcodes used by the queue
+///         Kernels before 5.6 have neither IORING_REGISTER_PROBE nor IORING_OP_READ/WRITE and fail the probe
+/// @param ring_fd File descriptor of the io_uring instance
+/// @return status code
+static int probe_io_uring(int ring_fd)
+{
+    static const int opcodes[] = {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED};
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) +
+                                                 HUFFMAN_IO_URING_PROBE_OPS * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+        return STATUS_CODE_IO_FAIL;
+    int status = 0;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, HUFFMAN_IO_URING_PROBE_OPS) < 0)
+        status = STATUS_CODE_IO_FAIL;
+    for (size_t i = 0; status == 0 && i < sizeof(opcodes) / sizeof(opcodes[0]); ++i)
+    {
+        if (opcodes[i] >= probe->ops_len || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED))
+            status = STATUS_CODE_IO_FAIL;
+    }
+    free(probe);
+    return status;
+}
+
+/// @brief Creates the rings of an io_uring instance
+/// @param io Pointer to the HuffmanIo structure
+/// @param entries Number of submission entries
+/// @return status code
+static int setup_io_uring(HuffmanIo *io, unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0)
+        return STATUS_CODE_IO_FAIL;
+    io->ring_fd = ring_fd;
+    // An unsupported opcode would only show up as -EINVAL in the completions, fall back to pread now instead
+    if (probe_io_uring(ring_fd) > 0)
+        return STATUS_CODE_IO_FAIL;
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (io->cq_ring_size > io->sq_ring_size)
+            io->sq_ring_size = io->cq_ring_size;
+        io->cq_ring_size = 0;
+    }
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (io->sq_ring == MAP_FAILED)
+    {
+        io->sq_ring = NULL;
+        return STATUS_CODE_IO_FAIL;
+    }
+    io->cq_ring = io->sq_ring;
+    if (io->cq_ring_size > 0)
+    {
+        io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (io->cq_ring == MAP_FAILED)
+        {
+            io->cq_ring = NULL;
+            return STATUS_CODE_IO_FAIL;
+        }
+    }
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (io->sqes == MAP_FAILED)
+    {
+        io->sqes = NULL;
+        return STATUS_CODE_IO_FAIL;
+    }
+    unsigned char *sq_ring = io->sq_ring;
+    unsigned char *cq_ring = io->cq_ring;
+    io->sq_head = (unsigned int *)(sq_ring + params.sq_off.head);
+    io->sq_tail = (unsigned int *)(sq_ring + params.sq_off.tail);
+    io->sq_mask = (unsigned int *)(sq_ring + params.sq_off.ring_mask);
+    io->sq_array = (unsigned int *)(sq_ring + params.sq_off.array);
+    io->cq_head = (unsigned int *)(cq_ring + params.cq_off.head);
+    io->cq_tail = (unsigned int *)(cq_ring + params.cq_off.tail);
+    io->cq_mask = (unsigned int *)(cq_ring + params.cq_off.ring_mask);
+    io->cqes = cq_ring + params.cq_off.cqes;
+    return 0;
+}
+
+/// @brief Submits the queued entries, optionally waiting for completions
+/// @param io Pointer to the HuffmanIo structure
+/// @param min_complete Number of completions to wait for
+/// @return status code
+static int enter_io_uring(HuffmanIo *io, unsigned int min_complete)
+{
+    unsigned int flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+    while (1)
+    {
+        int nsubmitted = (int)syscall(__NR_io_uring_enter, io->ring_fd, io->nqueued, min_complete, flags, NULL, 0);
+        if (nsubmitted >= 0)
+        {
+            io->nqueued -= (unsigned int)nsubmitted;
+            io->ninflight += (unsigned int)nsubmitted;
+            return 0;
+        }
+        if (errno != EINTR)
+            return STATUS_CODE_IO_FAIL;
+    }
+}
+
+/// @brief Fills the next submission entry, the submission itself is batched until huffman_io_wait
+/// @param io Pointer to the HuffmanIo structure
+/// @param opcode IORING_OP_READ(_FIXED) or IORING_OP_WRITE(_FIXED)
+/// @param fd File descriptor
+/// @param buffer Buffer to read into or write from
+/// @param length Number of bytes
+/// @param offset Offset in the file
+/// @param buffer_index Index of the registered buffer or -1
+/// @param user_data Value identifying the request
+/// @return status code
+static int queue_io_uring(HuffmanIo *io, int opcode, int fd, const void *buffer, size_t length,
+                          off_t offset, int buffer_index, uint64_t user_data)
+{
+    unsigned int head = __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *io->sq_tail;
+    if (tail - head > *io->sq_mask)
+    {
+        int status = enter_io_uring(io, 0);
+        if (status > 0)
+            return status;
+        head = __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head > *io->sq_mask)
+            return STATUS_CODE_IO_QUEUE_FULL;
+    }
+    unsigned int index = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)io->sqes + index;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)length;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = user_data;
+    if (buffer_index >= 0 && io->registered_buffers)
+    {
+        sqe->opcode = (uint8_t)((opcode == IORING_OP_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED);
+        sqe->buf_index = (uint16_t)buffer_index;
+    }
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->nqueued += 1;
+    return 0;
+}
+#endif
+
+/// @brief Checks whether a backend can be used on this machine, io_uring can be compiled out or
+///         forbidden at runtime (old kernels, containers, seccomp)
+/// @param backend HUFFMAN_IO_PREAD or HUFFMAN_IO_URING
+/// @return 1 if available, 0 otherwise
+int huffman_io_available(int backend)
+{
+    if (backend == HUFFMAN_IO_PREAD)
+        return 1;
+    HuffmanIo io;
+    int status = create_huffman_io(&io, backend, 1);
+    int available = (status == 0 && io.backend == backend);
+    free_huffman_io(&io);
+    return available;
+}
+
+/// @brief Creates an I/O queue, falling back to HUFFMAN_IO_PREAD when io_uring is unavailable
+/// @param io Pointer to the HuffmanIo structure to initialize, io->backend is the backend in use
+/// @param backend HUFFMAN_IO_PREAD or HUFFMAN_IO_URING
+/// @param queue_depth Maximum number of reads and writes in flight
+/// @return status code
+int create_huffman_io(HuffmanIo *io, int backend, unsigned int queue_depth)
+{
+    memset(io, 0, sizeof(HuffmanIo));
+    io->ring_fd = -1;
+    io->queue_depth = (queue_depth > 0) ? queue_depth : 1;
+#if HUFFMAN_HAS_IO_URING
+    if (backend == HUFFMAN_IO_URING)
+    {
+        if (setup_io_uring(io, io->queue_depth) == 0)
+        {
+            io->backend = HUFFMAN_IO_URING;
+            return 0;
+        }
+        free_huffman_io(io);
+        io->ring_fd = -1;
+        io->queue_depth = (queue_depth > 0) ? queue_depth : 1;
+    }
+#else
+    (void)backend;
+#endif
+    io->backend = HUFFMAN_IO_PREAD;
+    io->completion_capacity = io->queue_depth;
+    io->completions = malloc(io->completion_capacity * sizeof(HuffmanIoCompletion));
+    if (io->completions == NULL)
+        return STATUS_CODE_IO_FAIL;
+    return 0;
+}
+
+/// @brief Registers the buffers used by the requests so the kernel maps them once
+///         Does nothing with HUFFMAN_IO_PREAD, a failure only disables the registered buffers
+/// @param io Pointer to the HuffmanIo structure
+/// @param buffers Array of buffers
+/// @param sizes Size of each buffer
+/// @param nbuffers Number of buffers
+/// @return status code
+int huffman_io_register_buffers(HuffmanIo *io, void *const *buffers, const size_t *sizes, unsigned int nbuffers)
+{
+#if HUFFMAN_HAS_IO_URING
+    if (io->backend != HUFFMAN_IO_URING || nbuffers == 0)
+        return 0;
+    struct iovec *iovecs = malloc(nbuffers * sizeof(struct iovec));
+    if (iovecs == NULL)
+        return STATUS_CODE_IO_FAIL;
+    for (unsigned int i = 0; i < nbuffers; ++i)
+    {
+        iovecs[i].iov_base = buffers[i];
+        iovecs[i].iov_len = sizes[i];
+    }
+    int registered = (int)syscall(__NR_io_uring_register, io->ring_fd, IORING_REGISTER_BUFFERS, iovecs, nbuffers);
+    free(iovecs);
+    io->registered_buffers = (registered == 0);
+#else
+    (void)io;
+    (void)buffers;
+    (void)sizes;
+    (void)nbuffers;
+#endif
+    return 0;
+}
+
+/// @brief Queues a read, its result is returned by huffman_io_wait
+/// @param io Pointer to the HuffmanIo structure
+/// @param fd File descriptor
+/// @param buffer Buffer to read into
+/// @param length Number of bytes to read
+/// @param offset Offset in the file
+/// @param buffer_index Index of the buffer given to huffman_io_register_buffers or -1
+/// @param user_data Value identifying the request
+/// @return status code
+int huffman_io_read(HuffmanIo *io, int fd, void *buffer, size_t length, off_t offset, int buffer_index, uint64_t user_data)
+{
+#if HUFFMAN_HAS_IO_URING
+    if (io->backend == HUFFMAN_IO_URING)
+        return queue_io_uring(io, IORING_OP_READ, fd, buffer, length, offset, buffer_index, user_data);
+#else
+    (void)buffer_index;
+#endif
+    ssize_t nread = pread(fd, buffer, length, offset);
+    return push_completion(io, user_data, (nread < 0) ? -errno : (int64_t)nread);
+}
+
+/// @brief Queues a write, its result is returned by huffman_io_wait
+/// @param io Pointer to the HuffmanIo structure
+/// @param fd File descriptor
+/// @param buffer Buffer to write from
+/// @param length Number of bytes to write
+/// @param offset Offset in the file
+/// @param buffer_index Index of the buffer given to huffman_io_register_buffers or -1
+/// @param user_data Value identifying the request
+/// @return status code
+int huffman_io_write(HuffmanIo *io, int fd, const void *buffer, size_t length, off_t offset, int buffer_index, uint64_t user_data)
+{
+#if HUFFMAN_HAS_IO_URING
+    if (io->backend == HUFFMAN_IO_URING)
+        return queue_io_uring(io, IORING_OP_WRITE, fd, buffer, length, offset, buffer_index, user_data);
+#else
+    (void)buffer_index;
+#endif
+    ssize_t nwritten = pwrite(fd, buffer, length, offset);
+    return push_completion(io, user_data, (nwritten < 0) ? -errno : (int64_t)nwritten);
+}
+
+/// @brief Submits the queued requests and waits for the next completion
+/// @param io Pointer to the HuffmanIo structure
+/// @param completion Pointer to the HuffmanIoCompletion structure to fill
+/// @return status code
+int huffman_io_wait(HuffmanIo *io, HuffmanIoCompletion *completion)
+{
+#if HUFFMAN_HAS_IO_URING
+    if (io->backend == HUFFMAN_IO_URING)
+    {
+        while (1)
+        {
+            unsigned int head = *io->cq_head;
+            unsigned int tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+            if (head != tail)
+            {
+                struct io_uring_cqe *cqe = (struct io_uring_cqe *)io->cqes + (head & *io->cq_mask);
+                completion->user_data = cqe->user_data;
+                completion->result = cqe->res;
+                __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+                io->ninflight -= 1;
+                return 0;
+            }
+            if (io->nqueued == 0 && io->ninflight == 0)
+                return STATUS_CODE_IO_FAIL;
+            int status = enter_io_uring(io, 1);
+            if (status > 0)
+                return status;
+        }
+    }
+#endif
+    if (io->completion_count == 0)
+        return STATUS_CODE_IO_FAIL;
+    *completion = io->completions[io->completion_start];
+    io->completion_start = (io->completion_start + 1) % io->completion_capacity;
+    io->completion_count -= 1;
+    return 0;
+}
+
+/// @brief Frees resources associated with an I/O queue
+/// @param io Pointer to the HuffmanIo structure to free
+void free_huffman_io(HuffmanIo *io)
+{
+    if (io->completions != NULL)
+        free(io->completions);
+    io->completions = NULL;
+    if (io->sqes != NULL)
+        munmap(io->sqes, io->sqes_size);
+    if (io->cq_ring != NULL && io->cq_ring != io->sq_ring)
+        munmap(io->cq_ring, io->cq_ring_size);
+    if (io->sq_ring != NULL)
+        munmap(io->sq_ring, io->sq_ring_size);
+    if (io->ring_fd >= 0)
+        close(io->ring_fd);
+    memset(io, 0, sizeof(HuffmanIo));
+    io->ring_fd = -1;
+}
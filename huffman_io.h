@@ -0,0 +1,77 @@
+#ifndef _HUFFMAN_IO_H
+#define _HUFFMAN_IO_H 1
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/// Functions of the public API, as in huffman.h
+#ifndef HUFFMAN_API
+#if defined(__GNUC__)
+#define HUFFMAN_API __attribute__((visibility("default")))
+#else
+#define HUFFMAN_API
+#endif
+#endif
+
+#define STATUS_CODE_IO_FAIL 30
+#define STATUS_CODE_IO_QUEUE_FULL 31
+
+/// Synchronous pread/pwrite, always available
+#define HUFFMAN_IO_PREAD 0
+/// Asynchronous io_uring with registered buffers, falls back to HUFFMAN_IO_PREAD when unavailable
+#define HUFFMAN_IO_URING 1
+
+/// @brief Completed read or write
+typedef struct HuffmanIoCompletion
+{
+    uint64_t user_data;
+    int64_t result;
+} HuffmanIoCompletion;
+
+/// @brief Queue of reads and writes executed by one of the I/O backends
+typedef struct HuffmanIo
+{
+    int backend;
+    unsigned int queue_depth;
+    // HUFFMAN_IO_PREAD: the requests are executed when queued and their completions kept here
+    HuffmanIoCompletion *completions;
+    size_t completion_start;
+    size_t completion_count;
+    size_t completion_capacity;
+    // HUFFMAN_IO_URING: rings shared with the kernel
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    void *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    void *cqes;
+    unsigned int nqueued;
+    unsigned int ninflight;
+    int registered_buffers;
+} HuffmanIo;
+
+HUFFMAN_API int huffman_io_available(int);
+
+HUFFMAN_API int create_huffman_io(HuffmanIo *, int, unsigned int);
+
+HUFFMAN_API int huffman_io_register_buffers(HuffmanIo *, void *const *, const size_t *, unsigned int);
+
+HUFFMAN_API int huffman_io_read(HuffmanIo *, int, void *, size_t, off_t, int, uint64_t);
+
+HUFFMAN_API int huffman_io_write(HuffmanIo *, int, const void *, size_t, off_t, int, uint64_t);
+
+HUFFMAN_API int huffman_io_wait(HuffmanIo *, HuffmanIoCompletion *);
+
+HUFFMAN_API void free_huffman_io(HuffmanIo *);
+
+#endif // HUFFMAN_IO included
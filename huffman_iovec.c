@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+#include "huffman_iovec.h"
+#include "huffman_inline.h"
+#include <limits.h>
+
+/// @brief Position in a chain of segments
+typedef struct HuffmanIovecCursor
+{
+    const struct iovec *iov;
+    int count;
+    int index;
+    size_t offset;
+} HuffmanIovecCursor;
+
+/// @brief Moves the cursor past the end of exhausted and empty segments
+/// @return 1 if a byte is available, 0 at the end of the chain
+static inline int huffman_iovec_available(HuffmanIovecCursor *cursor)
+{
+    while (cursor->index < cursor->count && cursor->offset >= cursor->iov[cursor->index].iov_len)
+    {
+        cursor->index += 1;
+        cursor->offset = 0;
+    }
+    return cursor->index < cursor->count;
+}
+
+/// @brief Encodes a message split in segments into a chain of output segments
+///         The bits cross segment boundaries: the output bytes are the same as those of huffman_table_encode
+///         laid end to end over the output segments, ready to be written with writev.
+/// @param table Pointer to the HuffmanTable structure
+/// @param input Segments of the message
+/// @param input_count Number of input segments
+/// @param output Segments receiving the encoded bytes
+/// @param output_count Number of output segments
+/// @param nbits Number of bits of the encoded message, filling the first (nbits + 7) / 8 output bytes
+/// @return status code, STATUS_CODE_BUFFER_TOO_SMALL if the output segments are too short
+int huffman_table_encodev(const HuffmanTable *table, const struct iovec *input, int input_count,
+                          const struct iovec *output, int output_count, size_t *nbits)
+{
+    HuffmanIovecCursor writer = {output, output_count, 0, 0};
+    uint64_t buffer = 0;
+    unsigned int count = 0;
+    size_t nbytes = 0;
+    for (int segment = 0; segment < input_count; ++segment)
+    {
+        const unsigned char *data = input[segment].iov_base;
+        for (size_t i = 0; i < input[segment].iov_len; ++i)
+        {
+            if (huffman_inline_put_code(table, data[i], &buffer, &count) == 0)
+                return STATUS_CODE_SYMBOL_NOT_IN_TABLE;
+            while (count >= CHAR_BIT)
+            {
+                count -= CHAR_BIT;
+                if (!huffman_iovec_available(&writer))
+                    return STATUS_CODE_BUFFER_TOO_SMALL;
+                ((unsigned char *)writer.iov[writer.index].iov_base)[writer.offset++] = (unsigned char)(buffer >> count);
+                nbytes += 1;
+            }
+        }
+    }
+    if (count > 0)
+    {
+        if (!huffman_iovec_available(&writer))
+            return STATUS_CODE_BUFFER_TOO_SMALL;
+        ((unsigned char *)writer.iov[writer.index].iov_base)[writer.offset++] = (unsigned char)(buffer << (CHAR_BIT - count));
+    }
+    *nbits = nbytes * CHAR_BIT + count;
+    return 0;
+}
+
+/// @brief Decodes a message whose encoded bytes are split in segments into a chain of output segments
+/// @param table Pointer to the HuffmanTable structure
+/// @param input Segments of the encoded bytes, bits past the last segment are read as zeros
+/// @param input_count Number of input segments
+/// @param nbits Number of bits to decode
+/// @param output Segments receiving the decoded characters end to end
+/// @param output_count Number of output segments
+/// @param length Number of decoded characters
+/// @return status code, STATUS_CODE_BUFFER_TOO_SMALL if the output segments are too short
+int huffman_table_decodev(const HuffmanTable *table, const struct iovec *input, int input_count, size_t nbits,
+                          const struct iovec *output, int output_count, size_t *length)
+{
+    HuffmanIovecCursor reader = {input, input_count, 0, 0};
+    HuffmanIovecCursor writer = {output, output_count, 0, 0};
+    uint64_t buffer = 0;
+    unsigned int count = 0;
+    size_t pos = 0;
+    size_t current_idx = 0;
+    while (pos < nbits)
+    {
+        // Keep at least HUFFMAN_TABLE_MAX_NBITS bits in the buffer, padding with zeros after the end
+        while (count <= 64 - CHAR_BIT)
+        {
+            uint64_t byte = 0;
+            if (huffman_iovec_available(&reader))
+                byte = ((const unsigned char *)reader.iov[reader.index].iov_base)[reader.offset++];
+            huffman_inline_refill(&buffer, &count, byte);
+        }
+        unsigned char c = 0;
+        unsigned int code_nbits = huffman_inline_get_code(table, &buffer, &count, &c);
+        if (code_nbits == 0)
+            return STATUS_CODE_MESSAGE_CORRUPT;
+        if (!huffman_iovec_available(&writer))
+            return STATUS_CODE_BUFFER_TOO_SMALL;
+        ((char *)writer.iov[writer.index].iov_base)[writer.offset++] = (char)c;
+        current_idx += 1;
+        pos += code_nbits;
+    }
+    if (pos != nbits)
+        return STATUS_CODE_MESSAGE_CORRUPT;
+    *length = current_idx;
+    return 0;
+}
+
+/// @brief Shortens a chain of segments to its first bytes, for example before passing the output to writev
+/// @param iov Segments, the length of the last kept segment is reduced
+/// @param count Number of segments
+/// @param nbytes Number of bytes to keep
+/// @return number of segments holding the first nbytes bytes
+int huffman_iovec_truncate(struct iovec *iov, int count, size_t nbytes)
+{
+    int kept = 0;
+    while (kept < count && nbytes > 0)
+    {
+        if (iov[kept].iov_len > nbytes)
+            iov[kept].iov_len = nbytes;
+        nbytes -= iov[kept].iov_len;
+        kept += 1;
+    }
+    return kept;
+}
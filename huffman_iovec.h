@@ -0,0 +1,16 @@
+#ifndef _HUFFMAN_IOVEC_H
+#define _HUFFMAN_IOVEC_H 1
+
+/// Encoding and decoding of messages split in segments, for callers building writev/readv chains.
+/// Kept apart from huffman.h so that the core header does not depend on POSIX headers.
+
+#include "huffman.h"
+#include <sys/uio.h>
+
+HUFFMAN_API int huffman_table_encodev(const HuffmanTable *, const struct iovec *, int, const struct iovec *, int, size_t *);
+
+HUFFMAN_API int huffman_table_decodev(const HuffmanTable *, const struct iovec *, int, size_t, const struct iovec *, int, size_t *);
+
+HUFFMAN_API int huffman_iovec_truncate(struct iovec *, int, size_t);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef _HUFFMAN_TRACE_H
+#define _HUFFMAN_TRACE_H 1
+
+/// Static tracepoints of the codec stages, in the "huffman" provider.
+/// With <sys/sdt.h> each probe is a single nop recorded in the .note.stapsdt section,
+/// bpftrace attaches to it as usdt:<binary>:huffman:<name> and reads the arguments as arg0, arg1, ...
+/// Without the header, or with HUFFMAN_NO_TRACE defined, the probes and their arguments compile out.
+///
+/// Every *_start probe is followed by its *_done probe, also when the call fails with a non-zero status.
+///
+/// Probes and arguments:
+///   table_build_start(nsymbols)                  table_build_done(max_nbits, nsymbols)
+///   encode_start(length)                         encode_done(length, nbits, status)
+///   decode_start(nbits)                          decode_done(nbits, length, status)
+///   records_decode_start(count, nbytes)          records_decode_done(count, status)
+///   frame_encode_start(length)                   frame_encode_done(length, mode, frame_length, status)
+///   frame_decode_start(raw_length, mode)         frame_decode_done(raw_length, mode, status)
+///   block_compress_start(length)                 block_compress_done(length, output_length, status)
+///   block_decompress_start(length)               block_decompress_done(length, output_length, status)
+///   block_level(level, slack_us)                 slack_us is signed, negative over the CPU budget
+
+#if !defined(HUFFMAN_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HUFFMAN_TRACE_ENABLED 1
+#endif
+#endif
+
+#if HUFFMAN_TRACE_ENABLED
+#define HUFFMAN_TRACE1(name, a) DTRACE_PROBE1(huffman, name, a)
+#define HUFFMAN_TRACE2(name, a, b) DTRACE_PROBE2(huffman, name, a, b)
+#define HUFFMAN_TRACE3(name, a, b, c) DTRACE_PROBE3(huffman, name, a, b, c)
+#define HUFFMAN_TRACE4(name, a, b, c, d) DTRACE_PROBE4(huffman, name, a, b, c, d)
+#else
+#define HUFFMAN_TRACE1(name, a) \
+    do                          \
+    {                           \
+    } while (0)
+#define HUFFMAN_TRACE2(name, a, b) \
+    do                             \
+    {                              \
+    } while (0)
+#define HUFFMAN_TRACE3(name, a, b, c) \
+    do                                \
+    {                                 \
+    } while (0)
+#define HUFFMAN_TRACE4(name, a, b, c, d) \
+    do                                   \
+    {                                    \
+    } while (0)
+#endif
+
+#endif // HUFFMAN_TRACE included
@@ -0,0 +1,95 @@
+#define _POSIX_C_SOURCE 200809L
+#include "huffman_daemon.h"
+#include "huffman_file.h"
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+/// Largest number of cached tables given with -T
+#define HUFFMAND_MAX_TABLES 64
+
+/// @brief Prints the usage of the daemon
+/// @param program Name of the program
+static void print_usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-s socket] [-t threads] [-b max_batch] [-T table_file]...\n"
+            "  -s  path of the Unix domain socket (default /tmp/huffmand.sock)\n"
+            "  -t  number of workers (default 4)\n"
+            "  -b  largest number of requests taken together by a worker (default %d)\n"
+            "  -T  table file written by huffman_table_save, the n-th one is table id n\n",
+            program, HUFFMAN_DAEMON_DEFAULT_MAX_BATCH);
+}
+
+int main(int argc, char **argv)
+{
+    HuffmanDaemonOptions options;
+    huffman_daemon_default_options(&options, "/tmp/huffmand.sock");
+    HuffmanMappedTable mapped_tables[HUFFMAND_MAX_TABLES];
+    const HuffmanTable *tables[HUFFMAND_MAX_TABLES];
+    size_t ntables = 0;
+    int status = 0;
+    int opt = 0;
+    while (status == 0 && (opt = getopt(argc, argv, "s:t:b:T:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            options.socket_path = optarg;
+            break;
+        case 't':
+            options.nthreads = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            options.max_batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            if (ntables == HUFFMAND_MAX_TABLES)
+            {
+                status = STATUS_CODE_INDEX_OUT_OF_RANGE;
+                break;
+            }
+            status = huffman_table_map(optarg, &mapped_tables[ntables]);
+            if (status > 0)
+            {
+                fprintf(stderr, "ERROR: cannot map the table file %s, status code %d\n", optarg, status);
+                break;
+            }
+            tables[ntables] = mapped_tables[ntables].table;
+            ntables += 1;
+            break;
+        default:
+            print_usage(argv[0]);
+            status = 1;
+        }
+    }
+    options.tables = tables;
+    options.ntables = ntables;
+    // The signals are waited for by the main thread only, block them before starting the other threads
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    HuffmanDaemon daemon;
+    if (status == 0)
+    {
+        status = create_huffman_daemon(&daemon, &options);
+        if (status > 0)
+            fprintf(stderr, "ERROR: cannot listen on %s, status code %d\n", options.socket_path, status);
+    }
+    if (status == 0)
+    {
+        fprintf(stderr, "huffmand: listening on %s with %u workers and %zu tables\n", options.socket_path,
+                options.nthreads, ntables);
+        int signal_number = 0;
+        sigwait(&signals, &signal_number);
+        free_huffman_daemon(&daemon);
+        fprintf(stderr, "huffmand: %llu requests in %llu batches\n", (unsigned long long)daemon.nrequests,
+                (unsigned long long)daemon.nbatches);
+    }
+    for (size_t i = 0; i < ntables; ++i)
+        huffman_table_unmap(&mapped_tables[i]);
+    return status;
+}
@@ -1,8 +1,22 @@
+#define _POSIX_C_SOURCE 200809L
 #include "huffman.h"
+#include "huffman_file.h"
+#include "huffman_daemon.h"
+#include "huffman_inline.h"
+#include "huffman_iovec.h"
+#include "huffman_endian.h"
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
 #include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 void test_huffman(const char *message)
 {
@@ -31,6 +45,1053 @@ void test_huffman(const char *message)
         free(decoded_message);
 }
 
+/// Number of bits of a message coded with optimal code lengths, the sum of the weights merged by Huffman's algorithm
+size_t optimal_code_nbits(const size_t *frequencies)
+{
+    size_t weights[MAX_CHAR];
+    size_t nweights = 0;
+    for (size_t c = 0; c < MAX_CHAR; ++c)
+        if (frequencies[c] > 0)
+            weights[nweights++] = frequencies[c];
+    size_t nbits = 0;
+    while (nweights > 1)
+    {
+        // Move the two smallest weights to the end and merge them
+        for (size_t k = 0; k < 2; ++k)
+        {
+            size_t smallest = 0;
+            for (size_t i = 1; i < nweights - k; ++i)
+                if (weights[i] < weights[smallest])
+                    smallest = i;
+            size_t weight = weights[smallest];
+            weights[smallest] = weights[nweights - k - 1];
+            weights[nweights - k - 1] = weight;
+        }
+        weights[nweights - 2] += weights[nweights - 1];
+        nbits += weights[nweights - 2];
+        nweights -= 1;
+    }
+    return nbits;
+}
+
+/// The heap of the legacy tree, also used to build the tables, gives a message optimal code lengths
+void test_huffman_optimal_tree(const char *message)
+{
+    size_t frequencies[MAX_CHAR] = {0};
+    for (size_t i = 0; message[i] != '\0'; ++i)
+        frequencies[(unsigned char)message[i]] += 1;
+    size_t optimal_nbits = optimal_code_nbits(frequencies);
+    HuffmanTable table;
+    int status = build_huffman_table(frequencies, &table);
+    assert(status == 0);
+    size_t table_nbits = 0;
+    for (size_t c = 0; c < MAX_CHAR; ++c)
+        table_nbits += frequencies[c] * table.nbits[c];
+    assert(table_nbits == optimal_nbits);
+    EncodedMessage encoded_message = {
+        .header = {.data = NULL, .nbits = 0, .nbytes = 0},
+        .message = {.data = NULL, .nbits = 0, .nbytes = 0}};
+    status = huffman_encode(message, &encoded_message);
+    assert(status == 0);
+    assert(encoded_message.message.nbits == optimal_nbits);
+    free_encoded_message(&encoded_message);
+    printf("OPTIMAL TREE: %s, %zu bits\n", message, optimal_nbits);
+}
+
+void test_huffman_stream(const char *message, size_t block_length, int mode)
+{
+    size_t length = strlen(message);
+    HuffmanStream encoder;
+    HuffmanStream decoder;
+    huffman_stream_init(&encoder, mode);
+    huffman_stream_init(&decoder, mode);
+    if (mode == HUFFMAN_STREAM_DRIFT_TABLE)
+    {
+        int status = huffman_stream_set_window(&encoder, 4 * block_length, 0);
+        assert(status == 0);
+    }
+    size_t nbits = 0;
+    size_t nreused = 0;
+    for (size_t start = 0; start < length; start += block_length)
+    {
+        size_t current_length = (length - start < block_length) ? length - start : block_length;
+        EncodedMessage encoded_block = {
+            .header = {.data = NULL, .nbits = 0, .nbytes = 0},
+            .message = {.data = NULL, .nbits = 0, .nbytes = 0}};
+        int status = huffman_stream_encode(&encoder, message + start, current_length, &encoded_block);
+        assert(status == 0);
+        nbits += encoded_block.header.nbits + encoded_block.message.nbits;
+        if (encoded_block.header.nbytes == 0)
+            nreused += 1;
+        char *block = NULL;
+        size_t decoded_length = 0;
+        status = huffman_stream_decode(&decoder, &encoded_block, &block, &decoded_length);
+        assert(status == 0);
+        assert(decoded_length == current_length);
+        assert(memcmp(block, message + start, current_length) == 0);
+        free(block);
+        free_encoded_message(&encoded_block);
+    }
+    printf("STREAM (mode=%d): %zu bits, %zu blocks without header, %zu tables\n", mode, nbits, nreused, encoder.nrebuilds);
+    if (mode == HUFFMAN_STREAM_FRESH_TABLE)
+        assert(nreused == 0);
+    assert(encoder.nrebuilds == decoder.nrebuilds);
+    free_huffman_stream(&encoder);
+    free_huffman_stream(&decoder);
+}
+
+/// Each shard is processed by a child process standing in for a worker node
+void test_huffman_histogram_shards(const char *message, size_t nshards)
+{
+    size_t length = strlen(message);
+    size_t shard_length = length / nshards + 1;
+    HuffmanHistogram merged;
+    huffman_histogram_init(&merged);
+    for (size_t shard = 0; shard < nshards; ++shard)
+    {
+        size_t start = (shard * shard_length < length) ? shard * shard_length : length;
+        size_t end = (start + shard_length < length) ? start + shard_length : length;
+        int fds[2];
+        int status = pipe(fds);
+        assert(status == 0);
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0)
+        {
+            // Worker: histogram the local shard and send it serialized
+            close(fds[0]);
+            HuffmanHistogram histogram;
+            huffman_histogram_init(&histogram);
+            huffman_histogram_add(&histogram, message + start, end - start);
+            BitMessage serialized = {.data = NULL, .nbits = 0, .nbytes = 0};
+            if (huffman_histogram_serialize(&histogram, &serialized) != 0)
+                _exit(1);
+            ssize_t written = write(fds[1], serialized.data, serialized.nbytes);
+            _exit(written == (ssize_t)serialized.nbytes ? 0 : 1);
+        }
+        close(fds[1]);
+        unsigned char buffer[1 + MAX_CHAR * 10];
+        size_t nbytes = 0;
+        ssize_t nread = 0;
+        while ((nread = read(fds[0], buffer + nbytes, sizeof(buffer) - nbytes)) > 0)
+            nbytes += (size_t)nread;
+        close(fds[0]);
+        int child_status = 0;
+        pid_t waited = waitpid(pid, &child_status, 0);
+        assert(waited == pid && WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0);
+        BitMessage serialized = {.data = buffer, .nbits = nbytes * 8, .nbytes = nbytes};
+        HuffmanHistogram histogram;
+        status = huffman_histogram_deserialize(&serialized, &histogram);
+        assert(status == 0);
+        huffman_histogram_merge(&merged, &histogram);
+    }
+    // The merged counts are the counts of the whole message
+    HuffmanHistogram expected;
+    huffman_histogram_init(&expected);
+    huffman_histogram_add(&expected, message, length);
+    assert(memcmp(&merged, &expected, sizeof(HuffmanHistogram)) == 0);
+    // A count uses at most 64 bits: ten bytes holding UINT64_MAX are accepted, a larger tenth byte is not
+    unsigned char varints[1 + 10 + MAX_CHAR - 1] = {HUFFMAN_HISTOGRAM_VERSION};
+    memset(varints + 1, 0xFF, 9);
+    varints[10] = 0x01;
+    BitMessage overflow = {.data = varints, .nbits = sizeof(varints) * 8, .nbytes = sizeof(varints)};
+    HuffmanHistogram decoded_histogram;
+    int status = huffman_histogram_deserialize(&overflow, &decoded_histogram);
+    assert(status == 0 && decoded_histogram.counts[0] == UINT64_MAX);
+    varints[10] = 0x03;
+    status = huffman_histogram_deserialize(&overflow, &decoded_histogram);
+    assert(status == STATUS_CODE_HEADER_CORRUPT);
+    varints[10] = 0x81;
+    status = huffman_histogram_deserialize(&overflow, &decoded_histogram);
+    assert(status == STATUS_CODE_HEADER_CORRUPT);
+    HuffmanTable table;
+    status = huffman_table_from_histogram(&merged, &table);
+    assert(status == 0);
+    // Every worker encodes its shard with the shared table
+    size_t nbits = 0;
+    for (size_t start = 0; start < length; start += shard_length)
+    {
+        size_t current_length = (length - start < shard_length) ? length - start : shard_length;
+        BitMessage encoded = {.data = NULL, .nbits = 0, .nbytes = 0};
+        status = huffman_table_encode(&table, message + start, current_length, &encoded);
+        assert(status == 0);
+        nbits += encoded.nbits;
+        char *decoded = NULL;
+        size_t decoded_length = 0;
+        status = huffman_table_decode(&table, &encoded, &decoded, &decoded_length);
+        assert(status == 0);
+        assert(decoded_length == current_length);
+        assert(memcmp(decoded, message + start, current_length) == 0);
+        free(decoded);
+        free(encoded.data);
+    }
+    printf("SHARDS (n=%zu): %zu bits with a shared table of %u characters\n", nshards, nbits, (unsigned int)table.length);
+}
+
+/// Rebuild the table of a message from its code lengths alone
+void test_huffman_code_lengths(const char *message)
+{
+    size_t frequencies[MAX_CHAR] = {0};
+    for (size_t i = 0; message[i] != '\0'; ++i)
+        frequencies[(unsigned char)message[i]] += 1;
+    HuffmanTable table;
+    int status = build_huffman_table(frequencies, &table);
+    assert(status == 0);
+    // The table is the canonical code of its lengths
+    unsigned char lengths[MAX_CHAR];
+    HuffmanTable rebuilt;
+    status = huffman_code_lengths(frequencies, lengths);
+    assert(status == 0 && memcmp(lengths, table.nbits, sizeof(lengths)) == 0);
+    status = huffman_table_from_lengths(lengths, &rebuilt);
+    assert(status == 0);
+    assert(memcmp(&rebuilt, &table, sizeof(HuffmanTable)) == 0);
+    // Three codes of one bit are not a prefix code
+    memset(lengths, 0, sizeof(lengths));
+    memset(lengths, 1, 3);
+    status = huffman_table_from_lengths(lengths, &rebuilt);
+    assert(status == STATUS_CODE_HEADER_CORRUPT);
+    printf("CODE LENGTHS: %u characters, at most %u bits\n", (unsigned int)table.length, (unsigned int)table.max_nbits);
+}
+
+/// Child processes stand in for the workers of a prefork server sharing the mapped table
+void test_huffman_mapped_table(const char *message, size_t nworkers)
+{
+    size_t length = strlen(message);
+    HuffmanHistogram histogram;
+    huffman_histogram_init(&histogram);
+    huffman_histogram_add(&histogram, message, length);
+    HuffmanTable table;
+    int status = huffman_table_from_histogram(&histogram, &table);
+    assert(status == 0);
+    char path[] = "/tmp/test_huffman_table_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+    status = huffman_table_save(&table, path);
+    assert(status == 0);
+    for (size_t worker = 0; worker < nworkers; ++worker)
+    {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0)
+        {
+            HuffmanMappedTable mapped_table;
+            if (huffman_table_map(path, &mapped_table) != 0)
+                _exit(1);
+            BitMessage encoded = {.data = NULL, .nbits = 0, .nbytes = 0};
+            char *decoded = NULL;
+            size_t decoded_length = 0;
+            int ok = huffman_table_encode(mapped_table.table, message, length, &encoded) == 0 &&
+                     huffman_table_decode(mapped_table.table, &encoded, &decoded, &decoded_length) == 0 &&
+                     decoded_length == length && memcmp(decoded, message, length) == 0;
+            huffman_table_unmap(&mapped_table);
+            _exit(ok ? 0 : 1);
+        }
+        int child_status = 0;
+        pid_t waited = waitpid(pid, &child_status, 0);
+        assert(waited == pid && WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0);
+    }
+    // The mapped table encodes exactly like the table it was saved from
+    HuffmanMappedTable mapped_table;
+    status = huffman_table_map(path, &mapped_table);
+    assert(status == 0);
+    assert(memcmp(mapped_table.table, &table, sizeof(HuffmanTable)) == 0);
+    huffman_table_unmap(&mapped_table);
+    // Saving another table replaces the file without changing the table already mapped
+    status = huffman_table_map(path, &mapped_table);
+    assert(status == 0);
+    huffman_histogram_init(&histogram);
+    huffman_histogram_add(&histogram, "abbccccc", 8);
+    HuffmanTable other;
+    status = huffman_table_from_histogram(&histogram, &other);
+    assert(status == 0 && memcmp(&other, &table, sizeof(HuffmanTable)) != 0);
+    status = huffman_table_save(&other, path);
+    assert(status == 0);
+    assert(memcmp(mapped_table.table, &table, sizeof(HuffmanTable)) == 0);
+    huffman_table_unmap(&mapped_table);
+    // A file with a flipped bit in its table is rejected
+    status = huffman_table_save(&table, path);
+    assert(status == 0);
+    fd = open(path, O_RDWR);
+    assert(fd >= 0);
+    off_t lookup_offset = HUFFMAN_TABLE_FILE_OFFSET + offsetof(HuffmanTable, lookup);
+    unsigned char byte = 0;
+    ssize_t nbytes = pread(fd, &byte, 1, lookup_offset);
+    assert(nbytes == 1);
+    byte ^= 1;
+    nbytes = pwrite(fd, &byte, 1, lookup_offset);
+    assert(nbytes == 1);
+    close(fd);
+    status = huffman_table_map(path, &mapped_table);
+    assert(status == STATUS_CODE_FILE_CORRUPT);
+    // A truncated file is rejected
+    status = truncate(path, 100);
+    assert(status == 0);
+    status = huffman_table_map(path, &mapped_table);
+    assert(status == STATUS_CODE_FILE_CORRUPT);
+    unlink(path);
+    printf("MAPPED TABLE: %zu workers\n", nworkers);
+}
+
+void test_huffman_batch(const char *message, size_t count)
+{
+    size_t length = strlen(message);
+    const char **records = malloc(count * sizeof(char *));
+    size_t *lengths = malloc(count * sizeof(size_t));
+    assert(records != NULL && lengths != NULL);
+    // Short overlapping records of 0 to 40 characters
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t start = (i * 37) % length;
+        records[i] = message + start;
+        lengths[i] = (i * 13) % 41;
+        if (lengths[i] > length - start)
+            lengths[i] = length - start;
+    }
+    HuffmanBatch batch = {.data = NULL, .offsets = NULL};
+    int status = huffman_batch_encode(records, lengths, count, &batch);
+    assert(status == 0 && batch.count == count);
+    char *record = malloc(batch.max_length + 1);
+    assert(record != NULL);
+    // Random access in reverse order
+    for (size_t i = count; i-- > 0;)
+    {
+        size_t record_length = 0;
+        status = huffman_batch_get(&batch, i, record, batch.max_length, &record_length);
+        assert(status == 0 && record_length == lengths[i]);
+        assert(memcmp(record, records[i], record_length) == 0);
+    }
+    size_t record_length = 0;
+    status = huffman_batch_get(&batch, count, record, batch.max_length, &record_length);
+    assert(status == STATUS_CODE_INDEX_OUT_OF_RANGE);
+    // Decode all the records at once
+    HuffmanRecord *encoded_records = malloc(count * sizeof(HuffmanRecord));
+    size_t *decoded_offsets = malloc((count + 1) * sizeof(size_t));
+    assert(encoded_records != NULL && decoded_offsets != NULL);
+    for (size_t i = 0; i < count; ++i)
+    {
+        encoded_records[i].offset = batch.offsets[i];
+        encoded_records[i].nbits = batch.offsets[i + 1] - batch.offsets[i];
+    }
+    char *decoded = malloc(huffman_records_capacity(&batch.table, encoded_records, count) + 1);
+    assert(decoded != NULL);
+    status = huffman_table_decode_records(&batch.table, batch.data, batch.nbytes, encoded_records, count, decoded,
+                                          decoded_offsets);
+    assert(status == 0);
+    for (size_t i = 0; i < count; ++i)
+    {
+        assert(decoded_offsets[i + 1] - decoded_offsets[i] == lengths[i]);
+        assert(memcmp(decoded + decoded_offsets[i], records[i], lengths[i]) == 0);
+    }
+    free(decoded);
+    free(decoded_offsets);
+    free(encoded_records);
+    printf("BATCH: %zu records in %zu bytes\n", count, batch.nbytes);
+    free(record);
+    free_huffman_batch(&batch);
+    free(records);
+    free(lengths);
+}
+
+/// Encode and decode a message split in segments of irregular lengths, and compare with the linear API
+void test_huffman_iovec(const char *message)
+{
+    size_t length = strlen(message);
+    const size_t cuts[] = {0, 1, 1, 7, 64, 0, 333, 4096};
+    struct iovec input[sizeof(cuts) / sizeof(cuts[0]) + 1];
+    int input_count = 0;
+    size_t pos = 0;
+    HuffmanHistogram histogram;
+    huffman_histogram_init(&histogram);
+    for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]) && pos < length; ++i)
+    {
+        size_t segment_length = (cuts[i] < length - pos) ? cuts[i] : length - pos;
+        input[input_count].iov_base = (void *)(message + pos);
+        input[input_count].iov_len = segment_length;
+        huffman_histogram_add(&histogram, message + pos, segment_length);
+        input_count += 1;
+        pos += segment_length;
+    }
+    assert(pos == length);
+    HuffmanTable table;
+    int status = huffman_table_from_histogram(&histogram, &table);
+    assert(status == 0);
+    BitMessage linear = {.data = NULL, .nbits = 0, .nbytes = 0};
+    status = huffman_table_encode(&table, message, length, &linear);
+    assert(status == 0);
+    // Output segments of 1, 2 and 5 bytes force codes across every boundary
+    size_t capacity = linear.nbytes + 16;
+    unsigned char *encoded = malloc(capacity);
+    char *decoded = malloc(length);
+    struct iovec output[4] = {{encoded, 1}, {encoded + 1, 2}, {encoded + 3, 5}, {encoded + 8, capacity - 8}};
+    size_t nbits = 0;
+    status = huffman_table_encodev(&table, input, input_count, output, 4, &nbits);
+    assert(status == 0 && nbits == linear.nbits && memcmp(encoded, linear.data, linear.nbytes) == 0);
+    status = huffman_table_encodev(&table, input, input_count, output, 3, &nbits);
+    assert(status == STATUS_CODE_BUFFER_TOO_SMALL);
+    int output_count = huffman_iovec_truncate(output, 4, linear.nbytes);
+    assert(output_count == 4 && output[3].iov_len == linear.nbytes - 8);
+    struct iovec decoded_output[3] = {{decoded, 3}, {decoded + 3, 0}, {decoded + 3, length - 3}};
+    size_t decoded_length = 0;
+    status = huffman_table_decodev(&table, output, output_count, nbits, decoded_output, 3, &decoded_length);
+    assert(status == 0 && decoded_length == length && memcmp(decoded, message, length) == 0);
+    decoded_output[2].iov_len -= 1;
+    status = huffman_table_decodev(&table, output, output_count, nbits, decoded_output, 3, &decoded_length);
+    assert(status == STATUS_CODE_BUFFER_TOO_SMALL);
+    // The inline kernels append at any bit and decode from any bit
+    memset(encoded, 0xff, capacity);
+    size_t inline_nbits = 0;
+    status = huffman_inline_encode(&table, message, 5, encoded, &inline_nbits, NULL);
+    assert(status == 0);
+    status = huffman_inline_encode(&table, message + 5, length - 5, encoded, &inline_nbits, NULL);
+    assert(status == 0 && inline_nbits == linear.nbits && memcmp(encoded, linear.data, linear.nbytes) == 0);
+    size_t head_nbits = 0;
+    for (size_t i = 0; i < 3; ++i)
+        head_nbits += table.nbits[(unsigned char)message[i]];
+    status = huffman_inline_decode(&table, encoded, linear.nbytes, head_nbits, nbits - head_nbits, decoded, length,
+                                   &decoded_length, NULL);
+    assert(status == 0 && decoded_length == length - 3 && memcmp(decoded, message + 3, length - 3) == 0);
+    printf("IOVEC: %d segments, %zu bits\n", input_count, nbits);
+    free(decoded);
+    free(encoded);
+    free(linear.data);
+}
+
+/// Decode the frames of the blocks encoded at every level, with a distribution that changes halfway through the block
+void test_huffman_levels(const char *message)
+{
+    size_t length = strlen(message);
+    size_t block_length = 8 * HUFFMAN_SPLIT_MIN_LENGTH;
+    char *block = malloc(block_length);
+    for (size_t i = 0; i < block_length; ++i)
+        block[i] = (i < block_length / 2) ? message[i % length] : (char)('0' + rand() % 4);
+    unsigned char *output = malloc(HUFFMAN_FRAME_BOUND(block_length));
+    char *decoded = malloc(block_length);
+    size_t output_lengths[HUFFMAN_LEVEL_MAX + 1] = {0};
+    int status = 0;
+    for (int level = HUFFMAN_LEVEL_FAST; level <= HUFFMAN_LEVEL_MAX; ++level)
+    {
+        HuffmanFrameEncoder encoder;
+        huffman_frame_encoder_init(&encoder, level);
+        status = huffman_frame_encoder_encode(&encoder, block, block_length, output, &output_lengths[level]);
+        assert(status == 0);
+        size_t nframes = 0;
+        size_t offset = 0;
+        size_t decoded_length = 0;
+        while (offset < output_lengths[level])
+        {
+            HuffmanFrameHeader frame_header;
+            status = huffman_read_frame_header(output + offset, &frame_header);
+            assert(status == 0);
+            assert(decoded_length + frame_header.raw_length <= block_length);
+            status = huffman_decode_frame_payload(&frame_header, output + offset + HUFFMAN_FRAME_HEADER_SIZE, decoded + decoded_length);
+            assert(status == 0);
+            offset += HUFFMAN_FRAME_HEADER_SIZE + frame_header.payload_length;
+            decoded_length += frame_header.raw_length;
+            nframes += 1;
+        }
+        assert(offset == output_lengths[level] && decoded_length == block_length);
+        assert(memcmp(decoded, block, block_length) == 0);
+        assert((level == HUFFMAN_LEVEL_MAX) == (nframes > 1));
+        printf("LEVEL %d: %zu bytes in %zu frames\n", level, output_lengths[level], nframes);
+        free_huffman_frame_encoder(&encoder);
+    }
+    assert(output_lengths[HUFFMAN_LEVEL_MAX] < output_lengths[HUFFMAN_LEVEL_DEFAULT]);
+    // HUFFMAN_LEVEL_FAST keeps a previous table as good as the one of its sample
+    size_t text_length = block_length / 2;
+    size_t frequencies[MAX_CHAR] = {0};
+    for (size_t i = 0; i < text_length; ++i)
+        frequencies[(unsigned char)block[i]] += 1;
+    HuffmanFrameEncoder encoder;
+    huffman_frame_encoder_init(&encoder, HUFFMAN_LEVEL_FAST);
+    status = build_huffman_table(frequencies, &encoder.table);
+    assert(status == 0);
+    encoder.has_table = 1;
+    size_t fast_length = 0;
+    size_t default_length = 0;
+    status = huffman_frame_encoder_encode(&encoder, block, text_length, output, &fast_length);
+    assert(status == 0);
+    unsigned char *default_output = malloc(HUFFMAN_FRAME_BOUND(text_length));
+    status = huffman_encode_frame(block, text_length, default_output, &default_length);
+    assert(status == 0);
+    assert(fast_length == default_length && memcmp(output, default_output, fast_length) == 0);
+    // A character outside the sample rebuilds the table from the exact histogram
+    block[1500] = '\x7f';
+    status = huffman_frame_encoder_encode(&encoder, block, text_length, output, &fast_length);
+    assert(status == 0 && encoder.table.nbits[0x7f] > 0);
+    HuffmanFrameHeader frame_header;
+    status = huffman_read_frame_header(output, &frame_header);
+    assert(status == 0 && frame_header.mode == HUFFMAN_BLOCK_HUFFMAN);
+    status = huffman_decode_frame_payload(&frame_header, output + HUFFMAN_FRAME_HEADER_SIZE, decoded);
+    assert(status == 0);
+    assert(memcmp(decoded, block, text_length) == 0);
+    // Random blocks are stored
+    for (size_t i = 0; i < text_length; ++i)
+        block[i] = (char)rand();
+    status = huffman_frame_encoder_encode(&encoder, block, text_length, output, &fast_length);
+    assert(status == 0);
+    status = huffman_read_frame_header(output, &frame_header);
+    assert(status == 0 && frame_header.mode == HUFFMAN_BLOCK_STORED);
+    free_huffman_frame_encoder(&encoder);
+    free(default_output);
+    free(decoded);
+    free(output);
+    free(block);
+}
+
+/// Decode frames in place in a single buffer, including a block whose end is coded with long codes
+void test_huffman_frame_in_place(const char *message)
+{
+    size_t length = strlen(message);
+    char *blocks[3];
+    blocks[0] = strdup(message);
+    // Mostly one character, then rare characters whose codes are longer than a byte
+    blocks[1] = malloc(length);
+    for (size_t i = 0; i < length; ++i)
+        blocks[1][i] = (i < length - length / 8) ? 'a' : (char)('b' + i % 200);
+    blocks[2] = malloc(length);
+    for (size_t i = 0; i < length; ++i)
+        blocks[2][i] = (char)rand();
+    unsigned char *frame = malloc(HUFFMAN_FRAME_BOUND(length));
+    for (size_t b = 0; b < 3; ++b)
+    {
+        size_t frame_length = 0;
+        int status = huffman_encode_frame(blocks[b], length, frame, &frame_length);
+        assert(status == 0);
+        HuffmanFrameHeader frame_header;
+        status = huffman_read_frame_header(frame, &frame_header);
+        assert(status == 0);
+        size_t capacity = HUFFMAN_IN_PLACE_BUFFER_SIZE(frame_header.raw_length);
+        unsigned char *buffer = malloc(capacity);
+        memcpy(buffer + capacity - frame_length, frame, frame_length);
+        size_t decoded_length = 0;
+        status = huffman_decode_frame_in_place(buffer, capacity, frame_length, &decoded_length);
+        assert(status == 0 && decoded_length == length && memcmp(buffer, blocks[b], length) == 0);
+        // A buffer holding only the frame is too small for a coded block
+        memcpy(buffer, frame, frame_length);
+        status = huffman_decode_frame_in_place(buffer, frame_length, frame_length, &decoded_length);
+        assert(frame_header.mode != HUFFMAN_BLOCK_HUFFMAN || status == STATUS_CODE_BUFFER_TOO_SMALL);
+        printf("IN PLACE (mode=%u): %zu bytes in a buffer of %zu\n", frame_header.mode, frame_length, capacity);
+        free(buffer);
+        free(blocks[b]);
+    }
+    free(frame);
+}
+
+/// Check the statistics of the legacy coder and of frames against the message
+void test_huffman_stats(const char *message)
+{
+    size_t length = strlen(message);
+    EncodedMessage encoded = {.header = {.data = NULL, .nbits = 0, .nbytes = 0}, .message = {.data = NULL, .nbits = 0, .nbytes = 0}};
+    HuffmanStats encode_stats = {0};
+    HuffmanStats decode_stats = {0};
+    int status = huffman_encode_stats(message, &encoded, &encode_stats);
+    assert(status == 0);
+    // The alphabet and the tree are freed, the header and the codes are returned
+    assert(encode_stats.memory.nallocs > 2 && encode_stats.memory.peak > encode_stats.memory.current);
+    assert(encode_stats.memory.current >= encoded.header.nbytes + encoded.message.nbytes);
+    assert(encode_stats.input_length == length && encode_stats.mode == HUFFMAN_BLOCK_HUFFMAN);
+    assert(encode_stats.header_nbytes == encoded.header.nbytes && encode_stats.code_nbytes == encoded.message.nbytes);
+    // A Huffman code is within one bit of the entropy
+    assert(encode_stats.entropy <= encode_stats.bits_per_symbol + 1e-9 && encode_stats.bits_per_symbol < encode_stats.entropy + 1);
+    char *decoded = NULL;
+    status = huffman_decode_stats(&encoded, &decoded, &decode_stats);
+    assert(status == 0);
+    assert(decode_stats.input_length == length && decode_stats.nsymbols == encode_stats.nsymbols);
+    assert(decode_stats.max_nbits == encode_stats.max_nbits && fabs(decode_stats.entropy - encode_stats.entropy) < 1e-9);
+    assert(decode_stats.memory.current > length && decode_stats.memory.peak >= decode_stats.memory.current);
+    // The ceiling is kept across calls and fails the call cleanly
+    size_t decode_peak = decode_stats.memory.peak;
+    free(decoded);
+    decoded = NULL;
+    decode_stats.memory.limit = decode_peak - 1;
+    status = huffman_decode_stats(&encoded, &decoded, &decode_stats);
+    assert(status == STATUS_CODE_MEMORY_LIMIT);
+    assert(decoded == NULL && decode_stats.memory.limit_reached && decode_stats.memory.peak < decode_peak);
+    decode_stats.memory.limit = decode_peak;
+    status = huffman_decode_stats(&encoded, &decoded, &decode_stats);
+    assert(status == 0 && decode_stats.memory.peak == decode_peak);
+    free(decoded);
+    free_encoded_message(&encoded);
+    encode_stats.memory.limit = 64;
+    status = huffman_encode_stats(message, &encoded, &encode_stats);
+    assert(status == STATUS_CODE_MEMORY_LIMIT);
+    free_encoded_message(&encoded);
+    encode_stats.memory.limit = 0;
+    // Frames report the mode they chose
+    char *random_block = malloc(length);
+    for (size_t i = 0; i < length; ++i)
+        random_block[i] = (char)rand();
+    unsigned char *frame = malloc(HUFFMAN_FRAME_BOUND(length));
+    const char *blocks[2] = {message, random_block};
+    for (size_t b = 0; b < 2; ++b)
+    {
+        size_t frame_length = 0;
+        HuffmanFrameHeader frame_header;
+        status = huffman_encode_frame_stats(blocks[b], length, frame, &frame_length, &encode_stats);
+        assert(status == 0);
+        status = huffman_read_frame_header(frame, &frame_header);
+        assert(status == 0);
+        assert(encode_stats.mode == frame_header.mode);
+        assert(encode_stats.header_nbytes + encode_stats.code_nbytes == frame_length);
+        char *block = malloc(length);
+        status = huffman_decode_frame_payload_stats(&frame_header, frame + HUFFMAN_FRAME_HEADER_SIZE, block, &decode_stats);
+        assert(status == 0);
+        // Frames are decoded without allocating
+        assert(decode_stats.memory.nallocs == 0 && encode_stats.memory.current == 0);
+        assert(decode_stats.nsymbols == encode_stats.nsymbols && decode_stats.bits_per_symbol == encode_stats.bits_per_symbol);
+        // A failed decode reports no block
+        if (frame_header.mode == HUFFMAN_BLOCK_HUFFMAN)
+        {
+            frame_header.raw_length -= 1;
+            status = huffman_decode_frame_payload_stats(&frame_header, frame + HUFFMAN_FRAME_HEADER_SIZE, block, &decode_stats);
+            assert(status == STATUS_CODE_MESSAGE_CORRUPT && decode_stats.input_length == 0 && decode_stats.nsymbols == 0);
+        }
+        printf("STATS (mode=%d): %zu symbols, entropy %.3f, %.3f bits per symbol, max %u bits, header %zu bytes, "
+               "%llu/%llu/%llu/%llu ns\n", encode_stats.mode, encode_stats.nsymbols, encode_stats.entropy,
+               encode_stats.bits_per_symbol, encode_stats.max_nbits, encode_stats.header_nbytes,
+               (unsigned long long)encode_stats.stage_ns[HUFFMAN_STAGE_COUNT], (unsigned long long)encode_stats.stage_ns[HUFFMAN_STAGE_BUILD],
+               (unsigned long long)encode_stats.stage_ns[HUFFMAN_STAGE_HEADER], (unsigned long long)encode_stats.stage_ns[HUFFMAN_STAGE_CODES]);
+        free(block);
+    }
+    assert(encode_stats.mode == HUFFMAN_BLOCK_STORED && encode_stats.bits_per_symbol == CHAR_BIT);
+    free(frame);
+    free(random_block);
+}
+
+/// Decode inputs shaped against the decoders: deep codes, full alphabets and forged headers
+void test_huffman_adversarial(void)
+{
+    // Fibonacci frequencies give a code of 24 bits, a tree of the codes would need 2^25 entries
+    size_t nsymbols = 25;
+    size_t frequency[2] = {1, 1};
+    size_t length = 0;
+    char *message = malloc(200000);
+    for (size_t i = 0; i < nsymbols; ++i)
+    {
+        size_t count = (i < 2) ? 1 : frequency[0] + frequency[1];
+        if (i >= 2)
+        {
+            frequency[0] = frequency[1];
+            frequency[1] = count;
+        }
+        for (size_t j = 0; j < count; ++j)
+            message[length++] = (char)('A' + i);
+    }
+    message[length] = '\0';
+    EncodedMessage encoded = {.header = {.data = NULL, .nbits = 0, .nbytes = 0}, .message = {.data = NULL, .nbits = 0, .nbytes = 0}};
+    HuffmanStats stats = {0};
+    int status = huffman_encode_stats(message, &encoded, &stats);
+    assert(status == 0 && stats.max_nbits == nsymbols - 1);
+    char *decoded = NULL;
+    memset(&stats, 0, sizeof(stats));
+    status = huffman_decode_stats(&encoded, &decoded, &stats);
+    assert(status == 0 && strcmp(decoded, message) == 0);
+    // The decoded message is the only allocation growing with the input, its capacity is one character per coded bit
+    size_t output_capacity = encoded.message.nbits + 1;
+    assert(stats.memory.peak < output_capacity + 65536);
+    printf("ADVERSARIAL: fibonacci %zu characters, %u bits, decode peak %zu bytes\n", length, stats.max_nbits, stats.memory.peak);
+    free(decoded);
+    decoded = NULL;
+    free_encoded_message(&encoded);
+    free(message);
+    // Forged headers: [max_nbits][count of each length][characters]
+    unsigned char header_data[80] = {0};
+    unsigned char message_data[8] = {0};
+    EncodedMessage forged = {.header = {.data = header_data, .nbits = 0, .nbytes = 0}, .message = {.data = message_data, .nbits = 40, .nbytes = 5}};
+    // A single code of 40 bits
+    header_data[0] = 40;
+    header_data[40] = 1;
+    header_data[41] = 'x';
+    forged.header.nbytes = 42;
+    status = huffman_decode(&forged, &decoded);
+    assert(status == 0 && strcmp(decoded, "x") == 0);
+    free(decoded);
+    decoded = NULL;
+    // Bits of no code, then too few bits for a code
+    message_data[0] = 0x80;
+    status = huffman_decode(&forged, &decoded);
+    assert(status == STATUS_CODE_HEADER_CORRUPT && decoded == NULL);
+    message_data[0] = 0;
+    forged.message.nbits = 39;
+    status = huffman_decode(&forged, &decoded);
+    assert(status == STATUS_CODE_MESSAGE_CORRUPT && decoded == NULL);
+    // Characters missing from the header
+    forged.header.nbytes = 41;
+    status = huffman_decode(&forged, &decoded);
+    assert(status == STATUS_CODE_HEADER_CORRUPT && decoded == NULL);
+    // Codes longer than any message can produce
+    header_data[0] = 255;
+    forged.header.nbytes = sizeof(header_data);
+    status = huffman_decode(&forged, &decoded);
+    assert(status == STATUS_CODE_HEADER_CORRUPT && decoded == NULL);
+    // Three codes of one bit
+    memset(header_data, 0, sizeof(header_data));
+    header_data[0] = 1;
+    header_data[1] = 3;
+    memcpy(header_data + 2, "xyz", 3);
+    forged.header.nbytes = 5;
+    status = huffman_decode(&forged, &decoded);
+    assert(status == STATUS_CODE_HEADER_CORRUPT && decoded == NULL);
+    // Every byte value in a frame, then random corruptions of the frame
+    size_t block_length = 256 * 64;
+    char *block = malloc(block_length);
+    for (size_t i = 0; i < block_length; ++i)
+        block[i] = (char)(i % 256);
+    unsigned char *frame = malloc(HUFFMAN_FRAME_BOUND(block_length));
+    size_t frame_length = 0;
+    HuffmanFrameHeader frame_header;
+    char *decoded_block = malloc(block_length);
+    status = huffman_encode_frame(block, block_length, frame, &frame_length);
+    assert(status == 0);
+    status = huffman_read_frame_header(frame, &frame_header);
+    assert(status == 0);
+    status = huffman_decode_frame_payload(&frame_header, frame + HUFFMAN_FRAME_HEADER_SIZE, decoded_block);
+    assert(status == 0);
+    assert(memcmp(decoded_block, block, block_length) == 0);
+    for (size_t i = 0; i < block_length; ++i)
+        block[i] = (char)((i % 7 == 0) ? i % 256 : 'a' + i % 3);
+    status = huffman_encode_frame(block, block_length, frame, &frame_length);
+    assert(status == 0);
+    unsigned char *corrupted = malloc(frame_length);
+    size_t nfailed = 0;
+    for (size_t i = 0; i < 2000; ++i)
+    {
+        memcpy(corrupted, frame, frame_length);
+        for (size_t k = 0; k < 1 + i % 4; ++k)
+            corrupted[HUFFMAN_FRAME_HEADER_SIZE + (size_t)rand() % (frame_length - HUFFMAN_FRAME_HEADER_SIZE)] ^= (unsigned char)(1 + rand() % 255);
+        // The lengths of the frame are checked by the caller against its buffers
+        status = huffman_read_frame_header(corrupted, &frame_header);
+        assert(status == 0);
+        if (huffman_decode_frame_payload(&frame_header, corrupted + HUFFMAN_FRAME_HEADER_SIZE, decoded_block) > 0)
+            nfailed += 1;
+    }
+    printf("ADVERSARIAL: %zu of 2000 corrupted frames rejected\n", nfailed);
+    free(corrupted);
+    free(decoded_block);
+    free(frame);
+    free(block);
+}
+
+/// Arguments of a client thread of test_huffman_daemon
+typedef struct DaemonTestClient
+{
+    const char *socket_path;
+    const char *message;
+    size_t length;
+    unsigned int seed;
+    size_t nrequests;
+    int status;
+} DaemonTestClient;
+
+/// Sends records to the daemon and checks that they come back, with frames and with the cached table
+static void *run_daemon_test_client(void *arg)
+{
+    DaemonTestClient *test_client = arg;
+    HuffmanClient client;
+    test_client->status = huffman_client_connect(&client, test_client->socket_path);
+    unsigned int seed = test_client->seed;
+    for (size_t i = 0; i < test_client->nrequests && test_client->status == 0; ++i)
+    {
+        seed = seed * 1103515245u + 12345u;
+        size_t start = (seed >> 8) % test_client->length;
+        size_t length = (seed >> 4) % 200;
+        if (length > test_client->length - start)
+            length = test_client->length - start;
+        uint32_t table_id = (uint32_t)(i % 2);
+        unsigned char *compressed = NULL;
+        unsigned char *decompressed = NULL;
+        size_t compressed_length = 0;
+        size_t decompressed_length = 0;
+        int status = huffman_client_request(&client, HUFFMAN_DAEMON_COMPRESS, table_id, test_client->message + start,
+                                            length, &compressed, &compressed_length);
+        if (status == 0)
+            status = huffman_client_request(&client, HUFFMAN_DAEMON_DECOMPRESS, table_id, compressed,
+                                            compressed_length, &decompressed, &decompressed_length);
+        if (status == 0 && (decompressed_length != length || memcmp(decompressed, test_client->message + start, length) != 0))
+            status = STATUS_CODE_MESSAGE_CORRUPT;
+        test_client->status = status;
+        free(compressed);
+        free(decompressed);
+    }
+    if (test_client->status == 0)
+    {
+        unsigned char *result = NULL;
+        size_t result_length = 0;
+        // Unknown table
+        if (huffman_client_request(&client, HUFFMAN_DAEMON_COMPRESS, 7, test_client->message, 10, &result,
+                                   &result_length) != STATUS_CODE_INDEX_OUT_OF_RANGE)
+            test_client->status = STATUS_CODE_PROTOCOL_FAIL;
+    }
+    free_huffman_client(&client);
+    return NULL;
+}
+
+/// Connection of a client sending its requests without waiting for the responses
+typedef struct DaemonPipelinedClient
+{
+    int fd;
+    const char *message;
+    size_t length;
+    size_t nrequests;
+    int status;
+} DaemonPipelinedClient;
+
+/// Sends compress requests of the whole message back to back, request i having the id i
+static void *run_daemon_pipelined_sender(void *arg)
+{
+    DaemonPipelinedClient *pipelined = arg;
+    for (size_t i = 0; i < pipelined->nrequests && pipelined->status == 0; ++i)
+    {
+        unsigned char header[HUFFMAN_DAEMON_HEADER_SIZE] = {HUFFMAN_DAEMON_COMPRESS};
+        store_le32(header + 4, (uint32_t)i);
+        store_le32(header + 12, (uint32_t)pipelined->length);
+        const unsigned char *parts[2] = {header, (const unsigned char *)pipelined->message};
+        size_t sizes[2] = {sizeof(header), pipelined->length};
+        for (size_t part = 0; part < 2 && pipelined->status == 0; ++part)
+        {
+            for (size_t done = 0; done < sizes[part];)
+            {
+                ssize_t sent = send(pipelined->fd, parts[part] + done, sizes[part] - done, MSG_NOSIGNAL);
+                if (sent <= 0)
+                {
+                    pipelined->status = STATUS_CODE_DAEMON_FAIL;
+                    break;
+                }
+                done += (size_t)sent;
+            }
+        }
+    }
+    return NULL;
+}
+
+/// Reads the responses of a pipelined client late, so that they pile up in the daemon, and checks each of them
+static void test_huffman_daemon_pipelined(const char *socket_path, const char *message, size_t nrequests)
+{
+    HuffmanClient client;
+    int status = huffman_client_connect(&client, socket_path);
+    assert(status == 0);
+    DaemonPipelinedClient pipelined = {client.fd, message, strlen(message), nrequests, 0};
+    pthread_t sender;
+    status = pthread_create(&sender, NULL, run_daemon_pipelined_sender, &pipelined);
+    assert(status == 0);
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 50000000};
+    nanosleep(&delay, NULL);
+    unsigned char *frame = malloc(HUFFMAN_FRAME_BOUND(pipelined.length));
+    char *answered = calloc(nrequests, sizeof(char));
+    for (size_t i = 0; i < nrequests; ++i)
+    {
+        unsigned char header[HUFFMAN_DAEMON_HEADER_SIZE];
+        size_t nread = 0;
+        while (nread < sizeof(header))
+        {
+            ssize_t received = read(client.fd, header + nread, sizeof(header) - nread);
+            assert(received > 0);
+            nread += (size_t)received;
+        }
+        uint32_t id = load_le32(header + 4);
+        uint32_t length = load_le32(header + 12);
+        // Several workers answer the requests of a connection, the responses come in any order
+        assert(header[0] == 0 && id < nrequests && !answered[id] && length <= HUFFMAN_FRAME_BOUND(pipelined.length));
+        answered[id] = 1;
+        for (nread = 0; nread < length;)
+        {
+            ssize_t received = read(client.fd, frame + nread, length - nread);
+            assert(received > 0);
+            nread += (size_t)received;
+        }
+        HuffmanFrameHeader frame_header;
+        status = huffman_read_frame_header(frame, &frame_header);
+        assert(status == 0 && frame_header.raw_length == pipelined.length);
+    }
+    pthread_join(sender, NULL);
+    assert(pipelined.status == 0);
+    free(answered);
+    free(frame);
+    free_huffman_client(&client);
+}
+
+/// Serve several clients at once from one daemon with a cached table, with the given limits of queued responses
+/// and of requests in flight
+void test_huffman_daemon(const char *message, unsigned int nclients, size_t max_bytes)
+{
+    char socket_path[64];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/test_huffman_daemon_%d.sock", (int)getpid());
+    HuffmanHistogram histogram;
+    huffman_histogram_init(&histogram);
+    huffman_histogram_add(&histogram, message, strlen(message));
+    HuffmanTable table;
+    int status = huffman_table_from_histogram(&histogram, &table);
+    assert(status == 0);
+    const HuffmanTable *tables[1] = {&table};
+    HuffmanDaemonOptions options;
+    huffman_daemon_default_options(&options, socket_path);
+    options.nthreads = 2;
+    options.tables = tables;
+    options.ntables = 1;
+    options.max_output_bytes = max_bytes;
+    options.max_inflight_bytes = max_bytes;
+    HuffmanDaemon daemon;
+    status = create_huffman_daemon(&daemon, &options);
+    assert(status == 0);
+    pthread_t *threads = malloc(nclients * sizeof(pthread_t));
+    DaemonTestClient *clients = malloc(nclients * sizeof(DaemonTestClient));
+    for (unsigned int i = 0; i < nclients; ++i)
+    {
+        clients[i] = (DaemonTestClient){socket_path, message, strlen(message), i + 1, 100, 0};
+        status = pthread_create(&threads[i], NULL, run_daemon_test_client, &clients[i]);
+        assert(status == 0);
+    }
+    for (unsigned int i = 0; i < nclients; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        assert(clients[i].status == 0);
+    }
+    test_huffman_daemon_pipelined(socket_path, message, 400);
+    free_huffman_daemon(&daemon);
+    printf("DAEMON: %u clients, %llu requests in %llu batches, limits of %zu bytes\n", nclients,
+           (unsigned long long)daemon.nrequests, (unsigned long long)daemon.nbatches, max_bytes);
+    assert(daemon.nrequests == nclients * 201 + 400);
+    free(clients);
+    free(threads);
+}
+
+/// Feed a level controller synthetic block timings: it drops over budget, climbs once the slack covers a probe
+/// and waits twice as long after a failed probe
+void test_huffman_level_controller(void)
+{
+    HuffmanLevelController controller;
+    // 10 ns per byte of budget, blocks of 1000 bytes
+    huffman_level_controller_init(&controller, HUFFMAN_LEVEL_MAX, 100);
+    int level = huffman_level_controller_update(&controller, 1000, 50000);
+    assert(level == HUFFMAN_LEVEL_DEFAULT);
+    level = huffman_level_controller_update(&controller, 1000, 50000);
+    assert(level == HUFFMAN_LEVEL_FAST && controller.nchanges == 2);
+    // 80 us over budget, each fast block saves 9 us: the probe of 4 blocks at 50 ns per byte costs 160 us over budget
+    size_t nblocks = 0;
+    while (level == HUFFMAN_LEVEL_FAST && nblocks < 1000)
+    {
+        level = huffman_level_controller_update(&controller, 1000, 1000);
+        nblocks += 1;
+    }
+    assert(level == HUFFMAN_LEVEL_DEFAULT && nblocks == 27 && controller.probing);
+    // The probe turns out slower than measured before and ends over budget
+    level = huffman_level_controller_update(&controller, 1000, 300000);
+    assert(level == HUFFMAN_LEVEL_FAST && controller.climb_wait == 32 && controller.nchanges == 4);
+    // The next climb waits for the slack to cover a probe at the new cost of the level
+    nblocks = 0;
+    while (level == HUFFMAN_LEVEL_FAST && nblocks < 1000)
+    {
+        level = huffman_level_controller_update(&controller, 1000, 1000);
+        nblocks += 1;
+    }
+    assert(level == HUFFMAN_LEVEL_DEFAULT && nblocks == 46);
+    // A probe within the budget is kept and resets the wait
+    for (size_t i = 0; i < 4; ++i)
+        level = huffman_level_controller_update(&controller, 1000, 10000);
+    assert(level == HUFFMAN_LEVEL_DEFAULT && !controller.probing && controller.climb_wait == 16);
+    printf("LEVEL CONTROLLER: %zu changes, %.0f us of slack\n", controller.nchanges,
+           (controller.budget_ns - controller.used_ns) / 1e3);
+    // Without a target the level never moves
+    huffman_level_controller_init(&controller, HUFFMAN_LEVEL_MAX, 0);
+    level = huffman_level_controller_update(&controller, 1000, 1000000000);
+    assert(level == HUFFMAN_LEVEL_MAX && controller.nchanges == 0);
+}
+
+/// Compress and decompress a file mixing text, null characters and incompressible blocks
+void test_huffman_file(const char *message, int io_backend, unsigned int nthreads)
+{
+    char input_path[] = "/tmp/test_huffman_input_XXXXXX";
+    char compressed_path[] = "/tmp/test_huffman_compressed_XXXXXX";
+    char output_path[] = "/tmp/test_huffman_output_XXXXXX";
+    int fds[3] = {mkstemp(input_path), mkstemp(compressed_path), mkstemp(output_path)};
+    assert(fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0);
+    close(fds[1]);
+    close(fds[2]);
+    size_t length = strlen(message);
+    size_t size = 0;
+    char data[3 * 4096];
+    for (size_t i = 0; i < sizeof(data); ++i)
+        data[i] = (i < 4096) ? message[i % length] : (i < 8192) ? (char)(i % 3) : (char)rand();
+    for (size_t i = 0; i < 5; ++i)
+    {
+        ssize_t written = write(fds[0], data, sizeof(data));
+        assert(written == (ssize_t)sizeof(data));
+        size += sizeof(data);
+    }
+    close(fds[0]);
+    HuffmanFileOptions options;
+    huffman_file_default_options(&options);
+    options.block_size = 1000;
+    options.queue_depth = 3;
+    options.io_backend = io_backend;
+    options.nthreads = nthreads;
+    HuffmanFileStats stats;
+    options.stats = &stats;
+    // The second pass starts at HUFFMAN_LEVEL_MAX with a throughput target that forces the workers down to HUFFMAN_LEVEL_FAST
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        options.level = (pass == 0) ? HUFFMAN_LEVEL_DEFAULT : HUFFMAN_LEVEL_MAX;
+        options.min_mb_s = (pass == 0) ? 0 : 1e9;
+        int status = huffman_compress_file(input_path, compressed_path, &options);
+        assert(status == 0);
+        // Without a target the level stays, with it every worker drops and one at least goes down to HUFFMAN_LEVEL_FAST
+        assert((pass == 0) ? stats.nlevel_changes == 0 && stats.final_level == HUFFMAN_LEVEL_DEFAULT
+                           : stats.nlevel_changes >= 2 && stats.final_level == HUFFMAN_LEVEL_FAST);
+        // Decompress into a mapping of the output file and with writes
+        for (int output_mmap = 1; output_mmap >= 0; --output_mmap)
+        {
+            options.output_mmap = output_mmap;
+            status = huffman_decompress_file(compressed_path, output_path, &options);
+            assert(status == 0);
+            FILE *output = fopen(output_path, "rb");
+            assert(output != NULL);
+            char *decompressed = malloc(size + 1);
+            size_t nread = fread(decompressed, 1, size + 1, output);
+            assert(nread == size);
+            fclose(output);
+            for (size_t i = 0; i < size; ++i)
+                assert(decompressed[i] == data[i % sizeof(data)]);
+            free(decompressed);
+        }
+    }
+    options.output_mmap = 1;
+    // A FIFO output cannot seek nor be mapped: a child decompresses into it while the blocks are read back in order
+    char fifo_path[sizeof(output_path) + 5];
+    snprintf(fifo_path, sizeof(fifo_path), "%s.fifo", output_path);
+    int status = mkfifo(fifo_path, 0600);
+    assert(status == 0);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0)
+        _exit(huffman_decompress_file(compressed_path, fifo_path, &options));
+    int fifo_fd = open(fifo_path, O_RDONLY);
+    assert(fifo_fd >= 0);
+    char *streamed = malloc(size + 1);
+    size_t nstreamed = 0;
+    ssize_t nread = 0;
+    while ((nread = read(fifo_fd, streamed + nstreamed, size + 1 - nstreamed)) > 0)
+        nstreamed += (size_t)nread;
+    close(fifo_fd);
+    int child_status = 0;
+    pid_t waited = waitpid(pid, &child_status, 0);
+    assert(waited == pid && WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0);
+    assert(nstreamed == size);
+    for (size_t i = 0; i < size; ++i)
+        assert(streamed[i] == data[i % sizeof(data)]);
+    free(streamed);
+    unlink(fifo_path);
+    // A truncated compressed file is rejected
+    status = truncate(compressed_path, 100);
+    assert(status == 0);
+    status = huffman_decompress_file(compressed_path, output_path, &options);
+    assert(status == STATUS_CODE_FILE_CORRUPT);
+    printf("FILE (io=%d, available=%d, threads=%u): %zu bytes\n", io_backend, huffman_io_available(io_backend), nthreads, size);
+    unlink(input_path);
+    unlink(compressed_path);
+    unlink(output_path);
+}
+
 void generate_message(char *buffer, size_t length, unsigned int redundancy)
 {
     if (length == 0)
@@ -84,5 +1145,38 @@ int main(void)
     generate_message(message, 500, 10);
     printf("MESSAGE: %s\n", message);
     test_huffman(message);
+    test_huffman_optimal_tree("aabbccddbbeaebdddfffdbffddabbbbbcdefaabbcccccaabbddfffdcecc");
+    // The heap of the tree pops two equal parents below a larger node: both must be sifted past it
+    test_huffman_optimal_tree("aaabcdddefg");
+    // Test streams of blocks
+    char stream_message[4000];
+    generate_message(stream_message, 4000, 2);
+    // Force the fallback to a fresh table with a character unknown to the previous blocks
+    stream_message[3000] = 'Z';
+    test_huffman_histogram_shards(stream_message, 4);
+    test_huffman_code_lengths(stream_message);
+    test_huffman_mapped_table(stream_message, 2);
+    test_huffman_batch(stream_message, 1000);
+    test_huffman_batch(stream_message, 3);
+    test_huffman_iovec(stream_message);
+    test_huffman_frame_in_place(stream_message);
+    test_huffman_levels(stream_message);
+    test_huffman_stats(stream_message);
+    test_huffman_adversarial();
+    test_huffman_daemon(stream_message, 8, HUFFMAN_DAEMON_DEFAULT_MAX_OUTPUT_BYTES);
+    test_huffman_daemon(stream_message, 4, 1);
+    test_huffman_level_controller();
+    test_huffman_file(stream_message, HUFFMAN_IO_PREAD, 1);
+    test_huffman_file(stream_message, HUFFMAN_IO_URING, 1);
+    test_huffman_file(stream_message, HUFFMAN_IO_PREAD, 4);
+    test_huffman_stream(stream_message, 500, HUFFMAN_STREAM_FRESH_TABLE);
+    test_huffman_stream(stream_message, 500, HUFFMAN_STREAM_PREVIOUS_TABLE);
+    test_huffman_stream(stream_message, 1, HUFFMAN_STREAM_PREVIOUS_TABLE);
+    test_huffman_stream(stream_message, 500, HUFFMAN_STREAM_DRIFT_TABLE);
+    test_huffman_stream(stream_message, 50, HUFFMAN_STREAM_DRIFT_TABLE);
+    // Test a drift of the distribution in the middle of the stream
+    for (size_t i = 2000; i < 3999; ++i)
+        stream_message[i] = (char)('a' + ('z' - stream_message[i]) % 7);
+    test_huffman_stream(stream_message, 50, HUFFMAN_STREAM_DRIFT_TABLE);
     return 0;
 }
\ No newline at end of file